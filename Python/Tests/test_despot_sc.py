@@ -1,6 +1,7 @@
 from pathlib import Path
-from os import chdir
+from os import chdir, environ
 import unittest
+from unittest import mock
 from nipype.interfaces.base import CommandLine
 from qipype.commands import NewImage, Diff
 from qipype.fitting import DESPOT1, DESPOT1Sim, DESPOT2, DESPOT2Sim, HIFI, HIFISim, FM, FMSim
@@ -17,7 +18,7 @@ class DESPOT_SC(unittest.TestCase):
     def tearDown(self):
         chdir('../')
 
-    def test_despot1(self):
+    def test_despot1(self, batch=64, algo='l'):
         seq = {'SPGR': {'TR': 10e-3, 'FA': [3, 18]}}
         spgr_file = 'sim_spgr.nii.gz'
         img_sz = [32, 32, 32]
@@ -32,7 +33,7 @@ class DESPOT_SC(unittest.TestCase):
                    noise=noise, verbose=vb,
                    PD_map='PD.nii.gz', T1_map='T1.nii.gz').run()
         DESPOT1(sequence=seq, in_file=spgr_file,
-                verbose=vb, residuals=True).run()
+                verbose=vb, residuals=True, batch=batch, algo=algo).run()
 
         diff_T1 = Diff(in_file='D1_T1.nii.gz', baseline='T1.nii.gz',
                        noise=noise, verbose=vb).run()
@@ -41,6 +42,14 @@ class DESPOT_SC(unittest.TestCase):
         self.assertLessEqual(diff_T1.outputs.out_diff, 35)
         self.assertLessEqual(diff_PD.outputs.out_diff, 35)
 
+    def test_despot1_voxelwise(self):
+        self.test_despot1(batch=1)
+
+    def test_despot1_jacobian(self):
+        # Fails if the analytic Jacobian disagrees with automatic differentiation
+        with mock.patch.dict(environ, {'QUIT_CHECK_JACOBIAN': '1'}):
+            self.test_despot1(algo='n')
+
     def test_hifi(self):
         seqs = {'SPGR': {'TR': 5e-3, 'FA': [3, 18]},
                 'MPRAGE': {'FA': 5, 'TR': 5e-3, 'TI': 0.45, 'TD': 0, 'eta': 1, 'ETL': 64, 'k0': 0},
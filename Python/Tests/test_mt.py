@@ -1,4 +1,5 @@
 from pathlib import Path
+import json
 from os import chdir
 import unittest
 import numpy as np
@@ -128,6 +129,16 @@ class MT(unittest.TestCase):
         self.assertLessEqual(diff_f_b.outputs.out_diff, 50)
         self.assertLessEqual(diff_k.outputs.out_diff, 50)
 
+    def test_lineshape_on_resonance(self):
+        # The super-Lorentzian diverges at zero offset, so it must be clamped there
+        lineshape_file = '_sl_lineshape.json'
+        Lineshape(out_file=lineshape_file, lineshape='SuperLorentzian',
+                  frq_start=0, frq_space=100, frq_count=5).run()
+        with open(lineshape_file) as f:
+            values = json.load(f)['lineshape']['values']
+        self.assertTrue(all(v is not None and np.isfinite(v) for v in values))
+        self.assertGreaterEqual(values[0], values[1])
+
     def test_ZSpec(self):
         NewImage(out_file='zspec_linear.nii.gz', verbose=vb, img_size=[8, 8, 8, 4],
                  grad_dim=3, grad_vals=(-3, 3)).run()
@@ -24,9 +24,10 @@ from qipype.base import InputSpec, BaseCommand
 ####################################################################################################
 
 
-def FitIS(name, fixed=None, in_files=None, extra=None):
+def FitIS(name, fixed=None, in_files=None, extra=None, model_fit=True):
     """
-    Input Specification for tools in fitting mode
+    Input Specification for tools in fitting mode. The scheduling options are only added for tools
+    that fit with ModelFitFilter (model_fit=True)
     """
     if fixed is None:
         fixed = []
@@ -39,6 +40,15 @@ def FitIS(name, fixed=None, in_files=None, extra=None):
              'residuals': traits.Bool(desc='Write out residuals for each data-point',
                                       argstr='--resids'),
              '__module__': __name__}
+    if model_fit:
+        attrs['batch'] = traits.Int(desc='Number of voxels to fit in each batch',
+                                    argstr='--batch=%d')
+        attrs['dynamic'] = traits.Bool(desc='Share masked voxels dynamically between threads',
+                                       argstr='--dynamic')
+        attrs['stream_slabs'] = traits.Int(desc='Read, fit and write the image in N slabs',
+                                           argstr='--stream-slabs=%d')
+        attrs['resume'] = traits.String(desc='Save progress to this directory and resume from it',
+                                        argstr='--resume=%s')
 
     for f in fixed:
         aname = '{}_map'.format(f)
@@ -175,11 +185,12 @@ class SimCommand(BaseCommand):
 
 def Command(toolname, cmd, file_prefix, varying,
             derived=None, fixed=None, files=None, extra=None,
-            init=None):
+            init=None, model_fit=True):
     fit_ispec = FitIS(toolname,
                       fixed=fixed,
                       in_files=files,
-                      extra=extra)
+                      extra=extra,
+                      model_fit=model_fit)
     sim_ispec = SimIS(toolname,
                       varying=varying,
                       fixed=fixed,
@@ -211,7 +222,8 @@ DESPOT1, DESPOT1Sim, DESPOT1FitIS, DESPOT1FitOS, DESPOT1SimIS, DESPOT1SimOS = Co
     varying=['PD', 'T1'],
     fixed=['B1'],
     extra={'algo': traits.String(desc="Choose algorithm (l/w/n)", argstr="--algo=%s"),
-           'iterations': traits.Int(desc='Max iterations for WLLS/NLLS (default 15)', argstr='--its=%d')})
+           'iterations': traits.Int(desc='Max iterations for WLLS/NLLS (default 15)', argstr='--its=%d'),
+           'solver': traits.String(desc='Non-linear solver, ceres or lm', argstr='--solver=%s')})
 
 HIFI, HIFISim, HIFIFitIS, HIFIFitOS, HIFISimIS, HIFISimOS = Command(
     'HIFI', 'qi despot1hifi', 'HIFI',
@@ -226,6 +238,7 @@ DESPOT2, DESPOT2Sim, DESPOT2FitIS, DESPOT2FitOS, DESPOT2SimIS, DESPOT2SimOS = Co
     extra={'algo': traits.Enum("LLS", "WLS", "NLS", desc="Choose algorithm", argstr="--algo=%d"),
            'ellipse': traits.Bool(desc="Data is ellipse geometric solution", argstr='--gs'),
            'iterations': traits.Int(desc='Max iterations for WLLS/NLLS (default 15)', argstr='--its=%d'),
+           'solver': traits.String(desc='Non-linear solver, ceres or lm', argstr='--solver=%s'),
            'clamp_PD': traits.Float(desc='Clamp PD between 0 and value', argstr='-f %f'),
            'clamp_T2': traits.Float(desc='Clamp T2 between 0 and value', argstr='--clampT1=%f')})
 
@@ -243,7 +256,7 @@ JSR, JSRSim, JSRFitIS, JSRFitOS, JSRSimIS, JSRSimOS = Command(
     extra={'npsi': traits.Int(desc='Number of psi/off-resonance starts', argstr='--npsi=%d')})
 
 Multiecho, MultiechoSim, MultiechoFitIS, MultiechoFitOS, MultiechoSimIS, MultiechoSimOS = Command(
-    'Multiecho', 'qi multiecho', 'ME', varying=['PD', 'T2'], extra={'algo': traits.String(desc="Choose algorithm (l/a/n)", argstr="--algo=%s"), 'iterations': traits.Int(desc='Max iterations for WLLS/NLLS (default 15)', argstr='--its=%d'), 'thresh_PD': traits.Float(desc='Only output maps when PD exceeds threshold value', argstr='-t=%f'), 'clamp_T2': traits.Float(desc='Clamp T2 between 0 and value', argstr='-p=%f')})
+    'Multiecho', 'qi multiecho', 'ME', varying=['PD', 'T2'], extra={'algo': traits.String(desc="Choose algorithm (l/a/n)", argstr="--algo=%s"), 'iterations': traits.Int(desc='Max iterations for WLLS/NLLS (default 15)', argstr='--its=%d'), 'solver': traits.String(desc='Non-linear solver, ceres or lm', argstr='--solver=%s'), 'thresh_PD': traits.Float(desc='Only output maps when PD exceeds threshold value', argstr='-t=%f'), 'clamp_T2': traits.Float(desc='Clamp T2 between 0 and value', argstr='-p=%f')})
 
 MPMR2s, MPMR2sSim, MPMR2sFitIS, MPMR2sFitOS, MPMR2sSimIS, MPMR2sSimOS = Command(
     'MPMR2s', 'qi mpm_r2s', 'MPM', varying=['R2s', 'S0_PDw', 'S0_T1w', 'S0_MTw'], files=['PDw', 'T1w', 'MTw'])
@@ -269,7 +282,8 @@ MTSat, MTSatSim, MTSatFitIS, MTSatFitOS, MTSatSimIS, MTSatSimOS = Command(
     'MTSat', 'qi mtsat', 'MTSat',
     varying=['PD', 'R1', 'delta'],
     fixed=['B1'],
-    files=['PDw', 'T1w', 'MTw'])
+    files=['PDw', 'T1w', 'MTw'],
+    model_fit=False)
 
 qMT, qMTSim, qMTFitIS, qMTFitOS, qMTSimIS, qMTSimOS = Command(
     'qMT', 'qi qmt', 'QMT',
@@ -277,7 +291,8 @@ qMT, qMTSim, qMTFitIS, qMTFitOS, qMTSimIS, qMTSimOS = Command(
     derived=['T1_f', 'k_bf'],
     fixed=['f0', 'B1', 'T1'],
     extra={'lineshape': traits.String(argstr='--lineshape=%s', mandatory=True,
-                                      desc='Gauss/Lorentzian/SuperLorentzian/path to JSON file')})
+                                      desc='Gauss/Lorentzian/SuperLorentzian/path to JSON file'),
+           'solver': traits.String(desc='Non-linear solver, ceres or lm', argstr='--solver=%s')})
 
 eMT, eMTSim, eMTFitIS, eMTFitOS, eMTSimIS, eMTSimOS = Command(
     'eMT', 'qi ssfp_emt', 'EMT',
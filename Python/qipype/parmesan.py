@@ -161,8 +161,8 @@ class MUPAMTSim(QI.SimCommand):
 class SteadyStateInputSpec(QI.FitInputSpec):
     fitT2 = traits.Bool(desc='Fit T2 model', argstr='--T2')
     fitMT = traits.Bool(desc='Fit MT model', argstr='--MT')
-    lineshape = traits.File(
-        exists=True, desc='Lineshape file', argstr='--lineshape=%s')
+    lineshape = traits.String(
+        desc='Gaussian/Lorentzian/SuperLorentzian or lineshape file', argstr='--lineshape=%s')
 
 
 class SteadyStateOutputSpec(DynamicTraitedSpec):
@@ -194,8 +194,8 @@ class SteadyState(QI.FitCommand):
 class SteadyStateSimInputSpec(QI.SimInputSpec):
     fitT2 = traits.Bool(desc='Fit T2 model', argstr='--T2')
     fitMT = traits.Bool(desc='Fit MT model', argstr='--MT')
-    lineshape = traits.File(
-        exists=True, desc='Lineshape file', argstr='--lineshape=%s')
+    lineshape = traits.String(
+        desc='Gaussian/Lorentzian/SuperLorentzian or lineshape file', argstr='--lineshape=%s')
 
 
 class SteadyStateSim(QI.SimCommand):
@@ -94,3 +94,14 @@ extern args::Flag     verbose;
         parser, "PREFIX", "Add a prefix to output filenames", {'o', "out"});                   \
     args::ValueFlag<std::string> json_file(                                                    \
         parser, "JSON", "Read JSON from file instead of stdin", {"json"});
+
+// For commands that fit with ModelFitFilter, which are the only ones that honour these
+#define QI_FIT_ARGS                                                                            \
+    args::ValueFlag<int> batch(                                                                \
+        parser, "BATCH", "Fit N voxels per batch (default 64)", {"batch"}, 64);                \
+    args::Flag dynamic(                                                                        \
+        parser, "DYNAMIC", "Share masked voxels dynamically between threads", {"dynamic"});    \
+    args::ValueFlag<int> stream_slabs(                                                         \
+        parser, "SLABS", "Read, fit and write N slabs in turn", {"stream-slabs"}, 0);          \
+    args::ValueFlag<std::string> resume(                                                       \
+        parser, "DIR", "Save progress to DIR after each slab, resume from it", {"resume"});
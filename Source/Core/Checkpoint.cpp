@@ -0,0 +1,140 @@
+/*
+ *  Checkpoint.cpp - Part of QUantitative Imaging Tools
+ *
+ *  Copyright (c) 2026 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include "Checkpoint.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace QI {
+
+namespace {
+std::string const ProgressFile = "progress";
+std::string const DonePrefix   = "done: ";
+} // namespace
+
+Checkpoint::Checkpoint(std::string const &dir, std::string const &key, int const n_slabs) :
+    m_dir{dir}, m_key{key}, m_done(n_slabs, false) {
+    std::error_code ec;
+    fs::create_directories(m_dir, ec);
+    if (ec) {
+        QI::Fail("Could not create checkpoint directory {}: {}", m_dir, ec.message());
+    }
+    std::ifstream file(record());
+    if (!file) {
+        return; // Nothing to resume
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    auto const text     = contents.str();
+    auto const done_pos = text.rfind(DonePrefix);
+    if (done_pos == std::string::npos || text.substr(0, done_pos) != m_key) {
+        QI::Fail("Checkpoint in {} is for a different fit, use a new directory", m_dir);
+    }
+    auto const bits = text.substr(done_pos + DonePrefix.size(), n_slabs);
+    if (static_cast<int>(bits.size()) != n_slabs) {
+        QI::Fail("Checkpoint record in {} is damaged", m_dir);
+    }
+    for (int s = 0; s < n_slabs; s++) {
+        m_done[s] = (bits[s] == '1');
+    }
+}
+
+bool Checkpoint::resuming() const {
+    return std::any_of(m_done.begin(), m_done.end(), [](bool d) { return d; });
+}
+
+bool Checkpoint::done(int const slab) const {
+    return m_done.at(slab);
+}
+
+void Checkpoint::finished(int const slab) {
+    m_done.at(slab) = true;
+    save();
+}
+
+std::string Checkpoint::path(std::string const &output) const {
+    return (fs::path(m_dir) / fs::path(output).filename()).string();
+}
+
+void Checkpoint::complete(std::vector<std::string> const &outputs) {
+    for (auto const &output : outputs) {
+        std::error_code ec;
+        fs::rename(path(output), output, ec);
+        if (ec) { // Probably on a different filesystem
+            fs::copy_file(path(output), output, fs::copy_options::overwrite_existing, ec);
+            if (ec) {
+                QI::Fail("Could not move {} to {}: {}", path(output), output, ec.message());
+            }
+            fs::remove(path(output));
+        }
+    }
+    fs::remove(record());
+}
+
+std::string Checkpoint::record() const {
+    return (fs::path(m_dir) / ProgressFile).string();
+}
+
+/*
+ *  Write to a temporary file and rename it, so a job killed part way through writing leaves the
+ *  previous record intact. The record is synced before the rename, and the directory after it, so
+ *  after a crash it never claims slabs that did not reach the disk.
+ */
+void Checkpoint::save() const {
+    std::string text = m_key + DonePrefix;
+    for (bool const d : m_done) {
+        text += (d ? '1' : '0');
+    }
+    text += "\n";
+
+    auto const temp = record() + ".tmp";
+    int const  fd   = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        QI::Fail("Could not write checkpoint record {}", temp);
+    }
+    char const *data = text.data();
+    size_t      left = text.size();
+    while (left > 0) {
+        ssize_t const n = write(fd, data, left);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            close(fd);
+            QI::Fail("Could not write checkpoint record {}", temp);
+        }
+        data += n;
+        left -= n;
+    }
+    if (fsync(fd) != 0 || close(fd) != 0) {
+        QI::Fail("Could not sync checkpoint record {}", temp);
+    }
+    std::error_code ec;
+    fs::rename(temp, record(), ec);
+    if (ec) {
+        QI::Fail("Could not update checkpoint record {}: {}", record(), ec.message());
+    }
+    int const dir_fd = open(m_dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0 || fsync(dir_fd) != 0) {
+        QI::Fail("Could not sync checkpoint directory {}", m_dir);
+    }
+    close(dir_fd);
+}
+
+} // End namespace QI
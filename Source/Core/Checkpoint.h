@@ -0,0 +1,51 @@
+/*
+ *  Checkpoint.h - Part of QUantitative Imaging Tools
+ *
+ *  Copyright (c) 2026 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace QI {
+
+/*
+ *  Records which slabs of a streamed fit are finished, so a job that was stopped part way through
+ *  can carry on from where it got to. The outputs are written into the checkpoint directory while
+ *  the fit runs, and the record is a small text file alongside them that is replaced atomically
+ *  after each slab. The key describes the run (inputs, slabs, subregion, fit options), and a
+ *  checkpoint with a different key is an error rather than being silently overwritten.
+ */
+class Checkpoint {
+  public:
+    Checkpoint(std::string const &dir, std::string const &key, int const n_slabs);
+
+    // True if any slabs were finished by a previous run
+    bool resuming() const;
+    bool done(int const slab) const;
+
+    // Record a slab as finished. Its outputs must already be synced to disk.
+    void finished(int const slab);
+
+    // Where to write an output until the fit is complete
+    std::string path(std::string const &output) const;
+
+    // Move the outputs to their final paths and remove the record
+    void complete(std::vector<std::string> const &outputs);
+
+  private:
+    std::string       m_dir, m_key;
+    std::vector<bool> m_done;
+
+    std::string record() const;
+    void        save() const;
+};
+
+} // End namespace QI
@@ -0,0 +1,426 @@
+/*
+ *  FFT.cpp - Part of QUantitative Imaging Tools
+ *
+ *  Copyright (c) 2026 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include "FFT.h"
+#include "Log.h"
+#include "itkMultiThreaderBase.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace QI {
+
+using Complex = FFT::Complex;
+
+namespace {
+// Prime factors above this use Bluestein's algorithm, as the generic butterfly is O(p^2)
+int const MaxRadix = 64;
+// Lines along y and z are gathered this many at a time, so reads are not one value per row
+std::int64_t const LineBlock = 8;
+} // namespace
+
+/*
+ *  A forward transform of one length. Mixed-radix lengths use a recursive decimation in time
+ *  (after KISS FFT). Lengths with a large prime factor are done as a convolution with a chirp
+ *  using a power of two transform (Bluestein).
+ */
+class FFTPlan {
+  public:
+    explicit FFTPlan(std::int64_t const n);
+
+    std::int64_t size() const { return m_n; }
+    std::int64_t scratch() const { return m_conv ? 2 * m_conv->size() : m_n; }
+
+    // In place on n contiguous values, work must have room for scratch() values
+    void forward(Complex *data, Complex *work) const;
+
+  private:
+    std::int64_t         m_n;
+    std::vector<int>     m_factors; // Pairs of radix and remaining length
+    std::vector<Complex> m_twiddles;
+
+    std::shared_ptr<FFTPlan const> m_conv; // Only for Bluestein
+    std::vector<Complex>           m_chirp, m_kernel;
+
+    void recurse(Complex *out, Complex const *in, std::int64_t const stride, int const *f) const;
+    void radix2(Complex *out, std::int64_t const stride, std::int64_t const m) const;
+    void radix3(Complex *out, std::int64_t const stride, std::int64_t const m) const;
+    void radix4(Complex *out, std::int64_t const stride, std::int64_t const m) const;
+    void generic(Complex *out, std::int64_t const stride, std::int64_t const m, int const p) const;
+};
+
+namespace {
+/*
+ *  Plans hold no mutable state, so one plan serves every transform of that length. A Bluestein
+ *  plan asks for another plan while it is built, so plans are not built under the lock.
+ */
+std::shared_ptr<FFTPlan const> GetPlan(std::int64_t const n) {
+    static std::mutex                                             mutex;
+    static std::map<std::int64_t, std::shared_ptr<FFTPlan const>> plans;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto const                  it = plans.find(n);
+        if (it != plans.end()) {
+            return it->second;
+        }
+    }
+    auto                        plan = std::make_shared<FFTPlan const>(n);
+    std::lock_guard<std::mutex> lock(mutex);
+    return plans.emplace(n, plan).first->second;
+}
+} // namespace
+
+FFTPlan::FFTPlan(std::int64_t const n) : m_n{n} {
+    if (n < 1) {
+        QI::Fail("FFT length must be positive, not {}", n);
+    }
+    // Fours first, then twos, threes, and increasing odd numbers
+    std::int64_t remaining = n;
+    std::int64_t p         = 4;
+    bool         bluestein = false;
+    while (remaining > 1) {
+        while (remaining % p) {
+            p = (p == 4) ? 2 : (p == 2) ? 3 : p + 2;
+            if (p * p > remaining) {
+                p = remaining;
+            }
+        }
+        if (p > MaxRadix) {
+            bluestein = true;
+            break;
+        }
+        remaining /= p;
+        m_factors.push_back(static_cast<int>(p));
+        m_factors.push_back(static_cast<int>(remaining));
+    }
+    if (!bluestein) {
+        m_twiddles.resize(n);
+        for (std::int64_t k = 0; k < n; k++) {
+            m_twiddles[k] = std::polar(1.0, -2. * M_PI * k / n);
+        }
+        return;
+    }
+
+    m_factors.clear();
+    std::int64_t m = 1;
+    while (m < 2 * n - 1) {
+        m *= 2;
+    }
+    m_conv = GetPlan(m);
+    m_chirp.resize(n);
+    for (std::int64_t k = 0; k < n; k++) {
+        // k^2 mod 2n keeps the angle accurate for long transforms
+        m_chirp[k] = std::polar(1.0, -M_PI * static_cast<double>((k * k) % (2 * n)) / n);
+    }
+    m_kernel.assign(m, Complex{0.});
+    m_kernel[0] = 1.;
+    for (std::int64_t k = 1; k < n; k++) {
+        m_kernel[k] = m_kernel[m - k] = std::conj(m_chirp[k]);
+    }
+    std::vector<Complex> work(m_conv->scratch());
+    m_conv->forward(m_kernel.data(), work.data());
+    for (auto &k : m_kernel) {
+        k /= static_cast<double>(m); // Fold the scaling of the inverse into the kernel
+    }
+}
+
+void FFTPlan::forward(Complex *data, Complex *work) const {
+    if (m_conv) {
+        std::int64_t const m = m_conv->size();
+        Complex *          a = work;
+        for (std::int64_t k = 0; k < m_n; k++) {
+            a[k] = data[k] * m_chirp[k];
+        }
+        std::fill(a + m_n, a + m, Complex{0.});
+        m_conv->forward(a, work + m);
+        // Inverse transform of the product, using conj(F(conj(x)))
+        for (std::int64_t k = 0; k < m; k++) {
+            a[k] = std::conj(a[k] * m_kernel[k]);
+        }
+        m_conv->forward(a, work + m);
+        for (std::int64_t k = 0; k < m_n; k++) {
+            data[k] = std::conj(a[k]) * m_chirp[k];
+        }
+    } else if (m_n > 1) {
+        std::copy(data, data + m_n, work);
+        recurse(data, work, 1, m_factors.data());
+    }
+}
+
+void FFTPlan::recurse(Complex *          out,
+                      Complex const *    in,
+                      std::int64_t const stride,
+                      int const *        f) const {
+    int const          p = f[0];
+    std::int64_t const m = f[1];
+    if (m == 1) {
+        for (int j = 0; j < p; j++) {
+            out[j] = in[j * stride];
+        }
+    } else {
+        for (int j = 0; j < p; j++) {
+            recurse(out + j * m, in + j * stride, stride * p, f + 2);
+        }
+    }
+    switch (p) {
+    case 2:
+        return radix2(out, stride, m);
+    case 3:
+        return radix3(out, stride, m);
+    case 4:
+        return radix4(out, stride, m);
+    default:
+        return generic(out, stride, m, p);
+    }
+}
+
+void FFTPlan::radix2(Complex *out, std::int64_t const stride, std::int64_t const m) const {
+    for (std::int64_t k = 0; k < m; k++) {
+        Complex const t = out[k + m] * m_twiddles[k * stride];
+        out[k + m]      = out[k] - t;
+        out[k] += t;
+    }
+}
+
+void FFTPlan::radix3(Complex *out, std::int64_t const stride, std::int64_t const m) const {
+    double const s = m_twiddles[stride * m].imag(); // sin(-2pi/3)
+    for (std::int64_t k = 0; k < m; k++) {
+        Complex const s1 = out[k + m] * m_twiddles[k * stride];
+        Complex const s2 = out[k + 2 * m] * m_twiddles[2 * k * stride];
+        Complex const s3 = s1 + s2;
+        Complex const s0 = (s1 - s2) * s;
+        Complex const h  = out[k] - s3 * 0.5;
+        out[k] += s3;
+        out[k + m]     = {h.real() - s0.imag(), h.imag() + s0.real()};
+        out[k + 2 * m] = {h.real() + s0.imag(), h.imag() - s0.real()};
+    }
+}
+
+void FFTPlan::radix4(Complex *out, std::int64_t const stride, std::int64_t const m) const {
+    for (std::int64_t k = 0; k < m; k++) {
+        Complex const s0 = out[k + m] * m_twiddles[k * stride];
+        Complex const s1 = out[k + 2 * m] * m_twiddles[2 * k * stride];
+        Complex const s2 = out[k + 3 * m] * m_twiddles[3 * k * stride];
+        Complex const s5 = out[k] - s1;
+        Complex const s6 = out[k] + s1;
+        Complex const s3 = s0 + s2;
+        Complex const s4 = s0 - s2;
+        out[k]           = s6 + s3;
+        out[k + 2 * m]   = s6 - s3;
+        out[k + m]       = {s5.real() + s4.imag(), s5.imag() - s4.real()};
+        out[k + 3 * m]   = {s5.real() - s4.imag(), s5.imag() + s4.real()};
+    }
+}
+
+void FFTPlan::generic(Complex *out, std::int64_t const stride, std::int64_t const m, int const p)
+    const {
+    Complex scratch[MaxRadix];
+    for (std::int64_t u = 0; u < m; u++) {
+        for (int q = 0; q < p; q++) {
+            scratch[q] = out[u + q * m];
+        }
+        for (int q1 = 0; q1 < p; q1++) {
+            std::int64_t const k   = u + q1 * m;
+            std::int64_t       tw  = 0;
+            Complex            sum = scratch[0];
+            for (int q = 1; q < p; q++) {
+                tw += stride * k;
+                if (tw >= m_n) {
+                    tw %= m_n;
+                }
+                sum += scratch[q] * m_twiddles[tw];
+            }
+            out[k] = sum;
+        }
+    }
+}
+
+FFT::FFT(Size const &size, int const threads) : m_size{size}, m_threads{std::max(threads, 1)} {
+    for (int d = 0; d < 3; d++) {
+        m_plans[d] = GetPlan(size[d]);
+    }
+    if (size[0] % 2 == 0) {
+        m_half = GetPlan(size[0] / 2);
+        m_split.resize(size[0] / 2 + 1);
+        for (std::int64_t k = 0; k <= size[0] / 2; k++) {
+            m_split[k] = std::polar(1.0, -2. * M_PI * k / size[0]);
+        }
+    }
+}
+
+/*
+ *  Transform every line along one axis. Lines are handed out a block at a time to each thread,
+ *  and the inverse uses conj(F(conj(x))) so only forward plans are needed.
+ */
+void FFT::lines(Complex *data, Size const &size, int const axis, bool const inverse) const {
+    auto const &       plan   = *m_plans[axis];
+    std::int64_t const n      = size[axis];
+    std::int64_t const stride = (axis == 0) ? 1 : (axis == 1) ? size[0] : size[0] * size[1];
+    if (n == 1) {
+        return;
+    }
+    // Lines start at every offset below the stride, in each of the outer slices or rows. Along x
+    // each line is contiguous, otherwise a block is lines that start next to each other.
+    std::int64_t const outer     = size[0] * size[1] * size[2] / (n * stride);
+    std::int64_t const block     = std::min(LineBlock, stride);
+    std::int64_t const per_outer = (stride + block - 1) / block;
+    std::int64_t const n_jobs    = outer * per_outer;
+
+    std::atomic<std::int64_t> cursor{0};
+    auto                      mt = itk::MultiThreaderBase::New();
+    mt->SetNumberOfWorkUnits(m_threads);
+    mt->ParallelizeArray(
+        0,
+        m_threads,
+        [&](itk::SizeValueType) {
+            std::vector<Complex> buffer(block * n), work(plan.scratch());
+            for (std::int64_t job = cursor++; job < n_jobs; job = cursor++) {
+                std::int64_t const offset = (job % per_outer) * block;
+                std::int64_t const count  = std::min(block, stride - offset);
+                std::int64_t const start  = (job / per_outer) * stride * n + offset;
+                for (std::int64_t l = 0; l < count; l++) {
+                    for (std::int64_t i = 0; i < n; i++) {
+                        Complex const v   = data[start + l + i * stride];
+                        buffer[l * n + i] = inverse ? std::conj(v) : v;
+                    }
+                }
+                for (std::int64_t l = 0; l < count; l++) {
+                    plan.forward(&buffer[l * n], work.data());
+                }
+                for (std::int64_t l = 0; l < count; l++) {
+                    for (std::int64_t i = 0; i < n; i++) {
+                        Complex const v                = buffer[l * n + i];
+                        data[start + l + i * stride] = inverse ? std::conj(v) : v;
+                    }
+                }
+            }
+        },
+        nullptr);
+}
+
+void FFT::forward(Complex *data) const {
+    for (int d = 0; d < 3; d++) {
+        lines(data, m_size, d, false);
+    }
+}
+
+void FFT::inverse(Complex *data) const {
+    for (int d = 0; d < 3; d++) {
+        lines(data, m_size, d, true);
+    }
+    double const scale = 1. / (m_size[0] * m_size[1] * m_size[2]);
+    std::transform(data, data + m_size[0] * m_size[1] * m_size[2], data, [&](Complex const &v) {
+        return v * scale;
+    });
+}
+
+/*
+ *  For even nx each real line is packed into a complex line of half the length, with even
+ *  samples in the real part and odd in the imaginary, transformed, and then separated. Odd
+ *  lengths fall back to a complex transform of the whole line.
+ */
+void FFT::forward(double const *in, Complex *out) const {
+    std::int64_t const nx      = m_size[0];
+    std::int64_t const hx      = nx / 2 + 1;
+    std::int64_t const n_lines = m_size[1] * m_size[2];
+    std::atomic<std::int64_t> cursor{0};
+    auto                      mt = itk::MultiThreaderBase::New();
+    mt->SetNumberOfWorkUnits(m_threads);
+    mt->ParallelizeArray(
+        0,
+        m_threads,
+        [&](itk::SizeValueType) {
+            auto const &         plan = m_half ? *m_half : *m_plans[0];
+            std::vector<Complex> line(plan.size()), work(plan.scratch());
+            for (std::int64_t l = cursor++; l < n_lines; l = cursor++) {
+                double const *x = in + l * nx;
+                Complex *     X = out + l * hx;
+                if (!m_half) {
+                    std::copy(x, x + nx, line.begin());
+                    plan.forward(line.data(), work.data());
+                    std::copy(line.begin(), line.begin() + hx, X);
+                    continue;
+                }
+                std::int64_t const h = nx / 2;
+                for (std::int64_t j = 0; j < h; j++) {
+                    line[j] = {x[2 * j], x[2 * j + 1]};
+                }
+                plan.forward(line.data(), work.data());
+                for (std::int64_t k = 0; k < hx; k++) {
+                    Complex const z  = line[k % h];
+                    Complex const zc = std::conj(line[(h - k) % h]);
+                    Complex const e  = (z + zc) * 0.5;
+                    Complex const o  = (z - zc) * Complex{0., -0.5};
+                    X[k]             = e + m_split[k] * o;
+                }
+            }
+        },
+        nullptr);
+    Size const half = half_size();
+    lines(out, half, 1, false);
+    lines(out, half, 2, false);
+}
+
+void FFT::inverse(Complex *in, double *out) const {
+    Size const half = half_size();
+    lines(in, half, 1, true);
+    lines(in, half, 2, true);
+
+    std::int64_t const nx      = m_size[0];
+    std::int64_t const hx      = nx / 2 + 1;
+    std::int64_t const n_lines = m_size[1] * m_size[2];
+    double const       scale   = 1. / (m_size[0] * m_size[1] * m_size[2]);
+    std::atomic<std::int64_t> cursor{0};
+    auto                      mt = itk::MultiThreaderBase::New();
+    mt->SetNumberOfWorkUnits(m_threads);
+    mt->ParallelizeArray(
+        0,
+        m_threads,
+        [&](itk::SizeValueType) {
+            auto const &         plan = m_half ? *m_half : *m_plans[0];
+            std::vector<Complex> line(plan.size()), work(plan.scratch());
+            for (std::int64_t l = cursor++; l < n_lines; l = cursor++) {
+                Complex const *X = in + l * hx;
+                double *       x = out + l * nx;
+                if (!m_half) {
+                    // Rebuild the full line from its conjugate symmetry
+                    for (std::int64_t k = 0; k < nx; k++) {
+                        line[k] = (k < hx) ? std::conj(X[k]) : X[nx - k];
+                    }
+                    plan.forward(line.data(), work.data());
+                    for (std::int64_t j = 0; j < nx; j++) {
+                        x[j] = line[j].real() * scale;
+                    }
+                    continue;
+                }
+                std::int64_t const h = nx / 2;
+                for (std::int64_t k = 0; k < h; k++) {
+                    Complex const xc = std::conj(X[h - k]);
+                    Complex const e  = (X[k] + xc) * 0.5;
+                    Complex const o  = (X[k] - xc) * 0.5 * std::conj(m_split[k]);
+                    line[k]          = std::conj(e + Complex{0., 1.} * o);
+                }
+                plan.forward(line.data(), work.data());
+                // A half length transform is half the scale of a full one
+                for (std::int64_t j = 0; j < h; j++) {
+                    x[2 * j]     = 2. * line[j].real() * scale;
+                    x[2 * j + 1] = -2. * line[j].imag() * scale;
+                }
+            }
+        },
+        nullptr);
+}
+
+} // namespace QI
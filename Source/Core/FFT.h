@@ -0,0 +1,58 @@
+/*
+ *  FFT.h - Part of QUantitative Imaging Tools
+ *
+ *  Copyright (c) 2026 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <array>
+#include <complex>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace QI {
+
+class FFTPlan; // One dimensional plan, shared between transforms of the same length
+
+/*
+ *  3D FFTs of any size, done as 1D transforms along each axis with the lines shared out over
+ *  threads. Lengths are factored into radix 2, 3 and 4 butterflies, with a generic butterfly for
+ *  other small primes and Bluestein's algorithm for large ones, so there is no need to pad volumes
+ *  to a friendly size. 1D plans are cached by length, so each new volume of the same size only
+ *  pays for the transforms. Data is stored x fastest, as in an ITK image buffer. The inverse
+ *  transforms are scaled by 1/N, so forward then inverse returns the original data.
+ */
+class FFT {
+  public:
+    using Complex = std::complex<double>;
+    using Size    = std::array<std::int64_t, 3>;
+
+    FFT(Size const &size, int const threads = 1);
+
+    Size const &size() const { return m_size; }
+    // The size of a real-to-complex spectrum, which only keeps x frequencies 0 to nx/2
+    Size half_size() const { return {m_size[0] / 2 + 1, m_size[1], m_size[2]}; }
+
+    void forward(Complex *data) const; // In place
+    void inverse(Complex *data) const;
+    void forward(double const *in, Complex *out) const; // out has half_size()
+    void inverse(Complex *in, double *out) const;       // in is overwritten
+
+  private:
+    Size                                          m_size;
+    int                                           m_threads;
+    std::array<std::shared_ptr<FFTPlan const>, 3> m_plans;
+    std::shared_ptr<FFTPlan const>                m_half; // For real x transforms of even length
+    std::vector<Complex>                          m_split; // To separate the even and odd halves
+
+    void lines(Complex *data, Size const &size, int const axis, bool const inverse) const;
+};
+
+} // namespace QI
@@ -11,12 +11,25 @@
 
 #pragma once
 
+#include "LevenbergMarquardt.h"
 #include "Macro.h"
 #include "Model.h"
 #include <Eigen/Core>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <concepts>
+#include <cstdint>
+#include <cstdlib>
 #include <itkIndex.h>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <unordered_map>
+#include <vector>
 
 namespace QI {
 
@@ -29,6 +42,467 @@ struct FitReturnType {
     std::string message;
 };
 
+/*
+ *  Structure-of-arrays storage for a batch of voxels. Every array has one row per voxel, so a
+ *  single data-point or parameter is contiguous across the batch and closed-form fits can vectorize
+ *  over voxels. The buffers are sized once per work unit and re-used for every batch.
+ */
+template <typename ModelType, typename FlagType = int> struct FitBatch {
+    using InputType     = typename ModelType::DataType;
+    using ParameterType = typename ModelType::ParameterType;
+    using InputArray    = Eigen::Array<InputType, Eigen::Dynamic, Eigen::Dynamic>;
+    using FixedArray    = Eigen::Array<ParameterType, Eigen::Dynamic, ModelType::NF>;
+    using VaryingArray  = Eigen::Array<ParameterType, Eigen::Dynamic, ModelType::NV>;
+    using DerivedArray  = Eigen::Array<ParameterType, Eigen::Dynamic, ModelType::ND>;
+    using CovarArray    = Eigen::Array<ParameterType, Eigen::Dynamic, ModelType::NCov>;
+    using FlagArray     = Eigen::Array<FlagType, Eigen::Dynamic, 1>;
+
+    Eigen::Index               size = 0;   // Number of voxels currently in the batch
+    bool                       covar;      // Fill in the covar array
+    std::vector<InputArray>    inputs;     // Voxels x data-points, one per input
+    std::vector<InputArray>    residuals;  // As for inputs, empty if not requested
+    FixedArray                 fixed;      // Voxels x fixed parameters
+    VaryingArray               varying;    // Voxels x varying parameters
+    DerivedArray               derived;    // Voxels x derived parameters
+    CovarArray                 covar_out;  // Voxels x covariance entries
+    Eigen::ArrayXd             rmse;       // One per voxel
+    FlagArray                  flag;       // One per voxel
+    std::vector<FitReturnType> status;     // One per voxel
+    std::vector<itk::Index<3>> index;      // Image index of each voxel
+    std::vector<int>           block;      // Block number of each voxel (Blocked fits only)
+
+    // Scratch space for fit functions that only process one voxel at a time
+    std::vector<QI_ARRAY(InputType)> voxel_inputs, voxel_residuals;
+
+    template <typename FitType>
+    FitBatch(FitType const &f, Eigen::Index const capacity, bool const c, bool const r) :
+        covar{c}, inputs(ModelType::NI), fixed(capacity, ModelType::NF),
+        varying(capacity, ModelType::NV), derived(capacity, ModelType::ND),
+        covar_out(c ? capacity : 0, ModelType::NCov), rmse(capacity), flag(capacity),
+        status(capacity), index(capacity), block(capacity), voxel_inputs(ModelType::NI) {
+        for (int i = 0; i < ModelType::NI; i++) {
+            inputs[i].resize(capacity, f.input_size(i));
+            voxel_inputs[i].resize(f.input_size(i));
+            if (r) {
+                residuals.emplace_back(capacity, f.input_size(i));
+                voxel_residuals.emplace_back(f.input_size(i));
+            }
+        }
+    }
+
+    Eigen::Index capacity() const { return varying.rows(); }
+    bool         full() const { return size == capacity(); }
+};
+
+/*
+ *  Default batch fit. Copies each voxel into the scratch space and calls the single-voxel fit
+ *  function with the signature that ModelFitFilter would otherwise have used.
+ */
+template <typename FitType, typename BatchType>
+void FitEachVoxel(FitType const &f, BatchType &batch) {
+    using ModelType = typename FitType::ModelType;
+    typename ModelType::VaryingArray varying;
+    typename ModelType::FixedArray   fixed;
+    typename ModelType::CovarArray   covar;
+    typename ModelType::CovarArray * covar_ptr = batch.covar ? &covar : nullptr;
+    for (Eigen::Index v = 0; v < batch.size; v++) {
+        for (int i = 0; i < ModelType::NI; i++) {
+            batch.voxel_inputs[i] = batch.inputs[i].row(v).transpose();
+        }
+        for (auto &r : batch.voxel_residuals) {
+            r.setZero();
+        }
+        fixed   = batch.fixed.row(v).transpose();
+        varying = ModelType::VaryingArray::Zero();
+        covar   = ModelType::CovarArray::Zero();
+        typename FitType::RMSErrorType rmse = 0;
+        typename FitType::FlagType     flag = 0;
+
+        auto &status = batch.status[v];
+        if constexpr (FitType::Blocked && FitType::Indexed) {
+            status = f.fit(batch.voxel_inputs,
+                           fixed,
+                           varying,
+                           covar_ptr,
+                           rmse,
+                           batch.voxel_residuals,
+                           flag,
+                           batch.block[v],
+                           batch.index[v]);
+        } else if constexpr (FitType::Blocked) {
+            status = f.fit(batch.voxel_inputs,
+                           fixed,
+                           varying,
+                           covar_ptr,
+                           rmse,
+                           batch.voxel_residuals,
+                           flag,
+                           batch.block[v]);
+        } else if constexpr (FitType::Indexed) {
+            status = f.fit(batch.voxel_inputs,
+                           fixed,
+                           varying,
+                           covar_ptr,
+                           rmse,
+                           batch.voxel_residuals,
+                           flag,
+                           batch.index[v]);
+        } else if constexpr (ModelType::ND > 0) {
+            typename ModelType::DerivedArray derived;
+            status = f.fit(batch.voxel_inputs,
+                           fixed,
+                           varying,
+                           derived,
+                           covar_ptr,
+                           rmse,
+                           batch.voxel_residuals,
+                           flag);
+            batch.derived.row(v) = derived.transpose();
+        } else {
+            status = f.fit(
+                batch.voxel_inputs, fixed, varying, covar_ptr, rmse, batch.voxel_residuals, flag);
+        }
+
+        batch.varying.row(v) = varying.transpose();
+        if (batch.covar) {
+            batch.covar_out.row(v) = covar.transpose();
+        }
+        batch.rmse[v] = rmse;
+        batch.flag[v] = flag;
+        for (size_t i = 0; i < batch.residuals.size(); i++) {
+            batch.residuals[i].row(v) = batch.voxel_residuals[i].transpose();
+        }
+    }
+}
+
+/*
+ *  Fit functions can provide a fit_batch() member to process a whole batch at once
+ */
+template <typename FitType>
+concept BatchFitFunction =
+    requires(FitType const &f,
+             FitBatch<typename FitType::ModelType, typename FitType::FlagType> &b) {
+        f.fit_batch(b);
+    };
+
+template <typename FitType, typename BatchType>
+void FitBatchOf(FitType const &f, BatchType &batch) {
+    if constexpr (BatchFitFunction<FitType>) {
+        f.fit_batch(batch);
+    } else {
+        FitEachVoxel(f, batch);
+    }
+}
+
+/*
+ *  Costs with a jacobian(v, residuals, J) member, e.g. a ModelCost of a model with analytic
+ *  derivatives, fill in their own Jacobian instead of being differentiated with Jets. J is
+ *  row-major and may be null if Ceres only wants the residuals.
+ */
+template <typename Cost>
+concept AnalyticCost = requires(Cost const &c, double const *v, double *r, double *J) {
+    { c.jacobian(v, r, J) } -> std::same_as<bool>;
+};
+
+/*
+ *  Set $QUIT_CHECK_JACOBIAN to compare every analytic Jacobian with automatic differentiation
+ */
+inline bool CheckJacobians() {
+    static bool const check = std::getenv("QUIT_CHECK_JACOBIAN") != nullptr;
+    return check;
+}
+
+template <int NV, typename Cost>
+void CheckJacobian(Cost const &cost, double const *v, double const *r, double const *J, int n) {
+    using Jet = ceres::Jet<double, NV>;
+    std::array<Jet, NV> vj;
+    for (int i = 0; i < NV; i++) {
+        vj[i] = Jet(v[i], i);
+    }
+    std::vector<Jet> rj(n);
+    if (!cost(vj.data(), rj.data())) {
+        QI::Fail("Automatic differentiation failed while checking a Jacobian");
+    }
+    for (int i = 0; i < n; i++) {
+        if (!(std::abs(r[i] - rj[i].a) <= 1e-8 * (1. + std::abs(rj[i].a)))) {
+            QI::Fail("Residual {} is {} but should be {}", i, r[i], rj[i].a);
+        }
+        for (int j = 0; j < NV; j++) {
+            double const a = J[i * NV + j];
+            double const b = rj[i].v[j];
+            if (!(std::abs(a - b) <= 1e-8 * (1. + std::abs(b)))) {
+                QI::Fail("Jacobian ({},{}) is {} but autodiff gives {}", i, j, a, b);
+            }
+        }
+    }
+}
+
+template <typename Cost, int NV>
+class AnalyticCostFunction final : public ceres::SizedCostFunction<ceres::DYNAMIC, NV> {
+  public:
+    AnalyticCostFunction(Cost *cost, int const n) : m_cost{cost} { this->set_num_residuals(n); }
+
+    bool Evaluate(double const *const *p, double *r, double **J) const override {
+        double *const J0 = J ? J[0] : nullptr;
+        if (!m_cost->jacobian(p[0], r, J0)) {
+            return false;
+        }
+        if (J0 && CheckJacobians()) {
+            CheckJacobian<NV>(*m_cost, p[0], r, J0, this->num_residuals());
+        }
+        return true;
+    }
+
+  private:
+    std::unique_ptr<Cost> m_cost;
+};
+
+/*
+ *  Wrap a cost functor for Ceres, using its analytic Jacobian if it has one and automatic
+ *  differentiation otherwise. Ceres takes ownership of the functor.
+ */
+template <int NV, typename Cost>
+ceres::CostFunction *MakeCostFunction(Cost *cost, int const n_residuals) {
+    if constexpr (AnalyticCost<Cost>) {
+        return new AnalyticCostFunction<Cost, NV>(cost, n_residuals);
+    } else {
+        return new ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, NV>(cost, n_residuals);
+    }
+}
+
+/*
+ *  A Ceres problem that is built once and then re-used for every voxel. The parameter block, the
+ *  residual blocks, the loss and the solver options all stay alive, so a fit only has to copy the
+ *  data (and fixed parameters) for the next voxel into the cost functors and call Solve(). The same
+ *  residual blocks can instead be solved with the small dense Levenberg-Marquardt engine in
+ *  LevenbergMarquardt.h, which needs the costs to accept Jets, as for AddAutoDiff(), or to be
+ *  AnalyticCosts.
+ */
+template <typename ModelType, typename... Costs> struct CeresWorkspace {
+    static constexpr int    NV = ModelType::NV;
+    static constexpr size_t NC = sizeof...(Costs);
+    using VaryingArray         = typename ModelType::VaryingArray;
+    using Jet                  = ceres::Jet<double, NV>;
+
+    VaryingArray           p; // The parameter block shared by all residual blocks
+    std::tuple<Costs *...> costs;
+    ceres::Problem         problem;
+    ceres::Solver::Options options;
+    ceres::Solver::Summary summary;
+
+    // Results of the last call to Solve()
+    int         iterations = 0;
+    double      final_cost = 0.;
+    std::string message;
+
+    CeresWorkspace() :
+        lo{VaryingArray::Constant(-std::numeric_limits<double>::infinity())},
+        hi{VaryingArray::Constant(std::numeric_limits<double>::infinity())} {
+        options.logging_type = ceres::SILENT;
+    }
+    CeresWorkspace(CeresWorkspace const &) = delete;
+    CeresWorkspace &operator=(CeresWorkspace const &) = delete;
+
+    template <size_t I> auto &cost() { return *std::get<I>(costs); }
+    template <size_t I> using CostType = std::tuple_element_t<I, std::tuple<Costs...>>;
+
+    // The workspace takes ownership of the cost functors and the loss. AnalyticCosts are not
+    // differentiated, but must still accept Jets so that they can be checked.
+    template <size_t I>
+    void
+    AddAutoDiff(CostType<I> *cost, int const n_residuals, ceres::LossFunction *loss = nullptr) {
+        AddBlock<I>(cost, n_residuals, loss);
+        problem.AddResidualBlock(MakeCostFunction<NV>(cost, n_residuals), loss, p.data());
+    }
+
+    template <size_t I>
+    void
+    AddNumericDiff(CostType<I> *cost, int const n_residuals, ceres::LossFunction *loss = nullptr) {
+        using Diff =
+            ceres::NumericDiffCostFunction<CostType<I>, ceres::CENTRAL, ceres::DYNAMIC, NV>;
+        AddBlock<I>(cost, n_residuals, loss);
+        problem.AddResidualBlock(
+            new Diff(cost, ceres::TAKE_OWNERSHIP, n_residuals), loss, p.data());
+    }
+
+    template <typename Lo, typename Hi> void SetBounds(Lo const &new_lo, Hi const &new_hi) {
+        for (int i = 0; i < NV; i++) {
+            lo[i] = new_lo[i];
+            hi[i] = new_hi[i];
+            problem.SetParameterLowerBound(p.data(), i, lo[i]);
+            problem.SetParameterUpperBound(p.data(), i, hi[i]);
+        }
+    }
+
+    bool Solve() {
+        ceres::Solve(options, &problem, &summary);
+        iterations = summary.iterations.size();
+        final_cost = summary.final_cost;
+        if (!summary.IsSolutionUsable()) {
+            message = summary.FullReport();
+            return false;
+        }
+        return true;
+    }
+
+    bool Solve(NLLSSolver const solver) {
+        if (solver == NLLSSolver::Ceres) {
+            return Solve();
+        }
+        LMSummary const lm = LevenbergMarquardt<NV>(*this, p.data(), lo, hi, options);
+        iterations         = lm.iterations;
+        final_cost         = lm.final_cost;
+        message            = lm.message;
+        return lm.usable;
+    }
+
+    /*
+     *  Parameter covariance at p, as GetModelCovariance(), but from the normal equations that
+     *  Linearize() builds instead of a fresh evaluation of the problem
+     */
+    void Covariance(double const scale, typename ModelType::CovarArray *cov) {
+        Eigen::Matrix<double, NV, NV>      JtJ;
+        Eigen::Matrix<double, NV, 1>       Jtr;
+        Eigen::Matrix<double, NV, 1> const x = p.matrix();
+        double                             total;
+        if (!Linearize(x, JtJ, Jtr, total) || !NormalCovariance<ModelType>(JtJ, p, scale, cov)) {
+            CeresCovariance<ModelType>(problem, p, scale, cov);
+        }
+    }
+
+    /*
+     *  Evaluator interface for LevenbergMarquardt()
+     */
+    template <typename Vector, typename Matrix>
+    bool Linearize(Vector const &x, Matrix &JtJ, Vector &Jtr, double &total) {
+        std::array<Jet, NV> v;
+        for (int i = 0; i < NV; i++) {
+            v[i] = Jet(x[i], i);
+        }
+        JtJ.setZero();
+        Jtr.setZero();
+        total = 0.;
+        return [&]<size_t... I>(std::index_sequence<I...>) {
+            return ([&] {
+                if constexpr (AnalyticCost<CostType<I>>) {
+                    if (!cost<I>().jacobian(x.data(), residuals.data(), jacobian.data())) {
+                        return false;
+                    }
+                    if (CheckJacobians()) {
+                        CheckJacobian<NV>(
+                            cost<I>(), x.data(), residuals.data(), jacobian.data(), n_residuals[I]);
+                    }
+                    AccumulateNormalEquations<NV>(residuals.data(),
+                                                  jacobian.data(),
+                                                  n_residuals[I],
+                                                  losses[I],
+                                                  JtJ,
+                                                  Jtr,
+                                                  total);
+                } else {
+                    if (!cost<I>()(v.data(), jet_residuals.data())) {
+                        return false;
+                    }
+                    AccumulateNormalEquations<NV>(
+                        jet_residuals.data(), n_residuals[I], losses[I], JtJ, Jtr, total);
+                }
+                return true;
+            }() && ...);
+        }(std::index_sequence_for<Costs...>{});
+    }
+
+    template <typename Vector> bool Evaluate(Vector const &x, double &total) {
+        total = 0.;
+        return [&]<size_t... I>(std::index_sequence<I...>) {
+            return ([&] {
+                if (!cost<I>()(x.data(), residuals.data())) {
+                    return false;
+                }
+                total += ResidualCost(residuals.data(), n_residuals[I], losses[I]);
+                return true;
+            }() && ...);
+        }(std::index_sequence_for<Costs...>{});
+    }
+
+  private:
+    VaryingArray                          lo, hi;
+    std::array<int, NC>                   n_residuals;
+    std::array<ceres::LossFunction *, NC> losses;
+    std::vector<Jet>                      jet_residuals; // Scratch space for the LM solver
+    std::vector<double>                   residuals;
+    std::vector<double>                   jacobian;
+
+    template <size_t I>
+    void AddBlock(CostType<I> *cost, int const n, ceres::LossFunction *loss) {
+        std::get<I>(costs) = cost;
+        n_residuals[I]     = n;
+        losses[I]          = loss;
+        if (static_cast<size_t>(n) > residuals.size()) {
+            jet_residuals.resize(n);
+            residuals.resize(n);
+            jacobian.resize(n * NV);
+        }
+    }
+};
+
+/*
+ *  Keeps one workspace per thread for the fit object that it is a member of. The workspaces are
+ *  owned here, so they are freed with the fit even though ITK's pool threads live on. Each thread
+ *  remembers the last workspace it fetched, so the lock is only taken when it moves to another fit
+ *  object. Workspaces refer to the model inside the fit object, so a copy of the fit gets a new key
+ *  and builds its own.
+ */
+template <typename Workspace> class PerThreadWorkspace {
+  public:
+    PerThreadWorkspace() : m_key{NewKey()} {}
+    PerThreadWorkspace(PerThreadWorkspace const &) : m_key{NewKey()} {}
+    PerThreadWorkspace &operator=(PerThreadWorkspace const &) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_table.clear();
+        m_key = NewKey();
+        return *this;
+    }
+
+    /*
+     *  Returns this thread's workspace, calling setup() on it the first time
+     */
+    template <typename Setup> Workspace &get(Setup &&setup) const {
+        // Keys are never reused, so a key match means the workspace is still alive
+        thread_local std::pair<std::uint64_t, Workspace *> last{NoKey, nullptr};
+        if (last.first == m_key) {
+            return *last.second;
+        }
+        Workspace *w     = nullptr;
+        bool       fresh = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto &slot = m_table[std::this_thread::get_id()];
+            if (!slot) {
+                slot  = std::make_unique<Workspace>();
+                fresh = true;
+            }
+            w = slot.get();
+        }
+        if (fresh) {
+            setup(*w);
+        }
+        last = {m_key, w};
+        return *w;
+    }
+
+  private:
+    static constexpr std::uint64_t NoKey = std::numeric_limits<std::uint64_t>::max();
+
+    std::uint64_t                                                           m_key;
+    mutable std::mutex                                                      m_mutex;
+    mutable std::unordered_map<std::thread::id, std::unique_ptr<Workspace>> m_table;
+
+    static std::uint64_t NewKey() {
+        static std::atomic<std::uint64_t> next{0};
+        return next++;
+    }
+};
+
 template <typename Model_, bool Blocked_ = false, bool Indexed_ = false> struct FitFunctionBase {
     using ModelType           = Model_;
     using RMSErrorType        = double;
@@ -59,6 +533,10 @@ struct FitFunction : FitFunctionBase<ModelType, false, false> {
                               RMSErrorType &                          rmse,
                               std::vector<QI_ARRAY(InputType)> &      residuals,
                               FlagType &                              flag) const = 0;
+
+    virtual void fit_batch(FitBatch<ModelType, FlagType> &batch) const {
+        FitEachVoxel(*this, batch);
+    }
 };
 
 template <typename ModelType, typename FlagType_ = int>
@@ -70,6 +548,11 @@ struct NLLSFitFunction : FitFunction<ModelType> {
     using OutputType = typename ModelType::ParameterType;
     using FlagType   = FlagType_; // Iterations
 
+    using Cost      = ModelCost<ModelType>;
+    using Workspace = CeresWorkspace<ModelType, Cost>;
+    PerThreadWorkspace<Workspace> workspace;
+    NLLSSolver                    solver = NLLSSolver::Ceres;
+
     NLLSFitFunction(ModelType &m) : Super{m} {}
 
     FitReturnType fit(const std::vector<QI_ARRAY(InputType)> &inputs,
@@ -79,39 +562,34 @@ struct NLLSFitFunction : FitFunction<ModelType> {
                       RMSErrorType &                          rmse,
                       std::vector<QI_ARRAY(InputType)> &      residuals,
                       FlagType &                              iterations) const {
-        auto const &   data = inputs[0];
-        ceres::Problem problem;
-        using Cost      = ModelCost<ModelType>;
-        using AutoCost  = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, ModelType::NV>;
-        auto *cost      = new Cost{this->model, fixed, data};
-        auto *auto_cost = new AutoCost(cost, this->model.sequence.size());
-        problem.AddResidualBlock(auto_cost, NULL, p.data());
-        for (int i = 0; i < ModelType::NV; i++) {
-            problem.SetParameterLowerBound(p.data(), i, this->model.bounds_lo[i]);
-            problem.SetParameterUpperBound(p.data(), i, this->model.bounds_hi[i]);
-        }
-        ceres::Solver::Options options;
-        ceres::Solver::Summary summary;
-        options.max_num_iterations  = 15;
-        options.function_tolerance  = 1e-6;
-        options.gradient_tolerance  = 1e-7;
-        options.parameter_tolerance = 1e-5;
-        options.logging_type        = ceres::SILENT;
-        p << this->model.start;
-        ceres::Solve(options, &problem, &summary);
-        if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+        Workspace &ws = workspace.get([&](Workspace &w) {
+            w.template AddAutoDiff<0>(new Cost{this->model, fixed, inputs[0]},
+                                      this->model.sequence.size());
+            w.SetBounds(this->model.bounds_lo, this->model.bounds_hi);
+            w.options.max_num_iterations  = 15;
+            w.options.function_tolerance  = 1e-6;
+            w.options.gradient_tolerance  = 1e-7;
+            w.options.parameter_tolerance = 1e-5;
+        });
+        auto &cost = ws.template cost<0>();
+        cost.fixed = fixed;
+        cost.data  = inputs[0];
+        ws.p       = this->model.start;
+        if (!ws.Solve(solver)) {
+            return {false, ws.message};
         }
-        iterations = summary.iterations.size();
+        iterations = ws.iterations;
+        p          = ws.p;
 
-        Eigen::ArrayXd const rs  = (data - this->model.signal(p, fixed));
-        double const         var = rs.square().sum();
-        rmse                     = sqrt(var / data.rows());
+        auto const &         data = cost.data;
+        Eigen::ArrayXd const rs   = (data - this->model.signal(p, fixed));
+        double const         var  = rs.square().sum();
+        rmse                      = sqrt(var / data.rows());
         if (residuals.size() > 0) {
             residuals[0] = rs;
         }
         if (cov) {
-            QI::GetModelCovariance<ModelType>(problem, p, var / (data.rows() - ModelType::NV), cov);
+            ws.Covariance(var / (data.rows() - ModelType::NV), cov);
         }
 
         return {true, ""};
@@ -135,6 +613,10 @@ struct BlockFitFunction : FitFunctionBase<ModelType, true, false> {
                               std::vector<QI_ARRAY(InputType)> &      point_residuals,
                               FlagType &                              flag,
                               const int                               block) const = 0;
+
+    virtual void fit_batch(FitBatch<ModelType, FlagType> &batch) const {
+        FitEachVoxel(*this, batch);
+    }
 };
 
 template <typename ModelType, typename FlagType_ = int>
@@ -155,6 +637,10 @@ struct IndexedFitFunction : FitFunctionBase<ModelType, false, true> {
                               std::vector<QI_ARRAY(InputType)> &      point_residuals,
                               FlagType &                              flag,
                               const itk::Index<3> &                   index) const = 0;
+
+    virtual void fit_batch(FitBatch<ModelType, FlagType> &batch) const {
+        FitEachVoxel(*this, batch);
+    }
 };
 
 } // End namespace QI
@@ -12,6 +12,10 @@ struct ScaledNumericDiffFit : FitFunction<ModelType, int> {
     using InputType  = typename ModelType::DataType;
     using OutputType = typename ModelType::ParameterType;
 
+    using Cost      = QI::ModelCost<ModelType>;
+    using Workspace = QI::CeresWorkspace<ModelType, Cost>;
+    QI::PerThreadWorkspace<Workspace> workspace;
+
     ScaledNumericDiffFit(ModelType &m) : Super{m} {}
 
     // This has to match the function signature that will be called in ModelFitFilter (which depends
@@ -33,45 +37,32 @@ struct ScaledNumericDiffFit : FitFunction<ModelType, int> {
             rmse    = 0.0;
             return {false, "Maximum data value was zero or less"};
         }
-        Eigen::ArrayXd const data = inputs[0] / scale;
-
-        // Setup Ceres
-        ceres::Problem problem;
-        using Diff = ceres::NumericDiffCostFunction<QI::ModelCost<ModelType>,
-                                                    ceres::CENTRAL,
-                                                    ceres::DYNAMIC,
-                                                    ModelType::NV>;
-        auto *cost = new Diff(new QI::ModelCost<ModelType>{this->model, fixed, data},
-                              ceres::TAKE_OWNERSHIP,
-                              this->model.sequence.size());
-        auto *loss = new ceres::HuberLoss(1.0); // Don't know if this helps
-
-        // This is where the parameters and cost functions actually get added to Ceres
-        problem.AddResidualBlock(cost, loss, varying.data());
-
-        // Set up parameter bounds
-        for (int i = 0; i < ModelType::NV; i++) {
-            problem.SetParameterLowerBound(varying.data(), i, this->model.lo[i]);
-            problem.SetParameterUpperBound(varying.data(), i, this->model.hi[i]);
-        }
-
-        ceres::Solver::Options options;
-        ceres::Solver::Summary summary;
-        options.max_num_iterations  = 30;
-        options.function_tolerance  = 1e-6;
-        options.gradient_tolerance  = 1e-7;
-        options.parameter_tolerance = 1e-5;
-        options.logging_type        = ceres::SILENT;
+        // Fetch this thread's Ceres problem, setting it up if this is the first voxel
+        Workspace &ws = workspace.get([&](Workspace &w) {
+            w.template AddNumericDiff<0>(new Cost{this->model, fixed, inputs[0] / scale},
+                                         this->model.sequence.size(),
+                                         new ceres::HuberLoss(1.0)); // Don't know if this helps
+            w.SetBounds(this->model.lo, this->model.hi);
+            w.options.max_num_iterations  = 30;
+            w.options.function_tolerance  = 1e-6;
+            w.options.gradient_tolerance  = 1e-7;
+            w.options.parameter_tolerance = 1e-5;
+        });
 
-        varying = this->model.start;
-        ceres::Solve(options, &problem, &summary);
-        if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+        // Swap in the data for this voxel
+        auto &cost = ws.template cost<0>();
+        cost.fixed = fixed;
+        cost.data  = inputs[0] / scale;
+        ws.p       = this->model.start;
+        if (!ws.Solve()) {
+            return {false, ws.message};
         }
-        iterations = summary.iterations.size();
+        iterations = ws.iterations;
+        varying    = ws.p;
+        auto const &        data = cost.data;
         double              var;
         std::vector<double> rs(data.size());
-        problem.Evaluate(ceres::Problem::EvaluateOptions(), &var, &rs, nullptr, nullptr);
+        ws.problem.Evaluate(ceres::Problem::EvaluateOptions(), &var, &rs, nullptr, nullptr);
         rmse = sqrt(var / data.rows()) * scale;
         if (residuals.size() > 0) {
             for (long ii = 0; ii < residuals[0].size(); ii++) {
@@ -80,7 +71,7 @@ struct ScaledNumericDiffFit : FitFunction<ModelType, int> {
         }
         if (cov) {
             QI::GetModelCovariance<ModelType>(
-                problem, varying, var / (data.rows() - ModelType::NV), cov);
+                ws.problem, ws.p, var / (data.rows() - ModelType::NV), cov);
         }
         varying.template head<NScale>() *= scale; // Multiply signals/proton density back up
 
@@ -11,7 +11,19 @@
 
 #include "Kernels.h"
 
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <sstream>
+
 namespace QI {
+double FilterKernel::profile(const int, const double, const double, const double) const {
+    QI::Fail("Filter {} is not separable", *this);
+}
+double FilterKernel::radial(const double) const {
+    QI::Fail("Filter {} is not radial", *this);
+}
+
 TukeyKernel::TukeyKernel() {}
 TukeyKernel::TukeyKernel(std::istream &istr) {
     if (!istr.eof()) {
@@ -28,7 +40,9 @@ void TukeyKernel::print(std::ostream &ostr) const {
 double TukeyKernel::value(const Eigen::Array3d &pos,
                           const Eigen::Array3d &sz,
                           const Eigen::Array3d &) const {
-    const double r = sqrt(((pos / sz).square()).sum() / 3);
+    return radial(sqrt(((pos / sz).square()).sum() / 3));
+}
+double TukeyKernel::radial(const double r) const {
     const double v =
         (r <= (1 - m_a)) ? 1 : 0.5 * ((1 + m_q) + (1 - m_q) * cos(M_PI * (r - (1 - m_a)) / m_a));
     return v;
@@ -50,7 +64,9 @@ void HammingKernel::print(std::ostream &ostr) const {
 double HammingKernel::value(const Eigen::Array3d &pos,
                             const Eigen::Array3d &sz,
                             const Eigen::Array3d &) const {
-    const double r = sqrt(((pos / sz).square()).sum() / 3);
+    return radial(sqrt(((pos / sz).square()).sum() / 3));
+}
+double HammingKernel::radial(const double r) const {
     const double v = m_a - m_b * cos(M_PI * (1. + r));
     return v;
 }
@@ -84,6 +100,12 @@ double GaussKernel::value(const Eigen::Array3d &pos,
     const double         v       = exp(-r2 / 2.);
     return v;
 }
+double
+GaussKernel::profile(const int dim, const double pos, const double sz, const double sp) const {
+    static const double M       = 2. * sqrt(2. * log(2.)) / M_PI;
+    const double        sigma_k = M * sz * sp / m_fwhm[dim];
+    return exp(-(pos / sigma_k) * (pos / sigma_k) / 2.);
+}
 
 BlackmanKernel::BlackmanKernel() {
     calc_constants();
@@ -107,7 +129,9 @@ void BlackmanKernel::print(std::ostream &ostr) const {
 double BlackmanKernel::value(const Eigen::Array3d &pos,
                              const Eigen::Array3d &sz,
                              const Eigen::Array3d &) const {
-    const double r = sqrt(((pos / sz).square() / 3).sum());
+    return radial(sqrt(((pos / sz).square() / 3).sum()));
+}
+double BlackmanKernel::radial(const double r) const {
     const double v = m_a0 - m_a1 * cos(M_PI * (1. + r)) + m_a2 * cos(2. * M_PI * (1. + r));
     return v;
 }
@@ -130,11 +154,16 @@ RectKernel::RectKernel(std::istream &istr) {
     }
 }
 void RectKernel::print(std::ostream &ostr) const {
-    ostr << "FixFSE," << m_dim << "," << m_width << "," << m_val_inside << "," << m_val_outside;
+    ostr << "Rectangle," << m_dim << "," << m_width << "," << m_val_inside << "," << m_val_outside;
 }
 double
 RectKernel::value(const Eigen::Array3d &pos, const Eigen::Array3d &, const Eigen::Array3d &) const {
-    if (fabs(pos[m_dim]) > m_width) {
+    return profile(m_dim, pos[m_dim], 0, 0);
+}
+double RectKernel::profile(const int dim, const double pos, const double, const double) const {
+    if (dim != m_dim) {
+        return 1;
+    } else if (fabs(pos) > m_width) {
         return m_val_outside;
     } else {
         return m_val_inside;
@@ -168,11 +197,18 @@ void FixFSEKernel::print(std::ostream &ostr) const {
 }
 double FixFSEKernel::value(const Eigen::Array3d &pos,
                            const Eigen::Array3d &sz,
-                           const Eigen::Array3d &) const {
-    const int dim      = abs(m_dim);
+                           const Eigen::Array3d &sp) const {
+    const int dim = abs(m_dim);
+    return profile(dim, pos[dim], sz[dim], sp[dim]);
+}
+double
+FixFSEKernel::profile(const int dim, const double pos, const double sz, const double) const {
+    if (dim != abs(m_dim)) {
+        return 1;
+    }
     const int dir      = m_dim > 0 ? 1 : -1;
-    const int n_trains = 2 * sz[dim] / m_etl;
-    const int n_echo   = floor((dir * pos[dim] + sz[dim] - (m_etl / 2) + 2) / n_trains);
+    const int n_trains = 2 * sz / m_etl;
+    const int n_echo   = floor((dir * pos + sz - (m_etl / 2) + 2) / n_trains);
     // At this point, center of kspace is at m_etl / 2. Shift to make it kzero
     const int n_shifted = n_echo - (m_etl / 2) + m_kzero;
     // Wrap negative echoes to end of train
@@ -209,4 +245,135 @@ std::ostream &operator<<(std::ostream &ostr, const FilterKernel &k) {
     return ostr;
 }
 
+namespace {
+std::mutex                                                       weights_mutex;
+std::map<std::string, std::weak_ptr<std::vector<double> const>> weights_cache;
+
+std::vector<double> BuildWeights(const KernelList &           kernels,
+                                 const std::array<int64_t, 3> &size,
+                                 const std::array<double, 3> & spacing,
+                                 const bool                   highpass) {
+    const Eigen::Array3d sz{static_cast<double>(size[0]),
+                            static_cast<double>(size[1]),
+                            static_cast<double>(size[2])};
+    const Eigen::Array3d hsz = sz / 2;
+    const Eigen::Array3d sp{spacing[0], spacing[1], spacing[2]};
+    // Positions along each axis, wrapped so the centre of k-space is at index 0
+    std::array<std::vector<double>, 3> pos;
+    for (int d = 0; d < 3; d++) {
+        pos[d].resize(size[d]);
+        for (int64_t i = 0; i < size[d]; i++) {
+            pos[d][i] = fmod(static_cast<double>(i) + hsz[d], sz[d]) - hsz[d];
+        }
+    }
+    std::vector<double> w(size[0] * size[1] * size[2], 1.);
+    for (const auto &kernel : kernels) {
+        switch (kernel->form()) {
+        case FilterKernel::Form::Separable: {
+            std::array<std::vector<double>, 3> f;
+            for (int d = 0; d < 3; d++) {
+                for (const double p : pos[d]) {
+                    f[d].push_back(kernel->profile(d, p, hsz[d], sp[d]));
+                }
+            }
+            double *v = w.data();
+            for (int64_t z = 0; z < size[2]; z++) {
+                for (int64_t y = 0; y < size[1]; y++) {
+                    const double fyz = f[2][z] * f[1][y];
+                    for (int64_t x = 0; x < size[0]; x++) {
+                        v[x] *= f[0][x] * fyz;
+                    }
+                    v += size[0];
+                }
+            }
+        } break;
+        case FilterKernel::Form::Radial: {
+            // r^2 is a sum of one term per axis, and the kernel is interpolated from a fine table
+            std::array<std::vector<double>, 3> r2;
+            double                             r2_max = 0;
+            for (int d = 0; d < 3; d++) {
+                double m = 0;
+                for (const double p : pos[d]) {
+                    r2[d].push_back((p / hsz[d]) * (p / hsz[d]) / 3);
+                    m = std::max(m, r2[d].back());
+                }
+                r2_max += m;
+            }
+            const int           n_table = 8192;
+            const double        dr      = std::max(sqrt(r2_max), 1e-12) / (n_table - 1);
+            std::vector<double> table(n_table + 1);
+            for (int i = 0; i <= n_table; i++) {
+                table[i] = kernel->radial(i * dr);
+            }
+            double *v = w.data();
+            for (int64_t z = 0; z < size[2]; z++) {
+                for (int64_t y = 0; y < size[1]; y++) {
+                    const double r2_yz = r2[2][z] + r2[1][y];
+                    for (int64_t x = 0; x < size[0]; x++) {
+                        const double t    = sqrt(r2[0][x] + r2_yz) / dr;
+                        const int    i    = std::min(static_cast<int>(t), n_table - 1);
+                        const double frac = t - i;
+                        v[x] *= table[i] + frac * (table[i + 1] - table[i]);
+                    }
+                    v += size[0];
+                }
+            }
+        } break;
+        case FilterKernel::Form::General: {
+            double *v = w.data();
+            for (int64_t z = 0; z < size[2]; z++) {
+                for (int64_t y = 0; y < size[1]; y++) {
+                    for (int64_t x = 0; x < size[0]; x++) {
+                        const Eigen::Array3d p{pos[0][x], pos[1][y], pos[2][z]};
+                        *v++ *= kernel->value(p, hsz, sp);
+                    }
+                }
+            }
+        } break;
+        }
+    }
+    if (highpass) {
+        for (auto &v : w) {
+            v = 1 - v;
+        }
+    }
+    return w;
+}
+} // namespace
+
+std::shared_ptr<std::vector<double> const> KernelWeights(const KernelList &           kernels,
+                                                         const std::array<int64_t, 3> &size,
+                                                         const std::array<double, 3> & spacing,
+                                                         const bool                   highpass) {
+    std::ostringstream key;
+    key.precision(17);
+    key << size[0] << "x" << size[1] << "x" << size[2] << "," << spacing[0] << "x" << spacing[1]
+        << "x" << spacing[2] << (highpass ? ",highpass" : "");
+    for (const auto &k : kernels) {
+        key << ";" << *k;
+    }
+    {
+        std::lock_guard<std::mutex> lock(weights_mutex);
+        auto const                  it = weights_cache.find(key.str());
+        if (it != weights_cache.end()) {
+            if (auto weights = it->second.lock()) {
+                return weights;
+            }
+        }
+    }
+    // Built outside the lock so other kernels are not held up
+    auto weights = std::make_shared<std::vector<double> const>(
+        BuildWeights(kernels, size, spacing, highpass));
+    std::lock_guard<std::mutex> lock(weights_mutex);
+    for (auto it = weights_cache.begin(); it != weights_cache.end();) {
+        it = it->second.expired() ? weights_cache.erase(it) : std::next(it);
+    }
+    auto &slot = weights_cache[key.str()];
+    if (auto existing = slot.lock()) {
+        return existing; // Another thread got there first
+    }
+    slot = weights;
+    return weights;
+}
+
 } // End namespace QI
\ No newline at end of file
@@ -12,19 +12,34 @@
 #ifndef QI_KERNELS_H
 #define QI_KERNELS_H
 
+#include <array>
 #include <memory>
+#include <vector>
 
 #include "Eigen/Core"
 #include "Util.h"
 
 namespace QI {
 
+/*
+ *  Kernels are evaluated at a k-space position pos, where sz is half the size of k-space and sp is
+ *  the voxel spacing. Most kernels are either a product of 1D profiles along each axis, or a
+ *  function of the fractional radius r = sqrt(sum((pos / sz)^2) / 3), and say so with form() so a
+ *  whole volume can be built from a few lines or a table instead of calling value() at every voxel.
+ */
 class FilterKernel {
-  protected:
   public:
+    enum class Form { General, Separable, Radial };
+
     virtual void print(std::ostream &ostr) const = 0;
     virtual double
     value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, const Eigen::Array3d &sp) const = 0;
+    virtual Form form() const { return Form::General; }
+    // The factor along one axis, for separable kernels
+    virtual double
+    profile(const int dim, const double pos, const double sz, const double sp) const;
+    // The value at fractional radius r, for radial kernels
+    virtual double radial(const double r) const;
     virtual ~FilterKernel() = default;
 };
 
@@ -40,6 +55,8 @@ class TukeyKernel : public FilterKernel {
     virtual double value(const Eigen::Array3d &pos,
                          const Eigen::Array3d &sz,
                          const Eigen::Array3d &sp) const override;
+    virtual Form   form() const override { return Form::Radial; }
+    virtual double radial(const double r) const override;
 };
 
 class HammingKernel : public FilterKernel {
@@ -54,6 +71,8 @@ class HammingKernel : public FilterKernel {
     virtual double value(const Eigen::Array3d &pos,
                          const Eigen::Array3d &sz,
                          const Eigen::Array3d &sp) const override;
+    virtual Form   form() const override { return Form::Radial; }
+    virtual double radial(const double r) const override;
 };
 
 class GaussKernel : public FilterKernel {
@@ -67,6 +86,9 @@ class GaussKernel : public FilterKernel {
     virtual double value(const Eigen::Array3d &pos,
                          const Eigen::Array3d &sz,
                          const Eigen::Array3d &sp) const override;
+    virtual Form   form() const override { return Form::Separable; }
+    virtual double
+    profile(const int dim, const double pos, const double sz, const double sp) const override;
 };
 
 class BlackmanKernel : public FilterKernel {
@@ -81,6 +103,8 @@ class BlackmanKernel : public FilterKernel {
     virtual double value(const Eigen::Array3d &pos,
                          const Eigen::Array3d &sz,
                          const Eigen::Array3d &sp) const override;
+    virtual Form   form() const override { return Form::Radial; }
+    virtual double radial(const double r) const override;
 };
 
 class RectKernel : public FilterKernel {
@@ -95,6 +119,9 @@ class RectKernel : public FilterKernel {
     virtual double value(const Eigen::Array3d &pos,
                          const Eigen::Array3d &sz,
                          const Eigen::Array3d &sp) const override;
+    virtual Form   form() const override { return Form::Separable; }
+    virtual double
+    profile(const int dim, const double pos, const double sz, const double sp) const override;
 };
 
 class FixFSEKernel : public FilterKernel {
@@ -109,11 +136,26 @@ class FixFSEKernel : public FilterKernel {
     virtual double value(const Eigen::Array3d &pos,
                          const Eigen::Array3d &sz,
                          const Eigen::Array3d &sp) const override;
+    virtual Form   form() const override { return Form::Separable; }
+    virtual double
+    profile(const int dim, const double pos, const double sz, const double sp) const override;
 };
 
 std::shared_ptr<FilterKernel> ReadKernel(const std::string &str);
 std::ostream &                operator<<(std::ostream &ostr, const FilterKernel &k);
 
+typedef std::vector<std::shared_ptr<FilterKernel>> KernelList;
+
+/*
+ *  The product of the kernels over a k-space volume, x fastest with the centre of k-space at the
+ *  first voxel as an FFT produces it. Weights are shared by size, spacing and kernel parameters
+ *  for as long as any caller holds them, so repeated kernels are only built once.
+ */
+std::shared_ptr<std::vector<double> const> KernelWeights(const KernelList &           kernels,
+                                                         const std::array<int64_t, 3> &size,
+                                                         const std::array<double, 3> & spacing,
+                                                         const bool                   highpass);
+
 } // End namespace QI
 
 #endif // QI_KERNELS_H
\ No newline at end of file
@@ -0,0 +1,208 @@
+/*
+ *  LevenbergMarquardt.h - Part of QUantitative Imaging Tools
+ *
+ *  Copyright (c) 2026 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include "Log.h"
+#include "ceres/ceres.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+namespace QI {
+
+/*
+ *  Choice of non-linear least-squares engine for fits that support both
+ */
+enum class NLLSSolver { Ceres, LM };
+
+inline NLLSSolver ParseNLLSSolver(std::string const &name) {
+    if (name == "ceres") {
+        return NLLSSolver::Ceres;
+    } else if (name == "lm") {
+        return NLLSSolver::LM;
+    }
+    QI::Fail("Unknown solver {}, valid options are ceres or lm", name);
+}
+
+/*
+ *  Add one residual block to the normal equations. The residuals are Jets, i.e. each carries its
+ *  row of the Jacobian. The loss function is applied by re-weighting each residual with rho'.
+ */
+template <int NV>
+void AccumulateNormalEquations(ceres::Jet<double, NV> const *  r,
+                               int const                       n,
+                               ceres::LossFunction const *     loss,
+                               Eigen::Matrix<double, NV, NV> & JtJ,
+                               Eigen::Matrix<double, NV, 1> &  Jtr,
+                               double &                        cost) {
+    for (int i = 0; i < n; i++) {
+        double const s = r[i].a * r[i].a;
+        double       w = 1.0;
+        if (loss) {
+            double rho[3];
+            loss->Evaluate(s, rho);
+            cost += 0.5 * rho[0];
+            w = rho[1];
+        } else {
+            cost += 0.5 * s;
+        }
+        JtJ.template selfadjointView<Eigen::Lower>().rankUpdate(r[i].v, w);
+        Jtr += w * r[i].a * r[i].v;
+    }
+}
+
+/*
+ *  As above, for a residual block that supplies its own Jacobian, stored row-major with one row of
+ *  NV derivatives per residual
+ */
+template <int NV>
+void AccumulateNormalEquations(double const *                  r,
+                               double const *                  J,
+                               int const                       n,
+                               ceres::LossFunction const *     loss,
+                               Eigen::Matrix<double, NV, NV> & JtJ,
+                               Eigen::Matrix<double, NV, 1> &  Jtr,
+                               double &                        cost) {
+    for (int i = 0; i < n; i++) {
+        Eigen::Map<Eigen::Matrix<double, NV, 1> const> const Ji(J + i * NV);
+        double const                                         s = r[i] * r[i];
+        double                                               w = 1.0;
+        if (loss) {
+            double rho[3];
+            loss->Evaluate(s, rho);
+            cost += 0.5 * rho[0];
+            w = rho[1];
+        } else {
+            cost += 0.5 * s;
+        }
+        JtJ.template selfadjointView<Eigen::Lower>().rankUpdate(Ji, w);
+        Jtr += w * r[i] * Ji;
+    }
+}
+
+inline double ResidualCost(double const *r, int const n, ceres::LossFunction const *loss) {
+    double cost = 0.0;
+    for (int i = 0; i < n; i++) {
+        double const s = r[i] * r[i];
+        if (loss) {
+            double rho[3];
+            loss->Evaluate(s, rho);
+            cost += 0.5 * rho[0];
+        } else {
+            cost += 0.5 * s;
+        }
+    }
+    return cost;
+}
+
+struct LMSummary {
+    bool        usable     = false;
+    int         iterations = 0;
+    double      initial_cost, final_cost;
+    std::string message;
+};
+
+/*
+ *  Levenberg-Marquardt for problems with only a handful of parameters. The normal equations are
+ *  fixed-size, so nothing is allocated and the damped system is solved with a fixed-size LDLT.
+ *  Box constraints are handled by fixing parameters that are pushed against a bound and then
+ *  projecting each step back onto the bounds. The trust-region update and the tolerances follow
+ *  Ceres so the two solvers can share the same options.
+ *
+ *  The evaluator must provide:
+ *      bool Linearize(Vector const &x, Matrix &JtJ, Vector &Jtr, double &cost)
+ *      bool Evaluate(Vector const &x, double &cost)
+ *  where JtJ only needs the lower triangle filled in.
+ */
+template <int NV, typename Evaluator, typename Lo, typename Hi>
+LMSummary LevenbergMarquardt(Evaluator &                    eval,
+                             double *                       x_ptr,
+                             Lo const &                     lo_arr,
+                             Hi const &                     hi_arr,
+                             ceres::Solver::Options const & options) {
+    using Vector = Eigen::Matrix<double, NV, 1>;
+    using Matrix = Eigen::Matrix<double, NV, NV>;
+
+    Vector const lo = lo_arr.matrix();
+    Vector const hi = hi_arr.matrix();
+    auto project    = [&](Vector const &v) -> Vector { return v.cwiseMax(lo).cwiseMin(hi); };
+
+    LMSummary summary;
+    Vector    x = project(Eigen::Map<Vector>(x_ptr));
+    Matrix    JtJ;
+    Vector    Jtr;
+    double    cost;
+    if (!eval.Linearize(x, JtJ, Jtr, cost) || !std::isfinite(cost)) {
+        summary.message = "Residual evaluation failed at the starting point";
+        return summary;
+    }
+    summary.initial_cost = cost;
+
+    double radius = 1e4; // Initial trust region radius, as Ceres
+    double nu     = 2.0;
+    while (summary.iterations < options.max_num_iterations) {
+        summary.iterations++;
+        // Projected gradient, zero at a constrained minimum
+        if ((x - project(x - Jtr)).template lpNorm<Eigen::Infinity>() <=
+            options.gradient_tolerance) {
+            break;
+        }
+        Matrix A = JtJ.template selfadjointView<Eigen::Lower>();
+        A.diagonal() += (JtJ.diagonal().cwiseMax(1e-6).cwiseMin(1e32)) / radius;
+        // Parameters held at a bound by the gradient are removed from the step, otherwise the
+        // projection throws away most of the progress in the free parameters
+        Vector b = Jtr;
+        for (int i = 0; i < NV; i++) {
+            if ((x[i] <= lo[i] && Jtr[i] > 0.) || (x[i] >= hi[i] && Jtr[i] < 0.)) {
+                A.row(i).setZero();
+                A.col(i).setZero();
+                A(i, i) = 1.;
+                b[i]    = 0.;
+            }
+        }
+        Vector const x_new = project(x - A.ldlt().solve(b));
+        Vector const h     = x_new - x;
+        if (h.norm() <= options.parameter_tolerance * (x.norm() + options.parameter_tolerance)) {
+            break;
+        }
+        double const predicted =
+            -(Jtr.dot(h) + 0.5 * h.dot(JtJ.template selfadjointView<Eigen::Lower>() * h));
+        double new_cost;
+        if (eval.Evaluate(x_new, new_cost) && std::isfinite(new_cost) && predicted > 0 &&
+            (cost - new_cost) > 1e-3 * predicted) {
+            double const rho       = (cost - new_cost) / predicted;
+            bool const   converged = (cost - new_cost) <= options.function_tolerance * cost;
+            x                      = x_new;
+            if (!eval.Linearize(x, JtJ, Jtr, cost)) {
+                summary.message = "Residual evaluation failed";
+                return summary;
+            }
+            radius = std::min(radius / std::max(1.0 / 3.0, 1.0 - std::pow(2.0 * rho - 1.0, 3)),
+                              1e16);
+            nu = 2.0;
+            if (converged) {
+                break;
+            }
+        } else {
+            radius /= nu;
+            nu *= 2.0;
+        }
+    }
+    Eigen::Map<Vector> result(x_ptr);
+    result             = x;
+    summary.final_cost = cost;
+    summary.usable     = true;
+    return summary;
+}
+
+} // namespace QI
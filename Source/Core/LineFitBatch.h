@@ -0,0 +1,68 @@
+/*
+ *  LineFitBatch.h - Part of QUantitative Imaging Tools
+ *
+ *  Copyright (c) 2026 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <Eigen/Core>
+#include <cmath>
+
+namespace QI {
+
+/*
+ *  Least-squares straight line y = slope * x + intercept for every voxel in a batch. The data is
+ *  added one point at a time as a column across the voxels, so the sums for the 2x2 normal
+ *  equations are updated for a whole packet of voxels per instruction. Each argument to add() can
+ *  be an expression, which Eigen fuses into a single vectorized loop without temporaries.
+ */
+struct LineFitBatch {
+    Eigen::ArrayXd sw, sx, sy, sxx, sxy;
+
+    explicit LineFitBatch(Eigen::Index const n) :
+        sw{Eigen::ArrayXd::Zero(n)}, sx{Eigen::ArrayXd::Zero(n)}, sy{Eigen::ArrayXd::Zero(n)},
+        sxx{Eigen::ArrayXd::Zero(n)}, sxy{Eigen::ArrayXd::Zero(n)} {}
+
+    void reset() {
+        sw.setZero();
+        sx.setZero();
+        sy.setZero();
+        sxx.setZero();
+        sxy.setZero();
+    }
+
+    template <typename X, typename Y>
+    void add(Eigen::ArrayBase<X> const &x, Eigen::ArrayBase<Y> const &y) {
+        sw += 1.;
+        sx += x;
+        sy += y;
+        sxx += x.square();
+        sxy += x * y;
+    }
+
+    template <typename X, typename Y, typename W>
+    void add(Eigen::ArrayBase<X> const &x,
+             Eigen::ArrayBase<Y> const &y,
+             Eigen::ArrayBase<W> const &w) {
+        sw += w;
+        sx += w * x;
+        sy += w * y;
+        sxx += w * x.square();
+        sxy += w * x * y;
+    }
+
+    // Cramer's rule, the system is too small for a factorization to be worth it
+    template <typename S, typename I>
+    void solve(Eigen::ArrayBase<S> &slope, Eigen::ArrayBase<I> &intercept) const {
+        slope     = (sw * sxy - sx * sy) / (sw * sxx - sx.square());
+        intercept = (sxx * sy - sx * sxy) / (sw * sxx - sx.square());
+    }
+};
+
+} // End namespace QI
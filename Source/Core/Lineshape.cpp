@@ -12,10 +12,54 @@
 #include "Lineshape.h"
 #include "Macro.h"
 
+#include <algorithm>
+
 using namespace std::string_literals;
 
 namespace QI {
 
+SuperLorentzianTable const &SuperLorentzianTable::Get() {
+    static SuperLorentzianTable const table;
+    return table;
+}
+
+SuperLorentzianTable::SuperLorentzianTable() : n{1024}, x_lo{1e-3}, y(1024), d(1024) {
+    const double x_hi = 8.0;
+    s0                = std::log(x_lo);
+    h  = (std::log(x_hi) - s0) / (n - 1);
+
+    // The integrand peaks sharply at the magic angle, so integrate either side of it
+    Eigen::Integrator<double> integrator(200);
+    const double              u_magic = 1.0 / std::sqrt(3.0);
+    const double              T2b     = 1.0;
+    for (int i = 0; i < n; i++) {
+        const double           f0 = std::exp(s0 + i * h) / (2.0 * M_PI);
+        SLFunctor<double> const sl{T2b, f0};
+        double                 G = 0.;
+        for (auto const &[a, b] : {std::make_pair(0.0, u_magic), std::make_pair(u_magic, 1.0)}) {
+            G += integrator.quadratureAdaptive(sl,
+                                               a,
+                                               b,
+                                               0.0,
+                                               Eigen::NumTraits<double>::epsilon() * 50.0,
+                                               Eigen::Integrator<double>::GaussKronrod61);
+        }
+        y[i] = std::log(G);
+    }
+
+    // Harmonic mean slopes (Fritsch-Butland), so the interpolant does not overshoot between nodes
+    Eigen::ArrayXd const delta = (y.tail(n - 1) - y.head(n - 1)) / h;
+    d[0]                       = delta[0];
+    d[n - 1]                   = delta[n - 2];
+    for (int i = 1; i < n - 1; i++) {
+        if (delta[i - 1] * delta[i] <= 0.) {
+            d[i] = 0.;
+        } else {
+            d[i] = 2.0 / (1.0 / delta[i - 1] + 1.0 / delta[i]);
+        }
+    }
+}
+
 InterpLineshape::InterpLineshape(const double          fmin,
                                  const double          fstep,
                                  const int             fcount,
@@ -28,6 +72,24 @@ InterpLineshape::InterpLineshape(const double          fmin,
     interpolator = std::make_shared<ceres::CubicInterpolator<ceres::Grid1D<double>>>(*grid);
 }
 
+Lineshape ReadLineshape(std::string const &name, bool const verbose) {
+    if (name == "Gaussian") {
+        QI::Log(verbose, "Using a Gaussian lineshape");
+        return {Lineshapes::Gaussian};
+    } else if (name == "Lorentzian") {
+        QI::Log(verbose, "Using a Lorentzian lineshape");
+        return {Lineshapes::Lorentzian};
+    } else if (name == "SuperLorentzian" || name == "Superlorentzian") {
+        QI::Log(verbose, "Using a Super-Lorentzian lineshape");
+        return {Lineshapes::SuperLorentzian};
+    } else {
+        QI::Log(verbose, "Reading lineshape file: {}", name);
+        json ls_file = QI::ReadJSON(name);
+        return {Lineshapes::Interpolated,
+                std::make_shared<InterpLineshape>(ls_file.at("lineshape").get<InterpLineshape>())};
+    }
+}
+
 } // End namespace QI
 
 namespace nlohmann {
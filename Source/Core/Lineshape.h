@@ -13,6 +13,7 @@
 #define LINESHAPE_H
 
 #include "JSON.h"
+#include "Log.h"
 #include "Macro.h"
 #include "NumericalIntegration.h"
 #include "ceres/cubic_interpolation.h"
@@ -42,16 +43,55 @@ template <typename T> struct SLFunctor {
     }
 };
 
+/*
+ *  The super-Lorentzian scales with T2b, SL(f) = T2b * G(x) where x = 2*pi*f*T2b, so one table of
+ *  ln G on a uniform grid of ln x covers every T2b. It is integrated once, the first time it is
+ *  needed, and evaluated with a monotone cubic so that fits with Jets have smooth derivatives.
+ *  Below the table G diverges as -ln x, and is infinite at x = 0, so it is held at the value at the
+ *  start of the table as InterpLineshape does. Above it the widest component (u = 1) dominates and
+ *  G ~ exp(-x^2 / 2) / x^2.
+ */
+class SuperLorentzianTable {
+  public:
+    static SuperLorentzianTable const &Get();
+
+    template <typename T> T operator()(const T &x) const {
+        using std::exp;
+        using std::log;
+        if (Value(x) <= x_lo) {
+            return T(exp(y[0]));
+        }
+        const T      s  = log(x);
+        const double sv = (Value(s) - s0) / h;
+        if (sv >= n - 1.) {
+            const double x1 = exp(s0 + (n - 1.) * h);
+            return exp(y[n - 1]) * (x1 * x1) / (x * x) * exp(-(x * x - x1 * x1) / 2.0);
+        }
+        const int    i  = static_cast<int>(sv);
+        const T      t  = (s - s0) / h - static_cast<double>(i);
+        const T      t2 = t * t;
+        const T      t3 = t2 * t;
+        const T      lg = (2.0 * t3 - 3.0 * t2 + 1.0) * y[i] + (t3 - 2.0 * t2 + t) * h * d[i] +
+                     (-2.0 * t3 + 3.0 * t2) * y[i + 1] + (t3 - t2) * h * d[i + 1];
+        return exp(lg);
+    }
+
+  private:
+    SuperLorentzianTable();
+
+    static double Value(const double v) { return v; }
+    template <typename J, int N> static double Value(const ceres::Jet<J, N> &v) { return v.a; }
+
+    int            n;
+    double         x_lo, s0, h;
+    Eigen::ArrayXd y, d; // ln G and its slope with respect to ln x at each node
+};
+
 template <typename T> QI_ARRAY(T) SuperLorentzian(const Eigen::ArrayXd &df0, const T T2b) {
-    Eigen::Integrator<T> integrator(200);
-    const auto           quad_rule = Eigen::Integrator<T>::GaussKronrod61;
-    T                    abs_error{0.0};
-    T                    rel_error{Eigen::NumTraits<double>::epsilon() * 50.0};
+    const auto &table = SuperLorentzianTable::Get();
     QI_ARRAY(T) vals(df0.rows());
     for (auto i = 0; i < df0.rows(); i++) {
-        SLFunctor<T> sl_functor{T2b, df0[i]};
-        vals[i] = integrator.quadratureAdaptive(
-            sl_functor, T{0.0}, T{1.0}, abs_error, rel_error, quad_rule);
+        vals[i] = T2b * table(2.0 * M_PI * std::abs(df0[i]) * T2b);
     }
     return vals;
 }
@@ -105,6 +145,41 @@ struct InterpLineshape {
     }
 };
 
+/*
+ *  A lineshape chosen by name, or read from a file made by qi lineshape
+ */
+struct Lineshape {
+    Lineshapes                       shape  = Lineshapes::Gaussian;
+    std::shared_ptr<InterpLineshape> interp = nullptr;
+
+    template <typename T> QI_ARRAY(T) operator()(const Eigen::ArrayXd &f, const T T2b) const {
+        switch (shape) {
+        case Lineshapes::Gaussian:
+            return Gaussian(f, T2b);
+        case Lineshapes::Lorentzian:
+            return Lorentzian(f, T2b);
+        case Lineshapes::SuperLorentzian:
+            return SuperLorentzian(f, T2b);
+        case Lineshapes::Interpolated:
+            return (*interp)(f, T2b);
+        }
+        QI::Fail("Unknown lineshape");
+    }
+
+    template <typename T> T operator()(const double f, const T T2b) const {
+        switch (shape) {
+        case Lineshapes::SuperLorentzian:
+            return T2b * SuperLorentzianTable::Get()(2.0 * M_PI * std::abs(f) * T2b);
+        case Lineshapes::Interpolated:
+            return (*interp)(f, T2b);
+        default:
+            return (*this)(Eigen::ArrayXd::Constant(1, f), T2b)[0];
+        }
+    }
+};
+
+Lineshape ReadLineshape(std::string const &name_or_path, bool const verbose);
+
 } // End namespace QI
 
 namespace nlohmann {
@@ -14,7 +14,10 @@
 #include "ImageTypes.h"
 #include "Macro.h"
 #include "ceres/ceres.h"
+#include <Eigen/Eigenvalues>
 #include <array>
+#include <concepts>
+#include <limits>
 #include <string>
 
 namespace QI {
@@ -48,23 +51,36 @@ template <typename DT_, typename PT_, int NV_, int NF_, int NI_ = 1, int ND_ = 0
 };
 
 /*
- *  Convert the Covariance Matrix from Ceres into something useful
+ *  Models can also supply the derivatives of their signal with respect to the varying parameters.
+ *  jacobian() returns the signal and fills J with one row per point and one column per parameter.
+ */
+template <typename Model>
+concept AnalyticJacobianModel = requires(Model const &                       m,
+                                         typename Model::VaryingArray const &v,
+                                         typename Model::FixedArray const &  f,
+                                         Eigen::ArrayXXd &                   J) {
+    { m.jacobian(v, f, J) } -> std::convertible_to<Eigen::ArrayXd>;
+};
+
+/*
+ *  Store the derivatives of a signal as the row-major Jacobian that Ceres wants for the residuals,
+ *  which are data - signal
+ */
+template <int NV> void ResidualJacobian(Eigen::ArrayXXd const &dS, double *J) {
+    Eigen::Map<Eigen::Matrix<double, NV, Eigen::Dynamic>>(J, NV, dS.rows()) =
+        -dS.transpose().matrix();
+}
+
+/*
+ *  Convert the Covariance Matrix into something useful
  * The diagonal elements are the estimation variance of each parameter (after division by the
  * residual). Square-root to get the standard deviation. Off-diagonal elements need to be divided by
  * the standard deviation of each variable to get the correlation.
  */
 template <typename Model>
-void GetModelCovariance(ceres::Problem &                    p,
-                        typename Model::VaryingArray const &v,
-                        double const &                      scale,
-                        typename Model::CovarArray *        ptr) {
-    ceres::Covariance::Options cov_options;
-    ceres::Covariance          cov_c(cov_options);
-    cov_c.Compute({std::make_pair(v.data(), v.data())}, &p);
-
-    Eigen::MatrixXd full(Model::NV, Model::NV);
-    cov_c.GetCovarianceBlock(v.data(), v.data(), full.data());
-    full *= scale;
+void PackCovariance(Eigen::Matrix<double, Model::NV, Model::NV> const &full,
+                    typename Model::VaryingArray const &               v,
+                    typename Model::CovarArray *                       ptr) {
     typename Model::CovarArray &cov = (*ptr);
     cov.head(Model::NV)             = full.diagonal().array().sqrt();
     int index                       = Model::NV;
@@ -78,6 +94,84 @@ void GetModelCovariance(ceres::Problem &                    p,
     QI_DBVEC(cov);
 }
 
+/*
+ *  The covariance is scale * (J^T J)^-1 with J the Jacobian at the solution. For the handful of
+ *  parameters in a voxel this is a tiny dense eigen-decomposition, which only reads the lower
+ *  triangle of J^T J. Forming J^T J squares the condition number, so if its reciprocal drops below
+ *  1e-14 this returns false and the caller should fall back to CeresCovariance().
+ */
+template <typename Model>
+bool NormalCovariance(Eigen::Matrix<double, Model::NV, Model::NV> const &JtJ,
+                      typename Model::VaryingArray const &               v,
+                      double const &                                     scale,
+                      typename Model::CovarArray *                       ptr) {
+    using Matrix = Eigen::Matrix<double, Model::NV, Model::NV>;
+    Eigen::SelfAdjointEigenSolver<Matrix> const eig(JtJ);
+    if (eig.info() != Eigen::Success) {
+        return false;
+    }
+    auto const &lambda = eig.eigenvalues(); // Ascending
+    if (!(lambda[0] > 1e-14 * lambda[Model::NV - 1])) {
+        return false;
+    }
+    Matrix const full = eig.eigenvectors() * (scale / lambda.array()).matrix().asDiagonal() *
+                        eig.eigenvectors().transpose();
+    PackCovariance<Model>(full, v, ptr);
+    return true;
+}
+
+/*
+ *  ceres::Covariance works from a QR of J itself, so it still succeeds for condition numbers up to
+ *  1e14 that NormalCovariance() rejects. If J is genuinely rank deficient the parameters are not
+ *  determined by the data, and the covariance is written as NaN.
+ */
+template <typename Model>
+void CeresCovariance(ceres::Problem &                    p,
+                     typename Model::VaryingArray const &v,
+                     double const &                      scale,
+                     typename Model::CovarArray *        ptr) {
+    ceres::Covariance::Options cov_options;
+    ceres::Covariance          cov_c(cov_options);
+    Eigen::Matrix<double, Model::NV, Model::NV> full;
+    if (!cov_c.Compute({std::make_pair(v.data(), v.data())}, &p) ||
+        !cov_c.GetCovarianceBlock(v.data(), v.data(), full.data())) {
+        ptr->setConstant(std::numeric_limits<typename Model::ParameterType>::quiet_NaN());
+        return;
+    }
+    full *= scale;
+    PackCovariance<Model>(full, v, ptr);
+}
+
+/*
+ *  Parameter covariance for a problem with the single parameter block v. The Jacobian is evaluated
+ *  once, including any loss function as ceres::Covariance does, and only badly conditioned problems
+ *  go through ceres::Covariance itself. CeresWorkspace::Covariance() avoids the evaluation too.
+ */
+template <typename Model>
+void GetModelCovariance(ceres::Problem &                    p,
+                        typename Model::VaryingArray const &v,
+                        double const &                      scale,
+                        typename Model::CovarArray *        ptr) {
+    ceres::CRSMatrix J;
+    if (p.Evaluate(ceres::Problem::EvaluateOptions(), nullptr, nullptr, nullptr, &J) &&
+        J.num_cols == Model::NV) {
+        Eigen::Matrix<double, Model::NV, Model::NV> JtJ =
+            Eigen::Matrix<double, Model::NV, Model::NV>::Zero();
+        Eigen::Matrix<double, Model::NV, 1> row;
+        for (int r = 0; r < J.num_rows; r++) {
+            row.setZero();
+            for (int k = J.rows[r]; k < J.rows[r + 1]; k++) {
+                row[J.cols[k]] = J.values[k];
+            }
+            JtJ.template selfadjointView<Eigen::Lower>().rankUpdate(row);
+        }
+        if (NormalCovariance<Model>(JtJ, v, scale, ptr)) {
+            return;
+        }
+    }
+    CeresCovariance<Model>(p, v, scale, ptr);
+}
+
 /*
  *  A generic Ceres Cost Function compatible with auto-differentation
  */
@@ -85,9 +179,9 @@ template <typename Model> struct ModelCost {
     using VaryingArray = typename Model::VaryingArray;
     using FixedArray   = typename Model::FixedArray;
     using DataArray    = QI_ARRAY(typename Model::DataType);
-    const Model &    model;
-    const FixedArray fixed;
-    const DataArray  data;
+    const Model &model;
+    FixedArray   fixed; // Not const so that CeresWorkspace can swap in the next voxel
+    DataArray    data;
 
     template <typename T> bool operator()(const T *const vin, T *rin) const {
         Eigen::Map<QI_ARRAYN(T, Model::NV) const> const v(vin);
@@ -102,6 +196,24 @@ template <typename Model> struct ModelCost {
 
         return true;
     }
+
+    /*
+     *  Residuals and, if J is not null, their Jacobian from the model's own derivatives. See
+     *  MakeCostFunction() in FitFunction.h.
+     */
+    bool jacobian(double const *vin, double *rin, double *J) const
+        requires AnalyticJacobianModel<Model> {
+        Eigen::Map<VaryingArray const> const v(vin);
+        Eigen::Map<Eigen::ArrayXd>           residual(rin, data.rows());
+        if (J) {
+            Eigen::ArrayXXd dS(data.rows(), Model::NV);
+            residual = data - model.jacobian(v, fixed, dS);
+            ResidualJacobian<Model::NV>(dS, J);
+        } else {
+            residual = data - model.signal(v, fixed);
+        }
+        return true;
+    }
 };
 
 /*
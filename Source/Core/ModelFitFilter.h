@@ -12,24 +12,34 @@
  */
 
 #include <Eigen/Core>
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <functional>
+#include <memory>
+#include <string>
 #include <tuple>
+#include <type_traits>
 #include <vector>
 
 #include "itkCommand.h"
 #include "itkImageRegionConstIterator.h"
 #include "itkImageRegionIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkImageToImageFilter.h"
 #include "itkTimeProbe.h"
+#include "itkTotalProgressReporter.h"
 #include "itkVariableLengthVector.h"
 #include "itkVectorImage.h"
 
+#include "Checkpoint.h"
 #include "FitFunction.h"
+#include "ImageIO.h"
 #include "Log.h"
 #include "Model.h"
 #include "Monitor.h"
+#include "NiftiWriter.h"
 #include "Util.h"
 
 namespace QI {
@@ -74,6 +84,7 @@ class ModelFitFilter
 
     using TRegion = typename TInputImage::RegionType;
     using TIndex  = typename TRegion::IndexType;
+    using Batch   = FitBatch<ModelType, typename FitType::FlagType>;
 
     using Self       = ModelFitFilter;
     using Superclass = itk::ImageToImageFilter<TInputImage, TOutputImage>;
@@ -180,6 +191,57 @@ class ModelFitFilter
         m_hasSubregion = true;
     }
 
+    /*
+     * Number of voxels gathered into each call of the fit function. Closed-form fits can then work
+     * across voxels, and everything else avoids allocating buffers for each voxel.
+     */
+    void SetBatchSize(const int n) {
+        if (n < 1) {
+            QI::Fail("Batch size must be at least 1, was {}", n);
+        }
+        m_batchSize = n;
+    }
+
+    /*
+     * Share out a compacted list of masked voxels dynamically, instead of fixed slabs
+     */
+    void SetDynamicSchedule(const bool d) { m_dynamic = d; }
+
+    /*
+     * Process the image in N slabs of whole slices, so memory is bounded by the slab size and not
+     * the image size. ReadInputs() then only opens the inputs, Update() does nothing, and
+     * WriteOutputs() reads, fits and writes each slab in turn. The outputs are always written as
+     * uncompressed NIfTI. 0 (the default) processes the whole image at once.
+     */
+    void SetStreamSlabs(const int n) {
+        if (n < 0) {
+            QI::Fail("Number of slabs cannot be negative, was {}", n);
+        }
+        m_slabs = n;
+    }
+
+    /*
+     * Save the outputs and a record of the finished slabs to dir after every slab. If dir already
+     * has a record for the same fit those slabs are skipped, so a job that was stopped can carry
+     * on. This implies streaming, with 20 slabs unless SetStreamSlabs() was called first. The
+     * outputs are moved out of dir once every slab is done. config should describe whatever else
+     * changes the fit - the JSON sequence, algorithm and options - so that a record left by a
+     * differently configured run is refused instead of resumed.
+     */
+    void SetCheckpoint(std::string const &dir, std::string const &config = "") {
+        m_checkpoint = dir;
+        m_config     = config;
+        if (!m_checkpoint.empty() && m_slabs == 0) {
+            m_slabs = 20;
+        }
+    }
+
+    void Update() override {
+        if (m_slabs == 0) {
+            Superclass::Update();
+        }
+    }
+
     void SetBlocks(const int &nb) {
         if constexpr (Blocked) {
             m_blocks = nb;
@@ -250,9 +312,18 @@ class ModelFitFilter
         if (static_cast<size_t>(ModelType::NI) != inputs.size()) {
             QI::Fail("Number of input file paths did not match number of inputs for model");
         }
+        m_paths.clear();
+        m_paths.insert(m_paths.end(), inputs.begin(), inputs.end());
+        m_paths.insert(m_paths.end(), fixed.begin(), fixed.end());
+        m_paths.push_back(mask);
 
         for (int i = 0; i < ModelType::NI; i++) {
-            SetInput(i, QI::ReadImage<TInputImage>(inputs[i], m_verbose));
+            if (m_slabs > 0) {
+                m_readers[i] = std::make_unique<SlabReader<TInputImage>>(inputs[i], m_verbose);
+                SetInput(i, m_readers[i]->image());
+            } else {
+                SetInput(i, QI::ReadImage<TInputImage>(inputs[i], m_verbose));
+            }
         }
         for (int f = 0; f < ModelType::NF; f++) {
             if (fixed[f] != "")
@@ -263,42 +334,12 @@ class ModelFitFilter
     }
 
     void WriteOutputs(std::string const &prefix) {
-        for (int i = 0; i < ModelType::NV; i++) {
-            QI::WriteImage(
-                GetOutput(i), prefix + m_fit->model.varying_names.at(i) + QI::OutExt(), m_verbose);
-        }
-        if constexpr (ModelType::ND > 0) {
-            for (int i = 0; i < ModelType::ND; i++) {
-                QI::WriteImage(GetDerivedOutput(i),
-                               prefix + m_fit->model.derived_names.at(i) + QI::OutExt(),
-                               m_verbose);
-            }
-        }
-        QI::WriteImage(GetRMSErrorOutput(), prefix + "rmse" + QI::OutExt(), m_verbose);
-        QI::WriteImage(GetFlagOutput(), prefix + "iterations" + QI::OutExt(), m_verbose);
-        if (m_covar) {
-            for (int ii = 0; ii < ModelType::NV; ii++) {
-                auto const &name = m_fit->model.varying_names.at(ii);
-                QI::WriteImage(
-                    GetCovarOutput(ii), prefix + "CoV_" + name + QI::OutExt(), m_verbose);
-            }
-            int index = ModelType::NV;
-            for (int ii = 0; ii < ModelType::NV; ii++) {
-                auto const &name1 = m_fit->model.varying_names.at(ii);
-                for (int jj = ii + 1; jj < ModelType::NV; jj++) {
-                    auto const &name2 = m_fit->model.varying_names.at(jj);
-                    QI::WriteImage(GetCovarOutput(index++),
-                                   prefix + "Corr_" + name1 + "_" + name2 + QI::OutExt(),
-                                   m_verbose);
-                }
-            }
-        }
-        if (m_allResiduals) {
-            for (int i = 0; i < ModelType::NI; i++) {
-                QI::WriteImage(GetResidualsOutput(i),
-                               prefix + "residuals_" + std::to_string(i) + QI::OutExt(),
-                               m_verbose);
-            }
+        if (m_slabs > 0) {
+            StreamSlabs(prefix);
+        } else {
+            ForEachOutput(prefix, QI::OutExt(), [&](auto const *img, std::string const &path) {
+                QI::WriteImage(img, path, m_verbose);
+            });
         }
     }
 
@@ -335,7 +376,72 @@ class ModelFitFilter
     const bool     m_verbose, m_allResiduals, m_covar;
     bool           m_hasSubregion = false;
     TRegion        m_subregion;
-    int            m_blocks = 1;
+    int            m_blocks    = 1;
+    int            m_batchSize = 64;
+    bool           m_dynamic   = false;
+    int            m_slabs     = 0;
+    std::string    m_checkpoint;
+    std::string    m_config;
+
+    std::vector<std::string> m_paths; // To check a checkpoint is for the same fit
+
+    std::array<std::unique_ptr<SlabReader<TInputImage>>, ModelType::NI> m_readers;
+
+    /*
+     * Call f(image, path) for every output that will be written
+     */
+    template <typename F>
+    void ForEachOutput(std::string const &prefix, std::string const &ext, F &&f) {
+        for (int i = 0; i < ModelType::NV; i++) {
+            f(GetOutput(i), prefix + m_fit->model.varying_names.at(i) + ext);
+        }
+        if constexpr (ModelType::ND > 0) {
+            for (int i = 0; i < ModelType::ND; i++) {
+                f(GetDerivedOutput(i), prefix + m_fit->model.derived_names.at(i) + ext);
+            }
+        }
+        f(GetRMSErrorOutput(), prefix + "rmse" + ext);
+        f(GetFlagOutput(), prefix + "iterations" + ext);
+        if (m_covar) {
+            for (int ii = 0; ii < ModelType::NV; ii++) {
+                auto const &name = m_fit->model.varying_names.at(ii);
+                f(GetCovarOutput(ii), prefix + "CoV_" + name + ext);
+            }
+            int index = ModelType::NV;
+            for (int ii = 0; ii < ModelType::NV; ii++) {
+                auto const &name1 = m_fit->model.varying_names.at(ii);
+                for (int jj = ii + 1; jj < ModelType::NV; jj++) {
+                    auto const &name2 = m_fit->model.varying_names.at(jj);
+                    f(GetCovarOutput(index++), prefix + "Corr_" + name1 + "_" + name2 + ext);
+                }
+            }
+        }
+        if (m_allResiduals) {
+            for (int i = 0; i < ModelType::NI; i++) {
+                f(GetResidualsOutput(i), prefix + "residuals_" + std::to_string(i) + ext);
+            }
+        }
+    }
+
+    /*
+     * Outputs cover the whole image, but are only buffered for the same region as the inputs,
+     * which is a single slab when streaming
+     */
+    template <typename TImage> void AllocateOutput(TImage *op, const int components) {
+        auto const input = this->GetInput(0);
+        op->SetLargestPossibleRegion(input->GetLargestPossibleRegion());
+        op->SetBufferedRegion(input->GetBufferedRegion());
+        op->SetRequestedRegion(input->GetBufferedRegion());
+        op->SetSpacing(input->GetSpacing());
+        op->SetOrigin(input->GetOrigin());
+        op->SetDirection(input->GetDirection());
+        if constexpr (std::is_same_v<TImage,
+                                     itk::VectorImage<typename TImage::InternalPixelType,
+                                                      ImageDim>>) {
+            op->SetNumberOfComponentsPerPixel(components);
+        }
+        op->Allocate(true);
+    }
 
     virtual void GenerateOutputInformation() override {
         Superclass::GenerateOutputInformation();
@@ -360,81 +466,24 @@ class ModelFitFilter
         }
 
         Log(m_verbose, "Allocating output image memory");
-        auto input     = this->GetInput(0);
-        auto region    = input->GetLargestPossibleRegion();
-        auto spacing   = input->GetSpacing();
-        auto origin    = input->GetOrigin();
-        auto direction = input->GetDirection();
-
         for (int i = 0; i < ModelType::NV; i++) {
-            auto op = this->GetOutput(i);
-            op->SetRegions(region);
-            op->SetSpacing(spacing);
-            op->SetOrigin(origin);
-            op->SetDirection(direction);
-            if constexpr (Blocked) {
-                op->SetNumberOfComponentsPerPixel(m_blocks);
-            }
-            op->Allocate(true);
+            AllocateOutput(this->GetOutput(i), m_blocks);
         }
-
         if constexpr (HasDerived) {
             for (int i = 0; i < ModelType::ND; i++) {
-                auto op = this->GetDerivedOutput(i);
-                op->SetRegions(region);
-                op->SetSpacing(spacing);
-                op->SetOrigin(origin);
-                op->SetDirection(direction);
-                if constexpr (Blocked) {
-                    op->SetNumberOfComponentsPerPixel(m_blocks);
-                }
-                op->Allocate(true);
+                AllocateOutput(this->GetDerivedOutput(i), m_blocks);
             }
         }
-
-        auto f = this->GetFlagOutput();
-        f->SetRegions(region);
-        f->SetSpacing(spacing);
-        f->SetOrigin(origin);
-        f->SetDirection(direction);
-        if constexpr (Blocked) {
-            f->SetNumberOfComponentsPerPixel(m_blocks);
-        }
-        f->Allocate(true);
-
-        auto rms = this->GetRMSErrorOutput();
-        rms->SetRegions(region);
-        rms->SetSpacing(spacing);
-        rms->SetOrigin(origin);
-        rms->SetDirection(direction);
-        if constexpr (Blocked) {
-            rms->SetNumberOfComponentsPerPixel(m_blocks);
-        }
-        rms->Allocate(true);
-
+        AllocateOutput(this->GetFlagOutput(), m_blocks);
+        AllocateOutput(this->GetRMSErrorOutput(), m_blocks);
         if (m_covar) {
             for (int ii = 0; ii < ModelType::NCov; ii++) {
-                auto op = this->GetCovarOutput(ii);
-                op->SetRegions(region);
-                op->SetSpacing(spacing);
-                op->SetOrigin(origin);
-                op->SetDirection(direction);
-                if constexpr (Blocked) {
-                    op->SetNumberOfComponentsPerPixel(m_blocks);
-                }
-                op->Allocate(true);
+                AllocateOutput(this->GetCovarOutput(ii), m_blocks);
             }
         }
-
         if (m_allResiduals) {
             for (int i = 0; i < ModelType::NI; i++) {
-                auto res = this->GetResidualsOutput(i);
-                res->SetRegions(region);
-                res->SetSpacing(spacing);
-                res->SetOrigin(origin);
-                res->SetDirection(direction);
-                res->SetNumberOfComponentsPerPixel(m_fit->input_size(i) * m_blocks);
-                res->Allocate(true);
+                AllocateOutput(this->GetResidualsOutput(i), m_fit->input_size(i) * m_blocks);
             }
         }
     }
@@ -448,217 +497,326 @@ class ModelFitFilter
                 itkExceptionMacro("Specified subregion is not entirely inside image.");
             }
         }
+        FitRegion(region);
+    }
 
+    void FitRegion(const TRegion &region) {
         Info(m_verbose, "Processing...");
         this->GetMultiThreader()->SetNumberOfWorkUnits(this->GetNumberOfWorkUnits());
-        this->GetMultiThreader()->template ParallelizeImageRegion<ImageDim>(
-            region,
-            [this](const typename TOutputImage::RegionType &outputRegion) {
-                this->DynamicThreadedGenerateData(outputRegion);
-            },
-            this);
+        if (m_dynamic) {
+            DynamicScheduleGenerateData(region);
+        } else {
+            this->GetMultiThreader()->template ParallelizeImageRegion<ImageDim>(
+                region,
+                [this](const typename TOutputImage::RegionType &outputRegion) {
+                    this->DynamicThreadedGenerateData(outputRegion);
+                },
+                this);
+        }
         Info(m_verbose, "Finished processing.");
     }
 
-    virtual void DynamicThreadedGenerateData(const TRegion &region) override {
-        itk::ImageRegionConstIterator<TMaskImage> mask_iter;
-        const auto                                mask = this->GetMask();
-        if (mask) {
-            mask_iter = itk::ImageRegionConstIterator<TMaskImage>(mask, region);
+    /*
+     * Read, fit and write one slab at a time. The fixed images and mask are single volumes, so
+     * they are read whole. Output files are created zero-filled, so slabs outside the subregion
+     * are skipped entirely.
+     */
+    void StreamSlabs(std::string const &prefix) {
+        auto const whole      = this->GetInput(0)->GetLargestPossibleRegion();
+        auto       fit_region = whole;
+        if (m_hasSubregion) {
+            if (whole.IsInside(m_subregion)) {
+                fit_region = m_subregion;
+            } else {
+                QI::Fail("Specified subregion is not entirely inside image");
+            }
+        }
+        if (QI::OutExt() != ".nii") {
+            QI::Warn("Streamed outputs are written as uncompressed .nii");
         }
 
-        std::vector<itk::ImageRegionConstIterator<TInputImage>> input_iters(ModelType::NI);
-        std::vector<itk::ImageRegionIterator<TResidualsImage>>  residuals_iters(ModelType::NI);
-        for (int i = 0; i < ModelType::NI; i++) {
-            input_iters[i] = itk::ImageRegionConstIterator<TInputImage>(this->GetInput(i), region);
-            if (m_allResiduals) {
-                residuals_iters[i] =
-                    itk::ImageRegionIterator<TResidualsImage>(this->GetResidualsOutput(i), region);
+        itk::SizeValueType const n_slices = whole.GetSize()[2];
+        itk::SizeValueType const per_slab = (n_slices + m_slabs - 1) / m_slabs;
+        int const                n_slabs  = (n_slices + per_slab - 1) / per_slab;
+
+        std::unique_ptr<Checkpoint> checkpoint;
+        if (!m_checkpoint.empty()) {
+            checkpoint = std::make_unique<Checkpoint>(
+                m_checkpoint, CheckpointKey(prefix, n_slabs, fit_region), n_slabs);
+            if (checkpoint->resuming()) {
+                Info(m_verbose, "Resuming from checkpoint in {}", m_checkpoint);
             }
         }
-        std::array<itk::ImageRegionConstIterator<TFixedImage>, ModelType::NF> fixed_iters;
-        for (int i = 0; i < ModelType::NF; i++) {
-            typename TFixedImage::ConstPointer c = this->GetFixed(i);
-            if (c) {
-                fixed_iters[i] = itk::ImageRegionConstIterator<TFixedImage>(c, region);
+        auto const write_path = [&](std::string const &path) {
+            return checkpoint ? checkpoint->path(path) : path;
+        };
+
+        std::vector<std::unique_ptr<NiftiWriter>> writers;
+        for (int s = 0; s < n_slabs; s++) {
+            TRegion slab = whole;
+            slab.GetModifiableIndex()[2] += s * per_slab;
+            slab.GetModifiableSize()[2] = std::min(per_slab, n_slices - s * per_slab);
+
+            TRegion slab_fit = fit_region;
+            if (!slab_fit.Crop(slab) || (checkpoint && checkpoint->done(s))) {
+                continue;
+            }
+            Info(m_verbose, "Slab {} of {}", s + 1, n_slabs);
+            for (int i = 0; i < ModelType::NI; i++) {
+                SetInput(i, m_readers[i]->read(slab));
+            }
+            this->GenerateOutputInformation();
+            if (writers.empty()) {
+                bool const keep = checkpoint && checkpoint->resuming();
+                ForEachOutput(prefix, ".nii", [&](auto const *img, std::string const &path) {
+                    Log(m_verbose, "Streaming to {}", write_path(path));
+                    writers.push_back(NiftiWriter::Create(write_path(path), img, keep));
+                });
+            }
+            // The pipeline only resets progress once per Update(), so each slab counts from zero
+            this->ResetProgress();
+            FitRegion(slab_fit);
+            size_t w = 0;
+            ForEachOutput(prefix, ".nii", [&](auto const *img, std::string const &) {
+                writers[w++]->write(img);
+            });
+            if (checkpoint) {
+                for (auto &writer : writers) {
+                    writer->sync();
+                }
+                checkpoint->finished(s);
             }
         }
+        if (checkpoint) {
+            std::vector<std::string> outputs;
+            ForEachOutput(prefix, ".nii", [&](auto const *, std::string const &path) {
+                outputs.push_back(path);
+            });
+            checkpoint->complete(outputs);
+        }
+    }
+
+    std::string
+    CheckpointKey(std::string const &prefix, int const n_slabs, TRegion const &region) const {
+        std::string key =
+            fmt::format("prefix: {}\nslabs: {}\nblocks: {}\n", prefix, n_slabs, m_blocks);
+        for (auto const &path : m_paths) {
+            key += fmt::format("input: {}\n", path);
+        }
+        key += fmt::format("region: {} {} {} {} {} {}\n",
+                           region.GetIndex()[0],
+                           region.GetIndex()[1],
+                           region.GetIndex()[2],
+                           region.GetSize()[0],
+                           region.GetSize()[1],
+                           region.GetSize()[2]);
+        key += fmt::format("covar: {}\nresiduals: {}\n", m_covar, m_allResiduals);
+        key += fmt::format("config: {}\n", m_config);
+        return key;
+    }
 
-        std::array<itk::ImageRegionIterator<TOutputImage>, ModelType::NV> output_iters;
+    /*
+     * Raw buffer pointers for every input and output. The inputs have all been checked to share the
+     * same region, so a single offset addresses the same voxel in all of them.
+     */
+    struct Buffers {
+        std::array<InputPixelType const *, ModelType::NI> inputs;
+        std::array<int, ModelType::NI>                    input_stride;
+        std::array<FixedPixelType const *, ModelType::NF> fixed;
+        typename TMaskImage::PixelType const *            mask;
+        std::array<OutputPixelType *, ModelType::NV>      varying;
+        std::array<OutputPixelType *, ModelType::ND>      derived;
+        std::array<OutputPixelType *, ModelType::NCov>    covar;
+        std::array<InputPixelType *, ModelType::NI>       residuals;
+        typename FitType::FlagType *                      flag;
+        RMSErrorPixelType *                               rmse;
+    };
+
+    Buffers GetBuffers() {
+        Buffers b;
+        for (int i = 0; i < ModelType::NI; i++) {
+            b.inputs[i]       = this->GetInput(i)->GetBufferPointer();
+            b.input_stride[i] = this->GetInput(i)->GetNumberOfComponentsPerPixel();
+            b.residuals[i] =
+                m_allResiduals ? this->GetResidualsOutput(i)->GetBufferPointer() : nullptr;
+        }
+        // Fixed images and the mask are always whole, but the inputs may be a single slab
+        auto const start = this->GetInput(0)->GetBufferedRegion().GetIndex();
+        for (int i = 0; i < ModelType::NF; i++) {
+            auto const f = this->GetFixed(i);
+            b.fixed[i]   = f ? f->GetBufferPointer() + f->ComputeOffset(start) : nullptr;
+        }
+        auto const mask = this->GetMask();
+        b.mask          = mask ? mask->GetBufferPointer() + mask->ComputeOffset(start) : nullptr;
         for (int i = 0; i < ModelType::NV; i++) {
-            output_iters[i] = itk::ImageRegionIterator<TOutputImage>(this->GetOutput(i), region);
+            b.varying[i] = this->GetOutput(i)->GetBufferPointer();
         }
-
-        std::array<itk::ImageRegionIterator<TOutputImage>, ModelType::ND> derived_iters;
         if constexpr (HasDerived) {
             for (int i = 0; i < ModelType::ND; i++) {
-                derived_iters[i] =
-                    itk::ImageRegionIterator<TOutputImage>(this->GetDerivedOutput(i), region);
+                b.derived[i] = this->GetDerivedOutput(i)->GetBufferPointer();
             }
         }
+        for (int i = 0; i < ModelType::NCov; i++) {
+            b.covar[i] = m_covar ? this->GetCovarOutput(i)->GetBufferPointer() : nullptr;
+        }
+        b.flag = this->GetFlagOutput()->GetBufferPointer();
+        b.rmse = this->GetRMSErrorOutput()->GetBufferPointer();
+        return b;
+    }
 
-        std::array<itk::ImageRegionIterator<TOutputImage>, ModelType::NCov> covar_iters;
-        if (m_covar) {
-            for (int ii = 0; ii < ModelType::NCov; ii++) {
-                covar_iters[ii] =
-                    itk::ImageRegionIterator<TOutputImage>(this->GetCovarOutput(ii), region);
+    /*
+     * Copy one voxel (or one block of a voxel) into the next free row of the batch
+     */
+    void Gather(Buffers const &      b,
+                Batch &              batch,
+                itk::OffsetValueType offset,
+                TIndex const &       index,
+                int const            block) const {
+        auto const v = batch.size++;
+        for (int i = 0; i < ModelType::NI; i++) {
+            auto const  n  = m_fit->input_size(i);
+            auto const *in = b.inputs[i] + offset * b.input_stride[i] + block * n;
+            for (Eigen::Index j = 0; j < n; j++) {
+                batch.inputs[i](v, j) = in[j];
             }
         }
-
-        // Keep the index on this one to report voxel locations where algorithm fails.
-        itk::ImageRegionIteratorWithIndex<TRMSErrorImage> rmse_iter(this->GetRMSErrorOutput(),
-                                                                    region);
-        itk::ImageRegionIterator<TFlagImage>              flag_iter(this->GetFlagOutput(), region);
-
-        VaryingArray outputs;
-        FixedArray   fixed;
-        CovarArray * covar = m_covar ? new CovarArray : nullptr;
-
-        while (!input_iters[0].IsAtEnd()) {
-            if (!mask || mask_iter.Get()) {
-                for (int b = 0; b < m_blocks; b++) {
-                    std::vector<DataArray> inputs(ModelType::NI);
-                    for (int i = 0; i < ModelType::NI; i++) {
-                        auto input_data       = input_iters[i].Get();
-                        inputs[i]             = DataArray(m_fit->input_size(i));
-                        const int block_start = b * m_fit->input_size(i);
-                        for (Eigen::Index j = 0; j < m_fit->input_size(i); j++) {
-                            inputs[i][j] = input_data[j + block_start];
-                        }
-                    }
-
-                    outputs = VaryingArray::Zero();
-                    if constexpr (ModelType::NF > 0) {
-                        fixed = m_fit->model.fixed_defaults;
-                        for (size_t i = 0; i < fixed_iters.size(); i++) {
-                            if (this->GetFixed(i)) {
-                                fixed[i] = fixed_iters[i].Get();
-                            }
-                        }
-                    }
-                    if (m_covar) {
-                        *covar = CovarArray::Zero();
-                    }
-
-                    typename FitType::RMSErrorType rmse = 0;
-                    typename FitType::FlagType     flag = 0;
-                    std::vector<ResidualArray>     rs; // Leave size 0 if user doesn't want them
-                    if (m_allResiduals) {
-                        for (int i = 0; i < ModelType::NI; i++) {
-                            const int block_size = m_fit->input_size(i);
-                            rs.push_back(ResidualArray::Zero(block_size));
-                        }
-                    }
-
-                    QI::FitReturnType status;
-                    if constexpr (Blocked && Indexed) {
-                        status = m_fit->fit(
-                            inputs, fixed, outputs, covar, rmse, rs, flag, b, rmse_iter.GetIndex());
-                    } else if constexpr (Blocked) {
-                        status = m_fit->fit(inputs, fixed, outputs, covar, rmse, rs, flag, b);
-                    } else if constexpr (Indexed) {
-                        status = m_fit->fit(
-                            inputs, fixed, outputs, covar, rmse, rs, flag, rmse_iter.GetIndex());
-                    } else if constexpr (HasDerived) {
-                        typename ModelType::DerivedArray derived;
-                        status = m_fit->fit(inputs, fixed, outputs, derived, covar, rmse, rs, flag);
-                        for (int i = 0; i < ModelType::ND; i++) {
-                            derived_iters[i].Set(derived[i]);
-                        }
-                    } else {
-                        status = m_fit->fit(inputs, fixed, outputs, covar, rmse, rs, flag);
-                    }
-
-                    if (!status.success && m_verbose) {
-                        QI::Warn(
-                            "Fit failed for voxel {}: {}", rmse_iter.GetIndex(), status.message);
-                    }
-
-                    if constexpr (Blocked) {
-                        flag_iter.Get()[b] = flag;
-                        rmse_iter.Get()[b] = rmse;
-                        for (int i = 0; i < ModelType::NV; i++) {
-                            output_iters[i].Get()[b] = outputs[i];
-                        }
-                    } else {
-                        flag_iter.Set(flag);
-                        rmse_iter.Set(rmse);
-                        for (int i = 0; i < ModelType::NV; i++) {
-                            output_iters[i].Set(outputs[i]);
-                        }
-                        if (m_covar) {
-                            for (int ii = 0; ii < ModelType::NCov; ii++) {
-                                covar_iters[ii].Set((*covar)[ii]);
-                            }
-                        }
-                    }
-                    if (m_allResiduals) {
-                        for (int i = 0; i < ModelType::NI; i++) {
-                            const int block_start = m_fit->input_size(i) * b;
-                            for (int j = 0; j < m_fit->input_size(i); j++) {
-                                residuals_iters[i].Get()[j + block_start] = rs[i][j];
-                            }
-                        }
-                    }
-                }
-            } else {
-                if constexpr (Blocked) {
-                    flag_iter.Get().Fill(0);
-                    rmse_iter.Get().Fill(0);
-                    for (auto &o : output_iters) {
-                        o.Get().Fill(0);
-                    }
-                } else {
-                    flag_iter.Set(0);
-                    flag_iter.Set(0);
-                    for (auto &o : output_iters) {
-                        o.Set(0);
-                    }
-                    if (m_covar) {
-                        for (auto &c : covar_iters) {
-                            c.Set(0);
-                        }
-                    }
-                }
-                if constexpr (HasDerived) {
-                    for (auto &d : derived_iters) {
-                        d.Set(0);
-                    }
-                }
-                if (m_allResiduals) {
-                    for (auto &r : residuals_iters) {
-                        r.Get().Fill(0);
-                    }
-                }
+        if constexpr (ModelType::NF > 0) {
+            for (int i = 0; i < ModelType::NF; i++) {
+                batch.fixed(v, i) =
+                    b.fixed[i] ? b.fixed[i][offset] : m_fit->model.fixed_defaults[i];
             }
+        }
+        batch.index[v] = index;
+        batch.block[v] = block;
+    }
 
-            if (this->GetMask())
-                ++mask_iter;
-            for (int i = 0; i < ModelType::NI; i++) {
-                ++input_iters[i];
-                if (m_allResiduals)
-                    ++residuals_iters[i];
-            }
-            for (int i = 0; i < ModelType::NF; i++) {
-                if (this->GetFixed(i))
-                    ++fixed_iters[i];
+    /*
+     * Fit the current batch and write the results back to the output buffers. Voxels outside the
+     * mask are never gathered, they stay at the zero the outputs were allocated with.
+     */
+    void FitAndScatter(Buffers const &                          b,
+                       Batch &                                  batch,
+                       std::vector<itk::OffsetValueType> const &offsets) {
+        QI::FitBatchOf(*m_fit, batch);
+        for (Eigen::Index v = 0; v < batch.size; v++) {
+            if (!batch.status[v].success && m_verbose) {
+                QI::Warn("Fit failed for voxel {}: {}", batch.index[v], batch.status[v].message);
             }
+            // Blocked outputs are vector images with one component per block
+            auto const o = offsets[v] * m_blocks + batch.block[v];
+            b.flag[o]    = batch.flag[v];
+            b.rmse[o]    = batch.rmse[v];
             for (int i = 0; i < ModelType::NV; i++) {
-                ++output_iters[i];
+                b.varying[i][o] = batch.varying(v, i);
             }
             if constexpr (HasDerived) {
-                for (auto &d : derived_iters) {
-                    ++d;
+                for (int i = 0; i < ModelType::ND; i++) {
+                    b.derived[i][o] = batch.derived(v, i);
                 }
             }
             if (m_covar) {
-                for (auto &c : covar_iters) {
-                    ++c;
+                for (int i = 0; i < ModelType::NCov; i++) {
+                    b.covar[i][o] = batch.covar_out(v, i);
                 }
             }
-            ++flag_iter;
-            ++rmse_iter;
+            if (m_allResiduals) {
+                for (int i = 0; i < ModelType::NI; i++) {
+                    auto const n = m_fit->input_size(i);
+                    auto *r = b.residuals[i] + offsets[v] * b.input_stride[i] + batch.block[v] * n;
+                    for (Eigen::Index j = 0; j < n; j++) {
+                        r[j] = batch.residuals[i](v, j);
+                    }
+                }
+            }
+        }
+        batch.size = 0;
+    }
+
+    /*
+     * Add all blocks of a voxel to the batch, fitting whenever it fills up
+     */
+    void AddVoxel(Buffers const &                    b,
+                  Batch &                            batch,
+                  std::vector<itk::OffsetValueType> &offsets,
+                  itk::OffsetValueType const         offset,
+                  TIndex const &                     index) {
+        for (int block = 0; block < m_blocks; block++) {
+            offsets[batch.size] = offset;
+            Gather(b, batch, offset, index, block);
+            if (batch.full()) {
+                FitAndScatter(b, batch, offsets);
+            }
+        }
+    }
+
+    virtual void DynamicThreadedGenerateData(const TRegion &region) override {
+        Buffers const                     b = GetBuffers();
+        Batch                             batch(*m_fit, m_batchSize, m_covar, m_allResiduals);
+        std::vector<itk::OffsetValueType> offsets(m_batchSize);
+
+        auto const input = this->GetInput(0);
+        for (itk::ImageRegionConstIteratorWithIndex<TInputImage> it(input, region); !it.IsAtEnd();
+             ++it) {
+            auto const &index  = it.GetIndex();
+            auto const  offset = input->ComputeOffset(index);
+            if (b.mask && !b.mask[offset]) {
+                continue;
+            }
+            AddVoxel(b, batch, offsets, offset, index);
         }
+        if (batch.size > 0) {
+            FitAndScatter(b, batch, offsets);
+        }
+    }
+
+    /*
+     * Build a compact list of the voxels that need fitting, then let each work unit take small
+     * chunks from it until none are left. Fit times vary a lot between voxels and mask coverage
+     * varies a lot between slabs, so this keeps every thread busy until the end.
+     */
+    void DynamicScheduleGenerateData(const TRegion &region) {
+        auto const                        input = this->GetInput(0);
+        auto const                        mask  = GetBuffers().mask;
+        std::vector<itk::OffsetValueType> work;
+        work.reserve(region.GetNumberOfPixels());
+        for (itk::ImageRegionConstIteratorWithIndex<TInputImage> it(input, region); !it.IsAtEnd();
+             ++it) {
+            auto const offset = input->ComputeOffset(it.GetIndex());
+            if (!mask || mask[offset]) {
+                work.push_back(offset);
+            }
+        }
+        Log(m_verbose, "{} voxels to fit", work.size());
+
+        std::atomic<size_t> cursor{0};
+        size_t const        chunk = std::max(1, m_batchSize / m_blocks);
+        this->GetMultiThreader()->ParallelizeArray(
+            0,
+            this->GetNumberOfWorkUnits(),
+            [&](itk::SizeValueType) {
+                // Progress counts voxel blocks once they are fitted, not when they are queued
+                itk::TotalProgressReporter progress(this, work.size() * m_blocks);
+                Buffers const              b = GetBuffers();
+                Batch batch(*m_fit, m_batchSize, m_covar, m_allResiduals);
+                std::vector<itk::OffsetValueType> offsets(m_batchSize);
+                size_t                            added = 0, fitted = 0;
+                for (size_t start = cursor.fetch_add(chunk); start < work.size();
+                     start        = cursor.fetch_add(chunk)) {
+                    size_t const end = std::min(start + chunk, work.size());
+                    for (size_t ii = start; ii < end; ii++) {
+                        AddVoxel(b, batch, offsets, work[ii], input->ComputeIndex(work[ii]));
+                    }
+                    added += (end - start) * m_blocks;
+                    size_t const done = added - static_cast<size_t>(batch.size);
+                    progress.Completed(done - fitted);
+                    fitted = done;
+                }
+                if (batch.size > 0) {
+                    FitAndScatter(b, batch, offsets);
+                }
+                progress.Completed(added - fitted);
+            },
+            nullptr);
     }
 }; // namespace QI
 
@@ -13,11 +13,12 @@
 #ifndef DESPOT_RegionContraction_h
 #define DESPOT_RegionContraction_h
 
-#include <random>
-#include <vector>
-
+#include <algorithm>
 #include <atomic>
 #include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <vector>
 
 #include <Eigen/Core>
 
@@ -27,23 +28,6 @@ namespace QI {
 
 typedef Eigen::Array<bool, Eigen::Dynamic, 1> ArrayXb;
 
-std::vector<size_t> index_partial_sort(const Eigen::Ref<Eigen::ArrayXd> &x,
-                                       Eigen::ArrayXd::Index             N);
-std::vector<size_t> index_partial_sort(const Eigen::Ref<Eigen::ArrayXd> &x,
-                                       Eigen::ArrayXd::Index             N) {
-    eigen_assert(x.size() >= N);
-    std::vector<size_t> allIndices(x.size()), indices(N);
-    for (size_t i = 0; i < allIndices.size(); i++) {
-        allIndices[i] = i;
-    }
-    partial_sort(allIndices.begin(), allIndices.begin() + N, allIndices.end(),
-                 [&x](size_t i1, size_t i2) { return x[i1] < x[i2]; });
-    for (Eigen::ArrayXd::Index i = 0; i < N; i++) {
-        indices[i] = allIndices[i];
-    }
-    return indices;
-}
-
 enum class RCStatus {
     NotStarted = -1,
     Converged,
@@ -53,7 +37,7 @@ enum class RCStatus {
     ErrorResidual
 };
 
-std::ostream &operator<<(std::ostream &os, const RCStatus &s) {
+inline std::ostream &operator<<(std::ostream &os, const RCStatus &s) {
     switch (s) {
     case RCStatus::NotStarted:
         os << "Not Started";
@@ -77,53 +61,85 @@ std::ostream &operator<<(std::ostream &os, const RCStatus &s) {
     return os;
 }
 
-template <typename Functor_t> class RegionContraction {
+/*
+ *  Stochastic Region Contraction. Each contraction draws nS samples within the current bounds
+ *  (uniformly, or from a Gaussian fitted to the previous retained samples), keeps the nR with the
+ *  lowest cost and shrinks the bounds around them.
+ *
+ *  Samples are drawn with a counter-based RNG. The key is passed to optimise() and the counter
+ *  depends only on the contraction and sample number, so results are reproducible whatever order
+ *  voxels are processed in. Samples are evaluated in blocks of BlockSize so the functor can work on
+ *  many at once. The buffers are kept between calls, so a single object per thread can be re-used
+ *  for every voxel. The functor must provide:
+ *
+ *      int  inputs() const
+ *      bool constraint(VaryingArray const &sample) const
+ *      void operator()(Eigen::Ref<Eigen::ArrayXXd const> const &samples,
+ *                      Eigen::Ref<Eigen::ArrayXd>               cost)
+ *
+ *  where samples has one column per sample.
+ */
+class RegionContraction {
+  public:
+    static constexpr Eigen::Index BlockSize = 64;
+
   private:
-    Functor_t &     m_f;
-    std::mt19937_64 m_rng;
-    Eigen::ArrayXXd m_startBounds, m_currentBounds;
-    Eigen::ArrayXd  m_threshes;
-    size_t          m_nS, m_nR, m_maxContractions, m_contractions;
-    double          m_expand, m_SoS;
-    RCStatus        m_status;
-    bool            m_gaussian, m_debug;
+    Eigen::ArrayXXd     m_startBounds, m_currentBounds, m_region;
+    Eigen::ArrayXd      m_threshes;
+    size_t              m_nS = 0, m_nR = 0, m_maxContractions = 0, m_contractions = 0;
+    double              m_expand = 0., m_SoS = 0.;
+    RCStatus            m_status   = RCStatus::NotStarted;
+    bool                m_gaussian = false, m_debug = false, m_useRegion = false;
+    CounterRNG          m_rng;
+    Eigen::ArrayXXd     m_samples, m_retained;
+    Eigen::ArrayXd      m_residuals, m_retainedRes, m_gaussMu, m_gaussSigma;
+    std::vector<size_t> m_indices;
 
   public:
-    RegionContraction(Functor_t &f, const Eigen::ArrayXd &loBounds, const Eigen::ArrayXd &hiBounds,
-                      const Eigen::ArrayXd &thresh, const int nS = 5000, const int nR = 50,
-                      const int maxContractions = 10, const double expand = 0.,
-                      const bool gauss = false, const bool debug = false, const int seed = -1)
-        : m_f(f), m_threshes(thresh), m_nS(nS), m_nR(nR), m_maxContractions(maxContractions),
-          m_contractions(0), m_expand(expand), m_status(RCStatus::NotStarted), m_gaussian(gauss),
-          m_debug(debug) {
+    RegionContraction() = default;
+    RegionContraction(const Eigen::ArrayXd &loBounds,
+                      const Eigen::ArrayXd &hiBounds,
+                      const Eigen::ArrayXd &thresh,
+                      const int             nS              = 5000,
+                      const int             nR              = 50,
+                      const int             maxContractions = 10,
+                      const double          expand          = 0.,
+                      const bool            gauss           = false,
+                      const bool            debug           = false) :
+        m_threshes(thresh),
+        m_nS(nS), m_nR(nR), m_maxContractions(maxContractions), m_expand(expand),
+        m_gaussian(gauss), m_debug(debug), m_samples(loBounds.rows(), nS),
+        m_retained(loBounds.rows(), nR), m_residuals(nS), m_retainedRes(nR),
+        m_gaussMu(loBounds.rows()), m_gaussSigma(loBounds.rows()), m_indices(nS) {
         m_startBounds        = Eigen::ArrayXXd(loBounds.rows(), 2);
         m_startBounds.col(0) = loBounds;
         m_startBounds.col(1) = hiBounds;
         m_currentBounds      = m_startBounds;
-        eigen_assert(f.inputs() == m_startBounds.rows());
-        eigen_assert(m_startBounds.cols() == 2);
-        eigen_assert(thresh.rows() == f.inputs());
+        eigen_assert(hiBounds.rows() == loBounds.rows());
+        eigen_assert(thresh.rows() == loBounds.rows());
         eigen_assert((thresh >= 0.).all() && (thresh <= 1.).all());
-
-        if (seed < 0) {
-            m_rng = std::mt19937_64(RandomSeed());
-        } else {
-            m_rng = std::mt19937_64(seed);
-        }
+        eigen_assert(nR <= nS);
     }
 
     const Eigen::ArrayXXd &startBounds() const { return m_startBounds; }
     void                   setBounds(const Eigen::Ref<Eigen::ArrayXXd> &b) {
-        eigen_assert(m_f.inputs() == b.rows());
+        eigen_assert(m_startBounds.rows() == b.rows());
         eigen_assert(b.cols() == 2);
         m_startBounds = b;
     }
-    const ArrayXb &thresholds() const { return m_threshes; }
-    void           setThresholds(const Eigen::Ref<Eigen::ArrayXd> &t) {
-        eigen_assert(t.rows() == m_f.inputs());
+    const Eigen::ArrayXd &thresholds() const { return m_threshes; }
+    void                  setThresholds(const Eigen::Ref<Eigen::ArrayXd> &t) {
+        eigen_assert(t.rows() == m_startBounds.rows());
         eigen_assert((t >= 0.).all() && (t <= 1.).all());
         m_threshes = t;
     }
+    // Start the next call to optimise() from this region instead of the start bounds
+    void setRegion(const Eigen::Ref<const Eigen::ArrayXXd> &r) {
+        eigen_assert(m_startBounds.rows() == r.rows());
+        eigen_assert(r.cols() == 2);
+        m_region    = r;
+        m_useRegion = true;
+    }
     size_t                 contractions() const { return m_contractions; }
     RCStatus               status() const { return m_status; }
     const Eigen::ArrayXXd &currentBounds() const { return m_currentBounds; }
@@ -132,32 +148,27 @@ template <typename Functor_t> class RegionContraction {
     Eigen::ArrayXd width() const { return m_currentBounds.col(1) - m_currentBounds.col(0); }
     Eigen::ArrayXd midPoint() const { return (m_currentBounds.rowwise().sum() / 2.); }
 
-    bool optimise(Eigen::Ref<Eigen::ArrayXd> params) {
+    template <typename Functor_t>
+    bool optimise(Functor_t &f, Eigen::Ref<Eigen::ArrayXd> params, std::uint64_t const key) {
         static std::atomic<bool> finiteWarning(false);
         static std::atomic<bool> constraintWarning(false);
         static std::atomic<bool> boundsWarning(false);
-        std::mutex               warn_mtx;
 
-        eigen_assert(m_f.inputs() == params.size());
-        int                 nP = static_cast<int>(params.size());
-        Eigen::ArrayXXd     samples(m_f.inputs(), m_nS);
-        Eigen::ArrayXXd     retained(m_f.inputs(), m_nR);
-        Eigen::ArrayXd      residuals(m_nS);
-        Eigen::ArrayXd      retainedRes(m_nR);
-        Eigen::ArrayXd      gauss_mu(m_f.inputs()), gauss_sigma(m_f.inputs());
-        std::vector<size_t> indices(m_nR);
-        m_currentBounds = m_startBounds;
+        eigen_assert(f.inputs() == params.size());
+        eigen_assert(f.inputs() == m_startBounds.rows());
+        m_rng.key       = key;
+        m_currentBounds = m_useRegion ? m_region : m_startBounds;
+        m_useRegion     = false;
+        // NaN, so the first contraction never counts as no improvement
+        m_retained.setConstant(std::numeric_limits<double>::quiet_NaN());
         if ((m_startBounds != m_startBounds).any() ||
             (m_startBounds >= std::numeric_limits<double>::infinity()).any() ||
             (m_startBounds.col(1) < m_startBounds.col(0)).any()) {
-            warn_mtx.lock();
-            if (!boundsWarning) {
-                boundsWarning = true;
+            if (!boundsWarning.exchange(true)) {
                 std::cerr << "Warning: Starting boundaries do not make sense." << std::endl;
                 std::cerr << "Bounds were: " << m_startBounds.transpose() << std::endl;
                 std::cerr << "This warning will only be printed once." << std::endl;
             }
-            warn_mtx.unlock();
             params.setZero();
             m_status = RCStatus::ErrorInvalid;
             return false;
@@ -170,107 +181,75 @@ template <typename Functor_t> class RegionContraction {
                       << m_startBounds.transpose() << std::endl;
         }
 
-        std::uniform_real_distribution<double> uniform(0., 1.);
         m_status = RCStatus::IterationLimit;
         for (m_contractions = 0; m_contractions < m_maxContractions; m_contractions++) {
-            size_t startSample = 0;
-            /*if (m_contractions > 0) {
-                    // Keep the retained samples to prevent boundary contracting too fast
-                    for (size_t s = 0; s < m_nR; s++) {
-                            samples.col(s) = retained.col(s);
-                            residuals.col(s) = retainedRes.col(s);
-                    }
-                    startSample = m_nR;
-            }*/
-            for (size_t s = startSample; s < m_nS; s++) {
-                Eigen::ArrayXd tempSample(nP);
-                size_t         nTries = 0;
-                do {
-                    if (!m_gaussian || (m_contractions == 0)) {
-                        for (int p = 0; p < nP; p++) {
-                            tempSample(p) = uniform(m_rng);
-                        }
-                        tempSample *= width();
-                        tempSample += m_currentBounds.col(0);
-                    } else {
-                        for (int p = 0; p < nP; p++) {
-                            if (std::isfinite(gauss_sigma(p))) {
-                                std::normal_distribution<double> gauss(gauss_mu(p), gauss_sigma(p));
-                                do {
-                                    tempSample(p) = gauss(m_rng);
-                                } while ((tempSample(p) < m_currentBounds(p, 0)) ||
-                                         (tempSample(p) > m_currentBounds(p, 1)));
-                            } else {
-                                tempSample(p) = gauss_mu(p);
-                            }
-                        }
-                    }
-                    nTries++;
-                    if (nTries > 100) {
-                        warn_mtx.lock();
-                        if (!constraintWarning) {
-                            constraintWarning = true;
-                            std::cerr << "Warning: Cannot fulfill sample constraints after "
-                                      << std::to_string(nTries) << " attempts, giving up."
+            for (size_t start = 0; start < m_nS; start += BlockSize) {
+                auto const n = std::min<Eigen::Index>(BlockSize, m_nS - start);
+                for (Eigen::Index s = start; s < static_cast<Eigen::Index>(start + n); s++) {
+                    if (!draw(f, s)) {
+                        if (!constraintWarning.exchange(true)) {
+                            std::cerr << "Warning: Cannot fulfill sample constraints after 100 "
+                                         "attempts, giving up."
+                                      << std::endl
+                                      << "Last attempt was: " << m_samples.col(s).transpose()
                                       << std::endl
-                                      << "Last attempt was: " << tempSample.transpose() << std::endl
                                       << "This warning will only be printed once." << std::endl;
                         }
-                        warn_mtx.unlock();
                         params.setZero();
                         m_status = RCStatus::ErrorInvalid;
                         return false;
                     }
-                } while (!m_f.constraint(tempSample));
-
-                residuals[s] = m_f(tempSample);
-                if (!std::isfinite(residuals[s])) {
-                    warn_mtx.lock();
-                    if (!finiteWarning) {
-                        finiteWarning = true;
+                }
+                f(m_samples.middleCols(start, n), m_residuals.segment(start, n));
+                if (!m_residuals.segment(start, n).allFinite()) {
+                    if (!finiteWarning.exchange(true)) {
+                        Eigen::Index bad;
+                        (!m_residuals.segment(start, n).isFinite()).maxCoeff(&bad);
                         std::cout
                             << "Warning: Non-finite residual found!" << std::endl
                             << "Result may be meaningless. This warning will only be printed once."
                             << std::endl
-                            << "Parameters were " << tempSample.transpose() << std::endl;
+                            << "Parameters were " << m_samples.col(start + bad).transpose()
+                            << std::endl;
                     }
-                    warn_mtx.unlock();
-                    params   = retained.col(0);
+                    params   = m_retained.col(0);
                     m_status = RCStatus::ErrorResidual;
                     return false;
                 }
-                samples.col(s) = tempSample;
             }
-            indices                     = index_partial_sort(residuals, m_nR);
-            Eigen::ArrayXd previousBest = retained.col(0);
+            // Only the best nR need to be in order
+            std::iota(m_indices.begin(), m_indices.end(), 0);
+            auto const by_residual = [&](size_t i1, size_t i2) {
+                return m_residuals[i1] < m_residuals[i2];
+            };
+            std::nth_element(
+                m_indices.begin(), m_indices.begin() + m_nR, m_indices.end(), by_residual);
+            std::sort(m_indices.begin(), m_indices.begin() + m_nR, by_residual);
+            Eigen::ArrayXd const previousBest = m_retained.col(0);
             for (size_t i = 0; i < m_nR; i++) {
-                retained.col(i) = samples.col(indices[i]);
-                retainedRes(i)  = residuals(indices[i]);
+                m_retained.col(i) = m_samples.col(m_indices[i]);
+                m_retainedRes(i)  = m_residuals(m_indices[i]);
             }
             // Find the min and max for each parameter in the top nR samples
-            m_currentBounds.col(0) = retained.rowwise().minCoeff();
-            m_currentBounds.col(1) = retained.rowwise().maxCoeff();
+            m_currentBounds.col(0) = m_retained.rowwise().minCoeff();
+            m_currentBounds.col(1) = m_retained.rowwise().maxCoeff();
             if (m_gaussian) {
-                gauss_mu = retained.rowwise().mean();
-                gauss_sigma =
-                    ((retained.colwise() - gauss_mu).square().rowwise().sum() / (m_f.inputs() - 1))
-                        .sqrt();
+                m_gaussMu    = m_retained.rowwise().mean();
+                m_gaussSigma = ((m_retained.colwise() - m_gaussMu).square().rowwise().sum() /
+                                (f.inputs() - 1))
+                                   .sqrt();
             }
             if (m_debug) {
                 std::cout << "CONTRACTION:    " << m_contractions << std::endl
-                          << "Retained best: " << retainedRes.minCoeff()
-                          << " Worst: " << retainedRes.maxCoeff() << std::endl
-                          << "All best:      " << residuals.minCoeff()
-                          << " Worst: " << residuals.maxCoeff() << std::endl
+                          << "Retained best: " << m_retainedRes.minCoeff()
+                          << " Worst: " << m_retainedRes.maxCoeff() << std::endl
+                          << "All best:      " << m_residuals.minCoeff()
+                          << " Worst: " << m_residuals.maxCoeff() << std::endl
                           << "Current width%: " << (width() / startWidth()).transpose()
                           << std::endl;
-                // cout << "Thresh        : " << m_threshes.transpose() << std::endl;
-                // cout << "Width < Thresh: " << (width() <= (m_threshes *
-                // startWidth())).transpose() << std::endl; cout << "Converged:      " << (width() <=
-                // (m_threshes * startWidth())).all() << std::endl;
                 if (m_gaussian) {
-                    std::cout << "Gaussian mu:    " << gauss_mu.transpose() << std::endl
-                              << "Gaussian sigma%:" << (gauss_sigma / startWidth()).transpose()
+                    std::cout << "Gaussian mu:    " << m_gaussMu.transpose() << std::endl
+                              << "Gaussian sigma%:" << (m_gaussSigma / startWidth()).transpose()
                               << std::endl;
                 }
             }
@@ -279,7 +258,7 @@ template <typename Functor_t> class RegionContraction {
                 m_status = RCStatus::Converged;
                 m_contractions++; // Just to give an accurate contraction count.
                 break;
-            } else if ((previousBest == retained.col(0)).all()) {
+            } else if ((previousBest == m_retained.col(0)).all()) {
                 m_status = RCStatus::NoImprovement;
                 m_contractions++; // Just to give an accurate contraction count.
                 break;
@@ -300,17 +279,49 @@ template <typename Functor_t> class RegionContraction {
         }
 
         if (m_gaussian) {
-            params = gauss_mu;
+            params = m_gaussMu;
         } else {
             // Return the best evaluated solution so far
-            params = retained.col(0);
+            params = m_retained.col(0);
         }
-        m_SoS = retainedRes(0);
+        m_SoS = m_retainedRes(0);
         if (m_debug) {
             std::cout << "Finished, contractions = " << m_contractions << std::endl;
         }
         return true;
     }
+
+  private:
+    /*
+     *  Draw sample s of the current contraction, trying again until it satisfies the constraint.
+     *  Each sample has its own range of 2^24 counters.
+     */
+    template <typename Functor_t> bool draw(Functor_t const &f, Eigen::Index const s) {
+        std::uint64_t counter = (m_contractions * m_nS + s) << 24;
+        auto          sample  = m_samples.col(s);
+        for (int tries = 0; tries < 100; tries++) {
+            for (Eigen::Index p = 0; p < sample.rows(); p++) {
+                double const lo = m_currentBounds(p, 0);
+                double const hi = m_currentBounds(p, 1);
+                if (!m_gaussian || (m_contractions == 0)) {
+                    sample[p] = lo + m_rng.uniform(counter++) * (hi - lo);
+                } else if (std::isfinite(m_gaussSigma[p])) {
+                    // Truncate to the current bounds
+                    int t = 0;
+                    do {
+                        sample[p] = m_gaussMu[p] + m_gaussSigma[p] * m_rng.normal(counter++);
+                    } while (((sample[p] < lo) || (sample[p] > hi)) && (++t < 1000));
+                    sample[p] = std::clamp(sample[p], lo, hi);
+                } else {
+                    sample[p] = m_gaussMu[p];
+                }
+            }
+            if (f.constraint(sample)) {
+                return true;
+            }
+        }
+        return false;
+    }
 };
 
 } // End namespace QI
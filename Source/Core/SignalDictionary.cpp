@@ -0,0 +1,190 @@
+/*
+ *  SignalDictionary.cpp - Part of QUantitative Imaging Tools
+ *
+ *  Copyright (c) 2026 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include "SignalDictionary.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <numeric>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace QI {
+
+namespace {
+char const         Magic[8] = {'Q', 'I', 'D', 'I', 'C', 'T', '\0', '\0'};
+std::uint32_t const Version = 1;
+
+// Every block in the file starts on a 64 byte boundary, so the mapped arrays are aligned
+std::size_t Align(std::size_t const bytes) {
+    return (bytes + 63) & ~std::size_t(63);
+}
+
+/*
+ *  Each slice is the weights (float x data), the norms (float x entries) then the signals
+ *  (float x data x entries)
+ */
+std::size_t SliceBytes(std::size_t const n_data, std::size_t const n_entries) {
+    return Align(n_data * sizeof(float)) + Align(n_entries * sizeof(float)) +
+           Align(n_data * n_entries * sizeof(float));
+}
+} // namespace
+
+std::uint64_t SignalDictionary::Hash(std::string const &s) {
+    std::uint64_t h = 14695981039346656037ULL; // FNV-1a
+    for (unsigned char const c : s) {
+        h = (h ^ c) * 1099511628211ULL;
+    }
+    return h;
+}
+
+void SignalDictionary::Write(std::string const &                 path,
+                             std::uint64_t const                 protocol,
+                             Eigen::ArrayXd const &              B1,
+                             Eigen::ArrayXd const &              f0,
+                             Eigen::ArrayXXd const &             parameters,
+                             std::vector<Eigen::ArrayXXf> const &signals,
+                             std::vector<Eigen::ArrayXf> const & weights) {
+    auto const n_slices = B1.rows() * f0.rows();
+    if (static_cast<Eigen::Index>(signals.size()) != n_slices ||
+        static_cast<Eigen::Index>(weights.size()) != n_slices) {
+        QI::Fail("Dictionary has {} signal slices, expected {}", signals.size(), n_slices);
+    }
+    Header header{};
+    std::memcpy(header.magic, Magic, sizeof(Magic));
+    header.version   = Version;
+    header.n_varying = parameters.rows();
+    header.n_data    = signals.front().rows();
+    header.n_B1      = B1.rows();
+    header.n_f0      = f0.rows();
+    header.n_entries = parameters.cols();
+    header.protocol  = protocol;
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        QI::Fail("Could not open {} to write dictionary", path);
+    }
+    auto write_block = [&](void const *data, std::size_t const bytes) {
+        static char const zeros[64] = {};
+        file.write(static_cast<char const *>(data), bytes);
+        file.write(zeros, Align(bytes) - bytes);
+    };
+    write_block(&header, sizeof(Header));
+    write_block(B1.data(), B1.rows() * sizeof(double));
+    write_block(f0.data(), f0.rows() * sizeof(double));
+    write_block(parameters.data(), parameters.size() * sizeof(double));
+    for (Eigen::Index s = 0; s < n_slices; s++) {
+        Eigen::ArrayXf const norms =
+            (signals[s].square().colwise() * weights[s]).colwise().sum().transpose();
+        write_block(weights[s].data(), weights[s].size() * sizeof(float));
+        write_block(norms.data(), norms.size() * sizeof(float));
+        write_block(signals[s].data(), signals[s].size() * sizeof(float));
+    }
+    if (!file) {
+        QI::Fail("Failed to write dictionary to {}", path);
+    }
+}
+
+SignalDictionary::SignalDictionary(std::string const &path) {
+    int const fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        QI::Fail("Could not open dictionary {}", path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        QI::Fail("Could not read size of dictionary {}", path);
+    }
+    m_size = st.st_size;
+    if (m_size < sizeof(Header)) {
+        close(fd);
+        QI::Fail("Dictionary {} is too small to be valid", path);
+    }
+    m_map = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m_map == MAP_FAILED) {
+        QI::Fail("Could not memory map dictionary {}", path);
+    }
+    auto const *bytes = static_cast<char const *>(m_map);
+    m_header          = reinterpret_cast<Header const *>(bytes);
+    if (std::memcmp(m_header->magic, Magic, sizeof(Magic)) != 0 || m_header->version != Version) {
+        QI::Fail("{} is not a version {} dictionary file", path, Version);
+    }
+    std::size_t offset = Align(sizeof(Header));
+    m_B1               = reinterpret_cast<double const *>(bytes + offset);
+    offset += Align(m_header->n_B1 * sizeof(double));
+    m_f0 = reinterpret_cast<double const *>(bytes + offset);
+    offset += Align(m_header->n_f0 * sizeof(double));
+    m_parameters = reinterpret_cast<double const *>(bytes + offset);
+    offset += Align(m_header->n_varying * m_header->n_entries * sizeof(double));
+    m_slice_offset = offset;
+    m_slice_stride = SliceBytes(m_header->n_data, m_header->n_entries);
+    if (m_size != offset + m_slice_stride * m_header->n_B1 * m_header->n_f0) {
+        QI::Fail("Dictionary {} is truncated or corrupt", path);
+    }
+    // The signals are read in a random order of slices
+    madvise(m_map, m_size, MADV_RANDOM);
+}
+
+SignalDictionary::~SignalDictionary() {
+    munmap(m_map, m_size);
+}
+
+Eigen::Map<Eigen::ArrayXXd const> SignalDictionary::parameters() const {
+    return Eigen::Map<Eigen::ArrayXXd const>(
+        m_parameters, m_header->n_varying, m_header->n_entries);
+}
+
+Eigen::Index SignalDictionary::slice(double const B1, double const f0) const {
+    auto const closest = [](double const *grid, std::uint32_t const n, double const x) {
+        return std::distance(grid, std::min_element(grid, grid + n, [x](double a, double b) {
+                                 return std::abs(a - x) < std::abs(b - x);
+                             }));
+    };
+    return closest(m_B1, m_header->n_B1, B1) + m_header->n_B1 * closest(m_f0, m_header->n_f0, f0);
+}
+
+void SignalDictionary::nearest(Eigen::Index const         slice,
+                               Eigen::ArrayXd const &     data,
+                               Eigen::Index const         k,
+                               std::vector<Eigen::Index> &indices,
+                               Eigen::VectorXf &          scores) const {
+    using Vector          = Eigen::Map<Eigen::VectorXf const>;
+    using Matrix          = Eigen::Map<Eigen::MatrixXf const>;
+    auto const  n_data    = m_header->n_data;
+    auto const  n_entries = m_header->n_entries;
+    auto const *bytes = static_cast<char const *>(m_map) + m_slice_offset + slice * m_slice_stride;
+    Vector const weights(reinterpret_cast<float const *>(bytes), n_data);
+    bytes += Align(n_data * sizeof(float));
+    Vector const norms(reinterpret_cast<float const *>(bytes), n_entries);
+    bytes += Align(n_entries * sizeof(float));
+    Matrix const signals(reinterpret_cast<float const *>(bytes), n_data, n_entries);
+
+    // |d - s|^2_w = d'Wd - 2 s'Wd + s'Ws, and the first term is the same for every entry
+    Eigen::VectorXf const wd = weights.cwiseProduct(data.matrix().cast<float>());
+    scores.noalias()         = norms;
+    scores.noalias() -= 2.f * (signals.transpose() * wd);
+
+    indices.resize(n_entries);
+    std::iota(indices.begin(), indices.end(), 0);
+    auto const by_score = [&](Eigen::Index i1, Eigen::Index i2) { return scores[i1] < scores[i2]; };
+    auto const kk       = std::min<Eigen::Index>(k, n_entries);
+    std::nth_element(indices.begin(), indices.begin() + kk, indices.end(), by_score);
+    std::sort(indices.begin(), indices.begin() + kk, by_score);
+    indices.resize(kk);
+}
+
+} // End namespace QI
@@ -0,0 +1,95 @@
+/*
+ *  SignalDictionary.h - Part of QUantitative Imaging Tools
+ *
+ *  Copyright (c) 2026 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <Eigen/Core>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace QI {
+
+/*
+ *  Simulated signals for a fixed set of parameter samples, stored in a binary file that is memory
+ *  mapped when read. The fixed parameters (B1 and f0) are tabulated on a grid, and each grid
+ *  point (slice) stores the signals for every sample, the data weights at that point, and the
+ *  weighted squared norm of each signal. Finding the nearest samples to some data is then a
+ *  single matrix-vector product per voxel. The protocol key identifies the sequence and model the
+ *  file was built for, so a dictionary can be safely re-used for any subject with the same
+ *  protocol.
+ */
+class SignalDictionary {
+  public:
+    struct Header {
+        char          magic[8];
+        std::uint32_t version;
+        std::uint32_t n_varying, n_data, n_B1, n_f0, unused;
+        std::uint64_t n_entries, protocol;
+    };
+
+    SignalDictionary(std::string const &path);
+    ~SignalDictionary();
+    SignalDictionary(SignalDictionary const &) = delete;
+    SignalDictionary &operator=(SignalDictionary const &) = delete;
+
+    /*
+     *  Write a dictionary. Parameters are varying x entries, and there is one signal array
+     *  (data-points x entries) and one weight array per slice, with B1 changing fastest.
+     */
+    static void Write(std::string const &                path,
+                      std::uint64_t const                protocol,
+                      Eigen::ArrayXd const &             B1,
+                      Eigen::ArrayXd const &             f0,
+                      Eigen::ArrayXXd const &            parameters,
+                      std::vector<Eigen::ArrayXXf> const &signals,
+                      std::vector<Eigen::ArrayXf> const & weights);
+
+    static std::uint64_t Hash(std::string const &s); // For protocol keys
+
+    Header const &header() const { return *m_header; }
+    Eigen::Index  size() const { return m_header->n_entries; }
+
+    Eigen::Map<Eigen::ArrayXXd const> parameters() const;
+    Eigen::Index                      slice(double const B1, double const f0) const;
+
+    /*
+     *  Find the k entries in a slice with the smallest weighted squared distance to data, best
+     *  first. Scores is scratch space.
+     */
+    void nearest(Eigen::Index const         slice,
+                 Eigen::ArrayXd const &     data,
+                 Eigen::Index const         k,
+                 std::vector<Eigen::Index> &indices,
+                 Eigen::VectorXf &          scores) const;
+
+  private:
+    void *         m_map  = nullptr;
+    std::size_t    m_size = 0;
+    Header const * m_header;
+    double const * m_B1, *m_f0, *m_parameters;
+    std::ptrdiff_t m_slice_offset, m_slice_stride; // In bytes from the start of the file
+};
+
+/*
+ *  Element i of the Halton low-discrepancy sequence in a prime base
+ */
+inline double Halton(std::uint64_t i, int const base) {
+    double f = 1., r = 0.;
+    while (i > 0) {
+        f /= base;
+        r += f * (i % base);
+        i /= base;
+    }
+    return r;
+}
+
+} // End namespace QI
@@ -110,17 +110,11 @@ std::string Basename(const std::string &path) {
 }
 
 std::mt19937_64::result_type RandomSeed() {
-    static std::random_device rd;
-    static std::mt19937_64    rng;
-    static bool               init = false;
-    std::mutex                seed_mtx;
-    if (!init) {
-        rng = std::mt19937_64(rd());
-    }
-    seed_mtx.lock();
-    std::mt19937_64::result_type r = rng();
-    seed_mtx.unlock();
-    return r;
+    static std::random_device   rd;
+    static std::mt19937_64      rng(rd());
+    static std::mutex           seed_mtx;
+    std::lock_guard<std::mutex> lock(seed_mtx);
+    return rng();
 }
 
 std::vector<size_t> SortedUniqueIndices(Eigen::ArrayXd const &x) {
@@ -13,6 +13,8 @@
 #pragma once
 
 #include <Eigen/Core>
+#include <cmath>
+#include <cstdint>
 #include <functional>
 #include <map>
 #include <mutex>
@@ -53,6 +55,34 @@ std::vector<size_t> SortedUniqueIndices(Eigen::ArrayXd const &x); //!< For splin
 std::vector<int>    IntsFromString(const std::string &s); // !!< Ints from comma-separated string
 std::mt19937_64::result_type RandomSeed();                //!< Thread-safe random seed
 
+/*
+ *  Counter-based random numbers. Each draw is a hash of the key and a counter, so any draw can be
+ *  made in any order, or on any thread, and still give the same value.
+ */
+struct CounterRNG {
+    std::uint64_t key = 0;
+
+    static std::uint64_t Mix(std::uint64_t z) { // SplitMix64 finalizer
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    std::uint64_t bits(std::uint64_t const counter) const {
+        return Mix(key ^ Mix(counter + 0x9e3779b97f4a7c15ULL));
+    }
+
+    double uniform(std::uint64_t const counter) const { // [0, 1)
+        return (bits(counter) >> 11) * 0x1.0p-53;
+    }
+
+    double normal(std::uint64_t const counter) const { // Box-Muller, counters must be < 2^63
+        double const u1 = 1. - uniform(counter);
+        double const u2 = uniform(counter | (1ULL << 63));
+        return std::sqrt(-2. * std::log(u1)) * std::cos(2. * M_PI * u2);
+    }
+};
+
 /*
  * Helper function to calculate the volume of a voxel in an image
  */
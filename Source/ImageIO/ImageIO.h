@@ -11,10 +11,13 @@
  */
 
 #include "ImageTypes.h"
+#include <memory>
 #include <string>
 
 namespace QI {
 
+class NiftiMap;
+
 template <typename TImg = QI::VolumeF>
 extern auto ReadImage(const std::string &path, const bool verbose) -> typename TImg::Pointer;
 
@@ -49,4 +52,24 @@ extern void WriteScaledImage(const itk::SmartPointer<TImg> &       ptr,
                              const std::string &                   path,
                              const bool                            verbose);
 
+/*
+ *  Reads a multi-volume image one slab of whole slices at a time. Uncompressed NIfTI is read
+ *  straight from a memory map, so only the requested slab is ever held in memory. Anything else
+ *  has to be read completely when the reader is created, and slabs are copied out of that.
+ */
+template <typename TVectorImg> class SlabReader {
+  public:
+    SlabReader(const std::string &path, const bool verbose);
+    ~SlabReader();
+
+    // Geometry and number of volumes of the whole image, with no buffer if it is mapped
+    const TVectorImg *image() const { return m_image; }
+
+    auto read(const typename TVectorImg::RegionType &slab) const -> typename TVectorImg::Pointer;
+
+  private:
+    std::unique_ptr<NiftiMap>    m_map;
+    typename TVectorImg::Pointer m_image;
+};
+
 } // namespace QI
@@ -0,0 +1,322 @@
+/*
+ *  NiftiMap.cpp
+ *
+ *  Copyright (c) 2026 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include "NiftiMap.h"
+#include "itkMultiThreaderBase.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+
+namespace QI {
+
+namespace {
+// NIfTI datatype codes
+enum : int {
+    UINT8      = 2,
+    INT16      = 4,
+    INT32      = 8,
+    FLOAT32    = 16,
+    COMPLEX64  = 32,
+    FLOAT64    = 64,
+    INT8       = 256,
+    UINT16     = 512,
+    UINT32     = 768,
+    COMPLEX128 = 1792
+};
+
+std::size_t ElementSize(int const datatype) {
+    switch (datatype) {
+    case UINT8:
+    case INT8:
+        return 1;
+    case INT16:
+    case UINT16:
+        return 2;
+    case INT32:
+    case UINT32:
+    case FLOAT32:
+        return 4;
+    case FLOAT64:
+    case COMPLEX64:
+        return 8;
+    case COMPLEX128:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
+template <typename T> T Get(char const *bytes, std::size_t const offset) {
+    T value;
+    std::memcpy(&value, bytes + offset, sizeof(T));
+    return value;
+}
+
+// 1024 voxels x 16 volumes of doubles is 128 KiB, which fits in L2 alongside the output rows
+std::int64_t const TileVoxels  = 1024;
+std::int64_t const TileVolumes = 16;
+
+/*
+ *  Each tile reads a short run of voxels from TileVolumes volumes, and writes them out as
+ *  contiguous rows. Tiles are independent, so they are shared across the ITK thread pool.
+ */
+template <typename TIn, typename TOut>
+void Transpose(char const *       data,
+               std::int64_t const n_voxels,
+               std::int64_t const first,
+               std::int64_t const count,
+               std::int64_t const n_volumes,
+               double const       slope,
+               double const       inter,
+               TOut *             out) {
+    auto const *in      = reinterpret_cast<TIn const *>(data);
+    auto const  n_tiles = (count + TileVoxels - 1) / TileVoxels;
+    auto        mt      = itk::MultiThreaderBase::New();
+    mt->ParallelizeArray(
+        0,
+        n_tiles,
+        [&](itk::SizeValueType const tile) {
+            std::int64_t const x0 = tile * TileVoxels;
+            std::int64_t const x1 = std::min(x0 + TileVoxels, count);
+            for (std::int64_t v0 = 0; v0 < n_volumes; v0 += TileVolumes) {
+                std::int64_t const v1 = std::min(v0 + TileVolumes, n_volumes);
+                for (std::int64_t x = x0; x < x1; x++) {
+                    TOut *row = out + x * n_volumes;
+                    for (std::int64_t v = v0; v < v1; v++) {
+                        auto const value = in[v * n_voxels + first + x];
+                        if constexpr (std::is_arithmetic_v<TIn>) {
+                            row[v] = static_cast<TOut>(value * slope + inter);
+                        } else {
+                            row[v] = static_cast<TOut>(value);
+                        }
+                    }
+                }
+            }
+        },
+        nullptr);
+}
+} // namespace
+
+std::unique_ptr<NiftiMap> NiftiMap::Open(std::string const &path, bool const complex) {
+    if (path.size() < 4 || path.compare(path.size() - 4, 4, ".nii") != 0) {
+        return nullptr;
+    }
+    int const fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 348) {
+        close(fd);
+        return nullptr;
+    }
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return nullptr;
+    }
+    std::unique_ptr<NiftiMap> nii(new NiftiMap);
+    nii->m_map        = map;
+    nii->m_size       = st.st_size;
+    auto const *bytes = static_cast<char const *>(map);
+
+    // A header size that does not match is either not NIfTI or the opposite byte order
+    std::int64_t dim[8];
+    std::int64_t offset;
+    auto const   sizeof_hdr = Get<std::int32_t>(bytes, 0);
+    if (sizeof_hdr == 348 && std::memcmp(bytes + 344, "n+1", 4) == 0) {
+        for (int i = 0; i < 8; i++) {
+            dim[i] = Get<std::int16_t>(bytes, 40 + 2 * i);
+        }
+        nii->m_datatype = Get<std::int16_t>(bytes, 70);
+        offset          = static_cast<std::int64_t>(Get<float>(bytes, 108));
+        nii->m_slope    = Get<float>(bytes, 112);
+        nii->m_inter    = Get<float>(bytes, 116);
+    } else if (sizeof_hdr == 540 && nii->m_size >= 540 && std::memcmp(bytes + 4, "n+2", 4) == 0) {
+        for (int i = 0; i < 8; i++) {
+            dim[i] = Get<std::int64_t>(bytes, 16 + 8 * i);
+        }
+        nii->m_datatype = Get<std::int16_t>(bytes, 12);
+        offset          = Get<std::int64_t>(bytes, 168);
+        nii->m_slope    = Get<double>(bytes, 176);
+        nii->m_inter    = Get<double>(bytes, 184);
+    } else {
+        return nullptr;
+    }
+    if (dim[0] < 3 || dim[0] > 4) {
+        return nullptr;
+    }
+    for (int d = 0; d < 4; d++) {
+        nii->m_dims[d] = (d < dim[0]) ? dim[d + 1] : 1;
+    }
+
+    // Same rule as ITK, a slope of 0 or an identity transform means unscaled
+    bool const scaled = nii->m_slope != 0. && !(nii->m_slope == 1. && nii->m_inter == 0.);
+    if (!scaled) {
+        nii->m_slope = 1.;
+        nii->m_inter = 0.;
+    }
+    bool const is_complex = (nii->m_datatype == COMPLEX64) || (nii->m_datatype == COMPLEX128);
+    if (is_complex != complex || (is_complex && scaled)) {
+        return nullptr;
+    }
+    auto const element = ElementSize(nii->m_datatype);
+    auto const n_bytes =
+        element * nii->m_dims[0] * nii->m_dims[1] * nii->m_dims[2] * nii->m_dims[3];
+    if (element == 0 || offset < 348 || offset % 8 || offset + n_bytes > nii->m_size) {
+        return nullptr;
+    }
+    nii->m_data    = bytes + offset;
+    nii->m_element = element;
+    return nii;
+}
+
+NiftiMap::~NiftiMap() {
+    munmap(m_map, m_size);
+}
+
+/*
+ *  Start paging in the slices that are about to be read. A full read is one contiguous range, but
+ *  a slab is a separate range in every volume, and advising the whole file would pull in slabs
+ *  that streaming is trying to keep out of memory.
+ */
+void NiftiMap::advise(std::int64_t const z_begin, std::int64_t const z_end) const {
+    auto const page   = static_cast<std::int64_t>(sysconf(_SC_PAGESIZE));
+    auto const base   = static_cast<char const *>(m_map);
+    auto const slice  = m_element * m_dims[0] * m_dims[1];
+    auto const volume = slice * m_dims[2];
+    auto const range  = [&](std::int64_t const begin, std::int64_t const length) {
+        auto const first = ((m_data - base) + begin) / page * page;
+        auto const last  = (m_data - base) + begin + length;
+        madvise(const_cast<char *>(base) + first, last - first, MADV_WILLNEED);
+    };
+    if (z_begin == 0 && z_end == m_dims[2]) {
+        range(0, volume * m_dims[3]);
+    } else {
+        for (std::int64_t v = 0; v < m_dims[3]; v++) {
+            range(v * volume + slice * z_begin, slice * (z_end - z_begin));
+        }
+    }
+}
+
+namespace {
+template <typename TOut>
+void ReadReal(char const *       data,
+              int const          datatype,
+              std::int64_t const n_voxels,
+              std::int64_t const first,
+              std::int64_t const count,
+              std::int64_t const n_volumes,
+              double const       slope,
+              double const       inter,
+              TOut *             out) {
+    switch (datatype) {
+    case UINT8:
+        return Transpose<std::uint8_t>(data, n_voxels, first, count, n_volumes, slope, inter, out);
+    case INT8:
+        return Transpose<std::int8_t>(data, n_voxels, first, count, n_volumes, slope, inter, out);
+    case INT16:
+        return Transpose<std::int16_t>(data, n_voxels, first, count, n_volumes, slope, inter, out);
+    case UINT16:
+        return Transpose<std::uint16_t>(
+            data, n_voxels, first, count, n_volumes, slope, inter, out);
+    case INT32:
+        return Transpose<std::int32_t>(data, n_voxels, first, count, n_volumes, slope, inter, out);
+    case UINT32:
+        return Transpose<std::uint32_t>(
+            data, n_voxels, first, count, n_volumes, slope, inter, out);
+    case FLOAT32:
+        return Transpose<float>(data, n_voxels, first, count, n_volumes, slope, inter, out);
+    case FLOAT64:
+        return Transpose<double>(data, n_voxels, first, count, n_volumes, slope, inter, out);
+    }
+}
+
+template <typename TOut>
+void ReadComplex(char const *       data,
+                 int const          datatype,
+                 std::int64_t const n_voxels,
+                 std::int64_t const first,
+                 std::int64_t const count,
+                 std::int64_t const n_volumes,
+                 TOut *             out) {
+    switch (datatype) {
+    case COMPLEX64:
+        return Transpose<std::complex<float>>(data, n_voxels, first, count, n_volumes, 1., 0., out);
+    case COMPLEX128:
+        return Transpose<std::complex<double>>(
+            data, n_voxels, first, count, n_volumes, 1., 0., out);
+    }
+}
+} // namespace
+
+void NiftiMap::read(float *out, std::int64_t const z_begin, std::int64_t const z_end) const {
+    advise(z_begin, z_end);
+    auto const slice = m_dims[0] * m_dims[1];
+    ReadReal(m_data,
+             m_datatype,
+             slice * m_dims[2],
+             slice * z_begin,
+             slice * (z_end - z_begin),
+             m_dims[3],
+             m_slope,
+             m_inter,
+             out);
+}
+
+void NiftiMap::read(double *out, std::int64_t const z_begin, std::int64_t const z_end) const {
+    advise(z_begin, z_end);
+    auto const slice = m_dims[0] * m_dims[1];
+    ReadReal(m_data,
+             m_datatype,
+             slice * m_dims[2],
+             slice * z_begin,
+             slice * (z_end - z_begin),
+             m_dims[3],
+             m_slope,
+             m_inter,
+             out);
+}
+
+void NiftiMap::read(std::complex<float> *out,
+                    std::int64_t const   z_begin,
+                    std::int64_t const   z_end) const {
+    advise(z_begin, z_end);
+    auto const slice = m_dims[0] * m_dims[1];
+    ReadComplex(m_data,
+                m_datatype,
+                slice * m_dims[2],
+                slice * z_begin,
+                slice * (z_end - z_begin),
+                m_dims[3],
+                out);
+}
+
+void NiftiMap::read(std::complex<double> *out,
+                    std::int64_t const    z_begin,
+                    std::int64_t const    z_end) const {
+    advise(z_begin, z_end);
+    auto const slice = m_dims[0] * m_dims[1];
+    ReadComplex(m_data,
+                m_datatype,
+                slice * m_dims[2],
+                slice * z_begin,
+                slice * (z_end - z_begin),
+                m_dims[3],
+                out);
+}
+
+} // namespace QI
@@ -0,0 +1,65 @@
+#pragma once
+/*
+ *  NiftiMap.h
+ *
+ *  Copyright (c) 2026 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <complex>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace QI {
+
+/*
+ *  An uncompressed, native-endian NIfTI-1 or NIfTI-2 file mapped read-only into memory.
+ *
+ *  NIfTI stores a series volume by volume, but a VectorImage keeps all the volumes for a voxel
+ *  together. read() does that transpose directly from the mapped pages into the output buffer in
+ *  cache-sized tiles, so there are no intermediate images and the data is only held once.
+ */
+class NiftiMap {
+  public:
+    /*
+     *  Returns nullptr if the file cannot be mapped (compressed, byte-swapped, more than 4
+     *  dimensions, or a datatype that does not match complex), so the caller can fall back to ITK
+     */
+    static std::unique_ptr<NiftiMap> Open(std::string const &path, bool const complex);
+    ~NiftiMap();
+    NiftiMap(NiftiMap const &) = delete;
+    NiftiMap &operator=(NiftiMap const &) = delete;
+
+    std::int64_t size(int const d) const { return m_dims[d]; } // x, y, z
+    std::int64_t volumes() const { return m_dims[3]; }
+
+    /*
+     *  Read slices [z_begin, z_end) of every volume into out, voxel-major, applying the scaling
+     *  from the header to real data.
+     */
+    void read(float *out, std::int64_t const z_begin, std::int64_t const z_end) const;
+    void read(double *out, std::int64_t const z_begin, std::int64_t const z_end) const;
+    void
+    read(std::complex<float> *out, std::int64_t const z_begin, std::int64_t const z_end) const;
+    void
+    read(std::complex<double> *out, std::int64_t const z_begin, std::int64_t const z_end) const;
+
+  private:
+    NiftiMap() = default;
+    void advise(std::int64_t const z_begin, std::int64_t const z_end) const;
+
+    void *       m_map  = nullptr;
+    std::size_t  m_size = 0;
+    char const * m_data = nullptr;
+    std::int64_t m_dims[4];
+    int          m_datatype;
+    std::int64_t m_element;
+    double       m_slope, m_inter;
+};
+
+} // namespace QI
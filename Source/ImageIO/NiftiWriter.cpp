@@ -0,0 +1,210 @@
+/*
+ *  NiftiWriter.cpp
+ *
+ *  Copyright (c) 2026 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include "NiftiWriter.h"
+#include "Log.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace QI {
+
+namespace {
+std::int64_t const HeaderBytes = 352; // NIfTI-1 header plus the empty extension flag
+
+template <typename T> void Put(char *bytes, std::size_t const offset, T const value) {
+    std::memcpy(bytes + offset, &value, sizeof(T));
+}
+
+double Determinant(std::array<std::array<double, 3>, 3> const &r) {
+    return r[0][0] * (r[1][1] * r[2][2] - r[1][2] * r[2][1]) -
+           r[0][1] * (r[1][0] * r[2][2] - r[1][2] * r[2][0]) +
+           r[0][2] * (r[1][0] * r[2][1] - r[1][1] * r[2][0]);
+}
+
+/*
+ *  Quaternion for a rotation matrix, as nifti_mat44_to_quatern. A left-handed matrix has its
+ *  third column flipped first, which the caller records in qfac.
+ */
+std::array<double, 3> Quaternion(std::array<std::array<double, 3>, 3> r) {
+    if (Determinant(r) < 0) {
+        for (int i = 0; i < 3; i++) {
+            r[i][2] = -r[i][2];
+        }
+    }
+    double a = r[0][0] + r[1][1] + r[2][2] + 1., b, c, d;
+    if (a > 0.5) {
+        a = 0.5 * std::sqrt(a);
+        b = 0.25 * (r[2][1] - r[1][2]) / a;
+        c = 0.25 * (r[0][2] - r[2][0]) / a;
+        d = 0.25 * (r[1][0] - r[0][1]) / a;
+    } else {
+        double const xd = 1. + r[0][0] - (r[1][1] + r[2][2]);
+        double const yd = 1. + r[1][1] - (r[0][0] + r[2][2]);
+        double const zd = 1. + r[2][2] - (r[0][0] + r[1][1]);
+        if (xd > 1.) {
+            b = 0.5 * std::sqrt(xd);
+            c = 0.25 * (r[0][1] + r[1][0]) / b;
+            d = 0.25 * (r[0][2] + r[2][0]) / b;
+            a = 0.25 * (r[2][1] - r[1][2]) / b;
+        } else if (yd > 1.) {
+            c = 0.5 * std::sqrt(yd);
+            b = 0.25 * (r[0][1] + r[1][0]) / c;
+            d = 0.25 * (r[1][2] + r[2][1]) / c;
+            a = 0.25 * (r[0][2] - r[2][0]) / c;
+        } else {
+            d = 0.5 * std::sqrt(zd);
+            b = 0.25 * (r[0][2] + r[2][0]) / d;
+            c = 0.25 * (r[1][2] + r[2][1]) / d;
+            a = 0.25 * (r[1][0] - r[0][1]) / d;
+        }
+        if (a < 0.) {
+            b = -b;
+            c = -c;
+            d = -d;
+        }
+    }
+    return {b, c, d};
+}
+
+// pwrite() may write less than asked for, or be interrupted by a signal, so keep going
+bool WriteAll(int const fd, char const *data, std::int64_t bytes, std::int64_t offset) {
+    while (bytes > 0) {
+        ssize_t const n = pwrite(fd, data, bytes, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        data += n;
+        bytes -= n;
+        offset += n;
+    }
+    return true;
+}
+} // namespace
+
+NiftiWriter::NiftiWriter(std::string const &path,
+                         Geometry const &   g,
+                         int const          datatype,
+                         int const          element_size,
+                         bool const         keep) :
+    m_geometry{g},
+    m_element(element_size) {
+    for (auto const s : g.size) {
+        if (s > std::numeric_limits<std::int16_t>::max()) {
+            QI::Fail("Image dimension {} is too large for NIfTI-1", s);
+        }
+    }
+    auto const data_bytes = g.size[0] * g.size[1] * g.size[2] * g.size[3] * m_element;
+    if (keep) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 ||
+            static_cast<std::size_t>(st.st_size) != HeaderBytes + data_bytes) {
+            QI::Fail("{} is missing or the wrong size to continue writing", path);
+        }
+    }
+    m_fd = open(path.c_str(), O_WRONLY | O_CREAT | (keep ? 0 : O_TRUNC), 0644);
+    if (m_fd < 0) {
+        QI::Fail("Could not open {} for writing", path);
+    }
+
+    // NIfTI is RAS and ITK is LPS, so the first two rows of the transform change sign
+    std::array<std::array<double, 3>, 3> r;
+    std::array<double, 3>                offset;
+    for (int i = 0; i < 3; i++) {
+        double const flip = (i < 2) ? -1. : 1.;
+        offset[i]         = flip * g.origin[i];
+        for (int j = 0; j < 3; j++) {
+            r[i][j] = flip * g.direction[i][j];
+        }
+    }
+    double const det = Determinant(r);
+    auto const   q   = Quaternion(r);
+
+    char header[HeaderBytes] = {};
+    Put<std::int32_t>(header, 0, 348);
+    header[38] = 'r';
+    Put<std::int16_t>(header, 40, (g.size[3] > 1) ? 4 : 3);
+    for (int i = 0; i < 7; i++) {
+        Put<std::int16_t>(header, 42 + 2 * i, (i < 4) ? g.size[i] : 1);
+    }
+    Put<std::int16_t>(header, 70, datatype);
+    Put<std::int16_t>(header, 72, 8 * element_size);
+    Put<float>(header, 76, (det < 0) ? -1.f : 1.f); // qfac
+    for (int i = 0; i < 3; i++) {
+        Put<float>(header, 80 + 4 * i, g.spacing[i]);
+    }
+    Put<float>(header, 92, 1.f);
+    Put<float>(header, 108, HeaderBytes);
+    Put<float>(header, 112, 1.f);
+    header[123] = 2 | 8; // mm and s
+    Put<std::int16_t>(header, 252, 1); // Scanner anatomical for both qform and sform
+    Put<std::int16_t>(header, 254, 1);
+    for (int i = 0; i < 3; i++) {
+        Put<float>(header, 256 + 4 * i, q[i]);
+        Put<float>(header, 268 + 4 * i, offset[i]);
+        for (int j = 0; j < 3; j++) {
+            Put<float>(header, 280 + 16 * i + 4 * j, r[i][j] * g.spacing[j]);
+        }
+        Put<float>(header, 292 + 16 * i, offset[i]);
+    }
+    std::memcpy(header + 344, "n+1", 4);
+
+    if (!WriteAll(m_fd, header, HeaderBytes, 0) ||
+        ftruncate(m_fd, HeaderBytes + data_bytes) != 0) {
+        QI::Fail("Could not create {}", path);
+    }
+}
+
+NiftiWriter::~NiftiWriter() {
+    close(m_fd);
+}
+
+void NiftiWriter::write(void const *data, std::int64_t const z_begin, std::int64_t const z_end) {
+    auto const  slice     = m_geometry.size[0] * m_geometry.size[1];
+    auto const  n_voxels  = slice * m_geometry.size[2];
+    auto const  n_volumes = m_geometry.size[3];
+    auto const  count     = slice * (z_end - z_begin);
+    auto const *in        = static_cast<char const *>(data);
+
+    // Volume-major on disk, so each volume of the slab is gathered and written separately
+    std::vector<char> volume(n_volumes > 1 ? count * m_element : 0);
+    for (std::int64_t v = 0; v < n_volumes; v++) {
+        char const *out = in;
+        if (n_volumes > 1) {
+            for (std::int64_t x = 0; x < count; x++) {
+                std::memcpy(
+                    &volume[x * m_element], in + (x * n_volumes + v) * m_element, m_element);
+            }
+            out = volume.data();
+        }
+        auto const bytes  = count * m_element;
+        auto const offset = HeaderBytes + (v * n_voxels + z_begin * slice) * m_element;
+        if (!WriteAll(m_fd, out, bytes, offset)) {
+            QI::Fail("Failed to write slices {}-{}", z_begin, z_end);
+        }
+    }
+}
+
+void NiftiWriter::sync() {
+    if (fdatasync(m_fd) != 0) {
+        QI::Fail("Failed to sync output to disk");
+    }
+}
+
+} // namespace QI
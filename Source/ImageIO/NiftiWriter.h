@@ -0,0 +1,101 @@
+#pragma once
+/*
+ *  NiftiWriter.h
+ *
+ *  Copyright (c) 2026 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <array>
+#include <complex>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+#include "itkVectorImage.h"
+
+namespace QI {
+
+template <typename T> struct NiftiDatatype;
+template <> struct NiftiDatatype<std::uint8_t> { static constexpr int value = 2; };
+template <> struct NiftiDatatype<std::int16_t> { static constexpr int value = 4; };
+template <> struct NiftiDatatype<std::int32_t> { static constexpr int value = 8; };
+template <> struct NiftiDatatype<float> { static constexpr int value = 16; };
+template <> struct NiftiDatatype<std::complex<float>> { static constexpr int value = 32; };
+template <> struct NiftiDatatype<double> { static constexpr int value = 64; };
+template <> struct NiftiDatatype<std::complex<double>> { static constexpr int value = 1792; };
+
+/*
+ *  Writes an uncompressed NIfTI-1 file a slab of slices at a time, so an image never has to be
+ *  held in memory all at once. The file is created full size and zero-filled, and each slab is
+ *  written into place. With keep, an existing file of the right size is reopened as it is, so a
+ *  stopped job can fill in the remaining slabs. Slabs come from images (or VectorImages, which
+ *  become 4D) whose buffered region is part of the largest possible region.
+ */
+class NiftiWriter {
+  public:
+    struct Geometry {
+        std::array<std::int64_t, 4>          size; // x, y, z, volumes
+        std::array<double, 3>                spacing, origin;
+        std::array<std::array<double, 3>, 3> direction; // ITK (LPS) convention
+    };
+
+    NiftiWriter(std::string const &path,
+                Geometry const &   geometry,
+                int const          datatype,
+                int const          element_size,
+                bool const         keep = false);
+    ~NiftiWriter();
+    NiftiWriter(NiftiWriter const &) = delete;
+    NiftiWriter &operator=(NiftiWriter const &) = delete;
+
+    template <typename TImg>
+    static std::unique_ptr<NiftiWriter>
+    Create(std::string const &path, TImg const *img, bool const keep = false) {
+        using TPixel      = typename TImg::InternalPixelType;
+        auto const region = img->GetLargestPossibleRegion();
+        Geometry   g;
+        for (int i = 0; i < 3; i++) {
+            g.size[i]    = region.GetSize()[i];
+            g.spacing[i] = img->GetSpacing()[i];
+            g.origin[i]  = img->GetOrigin()[i];
+            for (int j = 0; j < 3; j++) {
+                g.direction[i][j] = img->GetDirection()[i][j];
+            }
+        }
+        // Scalar images can report more than one component, e.g. two for complex
+        if constexpr (std::is_same_v<TImg, itk::VectorImage<TPixel, 3>>) {
+            g.size[3] = img->GetNumberOfComponentsPerPixel();
+        } else {
+            g.size[3] = 1;
+        }
+        return std::make_unique<NiftiWriter>(
+            path, g, NiftiDatatype<TPixel>::value, static_cast<int>(sizeof(TPixel)), keep);
+    }
+
+    template <typename TImg> void write(TImg const *slab) {
+        auto const buffered = slab->GetBufferedRegion();
+        auto const z0 = buffered.GetIndex()[2] - slab->GetLargestPossibleRegion().GetIndex()[2];
+        write(slab->GetBufferPointer(), z0, z0 + buffered.GetSize()[2]);
+    }
+
+    /*
+     *  Write slices [z_begin, z_end) from a voxel-major buffer, i.e. all the volumes for a voxel
+     *  are contiguous
+     */
+    void write(void const *data, std::int64_t const z_begin, std::int64_t const z_end);
+
+    void sync(); // Make sure everything written so far is on disk
+
+  private:
+    int         m_fd;
+    Geometry    m_geometry;
+    std::size_t m_element;
+};
+
+} // namespace QI
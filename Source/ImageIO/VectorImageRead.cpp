@@ -14,11 +14,61 @@
 #include "ImageIO.h"
 #include "ImageToVectorFilter.h"
 #include "Log.h"
+#include "NiftiMap.h"
 #include "itkImageFileReader.h"
+#include "itkNiftiImageIO.h"
+#include <algorithm>
 #include <string>
+#include <type_traits>
 
 namespace QI {
 
+/*
+ *  An image with the geometry and number of volumes of a mapped file, but no buffer
+ */
+template <typename TVectorImg>
+auto MappedGeometry(const NiftiMap &nii, const std::string &path) ->
+    typename TVectorImg::Pointer {
+    // Let ITK work out the orientation so it matches the other images exactly
+    auto io = itk::NiftiImageIO::New();
+    io->SetFileName(path);
+    io->ReadImageInformation();
+
+    typename TVectorImg::RegionType    region;
+    typename TVectorImg::SpacingType   spacing;
+    typename TVectorImg::PointType     origin;
+    typename TVectorImg::DirectionType direction;
+    for (unsigned int i = 0; i < 3; i++) {
+        region.GetModifiableSize()[i] = nii.size(i);
+        spacing[i]                    = io->GetSpacing(i);
+        origin[i]                     = io->GetOrigin(i);
+        auto const axis               = io->GetDirection(i);
+        for (unsigned int j = 0; j < 3; j++) {
+            direction[j][i] = axis[j];
+        }
+    }
+    auto vols = TVectorImg::New();
+    vols->SetRegions(region);
+    vols->SetSpacing(spacing);
+    vols->SetOrigin(origin);
+    vols->SetDirection(direction);
+    vols->SetNumberOfComponentsPerPixel(nii.volumes());
+    return vols;
+}
+
+/*
+ *  Uncompressed NIfTI is transposed straight from the mapped file into the output, the ITK path
+ *  below holds the 4D image, the extracted volumes and the output at once
+ */
+template <typename TVectorImg>
+auto ReadMappedImage(const NiftiMap &nii, const std::string &path) ->
+    typename TVectorImg::Pointer {
+    auto vols = MappedGeometry<TVectorImg>(nii, path);
+    vols->Allocate();
+    nii.read(vols->GetBufferPointer(), 0, nii.size(2));
+    return vols;
+}
+
 template <typename TVectorImg>
 auto ReadImage(const std::string &path, const bool verbose) -> typename TVectorImg::Pointer {
 
@@ -27,6 +77,11 @@ auto ReadImage(const std::string &path, const bool verbose) -> typename TVectorI
     using TReader   = itk::ImageFileReader<TSeries>;
     using TToVector = itk::ImageToVectorFilter<TSeries>;
 
+    if (auto const nii = NiftiMap::Open(path, !std::is_arithmetic_v<TPixel>)) {
+        QI::Log(verbose, "Reading mapped image: {}", path);
+        return ReadMappedImage<TVectorImg>(*nii, path);
+    }
+
     auto file = TReader::New();
     file->SetFileName(path);
     QI::Log(verbose, "Reading image: {}", path);
@@ -44,6 +99,53 @@ auto ReadImage(const std::string &path, const bool verbose) -> typename TVectorI
     return vols;
 }
 
+template <typename TVectorImg>
+SlabReader<TVectorImg>::SlabReader(const std::string &path, const bool verbose) :
+    m_map{NiftiMap::Open(path, !std::is_arithmetic_v<typename TVectorImg::InternalPixelType>)} {
+    if (m_map) {
+        QI::Log(verbose, "Mapping image: {}", path);
+        m_image = MappedGeometry<TVectorImg>(*m_map, path);
+    } else {
+        QI::Log(verbose, "Cannot map {}, reading all of it", path);
+        m_image = ReadImage<TVectorImg>(path, verbose);
+    }
+}
+
+template <typename TVectorImg> SlabReader<TVectorImg>::~SlabReader() = default;
+
+template <typename TVectorImg>
+auto SlabReader<TVectorImg>::read(const typename TVectorImg::RegionType &slab) const ->
+    typename TVectorImg::Pointer {
+    auto const whole = m_image->GetLargestPossibleRegion();
+    if (!whole.IsInside(slab) || slab.GetSize()[0] != whole.GetSize()[0] ||
+        slab.GetSize()[1] != whole.GetSize()[1]) {
+        QI::Fail("Slab must be whole slices inside the image");
+    }
+    auto const n_volumes = m_image->GetNumberOfComponentsPerPixel();
+    auto       vols      = TVectorImg::New();
+    vols->CopyInformation(m_image);
+    vols->SetBufferedRegion(slab);
+    vols->SetRequestedRegion(slab);
+    vols->SetNumberOfComponentsPerPixel(n_volumes);
+    vols->Allocate();
+
+    auto const z_begin = slab.GetIndex()[2] - whole.GetIndex()[2];
+    auto const z_end   = z_begin + slab.GetSize()[2];
+    if (m_map) {
+        m_map->read(vols->GetBufferPointer(), z_begin, z_end);
+    } else {
+        // Whole slices are contiguous, and so is a run of them
+        auto const slice = whole.GetSize()[0] * whole.GetSize()[1] * n_volumes;
+        std::copy(m_image->GetBufferPointer() + z_begin * slice,
+                  m_image->GetBufferPointer() + z_end * slice,
+                  vols->GetBufferPointer());
+    }
+    return vols;
+}
+
+template class SlabReader<QI::VectorVolumeF>;
+template class SlabReader<QI::VectorVolumeXF>;
+
 template auto ReadImage<QI::VectorVolumeF>(const std::string &path, const bool verbose)
     -> QI::VectorVolumeF::Pointer;
 template auto ReadImage<QI::VectorVolumeXF>(const std::string &path, const bool verbose)
@@ -98,6 +98,7 @@ int lorentzian_main(args::Subparser &parser) {
     args::ValueFlag<int>          pools(
         parser, "POOLS", "Number of Lorentzians to fit, default 1", {'p', "pools"}, 1);
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     args::Flag additive(
         parser, "ADDITIVE", "Use an additive model instead of subtractive", {'a', "add"}, false);
     args::ValueFlag<double> Zref(
@@ -182,6 +183,15 @@ int lorentzian_main(args::Subparser &parser) {
             auto fit_filter =
                 QI::ModelFitFilter<LFit>::New(
                     &fit, verbose, covar, resids, threads.Get(), subregion.Get());
+            fit_filter->SetBatchSize(batch.Get());
+            fit_filter->SetDynamicSchedule(dynamic.Get());
+            fit_filter->SetStreamSlabs(stream_slabs.Get());
+            fit_filter->SetCheckpoint(resume.Get(),
+                                      fmt::format("{} pools: {} additive: {} Zref: {}",
+                                                  input.dump(),
+                                                  pools.Get(),
+                                                  additive.Get(),
+                                                  Zref.Get()));
             fit_filter->ReadInputs({input_path.Get()}, {}, mask.Get());
             fit_filter->Update();
             fit_filter->WriteOutputs(prefix.Get() + "LTZ_");
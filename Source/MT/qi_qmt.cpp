@@ -28,10 +28,9 @@
 using namespace std::literals;
 
 struct RamaniModel : QI::Model<double, double, 5, 3, 1, 2> {
-    QI::ZSpecSequence const &                  sequence;
-    ParameterType const                        R1_b;
-    QI::Lineshapes const                       lineshape;
-    std::shared_ptr<QI::InterpLineshape> const interp = nullptr;
+    QI::ZSpecSequence const &sequence;
+    ParameterType const      R1_b;
+    QI::Lineshape const      lineshape;
 
     std::array<const std::string, NV> const varying_names{
         {"M0_f"s, "f_b"s, "T2_b"s, "T2_f"s, "k"s}};
@@ -58,21 +57,7 @@ struct RamaniModel : QI::Model<double, double, 5, 3, 1, 2> {
         auto const &B1     = f[1];
         auto const &T1_obs = f[2];
 
-        QI_ARRAY(typename Derived::Scalar) lsv;
-        switch (lineshape) {
-        case QI::Lineshapes::Gaussian:
-            lsv = QI::Gaussian((sequence.sat_f0 + f0), T2b);
-            break;
-        case QI::Lineshapes::Lorentzian:
-            lsv = QI::Lorentzian((sequence.sat_f0 + f0), T2b);
-            break;
-        case QI::Lineshapes::SuperLorentzian:
-            lsv = QI::SuperLorentzian((sequence.sat_f0 + f0), T2b);
-            break;
-        case QI::Lineshapes::Interpolated:
-            lsv = (*interp)((sequence.sat_f0 + f0), T2b);
-            break;
-        }
+        QI_ARRAY(typename Derived::Scalar) const lsv = lineshape((sequence.sat_f0 + f0), T2b);
 
         auto const w_cwpe = (B1 * sequence.sat_angle / sequence.pulse.p1) *
                             sqrt(sequence.pulse.p2 / (sequence.Trf * sequence.TR));
@@ -122,42 +107,28 @@ using RamaniFitFunction = QI::ScaledAutoDiffFit<RamaniModel>;
 int qmt_main(args::Subparser &parser) {
     args::Positional<std::string> mtsat_path(parser, "MTSAT FILE", "Path to MT-Sat data");
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     args::ValueFlag<std::string> T1(parser, "T1", "T1 map (seconds) file ** REQUIRED **", {"T1"});
     args::ValueFlag<std::string> f0(parser, "f0", "f0 map (Hz) file", {'f', "f0"});
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio) file", {'b', "B1"});
     args::ValueFlag<std::string> lineshape_arg(
         parser,
         "LINESHAPE",
-        "Either Gaussian, Lorentzian, Superlorentzian, or a .json file generated by qi_lineshape",
+        "Either Gaussian, Lorentzian, SuperLorentzian, or a .json file generated by qi_lineshape",
         {'l', "lineshape"},
         "Gaussian");
     args::ValueFlag<float> R1_b(
         parser, "R1b", "R1 (not T1) of the bound pool. Default 2.5s^-1", {'r', "R1b"}, 2.5f);
+    args::ValueFlag<std::string> solver(
+        parser, "SOLVER", "Non-linear solver, ceres or lm (default ceres)", {"solver"}, "ceres");
     parser.Parse();
     QI::CheckPos(mtsat_path);
     QI::Log(verbose, "Reading sequence information");
-    json           input = json_file ? QI::ReadJSON(json_file.Get()) : QI::ReadJSON(std::cin);
-    auto           mtsat_sequence = input.at("MTSat").get<QI::ZSpecSequence>();
-    QI::Lineshapes lineshape;
-    std::shared_ptr<QI::InterpLineshape> interp = nullptr;
-    if (lineshape_arg.Get() == "Gaussian") {
-        QI::Log(verbose, "Using a Gaussian lineshape");
-        lineshape = QI::Lineshapes::Gaussian;
-    } else if (lineshape_arg.Get() == "Lorentzian") {
-        QI::Log(verbose, "Using a Lorentzian lineshape");
-        lineshape = QI::Lineshapes::Lorentzian;
-    } else if (lineshape_arg.Get() == "Superlorentzian") {
-        QI::Log(verbose, "Using a Super-Lorentzian lineshape");
-        lineshape = QI::Lineshapes::SuperLorentzian;
-    } else {
-        QI::Log(verbose, "Reading lineshape file: {}", lineshape_arg.Get());
-        json ls_file = QI::ReadJSON(lineshape_arg.Get());
-        interp       = std::make_shared<QI::InterpLineshape>(
-            ls_file.at("lineshape").get<QI::InterpLineshape>());
-        lineshape = QI::Lineshapes::Interpolated;
-    }
+    json       input = json_file ? QI::ReadJSON(json_file.Get()) : QI::ReadJSON(std::cin);
+    auto       mtsat_sequence = input.at("MTSat").get<QI::ZSpecSequence>();
+    auto const lineshape      = QI::ReadLineshape(lineshape_arg.Get(), verbose);
 
-    RamaniModel model{{}, mtsat_sequence, R1_b.Get(), lineshape, interp};
+    RamaniModel model{{}, mtsat_sequence, R1_b.Get(), lineshape};
     if (simulate) {
         QI::SimulateModel<RamaniModel, false>(input,
                                               model,
@@ -170,9 +141,19 @@ int qmt_main(args::Subparser &parser) {
                                               subregion.Get());
     } else {
         RamaniFitFunction fit{model};
+        fit.solver = QI::ParseNLLSSolver(solver.Get());
 
         auto fit_filter = QI::ModelFitFilter<RamaniFitFunction>::New(
             &fit, verbose, covar, resids, threads.Get(), subregion.Get());
+        fit_filter->SetBatchSize(batch.Get());
+        fit_filter->SetDynamicSchedule(dynamic.Get());
+        fit_filter->SetStreamSlabs(stream_slabs.Get());
+        fit_filter->SetCheckpoint(resume.Get(),
+                                  fmt::format("{} lineshape: {} R1b: {} solver: {}",
+                                              input.dump(),
+                                              lineshape_arg.Get(),
+                                              R1_b.Get(),
+                                              solver.Get()));
         fit_filter->ReadInputs(
             {mtsat_path.Get()}, {f0.Get(), B1.Get(), QI::CheckValue(T1)}, mask.Get());
         fit_filter->Update();
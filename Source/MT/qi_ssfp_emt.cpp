@@ -186,6 +186,7 @@ int ssfp_emt_main(args::Subparser &parser) {
     args::Positional<std::string> b_path(parser, "b_FILE", "Input b file");
 
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio)", {'b', "B1"});
     args::ValueFlag<std::string> T2_f(parser, "T2f", "T2 Free map (for simulation only)", {"T2f"});
     args::ValueFlag<double>      G0(
@@ -244,6 +245,10 @@ int ssfp_emt_main(args::Subparser &parser) {
         auto   fit_filter =
             QI::ModelFitFilter<EMTFit>::New(
                 &fit, verbose, covar, resids, threads.Get(), subregion.Get());
+        fit_filter->SetBatchSize(batch.Get());
+        fit_filter->SetDynamicSchedule(dynamic.Get());
+        fit_filter->SetStreamSlabs(stream_slabs.Get());
+        fit_filter->SetCheckpoint(resume.Get(), fmt::format("{} G0: {}", input.dump(), G0.Get()));
         fit_filter->ReadInputs(
             {G_path.Get(), a_path.Get(), b_path.Get()}, {B1.Get(), ""}, mask.Get());
         fit_filter->SetFixed(1, T2_f_calc);
@@ -31,10 +31,15 @@
 int ss_main(args::Subparser &parser) {
     args::Positional<std::string> input_path(parser, "INPUT", "Input MUPA file");
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     args::Flag                   T2(parser, "T2", "Fit T2 model", {"T2"});
     args::Flag                   MT(parser, "MT", "Fit MT model", {"MT"});
     args::ValueFlag<std::string> ls_arg(
-        parser, "LINESHAPE", "Path to lineshape file", {"lineshape"});
+        parser,
+        "LINESHAPE",
+        "Gaussian, Lorentzian, SuperLorentzian or path to lineshape file",
+        {"lineshape"},
+        "SuperLorentzian");
     parser.Parse();
     QI::CheckPos(input_path);
     QI::Log(verbose, "Reading sequence parameters");
@@ -61,6 +66,15 @@ int ss_main(args::Subparser &parser) {
             auto fit_filter =
                 QI::ModelFitFilter<FitType>::New(
                     &fit, verbose, covar, resids, threads.Get(), subregion.Get());
+            fit_filter->SetBatchSize(batch.Get());
+            fit_filter->SetDynamicSchedule(dynamic.Get());
+            fit_filter->SetStreamSlabs(stream_slabs.Get());
+            fit_filter->SetCheckpoint(resume.Get(),
+                                      fmt::format("{} T2: {} MT: {} lineshape: {}",
+                                                  doc.dump(),
+                                                  T2.Get(),
+                                                  MT.Get(),
+                                                  ls_arg.Get()));
             fit_filter->ReadInputs({input_path.Get()}, fixed, mask.Get());
             fit_filter->Update();
             fit_filter->WriteOutputs(prefix.Get() + model_name);
@@ -69,9 +83,7 @@ int ss_main(args::Subparser &parser) {
 
     if (MT) {
         QI::Log(verbose, "Using MT model");
-        QI::Log(verbose, "Reading lineshape file: {}", ls_arg.Get());
-        json        ls_file = QI::ReadJSON(ls_arg.Get());
-        SS_MT_Model model{{}, sequence, ls_file.at("lineshape").get<QI::InterpLineshape>()};
+        SS_MT_Model model{{}, sequence, QI::ReadLineshape(ls_arg.Get(), verbose)};
         process(model, "SS_", {});
     } else if (T2) {
         QI::Log(verbose, "Using T2 model");
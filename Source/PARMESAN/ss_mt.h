@@ -5,12 +5,12 @@
 #include "ss_sequence.h"
 
 struct SS_MT_Model : QI::Model<double, double, 8, 0, 1, 1> {
-    static int const    NS = 2;
-    SSSequence &        sequence;
-    QI::InterpLineshape lineshape;
-    VaryingArray const  start{30.0, 3.0, 1.0, 0.1, 12e-6, 30., 0., 1.0};
-    VaryingArray const  lo{0.1, 5e-6, 0.5, 0.005, 5e-6, 1., -250., 0.5};
-    VaryingArray const  hi{60.0, 30.0, 5.0, 5.0, 25e-6, 100., 250., 1.5};
+    static int const   NS = 2;
+    SSSequence &       sequence;
+    QI::Lineshape      lineshape;
+    VaryingArray const start{30.0, 3.0, 1.0, 0.1, 12e-6, 30., 0., 1.0};
+    VaryingArray const lo{0.1, 5e-6, 0.5, 0.005, 5e-6, 1., -250., 0.5};
+    VaryingArray const hi{60.0, 30.0, 5.0, 5.0, 25e-6, 100., 250., 1.5};
 
     std::array<std::string, NV> const varying_names{
         "M0_f", "M0_b", "T1_f", "T2_f", "T2_b", "k", "f0", "B1"};
@@ -31,6 +31,7 @@
 int transient_main(args::Subparser &parser) {
     args::Positional<std::string> input_path(parser, "INPUT", "Input MUPA file");
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     args::Flag                   mt(parser, "MT", "Use MT model", {"mt"});
     args::ValueFlag<double>      T2_b(parser, "T2_b", "T2 of bound pool", {"T2b"}, 12e-6);
     args::ValueFlag<std::string> ls_arg(
@@ -64,6 +65,15 @@ int transient_main(args::Subparser &parser) {
             auto    fit_filter =
                 QI::ModelFitFilter<FitType>::New(
                     &fit, verbose, covar, resids, threads.Get(), subregion.Get());
+            fit_filter->SetBatchSize(batch.Get());
+            fit_filter->SetDynamicSchedule(dynamic.Get());
+            fit_filter->SetStreamSlabs(stream_slabs.Get());
+            fit_filter->SetCheckpoint(resume.Get(),
+                                      fmt::format("{} mt: {} T2b: {} lineshape: {}",
+                                                  doc.dump(),
+                                                  mt.Get(),
+                                                  T2_b.Get(),
+                                                  ls_arg.Get()));
             fit_filter->ReadInputs({input_path.Get()}, fixed, mask.Get());
             fit_filter->Update();
             fit_filter->WriteOutputs(prefix.Get() + model_name);
@@ -10,8 +10,9 @@
  */
 
 #include <Eigen/Dense>
-
-#include "NumericalIntegration.h"
+#include <algorithm>
+#include <limits>
+#include <vector>
 
 // #define QI_DEBUG_BUILD
 
@@ -32,11 +33,116 @@ constexpr double kappa      = 0.03;                // Conversion factor
 constexpr double gyro_gamma = 2 * M_PI * 42.577e6; // Gyromagnetic Ratio
 constexpr double delta_X0   = 0.264e-6;            // Susc diff oxy and fully de-oxy blood
 
-template <typename T> struct fcFunctor {
-    const T &dw, tau;
-    T        operator()(const T u) const {
-        const auto Jterm = ceres::BesselJ0(1.5 * dw * tau * u);
-        return (2. + u) * sqrt(1. - u) * (1. - Jterm) / (u * u);
+/*
+ *  fc(a) = 1/3 * integral from 0 to 1 of (2 + u) * sqrt(1 - u) * (1 - J0(a * u)) / u^2 du, where
+ *  a = 1.5 * dw * tau. Substituting u = 1 - t^2 removes the square-root at u = 1 and leaves a
+ *  smooth integrand, so fixed Gauss-Legendre rules converge quickly and everything except the
+ *  Bessel term can be folded into the weights once. The Bessel term oscillates faster as a grows,
+ *  so there is a ladder of rules that double in order, each used up to the largest a at which it
+ *  agrees with the next to within the tolerance. The last rule is checked against a composite rule
+ *  with panels narrow enough to follow the oscillation, which is also used beyond its range.
+ */
+class FcQuadrature {
+  public:
+    explicit FcQuadrature(double const tolerance) : panel{MakeRule(PanelOrder)} {
+        for (int order = 16; order <= 2048; order *= 2) {
+            rules.push_back(MakeRule(order));
+        }
+        for (size_t r = 0; r < rules.size(); r++) {
+            auto const next = [&](double const a) {
+                return (r + 1 < rules.size()) ? Sum(rules[r + 1], a) : Composite(a);
+            };
+            double a = 0.1;
+            while (a < 1.e5 && std::abs(Sum(rules[r], a) - next(a)) < tolerance) {
+                a *= 1.1;
+            }
+            rules[r].a_max = a / 1.1;
+        }
+    }
+
+    template <typename T> T operator()(T const &a) const {
+        double const av   = std::abs(Value(a));
+        auto const   rule = std::find_if(
+            rules.begin(), rules.end(), [av](Rule const &r) { return av <= r.a_max; });
+        return (rule != rules.end()) ? Sum(*rule, a) : Composite(a);
+    }
+
+  private:
+    struct Rule {
+        std::vector<double> u, g; // Nodes and weights, including 1/3 and the non-Bessel terms
+        std::vector<double> t, w; // Nodes and weights on [0, 1] before the substitution
+        double              a_max = std::numeric_limits<double>::infinity();
+    };
+    static constexpr int PanelOrder = 64;
+    std::vector<Rule>    rules;
+    Rule                 panel;
+
+    static double Weight(double const t, double const w) {
+        double const u = 1. - t * t;
+        return w * 2. * t * t * (3. - t * t) / (3. * u * u);
+    }
+
+    static Rule MakeRule(int const n) {
+        Rule rule;
+        for (int k = 0; k < n; k++) {
+            // Newton's method for the roots of the Legendre polynomial on [-1, 1]
+            double x = std::cos(M_PI * (k + 0.75) / (n + 0.5)), dp = 0.;
+            for (int it = 0; it < 100; it++) {
+                double p0 = 1., p1 = x;
+                for (int j = 2; j <= n; j++) {
+                    double const p2 = ((2. * j - 1.) * x * p1 - (j - 1.) * p0) / j;
+                    p0              = p1;
+                    p1              = p2;
+                }
+                dp              = n * (x * p1 - p0) / (x * x - 1.);
+                double const dx = p1 / dp;
+                x -= dx;
+                if (std::abs(dx) < 1.e-15) {
+                    break;
+                }
+            }
+            double const t = (x + 1.) / 2.;
+            double const w = 1. / ((1. - x * x) * dp * dp); // Half the weight on [-1, 1]
+            rule.t.push_back(t);
+            rule.w.push_back(w);
+            rule.u.push_back(1. - t * t);
+            rule.g.push_back(Weight(t, w));
+        }
+        return rule;
+    }
+
+    static double Value(double const v) { return v; }
+    template <typename J, int N> static double Value(ceres::Jet<J, N> const &v) { return v.a; }
+
+    // 1 - J0 loses all precision for small arguments, and the weights are largest there
+    template <typename T> static T OneMinusJ0(T const &x) {
+        if (std::abs(Value(x)) < 0.1) {
+            T const x2 = x * x;
+            return x2 / 4. * (1. - x2 / 16. * (1. - x2 / 36. * (1. - x2 / 64.)));
+        }
+        return 1. - ceres::BesselJ0(x);
+    }
+
+    template <typename T> static T Sum(Rule const &rule, T const &a) {
+        T sum(0.);
+        for (size_t k = 0; k < rule.u.size(); k++) {
+            sum += rule.g[k] * OneMinusJ0(a * rule.u[k]);
+        }
+        return sum;
+    }
+
+    // The phase a * (1 - t^2) changes by at most 2 * a * h across a panel of width h in t
+    template <typename T> T Composite(T const &a) const {
+        int const    n_panels = std::max(1, static_cast<int>(std::ceil(std::abs(Value(a)) / 8.)));
+        double const h        = 1. / n_panels;
+        T            sum(0.);
+        for (int p = 0; p < n_panels; p++) {
+            for (size_t k = 0; k < panel.t.size(); k++) {
+                double const t = (p + panel.t[k]) * h;
+                sum += Weight(t, panel.w[k] * h) * OneMinusJ0(a * (1. - t * t));
+            }
+        }
+        return sum;
     }
 };
 
@@ -44,6 +150,7 @@ struct ASEModel : QI::Model<double, double, 4, 0, 1, 3> {
     using SequenceType = QI::MultiEchoSequence;
     const SequenceType &sequence;
     const double        B0, Hct;
+    const FcQuadrature  quadrature;
 
     const std::array<const std::string, NV> varying_names{"S0"s, "dT"s, "R2p"s, "DBV"s};
     const std::array<const std::string, ND> derived_names{"Tc"s, "OEF"s, "dHb"s};
@@ -64,17 +171,10 @@ struct ASEModel : QI::Model<double, double, 4, 0, 1, 3> {
         const T &  DBV = varying[3];
         const auto dw  = R2p / DBV;
 
-        Eigen::Integrator<T> integrator(5);
-        const auto           quad_rule = Eigen::Integrator<T>::GaussKronrod15;
-        T                    abs_error{1.e-9};
-        T                    rel_error{1.e-9};
-        const auto           aTE = (sequence.TE + dT).abs();
+        const auto aTE = (sequence.TE + dT).abs();
         QI_ARRAY(T) fc(sequence.size());
         for (int i = 0; i < sequence.size(); i++) {
-            const auto   tau = aTE(i);
-            fcFunctor<T> functor{dw, tau};
-            fc[i] = (1. / 3.) * integrator.quadratureAdaptive(
-                                    functor, T{0.0}, T{1.0}, abs_error, rel_error, quad_rule);
+            fc[i] = quadrature(1.5 * dw * aTE(i));
         }
         QI_ARRAY(T) S = S0 * exp(-DBV * fc);
         return S;
@@ -104,6 +204,7 @@ struct ASEFixDBVModel : QI::Model<double, double, 3, 0, 1, 3> {
     using SequenceType = QI::MultiEchoSequence;
     const SequenceType &sequence;
     const double        B0, Hct, DBV;
+    const FcQuadrature  quadrature;
 
     const std::array<const std::string, NV> varying_names{"S0"s, "dT"s, "R2p"s};
     const std::array<const std::string, ND> derived_names{"Tc"s, "OEF"s, "dHb"s};
@@ -123,17 +224,10 @@ struct ASEFixDBVModel : QI::Model<double, double, 3, 0, 1, 3> {
         const T &  R2p = varying[2];
         const auto dw  = R2p / DBV;
 
-        Eigen::Integrator<T> integrator(5);
-        const auto           quad_rule = Eigen::Integrator<T>::GaussKronrod15;
-        T                    abs_error{1.e-9};
-        T                    rel_error{1.e-9};
-        const auto           aTE = (sequence.TE + dT).abs();
+        const auto aTE = (sequence.TE + dT).abs();
         QI_ARRAY(T) fc(sequence.size());
         for (int i = 0; i < sequence.size(); i++) {
-            const auto   tau = aTE(i);
-            fcFunctor<T> functor{dw, tau};
-            fc[i] = (1. / 3.) * integrator.quadratureAdaptive(
-                                    functor, T{0.0}, T{1.0}, abs_error, rel_error, quad_rule);
+            fc[i] = quadrature(1.5 * dw * aTE(i));
         }
         QI_ARRAY(T) S = S0 * exp(-DBV * fc);
 
@@ -165,17 +259,21 @@ int ase_oef_main(args::Subparser &parser) {
     args::Positional<std::string> input_path(parser, "ASE_FILE", "Input ASE file");
 
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     args::ValueFlag<double> B0(parser, "B0", "Field-strength (Tesla), default 3", {'B', "B0"}, 3.0);
     args::ValueFlag<double> Hct(parser, "HCT", "Hematocrit (default 0.34)", {'h', "Hct"}, 0.34);
     args::ValueFlag<double> DBV(parser, "DBV", "Fix DBV and only fit R2'", {'d', "DBV"}, 0.0);
+    args::ValueFlag<double> tol(
+        parser, "TOL", "Tolerance for the signal integral (default 1e-9)", {"quad_tol"}, 1.e-9);
 
     parser.Parse();
     json input    = json_file ? QI::ReadJSON(json_file.Get()) : QI::ReadJSON(std::cin);
     auto sequence = input.at("MultiEcho").get<QI::MultiEchoSequence>();
+    FcQuadrature const quadrature{tol.Get()};
 
     if (simulate) {
         if (DBV) {
-            ASEFixDBVModel model{{}, sequence, B0.Get(), Hct.Get(), DBV.Get()};
+            ASEFixDBVModel model{{}, sequence, B0.Get(), Hct.Get(), DBV.Get(), quadrature};
             QI::SimulateModel<ASEFixDBVModel, false>(input,
                                                      model,
                                                      {},
@@ -186,7 +284,7 @@ int ase_oef_main(args::Subparser &parser) {
                                                      threads.Get(),
                                                      subregion.Get());
         } else {
-            ASEModel model{{}, sequence, B0.Get(), Hct.Get()};
+            ASEModel model{{}, sequence, B0.Get(), Hct.Get(), quadrature};
             QI::SimulateModel<ASEModel, false>(input,
                                                model,
                                                {},
@@ -201,16 +299,26 @@ int ase_oef_main(args::Subparser &parser) {
         auto process = [&](auto fit_func) {
             auto fit_filter = QI::ModelFitFilter<decltype(fit_func)>::New(
                 &fit_func, verbose, covar, resids, threads.Get(), subregion.Get());
+            fit_filter->SetBatchSize(batch.Get());
+            fit_filter->SetDynamicSchedule(dynamic.Get());
+            fit_filter->SetStreamSlabs(stream_slabs.Get());
+            fit_filter->SetCheckpoint(resume.Get(),
+                                      fmt::format("{} B0: {} Hct: {} DBV: {} tol: {}",
+                                                  input.dump(),
+                                                  B0.Get(),
+                                                  Hct.Get(),
+                                                  DBV.Get(),
+                                                  tol.Get()));
             fit_filter->ReadInputs({QI::CheckPos(input_path)}, {}, mask.Get());
             fit_filter->Update();
             fit_filter->WriteOutputs(prefix.Get() + "ASE_");
         };
         if (DBV) {
-            ASEFixDBVModel model{{}, sequence, B0.Get(), Hct.Get(), DBV.Get()};
+            ASEFixDBVModel model{{}, sequence, B0.Get(), Hct.Get(), DBV.Get(), quadrature};
             ASEFixDBVFit   fit{model};
             process(fit);
         } else {
-            ASEModel model{{}, sequence, Hct.Get(), B0.Get()};
+            ASEModel model{{}, sequence, B0.Get(), Hct.Get(), quadrature};
             ASEFit   fit{model};
             process(fit);
         }
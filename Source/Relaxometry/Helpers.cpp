@@ -9,8 +9,11 @@
  *
  */
 
-#include <limits>
+#include <array>
 #include <cmath>
+#include <limits>
+
+#include "Helpers.h"
 
 namespace QI {
 
@@ -27,4 +30,61 @@ void CalcExchange(const double tau_a, const double f_a, double &f_b, double &k_a
     }
 }
 
+/*
+ * For 2x2 A = m*I + N, where m is half the trace, N is traceless so N^2 = s^2*I with
+ * s^2 = -det(N). Then exp(t*A) = exp(t*m)*(cosh(t*s)*I + sinh(t*s)/s*N), or cos and sin if
+ * the eigenvalues m +/- s are complex. Exchange matrices always have real eigenvalues.
+ */
+Eigen::Matrix2d Exp2(const Eigen::Matrix2d &A, const double t) {
+    const double m = 0.5 * (A(0, 0) + A(1, 1));
+    const Eigen::Matrix2d N = A - m * Eigen::Matrix2d::Identity();
+    const double s2 = N(0, 0) * N(0, 0) + N(0, 1) * N(1, 0);
+    const double ts = t * std::sqrt(std::fabs(s2));
+    double c, sinc; // sinc is sinh(ts)/s or sin(ts)/s
+    if (ts < 1e-6) {
+        c = 1. + 0.5 * t * t * s2;
+        sinc = t * (1. + t * t * s2 / 6.);
+    } else if (s2 > 0) {
+        c = std::cosh(ts);
+        sinc = t * std::sinh(ts) / ts;
+    } else {
+        c = std::cos(ts);
+        sinc = t * std::sin(ts) / ts;
+    }
+    return std::exp(t * m) * (c * Eigen::Matrix2d::Identity() + sinc * N);
+}
+
+/*
+ * The angles for the signal equations are the sequence flip-angles scaled by B1, or the phase
+ * increments offset by f0. B1 and f0 are fixed within a voxel, so during a fit the same few sets
+ * of angles are used for every model evaluation. The last few are kept per thread to skip the trig.
+ * A hit moves the round-robin cursor past its slot, so the next miss cannot overwrite the entry
+ * that was just returned.
+ */
+CosSin const &CachedCosSin(const Eigen::ArrayXd &x, const double scale, const double offset) {
+    struct Entry {
+        Eigen::ArrayXd x;
+        double scale = 0., offset = 0.;
+        CosSin cs;
+    };
+    thread_local std::array<Entry, 4> cache;
+    thread_local size_t next = 0;
+    for (size_t i = 0; i < cache.size(); i++) {
+        Entry const &e = cache[i];
+        if (e.scale == scale && e.offset == offset && e.x.size() == x.size() && (e.x == x).all()) {
+            next = (i + 1) % cache.size();
+            return e.cs;
+        }
+    }
+    Entry &e = cache[next];
+    next = (next + 1) % cache.size();
+    e.x = x;
+    e.scale = scale;
+    e.offset = offset;
+    const Eigen::ArrayXd a = scale * x + offset;
+    e.cs.c = a.cos();
+    e.cs.s = a.sin();
+    return e.cs;
+}
+
 } // End namespace QI
@@ -25,6 +25,15 @@ namespace Eigen {
 namespace QI {
 
 void CalcExchange(const double tau_a, const double f_a, double &f_b, double &k_ab, double &k_ba);
+// Closed-form matrix exponential of t*A, much cheaper than the general Pade approximant
+Eigen::Matrix2d Exp2(const Eigen::Matrix2d &A, const double t);
+
+// cos and sin of (scale * x + offset)
+struct CosSin {
+    Eigen::ArrayXd c, s;
+};
+// The result is a per-thread cache slot, valid until the second call after it on the same thread
+CosSin const &CachedCosSin(const Eigen::ArrayXd &x, const double scale, const double offset = 0.);
 
 } // End namespace QI
 
@@ -1,4 +1,5 @@
 #include "OnePoolSignals.h"
+#include "Helpers.h"
 
 namespace QI {
 
@@ -9,8 +10,9 @@ Eigen::ArrayXcd SPGR1(double const &          PD,
                       double const &          B1,
                       SPGREchoSequence const &s) {
 
-    Eigen::ArrayXd const sa = sin(B1 * s.FA);
-    Eigen::ArrayXd const ca = cos(B1 * s.FA);
+    auto const           &a  = CachedCosSin(s.FA, B1);
+    Eigen::ArrayXd const &sa = a.s;
+    Eigen::ArrayXd const &ca = a.c;
 
     double     E1   = exp(-s.TR / T1);
     auto const echo = std::polar(exp(-s.TE / T2), 2. * M_PI * f0 * s.TE);
@@ -27,20 +29,100 @@ Eigen::ArrayXcd SSFP1(double const &          PD,
     const double E2 = exp(-s.TR / T2);
 
     const double               psi   = 2. * M_PI * f0 * s.TR;
-    const Eigen::ArrayXd       alpha = s.FA * B1;
-    const Eigen::ArrayXd       theta = psi + s.PhaseInc;
-    const Eigen::ArrayXd       d     = (1. - E1 * E2 * E2 - (E1 - E2 * E2) * cos(alpha));
+    const auto                &alpha = CachedCosSin(s.FA, B1);
+    const auto                &theta = CachedCosSin(s.PhaseInc, 1., psi);
+    const Eigen::ArrayXd       d     = (1. - E1 * E2 * E2 - (E1 - E2 * E2) * alpha.c);
     const std::complex<double> echo  = sqrt(E2) * std::polar(1., psi / 2.);
-    const Eigen::ArrayXcd      G     = -PD * echo * (1 - E1) * sin(alpha) / d;
-    const Eigen::ArrayXd       b     = E2 * (1. - E1) * (1. + cos(alpha)) / d;
+    const Eigen::ArrayXcd      G     = -PD * echo * (1 - E1) * alpha.s / d;
+    const Eigen::ArrayXd       b     = E2 * (1. - E1) * (1. + alpha.c) / d;
 
-    Eigen::ArrayXcd et(theta.size());
-    et.real() = cos(-theta);
-    et.imag() = sin(-theta);
+    Eigen::ArrayXcd et(theta.c.size());
+    et.real() = theta.c;
+    et.imag() = -theta.s;
 
-    const Eigen::ArrayXcd M = G * (1. - E2 * et) / (1 - b * cos(theta));
+    const Eigen::ArrayXcd M = G * (1. - E2 * et) / (1 - b * theta.c);
 
     return M;
 }
 
+Eigen::ArrayXd SPGRJacobian(double const        PD,
+                            double const        T1,
+                            double const        B1,
+                            SPGRSequence const &s,
+                            Eigen::ArrayXXd &   J) {
+    auto const          &a  = CachedCosSin(s.FA, B1);
+    double const         E1 = exp(-s.TR / T1);
+    Eigen::ArrayXd const d2 = (1. - E1 * a.c).square();
+    J.col(0)                = (1. - E1) * a.s / (1. - E1 * a.c);
+    J.col(1)                = PD * a.s * (a.c - 1.) / d2 * (E1 * s.TR / (T1 * T1));
+    if (J.cols() > 2) {
+        J.col(2) = PD * (1. - E1) * s.FA * (a.c - E1) / d2;
+    }
+    return PD * J.col(0);
+}
+
+/*
+ *  The signal is linear in M0, and every other quantity is carried along with its derivatives with
+ *  respect to T1 and B1
+ */
+Eigen::ArrayXd MPRAGEJacobian(double const          M0,
+                              double const          T1,
+                              double const          B1,
+                              MPRAGESequence const &s,
+                              Eigen::ArrayXXd &     J) {
+    using Grad       = Eigen::Array2d;
+    double const eta = -1.0;
+    double const TIs = s.TI - s.TR * s.k0;
+    double const ca  = cos(s.FA * B1);
+    double const sa  = sin(s.FA * B1);
+
+    // Rates instead of times, so the readout is R1s = R1 - log(cos(a)) / TR
+    double const R1   = 1. / T1;
+    Grad const   dR1  = {-R1 * R1, 0.};
+    double const R1s  = R1 - log(ca) / s.TR;
+    Grad const   dR1s = {-R1 * R1, s.FA * sa / (ca * s.TR)};
+    auto const   decay = [](double const t, double const R, Grad const &dR, Grad &dE) {
+        double const E = exp(-t * R);
+        dE             = -t * E * dR;
+        return E;
+    };
+
+    Grad         dE, dEs, dB_1, dB_2, dE3, dEk;
+    double const E    = decay(s.TR, R1, dR1, dE);
+    double const Es   = decay(s.TR, R1s, dR1s, dEs);
+    double const M0s  = (1. - E) / (1. - Es);
+    Grad const   dM0s = (M0s * dEs - dE) / (1. - Es);
+
+    double const B_1  = decay(s.ETL * s.TR, R1s, dR1s, dB_1);
+    double const A_1  = M0s * (1. - B_1);
+    Grad const   dA_1 = dM0s * (1. - B_1) - M0s * dB_1;
+    double const B_2  = decay(s.TD, R1, dR1, dB_2);
+    double const A_2  = 1. - B_2;
+    Grad const   dA_2 = -dB_2;
+    double const E3   = decay(TIs, R1, dR1, dE3);
+    double const A_3  = 1. - E3;
+    Grad const   dA_3 = -dE3;
+    double const B_3  = eta * E3;
+    Grad const   dB_3 = eta * dE3;
+
+    double const A  = A_3 + A_2 * B_3 + A_1 * B_2 * B_3;
+    Grad const   dA = dA_3 + dA_2 * B_3 + A_2 * dB_3 + dA_1 * B_2 * B_3 + A_1 * dB_2 * B_3 +
+                    A_1 * B_2 * dB_3;
+    double const B   = B_1 * B_2 * B_3;
+    Grad const   dB  = dB_1 * B_2 * B_3 + B_1 * dB_2 * B_3 + B_1 * B_2 * dB_3;
+    double const M1  = A / (1. - B);
+    Grad const   dM1 = (dA + M1 * dB) / (1. - B);
+
+    double const Ek  = decay(s.k0 * s.TR, R1s, dR1s, dEk);
+    double const Mz  = M0s + (M1 - M0s) * Ek;
+    Grad const   dMz = dM0s + (dM1 - dM0s) * Ek + (M1 - M0s) * dEk;
+
+    J(0, 0) = Mz * sa;
+    J(0, 1) = M0 * dMz[0] * sa;
+    if (J.cols() > 2) {
+        J(0, 2) = M0 * (dMz[1] * sa + Mz * s.FA * ca);
+    }
+    return Eigen::ArrayXd::Constant(1, M0 * J(0, 0));
+}
+
 } // namespace QI
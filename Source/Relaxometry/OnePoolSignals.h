@@ -34,6 +34,21 @@ Eigen::ArrayXcd SSFP1(double const &          PD,
                       double const &          B1,
                       const QI::SSFPSequence &s);
 
+/*
+ *  SPGRSignal() and MPRAGESignal() with their derivatives for fits with analytic Jacobians. J must
+ *  have one row per point and columns for PD and T1, plus B1 if it has a third column.
+ */
+Eigen::ArrayXd SPGRJacobian(double const        PD,
+                            double const        T1,
+                            double const        B1,
+                            SPGRSequence const &s,
+                            Eigen::ArrayXXd &   J);
+Eigen::ArrayXd MPRAGEJacobian(double const          M0,
+                              double const          T1,
+                              double const          B1,
+                              MPRAGESequence const &s,
+                              Eigen::ArrayXXd &     J);
+
 // For DESPOT1 B1 is a fixed (double), but for HIFI it is varying (might be a Jet)
 template <typename Ta, typename Tb>
 inline auto SPGRSignal(Ta const &PD, Ta const &T1, Tb const &B1, SPGRSequence const &s)
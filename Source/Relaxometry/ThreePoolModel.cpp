@@ -20,9 +20,6 @@
 #include "TwoPoolSignals.h"
 
 #include <Eigen/Dense>
-// There's a bug in matrix log that leads to duplicate symbol definitions if
-// this is included in the header file
-#include <unsupported/Eigen/MatrixFunctions>
 
 using namespace std::literals;
 
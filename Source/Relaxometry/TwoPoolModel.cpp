@@ -18,10 +18,6 @@
 #include "TwoPoolModel.h"
 #include "TwoPoolSignals.h"
 
-// There's a bug in matrix log that leads to duplicate symbol definitions if
-// this is included in the header file
-#include <unsupported/Eigen/MatrixFunctions>
-
 using namespace std::literals;
 
 namespace QI {
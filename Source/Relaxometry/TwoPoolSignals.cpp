@@ -4,7 +4,6 @@
 #include "Macro.h"
 
 #include <Eigen/Dense>
-#include <unsupported/Eigen/MatrixFunctions>
 
 #include "Helpers.h"
 
@@ -20,28 +19,29 @@ Eigen::ArrayXcd SPGR2(double const            PD,
                       double const            f0,
                       double const            B1,
                       SPGREchoSequence const &spgr) {
-    Eigen::Matrix2d  A, eATR;
-    Eigen::Vector2d  M0, Mz;
-    Eigen::Vector2cd Mxy;
-    double           k_ab, k_ba, f_b;
+    Eigen::Matrix2d A;
+    Eigen::Vector2d M0;
+    double          k_ab, k_ba, f_b;
     CalcExchange(tau_a, f_a, f_b, k_ab, k_ba);
     M0 << f_a, f_b;
     A << -(1. / T1_a) - k_ab, k_ba, //
         k_ab, -(1. / T1_b) - k_ba;
-    eATR                  = (spgr.TR * A).exp();
-    Eigen::Matrix2cd echo = Eigen::Matrix2cd::Zero();
+    Eigen::Matrix2d const eATR = Exp2(A, spgr.TR);
     // T2' absorbed into PD as it effects both components equally
-    echo(0, 0) = std::polar(exp(-spgr.TE / T2_a), 2. * M_PI * f0 * spgr.TE);
-    echo(1, 1) = std::polar(exp(-spgr.TE / T2_b), 2. * M_PI * f0 * spgr.TE);
+    auto const echo_a = std::polar(exp(-spgr.TE / T2_a), 2. * M_PI * f0 * spgr.TE);
+    auto const echo_b = std::polar(exp(-spgr.TE / T2_b), 2. * M_PI * f0 * spgr.TE);
 
+    // Mz = (I - eATR * cos(a))^-1 * RHS, with the 2x2 inverse written out for all flip-angles
     Eigen::Vector2d const RHS = (Eigen::Matrix2d::Identity() - eATR) * M0;
-    Eigen::VectorXcd      signal(spgr.size());
-    for (int i = 0; i < spgr.size(); i++) {
-        const double a = spgr.FA[i] * B1;
-        Mz.noalias()   = (Eigen::Matrix2d::Identity() - eATR * cos(a)).partialPivLu().solve(RHS);
-        Mxy.noalias()  = echo * PD * Mz * sin(a);
-        signal(i)      = Mxy(0) + Mxy(1);
-    }
+    auto const           &a   = CachedCosSin(spgr.FA, B1);
+    Eigen::ArrayXd const &ca  = a.c;
+    Eigen::ArrayXd const &sa  = a.s;
+    Eigen::ArrayXd const  det = 1. - ca * eATR.trace() + ca.square() * eATR.determinant();
+    Eigen::ArrayXd const  Mz_a =
+        ((1. - ca * eATR(1, 1)) * RHS[0] + ca * eATR(0, 1) * RHS[1]) / det;
+    Eigen::ArrayXd const Mz_b =
+        (ca * eATR(1, 0) * RHS[0] + (1. - ca * eATR(0, 0)) * RHS[1]) / det;
+    Eigen::ArrayXcd const signal = PD * sa * (echo_a * Mz_a + echo_b * Mz_b);
     QI_DBMSG("SPGR2\n");
     QI_DB(PD);
     QI_DB(T1_a);
@@ -76,22 +76,22 @@ Eigen::ArrayXcd SSFP2(double const            PD,
     const double  E2_b = exp(-TR / T2_b);
     double        f_b, k_ab, k_ba;
     CalcExchange(tau_a, f_a, f_b, k_ab, k_ba);
-    const double   E_ab  = exp(-TR * k_ab / f_b);
-    const double   K1    = E_ab * f_b + f_a;
-    const double   K2    = E_ab * f_a + f_b;
-    const double   K3    = f_a * (1 - E_ab);
-    const double   K4    = f_b * (1 - E_ab);
-    Eigen::ArrayXd alpha = B1 * s.FA;
-    Eigen::ArrayXd theta = s.PhaseInc + 2. * M_PI * f0 * TR;
+    const double E_ab = exp(-TR * k_ab / f_b);
+    const double K1   = E_ab * f_b + f_a;
+    const double K2   = E_ab * f_a + f_b;
+    const double K3   = f_a * (1 - E_ab);
+    const double K4   = f_b * (1 - E_ab);
 
-    // TR Evolution
-    Eigen::MatrixXd M(4, s.size());
-    Eigen::Matrix6d LHS;
-    Eigen::Vector6d RHS;
-    RHS << 0, 0, 0, 0, -E1_b * K3 * f_b + f_a * (-E1_a * K1 + 1),
-        -E1_a * K4 * f_a + f_b * (-E1_b * K2 + 1);
+    // TR Evolution, split into the exchange and T2 decay (P) and the exchange and T1 recovery (Q)
+    Eigen::Matrix2d P, Q;
+    P << E2_a * K1, E2_b * K3, //
+        E2_a * K4, E2_b * K2;
+    Q << E1_a * K1, E1_b * K3, //
+        E1_a * K4, E1_b * K2;
+    Eigen::Vector2d const RHS{-E1_b * K3 * f_b + f_a * (-E1_a * K1 + 1),
+                              -E1_a * K4 * f_a + f_b * (-E1_b * K2 + 1)};
 
-    // TE Evolution
+    // TE Evolution. The echo rotation is applied as a complex phase at the end
     const double sE2_a    = exp(-TR / (2. * T2_a));
     const double sE2_b    = exp(-TR / (2. * T2_b));
     const double sqrtE_ab = exp(-TR * k_ab / (2 * f_b));
@@ -99,33 +99,34 @@ Eigen::ArrayXcd SSFP2(double const            PD,
     const double K2e      = sqrtE_ab * f_a + f_b;
     const double K3e      = f_a * (1 - sqrtE_ab);
     const double K4e      = f_b * (1 - sqrtE_ab);
-    const double cte      = cos(M_PI * f0 * TR);
-    const double ste      = sin(M_PI * f0 * TR);
+    Eigen::RowVector2d const echo{sE2_a * (K1e + K4e), sE2_b * (K3e + K2e)};
 
-    Eigen::Matrix4d echo;
-    echo << sE2_a * K1e * cte, sE2_b * K3e * cte, -sE2_a * K1e * ste, -sE2_b * K3e * ste, //
-        sE2_a * K4e * cte, sE2_b * K2e * cte, -sE2_a * K4e * ste, -sE2_b * K2e * ste,     //
-        sE2_a * K1e * ste, sE2_b * K3e * ste, sE2_a * K1e * cte, sE2_b * K3e * cte,       //
-        sE2_a * K4e * ste, sE2_b * K2e * ste, sE2_a * K4e * cte, sE2_b * K2e * cte;
+    auto const           &alpha = CachedCosSin(s.FA, B1);
+    auto const           &theta = CachedCosSin(s.PhaseInc, 1., 2. * M_PI * f0 * TR);
+    Eigen::ArrayXd const &ca    = alpha.c;
+    Eigen::ArrayXd const &sa    = alpha.s;
+    Eigen::ArrayXd const &ctr   = theta.c;
+    Eigen::ArrayXd const &str   = theta.s;
 
+    /*
+     * The 6x6 steady-state system for Mx, My and Mz is
+     *   | ca*I - ctr*P   str*P         sa*I     |   | Mx |   | 0   |
+     *   | -str*P         I - ctr*P     0        | * | My | = | 0   |
+     *   | -sa*I          0             ca*I - Q |   | Mz |   | RHS |
+     * Eliminating My and then Mx leaves only 2x2 systems, which have closed-form inverses.
+     */
+    Eigen::Matrix2d const I = Eigen::Matrix2d::Identity();
+    Eigen::ArrayXcd       mce(s.size());
     for (int i = 0; i < s.size(); i++) {
-        const double ca  = cos(alpha[i]);
-        const double sa  = sin(alpha[i]);
-        const double ctr = cos(theta[i]);
-        const double str = sin(theta[i]);
-
-        LHS << -E2_a * K1 * ctr + ca, -E2_b * K3 * ctr, E2_a * K1 * str, E2_b * K3 * str, sa, 0,
-            -E2_a * K4 * ctr, -E2_b * K2 * ctr + ca, E2_a * K4 * str, E2_b * K2 * str, 0, sa,
-            -E2_a * K1 * str, -E2_b * K3 * str, -E2_a * K1 * ctr + 1, -E2_b * K3 * ctr, 0, 0,
-            -E2_a * K4 * str, -E2_b * K2 * str, -E2_a * K4 * ctr, -E2_b * K2 * ctr + 1, 0, 0, //
-            -sa, 0, 0, 0, -E1_a * K1 + ca, -E1_b * K3,                                        //
-            0, -sa, 0, 0, -E1_a * K4, -E1_b * K2 + ca;
-        M.col(i) = echo * (LHS.partialPivLu().solve(RHS)).head(4);
+        Eigen::Matrix2d const Ry = (I - ctr[i] * P).inverse() * P; // My = str * Ry * Mx
+        Eigen::Matrix2d const W  = ca[i] * I - ctr[i] * P + str[i] * str[i] * P * Ry;
+        Eigen::Vector2d const y =
+            ((ca[i] * I - Q) * W + sa[i] * sa[i] * I).inverse() * RHS; // Mz = W * y
+        Eigen::Vector2d const Mx = -sa[i] * y;
+        Eigen::Vector2d const My = str[i] * Ry * Mx;
+        mce[i] = std::complex<double>((echo * Mx).value(), (echo * My).value());
     }
-
-    Eigen::ArrayXcd mce(s.size());
-    mce.real() = PD * (M.row(0) + M.row(1));
-    mce.imag() = PD * (M.row(2) + M.row(3));
+    mce *= PD * std::polar(1., M_PI * f0 * TR);
 
     QI_DBMSG("SSFP2\n");
     QI_DB(PD);
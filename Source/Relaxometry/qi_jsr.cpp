@@ -136,7 +136,7 @@ struct JSRModel : QI::Model<double, double, 4, 1, 2> {
 struct SPGRCost {
     JSRModel const &     model;
     JSRModel::FixedArray fixed;
-    QI_ARRAY(double) const data;
+    QI_ARRAY(double) data;
 
     template <typename T> bool operator()(T const *const vin, T *rin) const {
         Eigen::Map<QI_ARRAYN(T, JSRModel::NV) const> const varying(vin);
@@ -150,7 +150,7 @@ struct SPGRCost {
 struct SSFPCost {
     JSRModel const &     model;
     JSRModel::FixedArray fixed;
-    QI_ARRAY(double) const data;
+    QI_ARRAY(double) data;
 
     template <typename T> bool operator()(T const *const vin, T *rin) const {
         Eigen::Map<QI_ARRAYN(T, JSRModel::NV) const> const varying(vin);
@@ -170,8 +170,10 @@ struct JSRFit {
     using FlagType            = int; // Almost always the number of iterations
 
     using ModelType = JSRModel;
-    ModelType model;
-    int       n_psi;
+    using Workspace = QI::CeresWorkspace<ModelType, SPGRCost, SSFPCost>;
+    ModelType                         model;
+    int                               n_psi;
+    QI::PerThreadWorkspace<Workspace> workspace{};
 
     // Have to tell the ModelFitFilter how many volumes we expect in each input
     int input_size(const int i) const {
@@ -205,52 +207,43 @@ struct JSRFit {
             rmse         = 0.0;
             return {false, "Maximum data value was zero or less"};
         }
-        Eigen::ArrayXd const spgr_data = inputs[0] / scale;
-        Eigen::ArrayXd const ssfp_data = inputs[1] / scale;
-
-        // Setup Ceres
-        ceres::Problem problem;
-        using AutoSPGRType = ceres::AutoDiffCostFunction<SPGRCost, ceres::DYNAMIC, ModelType::NV>;
-        using AutoSSFPType = ceres::AutoDiffCostFunction<SSFPCost, ceres::DYNAMIC, ModelType::NV>;
-        auto *spgr_cost =
-            new AutoSPGRType(new SPGRCost{model, fixed, spgr_data}, model.spgr.size());
-        auto *ssfp_cost =
-            new AutoSSFPType(new SSFPCost{model, fixed, ssfp_data}, model.ssfp.size());
-        ceres::LossFunction *loss = new ceres::HuberLoss(1.0); // Don't know if this helps
-        // This is where the parameters and cost functions actually get added to Ceres
-        ModelType::VaryingArray varying;
-        problem.AddResidualBlock(spgr_cost, loss, varying.data());
-        problem.AddResidualBlock(ssfp_cost, loss, varying.data());
-
-        // Set up parameter bounds
-        for (int i = 0; i < ModelType::NV; i++) {
-            problem.SetParameterLowerBound(varying.data(), i, model.bounds_lo[i]);
-            problem.SetParameterUpperBound(varying.data(), i, model.bounds_hi[i]);
-        }
-
-        ceres::Solver::Options options;
-        ceres::Solver::Summary summary;
-        options.max_num_iterations  = 50;
-        options.function_tolerance  = 1e-6;
-        options.gradient_tolerance  = 1e-7;
-        options.parameter_tolerance = 1e-5;
-        options.logging_type        = ceres::SILENT;
+        // Fetch this thread's Ceres problem, setting it up if this is the first voxel
+        Workspace &ws = workspace.get([&](Workspace &w) {
+            ceres::LossFunction *loss = new ceres::HuberLoss(1.0); // Don't know if this helps
+            w.AddAutoDiff<0>(
+                new SPGRCost{model, fixed, inputs[0] / scale}, model.spgr.size(), loss);
+            w.AddAutoDiff<1>(
+                new SSFPCost{model, fixed, inputs[1] / scale}, model.ssfp.size(), loss);
+            w.SetBounds(model.bounds_lo, model.bounds_hi);
+            w.options.max_num_iterations  = 50;
+            w.options.function_tolerance  = 1e-6;
+            w.options.gradient_tolerance  = 1e-7;
+            w.options.parameter_tolerance = 1e-5;
+        });
+        auto &spgr_cost = ws.cost<0>();
+        auto &ssfp_cost = ws.cost<1>();
+        spgr_cost.fixed = fixed;
+        spgr_cost.data  = inputs[0] / scale;
+        ssfp_cost.fixed = fixed;
+        ssfp_cost.data  = inputs[1] / scale;
+
+        auto const &spgr_data = spgr_cost.data;
+        auto const &ssfp_data = ssfp_cost.data;
 
         // We need to do 2 starts for JSR in case off-resonance is very high
         double       best_cost = std::numeric_limits<double>::max();
         double const psi_step  = (n_psi % 2) ? 2 * M_PI / (n_psi - 1) : 2 * M_PI / (n_psi);
         double       psi       = (n_psi == 1) ? 0 : -M_PI;
         for (int p = 0; p < n_psi; p++, psi += psi_step) {
-            varying    = model.start;
-            varying[3] = psi;
-            ceres::Solve(options, &problem, &summary);
-            if (!summary.IsSolutionUsable()) {
-                return {false, summary.FullReport()};
+            ws.p    = model.start;
+            ws.p[3] = psi;
+            if (!ws.Solve()) {
+                return {false, ws.message};
             }
-            if (summary.final_cost < best_cost) {
-                iterations   = summary.iterations.size();
-                best_varying = varying;
-                best_cost    = summary.final_cost;
+            if (ws.final_cost < best_cost) {
+                iterations   = ws.iterations;
+                best_varying = ws.p;
+                best_cost    = ws.final_cost;
             }
         }
         Eigen::ArrayXd const spgr_residual = (spgr_data - model.spgr_signal(best_varying, fixed));
@@ -263,8 +256,8 @@ struct JSRFit {
         int const    dsize = model.spgr.size() + model.ssfp.size();
         rmse               = sqrt(spgr_residual.square().mean() + ssfp_residual.square().mean());
         if (covar) {
-            varying = best_varying;
-            QI::GetModelCovariance<JSRModel>(problem, varying, var / (dsize - JSRModel::NV), covar);
+            ws.p = best_varying;
+            ws.Covariance(var / (dsize - JSRModel::NV), covar);
         }
         best_varying[0] *= scale; // Multiply signals/proton density back up
         // Wrap and convert to frequency
@@ -282,6 +275,7 @@ int jsr_main(args::Subparser &parser) {
     args::Positional<std::string> ssfp_path(parser, "SSFP", "Input SSFP file");
 
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     args::ValueFlag<std::string> b1_path(parser, "B1", "Path to B1 map", {'b', "B1"});
     args::ValueFlag<int>         npsi(
         parser, "N PSI", "Number of starts for psi/off-resonance, default 2", {'p', "npsi"}, 2);
@@ -313,6 +307,11 @@ int jsr_main(args::Subparser &parser) {
         auto   fit_filter =
             QI::ModelFitFilter<JSRFit>::New(
                 &jsr_fit, verbose, covar, resids, threads.Get(), subregion.Get());
+        fit_filter->SetBatchSize(batch.Get());
+        fit_filter->SetDynamicSchedule(dynamic.Get());
+        fit_filter->SetStreamSlabs(stream_slabs.Get());
+        fit_filter->SetCheckpoint(
+            resume.Get(), fmt::format("{} npsi: {}", input.dump(), npsi.Get()));
         fit_filter->ReadInputs({spgr_path.Get(), ssfp_path.Get()}, {b1_path.Get()}, mask.Get());
         fit_filter->Update();
         fit_filter->WriteOutputs(prefix.Get() + "JSR_");
@@ -76,11 +76,40 @@ struct MPMModel : QI::Model<double, double, 4, 0, 3> {
         -> std::vector<QI_ARRAY(double)> {
         return {pdw_signal(v), t1w_signal(v), mtw_signal(v)};
     }
+
+    /*
+     *  Residuals and their Jacobian for the costs below, where the echoes have amplitude v[a]. With
+     *  a noise floor the residuals are in squared signal, so the derivatives gain a factor of 2S.
+     */
+    bool echo_jacobian(int const a,
+                       QI_ARRAY(double) const &data,
+                       double const *vin,
+                       double *      rin,
+                       double *      J) const {
+        Eigen::ArrayXd const       e = (-pdw_s.TE * vin[0]).exp();
+        Eigen::ArrayXd const       S = vin[a] * e;
+        Eigen::Map<Eigen::ArrayXd> r(rin, data.rows());
+        Eigen::ArrayXd             w;
+        if (noise > 0.) {
+            r = (data.square() - noise) - S.square();
+            w = 2. * S;
+        } else {
+            r = data - S;
+            w = Eigen::ArrayXd::Ones(data.rows());
+        }
+        if (J) {
+            Eigen::Map<Eigen::Matrix<double, NV, Eigen::Dynamic>> Jt(J, NV, data.rows());
+            Jt.setZero();
+            Jt.row(0) = (w * pdw_s.TE * S).matrix().transpose();
+            Jt.row(a) = (-w * e).matrix().transpose();
+        }
+        return true;
+    }
 };
 
 struct PDwCost {
     MPMModel const &model;
-    QI_ARRAY(double) const data;
+    QI_ARRAY(double) data;
 
     template <typename T> bool operator()(const T *const vin, T *rin) const {
         Eigen::Map<QI_ARRAYN(T, MPMModel::NV) const> const v(vin);
@@ -94,11 +123,15 @@ struct PDwCost {
         }
         return true;
     }
+
+    bool jacobian(double const *v, double *r, double *J) const {
+        return model.echo_jacobian(1, data, v, r, J);
+    }
 };
 
 struct T1wCost {
     MPMModel const &model;
-    QI_ARRAY(double) const data;
+    QI_ARRAY(double) data;
 
     template <typename T> bool operator()(const T *const vin, T *rin) const {
         Eigen::Map<QI_ARRAYN(T, MPMModel::NV) const> const v(vin);
@@ -112,11 +145,15 @@ struct T1wCost {
         }
         return true;
     }
+
+    bool jacobian(double const *v, double *r, double *J) const {
+        return model.echo_jacobian(2, data, v, r, J);
+    }
 };
 
 struct MTwCost {
     MPMModel const &model;
-    QI_ARRAY(double) const data;
+    QI_ARRAY(double) data;
 
     template <typename T> bool operator()(const T *const vin, T *rin) const {
         Eigen::Map<QI_ARRAYN(T, MPMModel::NV) const> const v(vin);
@@ -130,6 +167,10 @@ struct MTwCost {
         }
         return true;
     }
+
+    bool jacobian(double const *v, double *r, double *J) const {
+        return model.echo_jacobian(3, data, v, r, J);
+    }
 };
 
 struct MPMFit {
@@ -140,7 +181,9 @@ struct MPMFit {
     using RMSErrorType        = double;
     using FlagType            = int;
     using ModelType           = MPMModel;
-    ModelType model;
+    using Workspace           = QI::CeresWorkspace<ModelType, PDwCost, T1wCost, MTwCost>;
+    ModelType                         model;
+    QI::PerThreadWorkspace<Workspace> workspace{};
 
     int input_size(const int i) const {
         switch (i) {
@@ -169,38 +212,30 @@ struct MPMFit {
             rmse = 0.0;
             return {false, "Maximum data value was zero or less"};
         }
-        Eigen::ArrayXd const pdw_data = inputs[0] / scale;
-        Eigen::ArrayXd const t1w_data = inputs[1] / scale;
-        Eigen::ArrayXd const mtw_data = inputs[2] / scale;
-        v << 20., 1., 1., 1.; // R2s, S_PDw, S_T1w, S_MTw
-        ceres::Problem problem;
-        using AutoPDwType = ceres::AutoDiffCostFunction<PDwCost, ceres::DYNAMIC, ModelType::NV>;
-        using AutoT1wType = ceres::AutoDiffCostFunction<T1wCost, ceres::DYNAMIC, ModelType::NV>;
-        using AutoMTwType = ceres::AutoDiffCostFunction<MTwCost, ceres::DYNAMIC, ModelType::NV>;
-        auto *pdw_cost    = new AutoPDwType(new PDwCost{model, pdw_data}, model.pdw_s.size());
-        auto *t1w_cost    = new AutoT1wType(new T1wCost{model, t1w_data}, model.t1w_s.size());
-        auto *mtw_cost    = new AutoMTwType(new MTwCost{model, mtw_data}, model.mtw_s.size());
-        ceres::LossFunction *loss = new ceres::HuberLoss(1.0);
-        problem.AddResidualBlock(pdw_cost, loss, v.data());
-        problem.AddResidualBlock(t1w_cost, loss, v.data());
-        problem.AddResidualBlock(mtw_cost, loss, v.data());
-        for (int i = 0; i < ModelType::NV; i++) {
-            problem.SetParameterLowerBound(v.data(), i, model.lo[i]);
-            problem.SetParameterUpperBound(v.data(), i, model.hi[i]);
-        }
-        ceres::Solver::Options options;
-        ceres::Solver::Summary summary;
-        options.max_num_iterations  = 50;
-        options.function_tolerance  = 1e-5;
-        options.gradient_tolerance  = 1e-6;
-        options.parameter_tolerance = 1e-4;
-        options.logging_type        = ceres::SILENT;
-        ceres::Solve(options, &problem, &summary);
-        if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+        Workspace &ws = workspace.get([&](Workspace &w) {
+            ceres::LossFunction *loss = new ceres::HuberLoss(1.0);
+            w.AddAutoDiff<0>(new PDwCost{model, inputs[0] / scale}, model.pdw_s.size(), loss);
+            w.AddAutoDiff<1>(new T1wCost{model, inputs[1] / scale}, model.t1w_s.size(), loss);
+            w.AddAutoDiff<2>(new MTwCost{model, inputs[2] / scale}, model.mtw_s.size(), loss);
+            w.SetBounds(model.lo, model.hi);
+            w.options.max_num_iterations  = 50;
+            w.options.function_tolerance  = 1e-5;
+            w.options.gradient_tolerance  = 1e-6;
+            w.options.parameter_tolerance = 1e-4;
+        });
+        ws.cost<0>().data = inputs[0] / scale;
+        ws.cost<1>().data = inputs[1] / scale;
+        ws.cost<2>().data = inputs[2] / scale;
+        ws.p << 20., 1., 1., 1.; // R2s, S_PDw, S_T1w, S_MTw
+        if (!ws.Solve()) {
+            return {false, ws.message};
         }
-        iterations = summary.iterations.size();
+        iterations = ws.iterations;
+        v          = ws.p;
 
+        auto const &         pdw_data  = ws.cost<0>().data;
+        auto const &         t1w_data  = ws.cost<1>().data;
+        auto const &         mtw_data  = ws.cost<2>().data;
         Eigen::ArrayXd const pdw_resid = pdw_data - model.pdw_signal(v);
         Eigen::ArrayXd const t1w_resid = t1w_data - model.t1w_signal(v);
         Eigen::ArrayXd const mtw_resid = mtw_data - model.mtw_signal(v);
@@ -213,7 +248,7 @@ struct MPMFit {
             pdw_resid.square().sum() + t1w_resid.square().sum() + mtw_resid.square().sum();
         int const dsize = model.pdw_s.size() + model.t1w_s.size() + model.mtw_s.size();
         if (cov) {
-            QI::GetModelCovariance<MPMModel>(problem, v, var / (dsize - ModelType::NV), cov);
+            ws.Covariance(var / (dsize - ModelType::NV), cov);
         }
         rmse      = sqrt(var / dsize);
         v.tail(3) = v.tail(3) * scale; // Multiply signals/proton densities back up
@@ -231,6 +266,7 @@ int mpm_r2s_main(args::Subparser &parser) {
     args::ValueFlag<double>       rician_noise(
         parser, "RICIAN", "Mean squared noise level for Rician correction", {"rician"}, 0.);
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     parser.Parse();
     QI::CheckPos(pdw_path);
     QI::CheckPos(t1w_path);
@@ -256,6 +292,11 @@ int mpm_r2s_main(args::Subparser &parser) {
         auto fit_filter =
             QI::ModelFitFilter<MPMFit>::New(
                 &mpm_fit, verbose, covar, resids, threads.Get(), subregion.Get());
+        fit_filter->SetBatchSize(batch.Get());
+        fit_filter->SetDynamicSchedule(dynamic.Get());
+        fit_filter->SetStreamSlabs(stream_slabs.Get());
+        fit_filter->SetCheckpoint(
+            resume.Get(), fmt::format("{} rician: {}", input.dump(), rician_noise.Get()));
         fit_filter->ReadInputs({pdw_path.Get(), t1w_path.Get(), mtw_path.Get()}, {}, mask.Get());
         fit_filter->Update();
         fit_filter->WriteOutputs(prefix.Get() + "MPM_");
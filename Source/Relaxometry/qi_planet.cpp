@@ -99,6 +99,7 @@ int planet_main(args::Subparser &parser) {
     args::Positional<std::string> b_path(parser, "b", "Ellipse parameter b");
     args::ValueFlag<std::string>  B1(parser, "B1", "B1 map (ratio) file", {'b', "B1"});
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     parser.Parse();
     QI::CheckPos(G_path);
     QI::CheckPos(a_path);
@@ -123,6 +124,10 @@ int planet_main(args::Subparser &parser) {
         auto      fit_filter =
             QI::ModelFitFilter<PLANETFit>::New(
                 &fit, verbose, false, false, threads.Get(), subregion.Get());
+        fit_filter->SetBatchSize(batch.Get());
+        fit_filter->SetDynamicSchedule(dynamic.Get());
+        fit_filter->SetStreamSlabs(stream_slabs.Get());
+        fit_filter->SetCheckpoint(resume.Get(), input.dump());
         fit_filter->ReadInputs({G_path.Get(), a_path.Get(), b_path.Get()}, {B1.Get()}, mask.Get());
         fit_filter->SetBlocks(ssfp.size());
         fit_filter->Update();
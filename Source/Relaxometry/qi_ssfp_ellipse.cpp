@@ -76,7 +76,7 @@ struct EllipseModel : QI::Model<std::complex<double>, double, 5, 0> {
 
 struct EllipseCost {
     EllipseModel const &model;
-    QI_ARRAY(std::complex<double>) const data;
+    QI_ARRAY(std::complex<double>) data;
 
     template <typename T> bool operator()(const T *const vin, T *rin) const {
         const Eigen::Map<const QI_ARRAYN(T, EllipseModel::NV)> v(vin);
@@ -105,7 +105,9 @@ struct EllipseFit {
     using RMSErrorType        = double;
     using FlagType            = int;
     using ModelType           = EllipseModel;
-    ModelType model;
+    using Workspace           = QI::CeresWorkspace<ModelType, EllipseCost>;
+    ModelType                         model;
+    QI::PerThreadWorkspace<Workspace> workspace{};
 
     int input_size(const int /* Unused */) const { return model.sequence.size(); }
     int n_outputs() const { return model.NV; }
@@ -118,53 +120,46 @@ struct EllipseFit {
                           std::vector<Eigen::ArrayXcd> &      residuals,
                           FlagType &                          iterations,
                           const int /* Unused */) const {
-        const double               scale  = inputs[0].abs().maxCoeff();
-        const Eigen::ArrayXcd      data   = inputs[0] / scale;
+        const double scale = inputs[0].abs().maxCoeff();
+
+        Workspace &ws = workspace.get([&](Workspace &w) {
+            w.AddAutoDiff<0>(new EllipseCost{model, inputs[0] / scale},
+                             model.sequence.size() * 2,
+                             new ceres::HuberLoss(1.0));
+            const double not_zero = 1.0e-6;
+            const double not_one  = 1.0 - not_zero;
+            const double max_a    = exp(-model.sequence.TR / 5.0); // Set a sensible maximum on T2
+            EllipseModel::VaryingArray lo, hi;
+            lo << not_zero, not_zero, not_zero, -2. * M_PI, -2. * M_PI;
+            hi << not_one, max_a, not_one, 2. * M_PI, 2. * M_PI;
+            w.SetBounds(lo, hi);
+            w.options.max_num_iterations  = 50;
+            w.options.function_tolerance  = 1e-5;
+            w.options.gradient_tolerance  = 1e-6;
+            w.options.parameter_tolerance = 1e-3;
+        });
+        ws.cost<0>().data                 = inputs[0] / scale;
+        const Eigen::ArrayXcd &    data   = ws.cost<0>().data;
         const std::complex<double> c_mean = data.mean();
 
-        using AutoCost = ceres::AutoDiffCostFunction<EllipseCost, ceres::DYNAMIC, EllipseModel::NV>;
-        auto *auto_cost           = new AutoCost(new EllipseCost{model, data}, data.rows() * 2);
-        ceres::LossFunction *loss = new ceres::HuberLoss(1.0);
-        ceres::Problem       problem;
-        problem.AddResidualBlock(auto_cost, loss, p.data());
-        const double not_zero = 1.0e-6;
-        const double not_one  = 1.0 - not_zero;
-        const double max_a    = exp(-model.sequence.TR / 5.0); // Set a sensible maximum on T2
-        problem.SetParameterLowerBound(p.data(), 0, not_zero);
-        problem.SetParameterUpperBound(p.data(), 0, not_one);
-        problem.SetParameterLowerBound(p.data(), 1, not_zero);
-        problem.SetParameterUpperBound(p.data(), 1, max_a);
-        problem.SetParameterLowerBound(p.data(), 2, not_zero);
-        problem.SetParameterUpperBound(p.data(), 2, not_one);
-        problem.SetParameterLowerBound(p.data(), 3, -2. * M_PI);
-        problem.SetParameterUpperBound(p.data(), 3, 2. * M_PI);
-        problem.SetParameterLowerBound(p.data(), 4, -2. * M_PI);
-        problem.SetParameterUpperBound(p.data(), 4, 2. * M_PI);
-        ceres::Solver::Options options;
-        ceres::Solver::Summary summary;
-        options.max_num_iterations  = 50;
-        options.function_tolerance  = 1e-5;
-        options.gradient_tolerance  = 1e-6;
-        options.parameter_tolerance = 1e-3;
-        options.logging_type        = ceres::SILENT;
         double th0 = 0.0, psi0 = 0.0, best_cost = std::numeric_limits<double>::infinity();
         for (const auto &th0_try : {-M_PI, 0., M_PI}) {
             const double psi0_try = arg(c_mean / std::polar(1.0, th0_try / 2));
-            p << abs(c_mean), 0.5, 0.5, th0_try, psi0_try;
+            ws.p << abs(c_mean), 0.5, 0.5, th0_try, psi0_try;
             double cost = 0.0;
-            problem.Evaluate(ceres::Problem::EvaluateOptions(), &cost, NULL, NULL, NULL);
+            ws.problem.Evaluate(ceres::Problem::EvaluateOptions(), &cost, NULL, NULL, NULL);
             if (cost < best_cost) {
                 best_cost = cost;
                 th0       = th0_try;
                 psi0      = psi0_try;
             }
         }
-        p << abs(c_mean), 0.5, 0.5, th0, psi0;
-        ceres::Solve(options, &problem, &summary);
-        if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+        ws.p << abs(c_mean), 0.5, 0.5, th0, psi0;
+        if (!ws.Solve()) {
+            return {false, ws.message};
         }
-        iterations = summary.iterations.size();
+        iterations = ws.iterations;
+        p          = ws.p;
 
         Eigen::ArrayXcd const rs  = (data - model.signal(p, fixed));
         double const          var = rs.abs().square().sum();
@@ -173,7 +168,7 @@ struct EllipseFit {
             residuals[0] = rs * scale;
         }
         if (cov) {
-            QI::GetModelCovariance<ModelType>(problem, p, var / (data.rows() - ModelType::NV), cov);
+            ws.Covariance(var / (data.rows() - ModelType::NV), cov);
         }
 
         p[0] *= scale;
@@ -186,6 +181,7 @@ struct EllipseFit {
 int ssfp_ellipse_main(args::Subparser &parser) {
     args::Positional<std::string> sequence_path(parser, "sequence_FILE", "Input sequence file");
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     args::ValueFlag<char> algorithm(
         parser, "ALGO", "Choose algorithm (h)yper/(d)irect, default d", {'a', "algo"}, 'd');
     parser.Parse();
@@ -210,6 +206,11 @@ int ssfp_ellipse_main(args::Subparser &parser) {
         auto       fit_filter =
             QI::ModelFitFilter<EllipseFit>::New(
                 &fit, verbose, covar, resids, threads.Get(), subregion.Get());
+        fit_filter->SetBatchSize(batch.Get());
+        fit_filter->SetDynamicSchedule(dynamic.Get());
+        fit_filter->SetStreamSlabs(stream_slabs.Get());
+        fit_filter->SetCheckpoint(
+            resume.Get(), fmt::format("{} algo: {}", input.dump(), algorithm.Get()));
         fit_filter->ReadInputs({sequence_path.Get()}, {}, mask.Get());
         fit_filter->SetBlocks(fit_filter->GetInput(0)->GetNumberOfComponentsPerPixel() /
                               sequence.size());
@@ -11,10 +11,12 @@
 
 #include "ceres/ceres.h"
 #include <Eigen/Core>
+#include <algorithm>
 #include <array>
 
 #include "Args.h"
 #include "FitFunction.h"
+#include "LineFitBatch.h"
 #include "ImageIO.h"
 #include "Model.h"
 #include "ModelFitFilter.h"
@@ -43,12 +45,92 @@ struct DESPOT1 : QI::Model<double, double, 2, 1> {
         -> QI_ARRAY(typename Derived::Scalar) {
         return QI::SPGRSignal(v[0], v[1], f[0], sequence);
     }
+
+    Eigen::ArrayXd jacobian(VaryingArray const &v, FixedArray const &f, Eigen::ArrayXXd &J) const {
+        return QI::SPGRJacobian(v[0], v[1], f[0], sequence, J);
+    }
 };
 
 using DESPOT1Fit = QI::FitFunction<DESPOT1>;
 
-struct DESPOT1LLS : DESPOT1Fit {
+/*
+ *  Shared parts of the batched LLS and WLLS fits. The linearised signal is S/sin(a) against
+ *  S/tan(a), so every voxel in a batch is a 2x2 line fit that LineFitBatch solves in SIMD lanes.
+ */
+struct DESPOT1LinearFit : DESPOT1Fit {
     using DESPOT1Fit::DESPOT1Fit;
+
+    // Sine and cosine of each B1-corrected flip-angle, one row per voxel and one column per angle
+    void angles(QI::FitBatch<DESPOT1> const &batch,
+                Eigen::ArrayXXd &            sa,
+                Eigen::ArrayXXd &            ca) const {
+        auto const n  = batch.size;
+        auto const B1 = batch.fixed.col(0).head(n);
+        sa.resize(n, model.sequence.size());
+        ca.resize(n, model.sequence.size());
+        for (Eigen::Index j = 0; j < model.sequence.size(); j++) {
+            sa.col(j) = (B1 * model.sequence.FA[j]).sin();
+            ca.col(j) = (B1 * model.sequence.FA[j]).cos();
+        }
+    }
+
+    void add_points(QI::FitBatch<DESPOT1> const &batch,
+                    Eigen::ArrayXXd const &      sa,
+                    Eigen::ArrayXXd const &      ca,
+                    QI::LineFitBatch &           line) const {
+        auto const data = batch.inputs[0].topRows(batch.size);
+        for (Eigen::Index j = 0; j < model.sequence.size(); j++) {
+            line.add(data.col(j) * ca.col(j) / sa.col(j), data.col(j) / sa.col(j));
+        }
+    }
+
+    // As above, but weighted by the derivative of the signal with respect to the linearised data
+    void add_points(QI::FitBatch<DESPOT1> const &batch,
+                    Eigen::ArrayXXd const &      sa,
+                    Eigen::ArrayXXd const &      ca,
+                    Eigen::ArrayXd const &       E1,
+                    QI::LineFitBatch &           line) const {
+        auto const data = batch.inputs[0].topRows(batch.size);
+        for (Eigen::Index j = 0; j < model.sequence.size(); j++) {
+            line.add(data.col(j) * ca.col(j) / sa.col(j),
+                     data.col(j) / sa.col(j),
+                     (sa.col(j) / (1. - E1 * ca.col(j))).square());
+        }
+    }
+
+    // Clamp the parameters and fill in the outputs, residuals and RMSE of the batch
+    void finish(Eigen::ArrayXd const &  PD_in,
+                Eigen::ArrayXd const &  T1_in,
+                Eigen::ArrayXXd const & sa,
+                Eigen::ArrayXXd const & ca,
+                QI::FitBatch<DESPOT1> & batch) const {
+        auto const n    = batch.size;
+        auto const data = batch.inputs[0].topRows(n);
+        auto       PD   = batch.varying.col(0).head(n);
+        auto       T1   = batch.varying.col(1).head(n);
+        PD              = PD_in.max(0.);
+        T1              = T1_in.max(model.bounds_lo[1]).min(model.bounds_hi[1]);
+        // Comparisons with NaN are false, so match QI::Clamp by sending NaN to the lower bound
+        PD = (PD_in == PD_in).select(PD, 0.);
+        T1 = (T1_in == T1_in).select(T1, model.bounds_lo[1]);
+
+        Eigen::ArrayXd const E1  = (-model.sequence.TR / T1).exp();
+        Eigen::ArrayXd       sum = Eigen::ArrayXd::Zero(n);
+        Eigen::ArrayXd       r(n);
+        for (Eigen::Index j = 0; j < model.sequence.size(); j++) {
+            r = data.col(j) - PD * (1. - E1) * sa.col(j) / (1. - E1 * ca.col(j));
+            sum += r.square();
+            if (batch.residuals.size() > 0) {
+                batch.residuals[0].col(j).head(n) = r;
+            }
+        }
+        batch.rmse.head(n) = (sum / model.sequence.size()).sqrt();
+        std::fill_n(batch.status.begin(), n, QI::FitReturnType{true, ""});
+    }
+};
+
+struct DESPOT1LLS : DESPOT1LinearFit {
+    using DESPOT1LinearFit::DESPOT1LinearFit;
     QI::FitReturnType fit(const std::vector<Eigen::ArrayXd> &inputs,
                           DESPOT1::FixedArray const &        fixed,
                           DESPOT1::VaryingArray &            outputs,
@@ -74,10 +156,22 @@ struct DESPOT1LLS : DESPOT1Fit {
         iterations = 1;
         return {true, ""};
     }
+
+    void fit_batch(QI::FitBatch<DESPOT1> &batch) const override {
+        auto const      n = batch.size;
+        Eigen::ArrayXXd sa, ca;
+        angles(batch, sa, ca);
+        QI::LineFitBatch line(n);
+        add_points(batch, sa, ca, line);
+        Eigen::ArrayXd b0(n), b1(n);
+        line.solve(b0, b1);
+        finish(b1 / (1. - b0), -model.sequence.TR / b0.log(), sa, ca, batch);
+        batch.flag.head(n).setOnes();
+    }
 };
 
-struct DESPOT1WLLS : DESPOT1Fit {
-    using DESPOT1Fit::DESPOT1Fit;
+struct DESPOT1WLLS : DESPOT1LinearFit {
+    using DESPOT1LinearFit::DESPOT1LinearFit;
     QI::FitReturnType fit(const std::vector<Eigen::ArrayXd> &inputs,
                           DESPOT1::FixedArray const &        fixed,
                           DESPOT1::VaryingArray &            outputs,
@@ -116,10 +210,51 @@ struct DESPOT1WLLS : DESPOT1Fit {
         residual = sqrt(temp_residuals.square().sum() / temp_residuals.rows());
         return {true, ""};
     }
+
+    // Voxels that have converged keep their parameters while the rest of the batch carries on
+    void fit_batch(QI::FitBatch<DESPOT1> &batch) const override {
+        auto const      n  = batch.size;
+        double const    TR = model.sequence.TR;
+        Eigen::ArrayXXd sa, ca;
+        angles(batch, sa, ca);
+        QI::LineFitBatch line(n);
+        add_points(batch, sa, ca, line);
+        Eigen::ArrayXd b0(n), b1(n);
+        line.solve(b0, b1);
+        Eigen::ArrayXd PD = b1 / (1. - b0);
+        Eigen::ArrayXd T1 = -TR / b0.log();
+
+        double const prec2 = std::pow(Eigen::NumTraits<double>::dummy_precision(), 2);
+        auto         its   = batch.flag.head(n);
+        its.setZero();
+        Eigen::Array<bool, Eigen::Dynamic, 1> done = Eigen::Array<bool, Eigen::Dynamic, 1>::Zero(n);
+        Eigen::ArrayXd                        newPD(n), newT1(n);
+        for (int it = 0; it < model.max_iterations && !done.all(); it++) {
+            line.reset();
+            add_points(batch, sa, ca, (-TR / T1).exp(), line);
+            line.solve(b0, b1);
+            newPD = b1 / (1. - b0);
+            newT1 = -TR / b0.log();
+            // Same test as isApprox() on the (PD, T1) pair in fit()
+            Eigen::Array<bool, Eigen::Dynamic, 1> const converged =
+                ((newPD - PD).square() + (newT1 - T1).square()) <=
+                prec2 * (newPD.square() + newT1.square()).min(PD.square() + T1.square());
+            its  = done.select(its, converged.select(Eigen::ArrayXi::Constant(n, it), it + 1));
+            PD   = (done || converged).select(PD, newPD);
+            T1   = (done || converged).select(T1, newT1);
+            done = done || converged;
+        }
+        finish(PD, T1, sa, ca, batch);
+    }
 };
 
 struct DESPOT1NLLS : DESPOT1Fit {
-    DESPOT1NLLS(DESPOT1 &m) : DESPOT1Fit(m) {}
+    using Cost      = QI::ModelCost<DESPOT1>;
+    using Workspace = QI::CeresWorkspace<DESPOT1, Cost>;
+    QI::PerThreadWorkspace<Workspace> workspace;
+    QI::NLLSSolver                    solver;
+
+    DESPOT1NLLS(DESPOT1 &m, QI::NLLSSolver const s) : DESPOT1Fit(m), solver{s} {}
 
     QI::FitReturnType fit(const std::vector<Eigen::ArrayXd> &inputs,
                           DESPOT1::FixedArray const &        fixed,
@@ -134,40 +269,33 @@ struct DESPOT1NLLS : DESPOT1Fit {
             rmse = 0;
             return {false, "Maximum data value was not positive"};
         }
-        const Eigen::ArrayXd data = inputs[0] / scale;
-        p << 10., 1.;
-        ceres::Problem problem;
-        using Cost      = QI::ModelCost<DESPOT1>;
-        using AutoCost  = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, DESPOT1::NV>;
-        auto *cost      = new Cost{model, fixed, data};
-        auto *auto_cost = new AutoCost(cost, model.sequence.size());
-        problem.AddResidualBlock(auto_cost, NULL, p.data());
-        problem.SetParameterLowerBound(p.data(), 0, model.bounds_lo[0]);
-        problem.SetParameterUpperBound(p.data(), 0, model.bounds_hi[0]);
-        problem.SetParameterLowerBound(p.data(), 1, model.bounds_lo[1]);
-        problem.SetParameterUpperBound(p.data(), 1, model.bounds_hi[1]);
-        ceres::Solver::Options options;
-        ceres::Solver::Summary summary;
-        options.max_num_iterations  = model.max_iterations;
-        options.function_tolerance  = 1e-5;
-        options.gradient_tolerance  = 1e-6;
-        options.parameter_tolerance = 1e-4;
-        options.logging_type        = ceres::SILENT;
-        ceres::Solve(options, &problem, &summary);
-
-        if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+        Workspace &ws = workspace.get([&](Workspace &w) {
+            w.AddAutoDiff<0>(new Cost{model, fixed, inputs[0] / scale}, model.sequence.size());
+            w.SetBounds(model.bounds_lo, model.bounds_hi);
+            w.options.max_num_iterations  = model.max_iterations;
+            w.options.function_tolerance  = 1e-5;
+            w.options.gradient_tolerance  = 1e-6;
+            w.options.parameter_tolerance = 1e-4;
+        });
+        auto &cost = ws.cost<0>();
+        cost.fixed = fixed;
+        cost.data  = inputs[0] / scale;
+        ws.p << 10., 1.;
+        if (!ws.Solve(solver)) {
+            return {false, ws.message};
         }
-        iterations = summary.iterations.size();
+        iterations = ws.iterations;
+        p          = ws.p;
 
-        Eigen::ArrayXd const rs  = (data - model.signal(p, fixed));
-        double const         var = rs.square().sum();
-        rmse                     = sqrt(var / data.rows()) * scale;
+        auto const &         data = cost.data;
+        Eigen::ArrayXd const rs   = (data - model.signal(p, fixed));
+        double const         var  = rs.square().sum();
+        rmse                      = sqrt(var / data.rows()) * scale;
         if (residuals.size() > 0) {
             residuals[0] = rs * scale;
         }
         if (cov) {
-            QI::GetModelCovariance<DESPOT1>(problem, p, var / (data.rows() - DESPOT1::NV), cov);
+            ws.Covariance(var / (data.rows() - DESPOT1::NV), cov);
         }
         p[0] = p[0] * scale;
         return {true, ""};
@@ -180,10 +308,13 @@ struct DESPOT1NLLS : DESPOT1Fit {
 int despot1_main(args::Subparser &parser) {
     args::Positional<std::string> spgr_path(parser, "SPGR FILE", "Path to SPGR data");
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio) file", {'b', "B1"});
     args::ValueFlag<char> algorithm(parser, "ALGO", "Choose algorithm (l/w/n)", {'a', "algo"}, 'l');
     args::ValueFlag<int>  its(
         parser, "ITERS", "Max iterations for WLLS/NLLS (default 15)", {'i', "its"}, 15);
+    args::ValueFlag<std::string> solver(
+        parser, "SOLVER", "Solver for NLLS, ceres or lm (default ceres)", {"solver"}, "ceres");
     parser.Parse();
     QI::CheckPos(spgr_path);
     QI::Log(verbose, "Reading sequence information");
@@ -213,7 +344,7 @@ int despot1_main(args::Subparser &parser) {
             QI::Log(verbose, "WLLS algorithm selected.");
             break;
         case 'n':
-            d1 = new DESPOT1NLLS(model);
+            d1 = new DESPOT1NLLS(model, QI::ParseNLLSSolver(solver.Get()));
             QI::Log(verbose, "NLLS algorithm selected.");
             break;
         default:
@@ -221,6 +352,15 @@ int despot1_main(args::Subparser &parser) {
         }
         auto fit = QI::ModelFitFilter<DESPOT1Fit>::New(
             d1, verbose, covar, resids, threads.Get(), subregion.Get());
+        fit->SetBatchSize(batch.Get());
+        fit->SetDynamicSchedule(dynamic.Get());
+        fit->SetStreamSlabs(stream_slabs.Get());
+        fit->SetCheckpoint(resume.Get(),
+                           fmt::format("{} algo: {} its: {} solver: {}",
+                                       input.dump(),
+                                       algorithm.Get(),
+                                       its.Get(),
+                                       solver.Get()));
         fit->ReadInputs({QI::CheckPos(spgr_path)}, {B1.Get()}, mask.Get());
         fit->Update();
         fit->WriteOutputs(prefix.Get() + "D1_");
@@ -79,6 +79,16 @@ struct HIFISPGRCost {
         r               = data - calc;
         return true;
     }
+
+    bool jacobian(double const *v, double *r, double *J) const {
+        Eigen::ArrayXXd dS(data.rows(), HIFIModel::NV);
+        Eigen::Map<Eigen::ArrayXd>(r, data.rows()) =
+            data - QI::SPGRJacobian(v[0], v[1], v[2], model.spgr, dS);
+        if (J) {
+            QI::ResidualJacobian<HIFIModel::NV>(dS, J);
+        }
+        return true;
+    }
 };
 
 struct HIFIMPRAGECost {
@@ -93,6 +103,16 @@ struct HIFIMPRAGECost {
         r               = data - calc;
         return true;
     }
+
+    bool jacobian(double const *v, double *r, double *J) const {
+        Eigen::ArrayXXd dS(data.rows(), HIFIModel::NV);
+        Eigen::Map<Eigen::ArrayXd>(r, data.rows()) =
+            data - QI::MPRAGEJacobian(v[0], v[1], v[2], model.mprage, dS);
+        if (J) {
+            QI::ResidualJacobian<HIFIModel::NV>(dS, J);
+        }
+        return true;
+    }
 };
 
 struct HIFIFit {
@@ -134,13 +154,10 @@ struct HIFIFit {
         const Eigen::ArrayXd mprage_data = inputs[1] / scale;
         v << 10., 1., 1.; // PD, T1, B1
         ceres::Problem problem;
-        using AutoSPGRType =
-            ceres::AutoDiffCostFunction<HIFISPGRCost, ceres::DYNAMIC, HIFIModel::NV>;
-        using AutoMPRAGEType =
-            ceres::AutoDiffCostFunction<HIFIMPRAGECost, ceres::DYNAMIC, HIFIModel::NV>;
-        auto *spgr_cost = new AutoSPGRType(new HIFISPGRCost{model, spgr_data}, model.spgr.size());
-        auto *mprage_cost =
-            new AutoMPRAGEType(new HIFIMPRAGECost{model, mprage_data}, model.mprage.size());
+        auto *spgr_cost   = QI::MakeCostFunction<HIFIModel::NV>(new HIFISPGRCost{model, spgr_data},
+                                                              model.spgr.size());
+        auto *mprage_cost = QI::MakeCostFunction<HIFIModel::NV>(
+            new HIFIMPRAGECost{model, mprage_data}, model.mprage.size());
         problem.AddResidualBlock(spgr_cost, NULL, v.data());
         problem.AddResidualBlock(mprage_cost, NULL, v.data());
         for (int i = 0; i < 3; i++) {
@@ -185,6 +202,7 @@ int despot1hifi_main(args::Subparser &parser) {
     args::Positional<std::string> spgr_path(parser, "SPGR_FILE", "Input SPGR file");
     args::Positional<std::string> mprage_path(parser, "MPRAGE_FILE", "Input MP-RAGE file");
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     args::ValueFlag<float> clamp(parser,
                                  "CLAMP",
                                  "Clamp output T1 values to this value",
@@ -213,6 +231,11 @@ int despot1hifi_main(args::Subparser &parser) {
         auto    fit_filter =
             QI::ModelFitFilter<HIFIFit>::New(
                 &hifi_fit, verbose, covar, resids, threads.Get(), subregion.Get());
+        fit_filter->SetBatchSize(batch.Get());
+        fit_filter->SetDynamicSchedule(dynamic.Get());
+        fit_filter->SetStreamSlabs(stream_slabs.Get());
+        fit_filter->SetCheckpoint(
+            resume.Get(), fmt::format("{} clamp: {}", input.dump(), clamp.Get()));
         fit_filter->ReadInputs(
             {QI::CheckPos(spgr_path), QI::CheckPos(mprage_path)}, {}, mask.Get());
         fit_filter->Update();
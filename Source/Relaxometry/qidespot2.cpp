@@ -16,6 +16,7 @@
 
 #include "Args.h"
 #include "FitFunction.h"
+#include "LineFitBatch.h"
 #include "ImageIO.h"
 #include "Model.h"
 #include "ModelFitFilter.h"
@@ -55,12 +56,129 @@ struct DESPOT2 : QI::Model<double, double, 2, 2> {
         const QI_ARRAY(T) numer = PD * sqrt(E2) * (1.0 - E1) * sin(alpha);
         return numer / denom;
     }
+
+    // The signal is linear in PD, and T2 only enters through E2
+    Eigen::ArrayXd jacobian(VaryingArray const &v, FixedArray const &f, Eigen::ArrayXXd &J) const {
+        double const         PD    = v[0];
+        double const         T2    = v[1];
+        double const         E1    = exp(-sequence.TR / f[0]);
+        double const         E2    = exp(-sequence.TR / T2);
+        Eigen::ArrayXd const alpha = sequence.FA * f[1];
+        Eigen::ArrayXd const ca    = alpha.cos();
+        Eigen::ArrayXd const denom = elliptical ? (1.0 - E1 * E2 * E2 - (E1 - E2 * E2) * ca) :
+                                                  (1.0 - E1 * E2 - (E1 - E2) * ca);
+        Eigen::ArrayXd const ddenom_dE2 = (ca - E1) * (elliptical ? 2. * E2 : 1.);
+
+        J.col(0) = sqrt(E2) * (1.0 - E1) * alpha.sin() / denom;
+        J.col(1) = PD * J.col(0) * (0.5 - E2 * ddenom_dE2 / denom) * sequence.TR / (T2 * T2);
+        return PD * J.col(0);
+    }
 };
 
 using DESPOT2Fit = QI::FitFunction<DESPOT2>;
 
-struct DESPOT2LLS : DESPOT2Fit {
+/*
+ *  Shared parts of the batched LLS and WLLS fits, see DESPOT1LinearFit in qidespot1.cpp
+ */
+struct DESPOT2LinearFit : DESPOT2Fit {
     using DESPOT2Fit::DESPOT2Fit;
+
+    // Sine and cosine of each B1-corrected flip-angle, one row per voxel and one column per angle
+    void angles(QI::FitBatch<DESPOT2> const &batch,
+                Eigen::ArrayXXd &            sa,
+                Eigen::ArrayXXd &            ca) const {
+        auto const n  = batch.size;
+        auto const B1 = batch.fixed.col(1).head(n);
+        sa.resize(n, model.sequence.size());
+        ca.resize(n, model.sequence.size());
+        for (Eigen::Index j = 0; j < model.sequence.size(); j++) {
+            sa.col(j) = (B1 * model.sequence.FA[j]).sin();
+            ca.col(j) = (B1 * model.sequence.FA[j]).cos();
+        }
+    }
+
+    void add_points(QI::FitBatch<DESPOT2> const &batch,
+                    Eigen::ArrayXXd const &      sa,
+                    Eigen::ArrayXXd const &      ca,
+                    QI::LineFitBatch &           line) const {
+        auto const data = batch.inputs[0].topRows(batch.size);
+        for (Eigen::Index j = 0; j < model.sequence.size(); j++) {
+            line.add(data.col(j) * ca.col(j) / sa.col(j), data.col(j) / sa.col(j));
+        }
+    }
+
+    // Weighted as in DESPOT2WLLS::fit()
+    void add_points(QI::FitBatch<DESPOT2> const &batch,
+                    Eigen::ArrayXXd const &      sa,
+                    Eigen::ArrayXXd const &      ca,
+                    Eigen::ArrayXd const &       E1,
+                    Eigen::ArrayXd const &       E2,
+                    QI::LineFitBatch &           line) const {
+        auto const           data = batch.inputs[0].topRows(batch.size);
+        Eigen::ArrayXd const E2e  = model.elliptical ? Eigen::ArrayXd(E2.square()) : E2;
+        for (Eigen::Index j = 0; j < model.sequence.size(); j++) {
+            auto const denom = 1. - E1 * E2e - (E1 - E2e) * ca.col(j);
+            line.add(data.col(j) * ca.col(j) / sa.col(j),
+                     data.col(j) / sa.col(j),
+                     ((1. - E1 * E2) * sa.col(j) / denom).square());
+        }
+    }
+
+    void parameters(QI::LineFitBatch const &line,
+                    Eigen::ArrayXd const &  E1,
+                    Eigen::ArrayXd &        PD,
+                    Eigen::ArrayXd &        T2,
+                    Eigen::ArrayXd &        E2) const {
+        double const   TR = model.sequence.TR;
+        Eigen::ArrayXd b0(E1.rows()), b1(E1.rows());
+        line.solve(b0, b1);
+        if (model.elliptical) {
+            T2 = 2. * TR / ((b0 * E1 - 1.) / (b0 - E1)).log();
+            E2 = (-TR / T2).exp();
+            PD = b1 * (1. - E1 * E2.square()) / (E2.sqrt() * (1. - E1));
+        } else {
+            T2 = TR / ((b0 * E1 - 1.) / (b0 - E1)).log();
+            E2 = (-TR / T2).exp();
+            PD = b1 * (1. - E1 * E2) / (E2.sqrt() * (1. - E1));
+        }
+    }
+
+    // Clamp the parameters and fill in the outputs, residuals and RMSE of the batch
+    void finish(Eigen::ArrayXd const &  PD_in,
+                Eigen::ArrayXd const &  T2_in,
+                Eigen::ArrayXd const &  E1,
+                Eigen::ArrayXXd const & sa,
+                Eigen::ArrayXXd const & ca,
+                QI::FitBatch<DESPOT2> & batch) const {
+        auto const n    = batch.size;
+        auto const data = batch.inputs[0].topRows(n);
+        auto       PD   = batch.varying.col(0).head(n);
+        auto       T2   = batch.varying.col(1).head(n);
+        PD              = PD_in.max(model.bounds_lo[0]).min(model.bounds_hi[0]);
+        T2              = T2_in.max(model.bounds_lo[1]).min(model.bounds_hi[1]);
+        // Comparisons with NaN are false, so match QI::Clamp by sending NaN to the lower bound
+        PD = (PD_in == PD_in).select(PD, model.bounds_lo[0]);
+        T2 = (T2_in == T2_in).select(T2, model.bounds_lo[1]);
+
+        Eigen::ArrayXd const E2    = (-model.sequence.TR / T2).exp();
+        Eigen::ArrayXd const numer = PD * E2.sqrt() * (1. - E1);
+        Eigen::ArrayXd const E2e   = model.elliptical ? Eigen::ArrayXd(E2.square()) : E2;
+        Eigen::ArrayXd       sum   = Eigen::ArrayXd::Zero(n);
+        Eigen::ArrayXd       r(n);
+        for (Eigen::Index j = 0; j < model.sequence.size(); j++) {
+            r = data.col(j) - numer * sa.col(j) / (1. - E1 * E2e - (E1 - E2e) * ca.col(j));
+            sum += r.square();
+            if (batch.residuals.size() > 0) {
+                batch.residuals[0].col(j).head(n) = r;
+            }
+        }
+        batch.rmse.head(n) = (sum / model.sequence.size()).sqrt();
+        std::fill_n(batch.status.begin(), n, QI::FitReturnType{true, ""});
+    }
+};
+
+struct DESPOT2LLS : DESPOT2LinearFit {
+    using DESPOT2LinearFit::DESPOT2LinearFit;
     QI::FitReturnType fit(const std::vector<QI_ARRAY(InputType)> &inputs,
                           DESPOT2::FixedArray const &             fixed,
                           DESPOT2::VaryingArray &                 outputs,
@@ -100,10 +218,23 @@ struct DESPOT2LLS : DESPOT2Fit {
         iterations = 1;
         return {true, ""};
     }
+
+    void fit_batch(QI::FitBatch<DESPOT2> &batch) const override {
+        auto const           n  = batch.size;
+        Eigen::ArrayXd const E1 = (-model.sequence.TR / batch.fixed.col(0).head(n)).exp();
+        Eigen::ArrayXXd      sa, ca;
+        angles(batch, sa, ca);
+        QI::LineFitBatch line(n);
+        add_points(batch, sa, ca, line);
+        Eigen::ArrayXd PD(n), T2(n), E2(n);
+        parameters(line, E1, PD, T2, E2);
+        finish(PD, T2, E1, sa, ca, batch);
+        batch.flag.head(n).setOnes();
+    }
 };
 
-struct DESPOT2WLLS : DESPOT2Fit {
-    using DESPOT2Fit::DESPOT2Fit;
+struct DESPOT2WLLS : DESPOT2LinearFit {
+    using DESPOT2LinearFit::DESPOT2LinearFit;
     QI::FitReturnType fit(const std::vector<QI_ARRAY(InputType)> &inputs,
                           DESPOT2::FixedArray const &             fixed,
                           DESPOT2::VaryingArray &                 outputs,
@@ -131,7 +262,7 @@ struct DESPOT2WLLS : DESPOT2Fit {
         } else {
             T2 = TR / log((b[0] * E1 - 1.) / (b[0] - E1));
             E2 = exp(-TR / T2);
-            PD = b[1] * (1. - E1 * E2) / (1. - E1);
+            PD = b[1] * (1. - E1 * E2) / (sqrt(E2) * (1. - E1));
         }
         Eigen::VectorXd W(model.sequence.size());
         for (iterations = 0; iterations < model.max_iterations; iterations++) {
@@ -153,23 +284,45 @@ struct DESPOT2WLLS : DESPOT2Fit {
             } else {
                 T2 = TR / log((b[0] * E1 - 1.) / (b[0] - E1));
                 E2 = exp(-TR / T2);
-                PD = b[1] * (1. - E1 * E2) / (1. - E1);
+                PD = b[1] * (1. - E1 * E2) / (sqrt(E2) * (1. - E1));
             }
         }
         outputs[0] = QI::Clamp(PD, model.bounds_lo[0], model.bounds_hi[0]);
         outputs[1] = QI::Clamp(T2, model.bounds_lo[1], model.bounds_hi[1]);
-        Eigen::Array2d v{PD, T2};
-        Eigen::ArrayXd r = data - model.signal(v, fixed);
+        Eigen::ArrayXd r = data - model.signal(outputs, fixed);
         if (residuals.size() > 0) { // Residuals will only be allocated if the user asked for them
             residuals[0] = r;
         }
         residual = sqrt(r.square().sum() / r.rows());
         return {true, ""};
     }
+
+    void fit_batch(QI::FitBatch<DESPOT2> &batch) const override {
+        auto const           n  = batch.size;
+        Eigen::ArrayXd const E1 = (-model.sequence.TR / batch.fixed.col(0).head(n)).exp();
+        Eigen::ArrayXXd      sa, ca;
+        angles(batch, sa, ca);
+        QI::LineFitBatch line(n);
+        add_points(batch, sa, ca, line);
+        Eigen::ArrayXd PD(n), T2(n), E2(n);
+        parameters(line, E1, PD, T2, E2);
+        for (int it = 0; it < model.max_iterations; it++) {
+            line.reset();
+            add_points(batch, sa, ca, E1, E2, line);
+            parameters(line, E1, PD, T2, E2);
+        }
+        finish(PD, T2, E1, sa, ca, batch);
+        batch.flag.head(n).setConstant(model.max_iterations);
+    }
 };
 
 struct DESPOT2NLLS : DESPOT2Fit {
-    DESPOT2NLLS(DESPOT2 &m) : DESPOT2Fit{m} {}
+    using Cost      = QI::ModelCost<DESPOT2>;
+    using Workspace = QI::CeresWorkspace<DESPOT2, Cost>;
+    QI::PerThreadWorkspace<Workspace> workspace;
+    QI::NLLSSolver                    solver;
+
+    DESPOT2NLLS(DESPOT2 &m, QI::NLLSSolver const s) : DESPOT2Fit{m}, solver{s} {}
 
     QI::FitReturnType fit(const std::vector<Eigen::ArrayXd> &inputs,
                           DESPOT2::FixedArray const &        fixed,
@@ -184,41 +337,36 @@ struct DESPOT2NLLS : DESPOT2Fit {
             rmse = 0;
             return {false, "Maximum data value was not positive"};
         }
-        const Eigen::ArrayXd data = inputs[0] / scale;
-        p << 10., 0.1;
-        ceres::Problem problem;
-        using Cost      = QI::ModelCost<DESPOT2>;
-        using AutoCost  = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, DESPOT2::NV>;
-        auto *cost      = new Cost{model, fixed, data};
-        auto *auto_cost = new AutoCost(cost, model.sequence.size());
-        problem.AddResidualBlock(auto_cost, NULL, p.data());
-        problem.SetParameterLowerBound(p.data(), 0, model.bounds_lo[0] / scale);
-        problem.SetParameterUpperBound(p.data(), 0, model.bounds_hi[0] / scale);
-        problem.SetParameterLowerBound(p.data(), 1, model.bounds_lo[1]);
-        problem.SetParameterUpperBound(
-            p.data(), 1, std::min(model.bounds_hi[1], fixed[0])); // T2 cannot be > T1
-        ceres::Solver::Options options;
-        ceres::Solver::Summary summary;
-        options.max_num_iterations  = model.max_iterations;
-        options.function_tolerance  = 1e-5;
-        options.gradient_tolerance  = 1e-6;
-        options.parameter_tolerance = 1e-4;
-        options.logging_type        = ceres::SILENT;
-        ceres::Solve(options, &problem, &summary);
-        p[0] = p[0] * scale;
-        if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+        Workspace &ws = workspace.get([&](Workspace &w) {
+            w.AddAutoDiff<0>(new Cost{model, fixed, inputs[0] / scale}, model.sequence.size());
+            w.options.max_num_iterations  = model.max_iterations;
+            w.options.function_tolerance  = 1e-5;
+            w.options.gradient_tolerance  = 1e-6;
+            w.options.parameter_tolerance = 1e-4;
+        });
+        auto &cost = ws.cost<0>();
+        cost.fixed = fixed;
+        cost.data  = inputs[0] / scale;
+        // PD bounds depend on the scale, and T2 cannot be > T1
+        ws.SetBounds(DESPOT2::VaryingArray{model.bounds_lo[0] / scale, model.bounds_lo[1]},
+                     DESPOT2::VaryingArray{model.bounds_hi[0] / scale,
+                                           std::min(model.bounds_hi[1], fixed[0])});
+        ws.p << 10., 0.1;
+        if (!ws.Solve(solver)) {
+            return {false, ws.message};
         }
-        iterations = summary.iterations.size();
+        iterations = ws.iterations;
+        p          = ws.p;
 
-        Eigen::ArrayXd const rs  = (data - model.signal(p, fixed));
-        double const         var = rs.square().sum();
-        rmse                     = sqrt(var / data.rows()) * scale;
+        auto const &         data = cost.data;
+        Eigen::ArrayXd const rs   = (data - model.signal(p, fixed));
+        double const         var  = rs.square().sum();
+        rmse                      = sqrt(var / data.rows()) * scale;
         if (residuals.size() > 0) {
             residuals[0] = rs * scale;
         }
         if (cov) {
-            QI::GetModelCovariance<ModelType>(problem, p, var / (data.rows() - ModelType::NV), cov);
+            ws.Covariance(var / (data.rows() - ModelType::NV), cov);
         }
         p[0] *= scale; // Multiply signals/proton density back up
         return {true, ""};
@@ -231,6 +379,7 @@ struct DESPOT2NLLS : DESPOT2Fit {
 int despot2_main(args::Subparser &parser) {
     args::Positional<std::string> ssfp_path(parser, "SSFP FILE", "Path to SSFP data");
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     args::ValueFlag<std::string> t1_path(parser, "T1 MAP", "Path to T1 map **REQUIRED**", {"T1"});
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio) file", {'b', "B1"});
     args::ValueFlag<char> algorithm(parser, "ALGO", "Choose algorithm (l/w/n)", {'a', "algo"}, 'l');
@@ -238,6 +387,8 @@ int despot2_main(args::Subparser &parser) {
         parser, "GS", "Data is band-free geometric solution / ellipse data", {'g', "gs"});
     args::ValueFlag<int> its(
         parser, "ITERS", "Max iterations for WLLS/NLLS (default 15)", {'i', "its"}, 15);
+    args::ValueFlag<std::string> solver(
+        parser, "SOLVER", "Solver for NLLS, ceres or lm (default ceres)", {"solver"}, "ceres");
     parser.Parse();
 
     QI::Log(verbose, "Reading sequence information");
@@ -268,7 +419,7 @@ int despot2_main(args::Subparser &parser) {
             QI::Log(verbose, "WLLS algorithm selected.");
             break;
         case 'n':
-            d2 = new DESPOT2NLLS(model);
+            d2 = new DESPOT2NLLS(model, QI::ParseNLLSSolver(solver.Get()));
             QI::Log(verbose, "NLLS algorithm selected.");
             break;
         }
@@ -278,6 +429,16 @@ int despot2_main(args::Subparser &parser) {
         }
         auto fit = QI::ModelFitFilter<DESPOT2Fit>::New(
             d2, verbose, covar, resids, threads.Get(), subregion.Get());
+        fit->SetBatchSize(batch.Get());
+        fit->SetDynamicSchedule(dynamic.Get());
+        fit->SetStreamSlabs(stream_slabs.Get());
+        fit->SetCheckpoint(resume.Get(),
+                           fmt::format("{} algo: {} gs: {} its: {} solver: {}",
+                                       input.dump(),
+                                       algorithm.Get(),
+                                       gs_arg.Get(),
+                                       its.Get(),
+                                       solver.Get()));
         fit->ReadInputs({QI::CheckPos(ssfp_path)}, {QI::CheckValue(t1_path), B1.Get()}, mask.Get());
         fit->Update();
         fit->WriteOutputs(prefix.Get() + "D2_");
@@ -69,6 +69,40 @@ struct FMModel : QI::Model<double, double, 3, 2> {
             (sin_psi - a * (cos_th * sin_psi + sin_th * cos_psi)) * G / (1.0 - b * cos_th);
         return sqrt(re_m.square() + im_m.square());
     }
+
+    /*
+     *  The magnitude is |PD G (1 - E2 exp(i theta)) / (1 - b cos(theta))|, so the log-derivatives
+     *  of each factor add up. T2 only enters through E2 and f0 through theta.
+     */
+    Eigen::ArrayXd jacobian(VaryingArray const &v, FixedArray const &f, Eigen::ArrayXXd &J) const {
+        double const PD = v[0];
+        double const T2 = v[1];
+        double const f0 = v[2];
+        auto const & s  = sequence;
+
+        double const         E1    = exp(-s.TR / f[0]);
+        double const         E2    = exp(-s.TR / T2);
+        Eigen::ArrayXd const ca    = (f[1] * s.FA).cos();
+        Eigen::ArrayXd const sa    = (f[1] * s.FA).sin();
+        Eigen::ArrayXd const d     = 1. - E1 * ca - (E2 * E2) * (E1 - ca);
+        Eigen::ArrayXd const dd    = -2. * E2 * (E1 - ca);
+        Eigen::ArrayXd const b     = E2 * (1. - E1) * (1. + ca) / d;
+        Eigen::ArrayXd const db    = b * (1. / E2 - dd / d);
+        Eigen::ArrayXd const theta = 2. * M_PI * f0 * s.TR + s.PhaseInc;
+        Eigen::ArrayXd const ct    = theta.cos();
+        Eigen::ArrayXd const st    = theta.sin();
+        Eigen::ArrayXd const q2    = 1. - 2. * E2 * ct + E2 * E2;
+        Eigen::ArrayXd const D     = 1. - b * ct;
+
+        Eigen::ArrayXd const dlnS_dE2 = 0.5 / E2 - dd / d + (E2 - ct) / q2 + ct * db / D;
+        Eigen::ArrayXd const dlnS_dth = E2 * st / q2 - b * st / D;
+
+        J.col(0) = (sqrt(E2) * (1. - E1) * sa * q2.sqrt() / (d * D)).abs();
+        Eigen::ArrayXd const S = PD * J.col(0); // PD is bounded to be positive
+        J.col(1)               = S * dlnS_dE2 * E2 * s.TR / (T2 * T2);
+        J.col(2)               = S * dlnS_dth * 2. * M_PI * s.TR;
+        return S;
+    }
 };
 
 using FMFit = QI::FitFunction<FMModel>;
@@ -101,11 +135,10 @@ struct FMNLLS : FMFit {
             double         best = std::numeric_limits<double>::infinity();
             Eigen::Array3d p;
             ceres::Problem problem;
-            using Cost      = QI::ModelCost<FMModel>;
-            using AutoCost  = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, FMModel::NV>;
-            auto *cost      = new Cost{model, fixed, data};
-            auto *auto_cost = new AutoCost(cost, model.sequence.size());
-            problem.AddResidualBlock(auto_cost, NULL, p.data());
+            using Cost = QI::ModelCost<FMModel>;
+            auto *cost = QI::MakeCostFunction<FMModel::NV>(new Cost{model, fixed, data},
+                                                           model.sequence.size());
+            problem.AddResidualBlock(cost, NULL, p.data());
             problem.SetParameterLowerBound(p.data(), 0, 1.);
             problem.SetParameterLowerBound(p.data(), 1, model.sequence.TR);
             problem.SetParameterUpperBound(p.data(), 1, T1);
@@ -169,6 +202,7 @@ struct FMNLLS : FMFit {
 int despot2fm_main(args::Subparser &parser) {
     args::Positional<std::string> ssfp_path(parser, "SSFP_FILE", "Input SSFP file");
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     args::ValueFlag<std::string> t1_path(parser, "T1_MAP", "Input T1 map ** REQUIRED **", {"T1"});
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio) file", {'b', "B1"});
     args::ValueFlag<int>         its(
@@ -197,6 +231,11 @@ int despot2fm_main(args::Subparser &parser) {
         auto fit_filter =
             QI::ModelFitFilter<FMNLLS>::New(
                 &fm, verbose, covar, resids, threads.Get(), subregion.Get());
+        fit_filter->SetBatchSize(batch.Get());
+        fit_filter->SetDynamicSchedule(dynamic.Get());
+        fit_filter->SetStreamSlabs(stream_slabs.Get());
+        fit_filter->SetCheckpoint(
+            resume.Get(), fmt::format("{} its: {} asym: {}", input.dump(), its.Get(), asym.Get()));
         fit_filter->ReadInputs(
             {QI::CheckPos(ssfp_path)}, {QI::CheckValue(t1_path), B1.Get()}, mask.Get());
         fit_filter->Update();
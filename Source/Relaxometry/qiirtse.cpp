@@ -108,6 +108,7 @@ struct IRTSENLLS : IRTSEFit {
 int irtse_main(args::Subparser &parser) {
     args::Positional<std::string> input_path(parser, "INPUT FILE", "Input multi-TI data");
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     parser.Parse();
     QI::CheckPos(input_path);
     QI::Log(verbose, "Reading sequence parameters");
@@ -133,6 +134,10 @@ int irtse_main(args::Subparser &parser) {
         auto fit =
             QI::ModelFitFilter<IRTSEFit>::New(
                 me, verbose, covar, resids, threads.Get(), subregion.Get());
+        fit->SetBatchSize(batch.Get());
+        fit->SetDynamicSchedule(dynamic.Get());
+        fit->SetStreamSlabs(stream_slabs.Get());
+        fit->SetCheckpoint(resume.Get(), input.dump());
         fit->ReadInputs({QI::CheckPos(input_path)}, {}, mask.Get());
         const int nvols = fit->GetInput(0)->GetNumberOfComponentsPerPixel();
         if (nvols % sequence.size() == 0) {
@@ -13,8 +13,11 @@
 // #define QI_DEBUG_BUILD
 
 #include "ceres/ceres.h"
+#include "itkMultiThreaderBase.h"
 #include <Eigen/Core>
 #include <array>
+#include <filesystem>
+#include <memory>
 
 #include "Args.h"
 #include "FitFunction.h"
@@ -24,47 +27,65 @@
 #include "RegionContraction.h"
 #include "SPGRSequence.h"
 #include "SSFPSequence.h"
+#include "SignalDictionary.h"
 #include "SimulateModel.h"
 #include "ThreePoolModel.h"
 #include "TwoPoolModel.h"
 #include "Util.h"
 
 template <typename Model> struct MCDSRCFunctor {
-    const Eigen::ArrayXd data, weights;
-    const QI_ARRAYN(double, Model::NF) fixed;
-    const Model &model;
-
-    MCDSRCFunctor(const Model &m,
-                  const QI_ARRAYN(double, Model::NF) & f,
-                  const Eigen::ArrayXd &d,
-                  const Eigen::ArrayXd &w) :
-        data(d),
-        weights(w), fixed(f), model(m) {}
+    Model const *  model = nullptr;
+    Eigen::ArrayXd data, weights;
+    QI_ARRAYN(double, Model::NF) fixed;
+    Eigen::ArrayXXd signals; // One column per sample in a block
 
     int inputs() const { return Model::NV; }
-    int values() const { return model.spgr.size() + model.ssfp.size(); }
+    int values() const { return model->spgr.size() + model->ssfp.size(); }
 
     bool constraint(const QI_ARRAYN(double, Model::NV) & varying) const {
-        return model.valid(varying);
+        return model->valid(varying);
     }
 
     Eigen::ArrayXd residuals(const QI_ARRAYN(double, Model::NV) & varying) const {
-        return data - model.signal(varying, fixed);
+        return data - model->signal(varying, fixed);
     }
 
-    double operator()(const QI_ARRAYN(double, Model::NV) & varying) const {
-        return (residuals(varying) * weights).square().sum();
+    void operator()(Eigen::Ref<Eigen::ArrayXXd const> const &samples,
+                    Eigen::Ref<Eigen::ArrayXd>               cost) {
+        auto const n = samples.cols();
+        if (signals.cols() < n) {
+            signals.resize(values(), n);
+        }
+        for (Eigen::Index s = 0; s < n; s++) {
+            signals.col(s) = model->signal(samples.col(s), fixed);
+        }
+        cost = ((signals.leftCols(n).colwise() - data).colwise() * weights)
+                   .square()
+                   .colwise()
+                   .sum()
+                   .transpose();
     }
 };
 
+/*
+ *  The region contraction buffers are kept between voxels on each thread
+ */
+template <typename Model> struct SRCWorkspace {
+    MCDSRCFunctor<Model>      func;
+    QI::RegionContraction     rc;
+    std::vector<Eigen::Index> matches;
+    Eigen::VectorXf           scores;
+};
+
 template <typename Model> struct SRCFit {
     static const bool Blocked = false;
-    static const bool Indexed = false;
+    static const bool Indexed = true;
     using InputType           = double;
     using OutputType          = double;
     using RMSErrorType        = double;
     using FlagType            = int;
     using ModelType           = Model;
+    using Workspace           = SRCWorkspace<Model>;
     Model &model;
 
     int input_size(const int &i) const {
@@ -78,9 +99,13 @@ template <typename Model> struct SRCFit {
     }
     int n_outputs() const { return Model::NV; }
 
-    int    max_iterations = 5;
-    size_t src_samples = 5000, src_retain = 50;
-    bool   src_gauss = true;
+    int                               max_iterations = 5;
+    size_t                            src_samples = 5000, src_retain = 50;
+    bool                              src_gauss = true;
+    std::uint64_t                     seed      = 0;
+    QI::SignalDictionary const *      dictionary      = nullptr;
+    bool                              dictionary_only = false;
+    QI::PerThreadWorkspace<Workspace> workspace{};
 
     QI::FitReturnType fit(const std::vector<Eigen::ArrayXd> &inputs,
                           typename Model::FixedArray const & fixed,
@@ -88,8 +113,23 @@ template <typename Model> struct SRCFit {
                           typename Model::CovarArray * /*Unused */,
                           RMSErrorType &               residual,
                           std::vector<Eigen::ArrayXd> &residuals,
-                          FlagType &                   iterations) const {
-        Eigen::ArrayXd data = Eigen::ArrayXd::Zero(model.ssfp.size() + model.spgr.size());
+                          FlagType &                   iterations,
+                          const itk::Index<3> &        index) const {
+        Workspace &ws = workspace.get([&](Workspace &w) {
+            QI_ARRAYN(double, Model::NV) thresh = QI_ARRAYN(double, Model::NV)::Constant(0.05);
+            w.func.model = &model;
+            w.rc         = QI::RegionContraction(model.bounds_lo,
+                                                 model.bounds_hi,
+                                                 thresh,
+                                                 src_samples,
+                                                 src_retain,
+                                                 max_iterations,
+                                                 0.02,
+                                                 src_gauss,
+                                                 false);
+        });
+        auto &data = ws.func.data;
+        data.resize(model.ssfp.size() + model.spgr.size());
         if (model.scale_to_mean) {
             QI_DBMSG("Scaling\n");
             data.head(model.spgr.size()) = inputs[0] / inputs[0].mean();
@@ -99,29 +139,49 @@ template <typename Model> struct SRCFit {
             data.tail(model.ssfp.size()) = inputs[1];
         }
         QI_DBVEC(data);
-        QI_ARRAYN(double, Model::NV) thresh = QI_ARRAYN(double, Model::NV)::Constant(0.05);
-        const double & f0                   = fixed[0];
-        Eigen::ArrayXd weights(model.spgr.size() + model.ssfp.size());
+        const double &f0      = fixed[0];
+        auto &        weights = ws.func.weights;
+        weights.resize(model.spgr.size() + model.ssfp.size());
         weights.head(model.spgr.size()) = 1;
         weights.tail(model.ssfp.size()) = model.ssfp.weights(f0);
+        ws.func.fixed                   = fixed;
         QI_DBVEC(fixed);
         QI_DBVEC(weights);
-        using Functor = MCDSRCFunctor<Model>;
-        Functor                        func(model, fixed, data, weights);
-        QI::RegionContraction<Functor> rc(func,
-                                          model.bounds_lo,
-                                          model.bounds_hi,
-                                          thresh,
-                                          src_samples,
-                                          src_retain,
-                                          max_iterations,
-                                          0.02,
-                                          src_gauss,
-                                          false);
-        if (!rc.optimise(v)) {
-            return {false, "Region contraction failed"};
+        if (dictionary) {
+            // The best matches replace the first, most expensive, contraction
+            auto const slice = dictionary->slice(fixed[1], f0);
+            dictionary->nearest(
+                slice, data, dictionary_only ? 1 : src_retain, ws.matches, ws.scores);
+            auto const      entries = dictionary->parameters();
+            Eigen::ArrayXXd region(Model::NV, 2);
+            region.col(0) = entries.col(ws.matches[0]);
+            region.col(1) = entries.col(ws.matches[0]);
+            for (auto const m : ws.matches) {
+                region.col(0) = region.col(0).min(entries.col(m));
+                region.col(1) = region.col(1).max(entries.col(m));
+            }
+            if (dictionary_only) {
+                v          = region.col(0);
+                iterations = 0;
+            } else {
+                Eigen::ArrayXd const w = region.col(1) - region.col(0);
+                region.col(0)          = (region.col(0) - w * 0.02).max(model.bounds_lo);
+                region.col(1)          = (region.col(1) + w * 0.02).min(model.bounds_hi);
+                ws.rc.setRegion(region);
+            }
+        }
+        if (!dictionary_only) {
+            // Each voxel has its own random stream, so results do not depend on the thread layout
+            std::uint64_t const voxel = std::uint64_t(index[0]) |
+                                        (std::uint64_t(index[1]) << 21) |
+                                        (std::uint64_t(index[2]) << 42);
+            if (!ws.rc.optimise(
+                    ws.func, v, QI::CounterRNG::Mix(seed ^ QI::CounterRNG::Mix(voxel)))) {
+                return {false, "Region contraction failed"};
+            }
+            iterations = ws.rc.contractions();
         }
-        auto r   = func.residuals(v);
+        auto r   = ws.func.residuals(v);
         residual = sqrt(r.square().sum() / r.rows());
         if (residuals.size() > 0) {
             residuals[0] = r.head(model.spgr.size());
@@ -130,11 +190,88 @@ template <typename Model> struct SRCFit {
         QI_DBVEC(residuals[0]);
         QI_DBVEC(residuals[1]);
         QI_DBVEC(v);
-        iterations = rc.contractions();
         return {true, ""};
     }
 };
 
+/*
+ *  Identifies the sequences, model, bounds, size and B1/f0 grids that a dictionary was built for
+ */
+template <typename Model>
+std::uint64_t DictionaryProtocol(json const &          input,
+                                 Model const &         model,
+                                 std::string const &   name,
+                                 Eigen::Index const    n,
+                                 Eigen::ArrayXd const &B1,
+                                 Eigen::ArrayXd const &f0) {
+    auto const bytes = [](auto const &a) {
+        return std::string(reinterpret_cast<char const *>(a.data()), a.size() * sizeof(double));
+    };
+    return QI::SignalDictionary::Hash(name + (model.scale_to_mean ? "scaled" : "") +
+                                      input.at("SPGR").dump() + input.at("SSFP").dump() +
+                                      bytes(model.bounds_lo) + bytes(model.bounds_hi) +
+                                      std::to_string(n) + bytes(B1) + "/" + bytes(f0));
+}
+
+/*
+ *  Simulate the signals for a Halton sequence over the model bounds, keeping only samples that
+ *  satisfy the model constraints, at every combination of the B1 and f0 grid points
+ */
+template <typename Model>
+void BuildDictionary(Model const &         model,
+                     std::string const &   path,
+                     std::uint64_t const   protocol,
+                     Eigen::Index const    n,
+                     Eigen::ArrayXd const &B1,
+                     Eigen::ArrayXd const &f0,
+                     int const             threads) {
+    static int const primes[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37};
+    static_assert(Model::NV <= 12, "Not enough primes for the Halton sequence");
+    Eigen::ArrayXXd params(Model::NV, n);
+    std::uint64_t   i = 1; // Element 0 is all zeros
+    for (Eigen::Index e = 0; e < n; i++) {
+        if (i > 1000 * static_cast<std::uint64_t>(n)) {
+            QI::Fail("Could not find enough valid samples for the dictionary");
+        }
+        typename Model::VaryingArray v;
+        for (int p = 0; p < Model::NV; p++) {
+            v[p] = model.bounds_lo[p] +
+                   QI::Halton(i, primes[p]) * (model.bounds_hi[p] - model.bounds_lo[p]);
+        }
+        if (model.valid(v)) {
+            params.col(e++) = v;
+        }
+    }
+
+    auto const                   n_data = model.spgr.size() + model.ssfp.size();
+    std::vector<Eigen::ArrayXXf> signals(B1.rows() * f0.rows(), Eigen::ArrayXXf(n_data, n));
+    std::vector<Eigen::ArrayXf>  weights(B1.rows() * f0.rows(), Eigen::ArrayXf(n_data));
+    for (Eigen::Index j = 0; j < f0.rows(); j++) {
+        for (Eigen::Index b = 0; b < B1.rows(); b++) {
+            auto &w                   = weights[b + j * B1.rows()];
+            w.head(model.spgr.size()) = 1.f;
+            // Squared, as MCDSRCFunctor weights the residuals
+            w.tail(model.ssfp.size()) = model.ssfp.weights(f0[j]).square().template cast<float>();
+        }
+    }
+    auto mt = itk::MultiThreaderBase::New();
+    mt->SetNumberOfWorkUnits(threads);
+    mt->ParallelizeArray(
+        0,
+        n,
+        [&](itk::SizeValueType const e) {
+            for (Eigen::Index j = 0; j < f0.rows(); j++) {
+                for (Eigen::Index b = 0; b < B1.rows(); b++) {
+                    typename Model::FixedArray const fixed{f0[j], B1[b]};
+                    signals[b + j * B1.rows()].col(e) =
+                        model.signal(params.col(e), fixed).template cast<float>();
+                }
+            }
+        },
+        nullptr);
+    QI::SignalDictionary::Write(path, protocol, B1, f0, params, signals, weights);
+}
+
 //******************************************************************************
 // Main
 //******************************************************************************
@@ -142,6 +279,7 @@ int mcdespot_main(args::Subparser &parser) {
     args::Positional<std::string> spgr_path(parser, "SPGR FILE", "Input SPGR file");
     args::Positional<std::string> ssfp_path(parser, "SSFP FILE", "Input SSFP file");
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     args::ValueFlag<std::string> f0(parser, "f0", "f0 map (Hertz)", {'f', "f0"});
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio)", {'b', "B1"});
     args::ValueFlag<int>         modelarg(
@@ -151,9 +289,24 @@ int mcdespot_main(args::Subparser &parser) {
         parser, "SRC", "Use flat prior (stochastic region contraction), not gaussian", {"SRC"});
     args::ValueFlag<int> its(parser, "ITERS", "Max iterations, default 4", {'i', "its"}, 4);
     args::Flag           bounds(parser, "BOUNDS", "Specify bounds in input", {"bounds"});
+    args::ValueFlag<std::uint64_t> seed(
+        parser, "SEED", "Random seed for region contraction (default random)", {"seed"});
+    args::ValueFlag<std::string> dict_path(
+        parser, "DICT", "Start from a signal dictionary, built if it does not exist", {"dict"});
+    args::ValueFlag<int> dict_size(parser,
+                                   "DICT SIZE",
+                                   "Entries when building a dictionary (default 50000)",
+                                   {"dict-size"},
+                                   50000);
+    args::Flag dict_only(
+        parser, "DICT ONLY", "Use the nearest dictionary entry, do not run SRC", {"dict-only"});
     parser.Parse();
     QI::CheckPos(spgr_path);
     QI::CheckPos(ssfp_path);
+    if (resume && !seed && !dict_only) {
+        // The resumed slabs must draw from the same random streams as the finished ones
+        QI::Fail("--resume requires --seed");
+    }
 
     QI::Log(verbose, "Reading sequences");
     auto input = json_file ? QI::ReadJSON(json_file.Get()) : QI::ReadJSON(std::cin);
@@ -175,6 +328,8 @@ int mcdespot_main(args::Subparser &parser) {
             using FitType = SRCFit<decltype(model)>;
             FitType src{model};
             src.src_gauss = !use_src;
+            src.seed      = seed ? seed.Get() : QI::RandomSeed();
+            QI::Log(verbose, "Random seed: {}", src.seed);
             if (bounds) {
                 src.model.bounds_lo = QI::ArrayFromJSON<double>(input, "lower_bounds");
                 src.model.bounds_hi = QI::ArrayFromJSON<double>(input, "upper_bounds");
@@ -182,9 +337,60 @@ int mcdespot_main(args::Subparser &parser) {
             QI::Log(verbose, "Low bounds: {}", src.model.bounds_lo.transpose());
             QI::Log(verbose, "High bounds: {}", src.model.bounds_hi.transpose());
 
+            std::unique_ptr<QI::SignalDictionary> dictionary;
+            if (dict_path) {
+                if (!scale) {
+                    QI::Fail("Dictionary matching requires --scale");
+                }
+                auto const grid = [&](std::string const &key, double const def) {
+                    return input.contains(key) ? QI::ArrayFromJSON<double>(input, key) :
+                                                 Eigen::ArrayXd::Constant(1, def);
+                };
+                Eigen::ArrayXd const dict_B1  = grid("dictionary_B1", 1.0);
+                Eigen::ArrayXd const dict_f0  = grid("dictionary_f0", 0.0);
+                auto const           protocol = DictionaryProtocol(
+                    input, src.model, model_name, dict_size.Get(), dict_B1, dict_f0);
+                if (std::filesystem::exists(dict_path.Get())) {
+                    QI::Log(verbose, "Reading existing dictionary {}", dict_path.Get());
+                } else {
+                    QI::Log(verbose, "Building dictionary {}", dict_path.Get());
+                    BuildDictionary(src.model,
+                                    dict_path.Get(),
+                                    protocol,
+                                    dict_size.Get(),
+                                    dict_B1,
+                                    dict_f0,
+                                    threads.Get());
+                }
+                dictionary = std::make_unique<QI::SignalDictionary>(dict_path.Get());
+                if (dictionary->header().protocol != protocol) {
+                    QI::Fail("Dictionary {} was built for a different protocol, model, size or "
+                             "B1/f0 grid, delete it to rebuild",
+                             dict_path.Get());
+                }
+                QI::Log(verbose, "Dictionary has {} entries", dictionary->size());
+                src.dictionary      = dictionary.get();
+                src.dictionary_only = dict_only;
+            }
+
             auto fit_filter =
                 QI::ModelFitFilter<FitType>::New(
                     &src, verbose, covar, resids, threads.Get(), subregion.Get());
+            fit_filter->SetBatchSize(batch.Get());
+            fit_filter->SetDynamicSchedule(dynamic.Get());
+            fit_filter->SetStreamSlabs(stream_slabs.Get());
+            fit_filter->SetCheckpoint(resume.Get(),
+                                      fmt::format("{} model: {} scale: {} SRC: {} its: {} seed: {}"
+                                                  " dict: {} dict-size: {} dict-only: {}",
+                                                  input.dump(),
+                                                  modelarg.Get(),
+                                                  scale.Get(),
+                                                  use_src.Get(),
+                                                  its.Get(),
+                                                  dict_only ? 0 : src.seed,
+                                                  dict_path.Get(),
+                                                  dict_size.Get(),
+                                                  dict_only.Get()));
             fit_filter->ReadInputs(
                 {spgr_path.Get(), ssfp_path.Get()}, {f0.Get(), B1.Get()}, mask.Get());
             fit_filter->Update();
@@ -10,6 +10,7 @@
  *
  */
 
+#include <algorithm>
 #include <array>
 
 #include "ceres/ceres.h"
@@ -44,6 +45,14 @@ struct MultiEcho : QI::Model<double, double, 2, 0> {
         const T &T2 = p[1];
         return PD * exp(-sequence.TE / T2);
     }
+
+    Eigen::ArrayXd jacobian(VaryingArray const &p, FixedArray const &, Eigen::ArrayXXd &J) const {
+        double const PD = p[0];
+        double const T2 = p[1];
+        J.col(0)        = (-sequence.TE / T2).exp();
+        J.col(1)        = PD * J.col(0) * sequence.TE / (T2 * T2);
+        return PD * J.col(0);
+    }
 };
 
 using MultiEchoFit = QI::BlockFitFunction<MultiEcho>;
@@ -73,6 +82,35 @@ struct MultiEchoLogLin : MultiEchoFit {
         iterations = 1;
         return {true, ""};
     }
+
+    // The design matrix is the same for every voxel, so the whole batch is one matrix product
+    void fit_batch(QI::FitBatch<MultiEcho> &batch) const override {
+        auto const      n = batch.size;
+        Eigen::MatrixXd X(model.sequence.size(), 2);
+        X.col(0) = model.sequence.TE;
+        X.col(1).setOnes();
+        Eigen::MatrixXd const W = (X.transpose() * X).partialPivLu().solve(X.transpose());
+        Eigen::MatrixXd const Y = batch.inputs[0].topRows(n).log().matrix();
+        Eigen::MatrixXd const b = Y * W.transpose();
+
+        auto PD = batch.varying.col(0).head(n);
+        auto T2 = batch.varying.col(1).head(n);
+        PD      = b.col(1).array().exp();
+        T2      = -1. / b.col(0).array();
+
+        Eigen::ArrayXd sum = Eigen::ArrayXd::Zero(n);
+        Eigen::ArrayXd r(n);
+        for (Eigen::Index j = 0; j < model.sequence.size(); j++) {
+            r = batch.inputs[0].col(j).head(n) - PD * (-model.sequence.TE[j] / T2).exp();
+            sum += r.square();
+            if (batch.residuals.size() > 0) {
+                batch.residuals[0].col(j).head(n) = r;
+            }
+        }
+        batch.rmse.head(n) = (sum / model.sequence.size()).sqrt();
+        batch.flag.head(n).setOnes();
+        std::fill_n(batch.status.begin(), n, QI::FitReturnType{true, ""});
+    }
 };
 
 struct MultiEchoARLO : MultiEchoFit {
@@ -110,7 +148,13 @@ struct MultiEchoARLO : MultiEchoFit {
 };
 
 struct MultiEchoNLLS : MultiEchoFit {
-    using MultiEchoFit::MultiEchoFit;
+    using Cost      = QI::ModelCost<MultiEcho>;
+    using Workspace = QI::CeresWorkspace<MultiEcho, Cost>;
+    QI::PerThreadWorkspace<Workspace> workspace;
+    QI::NLLSSolver                    solver;
+
+    MultiEchoNLLS(MultiEcho &m, QI::NLLSSolver const s) : MultiEchoFit(m), solver{s} {}
+
     QI::FitReturnType fit(const std::vector<Eigen::ArrayXd> &inputs,
                           MultiEcho::FixedArray const &      fixed,
                           MultiEcho::VaryingArray &          p,
@@ -125,39 +169,34 @@ struct MultiEchoNLLS : MultiEchoFit {
             rmse = 0;
             return {false, "Maximum data value was not positive"};
         }
-        const Eigen::ArrayXd data = inputs[0] / scale;
-        p                         = model.start;
-        ceres::Problem problem;
-        using Cost      = QI::ModelCost<MultiEcho>;
-        using AutoCost  = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, MultiEcho::NV>;
-        auto *cost      = new Cost{model, fixed, data};
-        auto *auto_cost = new AutoCost(cost, model.sequence.size());
-        problem.AddResidualBlock(auto_cost, NULL, p.data());
-        problem.SetParameterLowerBound(p.data(), 0, 1.0e-6);
-        problem.SetParameterUpperBound(p.data(), 0, model.bounds_hi[0] / scale);
-        problem.SetParameterLowerBound(p.data(), 1, 1.0e-3);
-        problem.SetParameterUpperBound(p.data(), 1, model.bounds_hi[1]);
-        ceres::Solver::Options options;
-        ceres::Solver::Summary summary;
-        options.max_num_iterations  = 50;
-        options.function_tolerance  = 1e-5;
-        options.gradient_tolerance  = 1e-6;
-        options.parameter_tolerance = 1e-4;
-        options.logging_type        = ceres::SILENT;
-        ceres::Solve(options, &problem, &summary);
-        if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+        Workspace &ws = workspace.get([&](Workspace &w) {
+            w.AddAutoDiff<0>(new Cost{model, fixed, inputs[0] / scale}, model.sequence.size());
+            w.options.max_num_iterations  = 50;
+            w.options.function_tolerance  = 1e-5;
+            w.options.gradient_tolerance  = 1e-6;
+            w.options.parameter_tolerance = 1e-4;
+        });
+        auto &cost = ws.cost<0>();
+        cost.fixed = fixed;
+        cost.data  = inputs[0] / scale;
+        ws.SetBounds(MultiEcho::VaryingArray{1.0e-6, 1.0e-3},
+                     MultiEcho::VaryingArray{model.bounds_hi[0] / scale, model.bounds_hi[1]});
+        ws.p = model.start;
+        if (!ws.Solve(solver)) {
+            return {false, ws.message};
         }
-        iterations = summary.iterations.size();
+        iterations = ws.iterations;
+        p          = ws.p;
 
-        Eigen::ArrayXd const rs  = (data - model.signal(p, fixed));
-        double const         var = rs.square().sum();
-        rmse                     = sqrt(var / data.rows()) * scale;
+        auto const &         data = cost.data;
+        Eigen::ArrayXd const rs   = (data - model.signal(p, fixed));
+        double const         var  = rs.square().sum();
+        rmse                      = sqrt(var / data.rows()) * scale;
         if (residuals.size() > 0) {
             residuals[0] = rs * scale;
         }
         if (cov) {
-            QI::GetModelCovariance<ModelType>(problem, p, var / (data.rows() - ModelType::NV), cov);
+            ws.Covariance(var / (data.rows() - ModelType::NV), cov);
         }
         p[0] = p[0] * scale;
         return {true, ""};
@@ -170,7 +209,10 @@ struct MultiEchoNLLS : MultiEchoFit {
 int multiecho_main(args::Subparser &parser) {
     args::Positional<std::string> input_path(parser, "INPUT FILE", "Input multi-echo data");
     QI_COMMON_ARGS;
+    QI_FIT_ARGS;
     args::ValueFlag<char> algorithm(parser, "ALGO", "Choose algorithm (l/a/n)", {'a', "algo"}, 'l');
+    args::ValueFlag<std::string> solver(
+        parser, "SOLVER", "Solver for NLLS, ceres or lm (default ceres)", {"solver"}, "ceres");
     parser.Parse();
     QI::CheckPos(input_path);
     QI::Log(verbose, "Reading sequence parameters");
@@ -200,7 +242,7 @@ int multiecho_main(args::Subparser &parser) {
             QI::Log(verbose, "ARLO algorithm selected.");
             break;
         case 'n':
-            me = new MultiEchoNLLS(model);
+            me = new MultiEchoNLLS(model, QI::ParseNLLSSolver(solver.Get()));
             QI::Log(verbose, "Non-linear algorithm (Levenberg Marquardt) selected.");
             break;
         default:
@@ -209,6 +251,14 @@ int multiecho_main(args::Subparser &parser) {
         auto fit =
             QI::ModelFitFilter<MultiEchoFit>::New(
                 me, verbose, covar, resids, threads.Get(), subregion.Get());
+        fit->SetBatchSize(batch.Get());
+        fit->SetDynamicSchedule(dynamic.Get());
+        fit->SetStreamSlabs(stream_slabs.Get());
+        fit->SetCheckpoint(resume.Get(),
+                           fmt::format("{} algo: {} solver: {}",
+                                       input.dump(),
+                                       algorithm.Get(),
+                                       solver.Get()));
         fit->ReadInputs({QI::CheckPos(input_path)}, {}, mask.Get());
         const int nvols = fit->GetInput(0)->GetNumberOfComponentsPerPixel();
         if (nvols % sequence.size() == 0) {
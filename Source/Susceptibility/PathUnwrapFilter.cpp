@@ -14,9 +14,16 @@
  *  avoids singularity loops, http://ao.osa.org/abstract.cfm?URI=ao-48-23-4582
  */
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
 #include "PathUnwrapFilter.h"
-#include "itkConstNeighborhoodIterator.h"
-#include "itkImageRegionIterator.h"
+#include "Log.h"
+#include "itkMultiThreaderBase.h"
 
 namespace itk {
 
@@ -34,7 +41,8 @@ UnwrapPathPhaseFilter::UnwrapPathPhaseFilter() {
     this->SetNthOutput(0, this->MakeOutput(0));
 }
 
-int UnwrapPathPhaseFilter::find_wrap(float phase1, float phase2) {
+namespace {
+int find_wrap(float phase1, float phase2) {
     const float difference = phase1 - phase2;
     if (difference > M_PI) {
         return -1;
@@ -45,94 +53,269 @@ int UnwrapPathPhaseFilter::find_wrap(float phase1, float phase2) {
     }
 }
 
-// Do not point shared_ptrs as references, otherwise group2 gets deallocated during loop
-void UnwrapPathPhaseFilter::merge_groups(std::shared_ptr<std::list<Voxel *>> group1,
-                    std::shared_ptr<std::list<Voxel *>> group2,
-                    int wrap_delta) {
-    for (auto v : *group2) {
-        v->group = group1;
-        v->wraps += wrap_delta;
+using Edge = UnwrapPathPhaseFilter::Edge;
+
+// Float bit patterns sort as unsigned integers once negative values are flipped
+std::uint32_t sort_key(float reliability) {
+    if (reliability == 0.f) {
+        reliability = 0.f; // Make -0 sort with +0
     }
-    group1->splice(group1->end(), *group2);
+    std::uint32_t bits;
+    std::memcpy(&bits, &reliability, sizeof(bits));
+    return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
 }
 
-void UnwrapPathPhaseFilter::GenerateData() {
-    //std::cout <<  __PRETTY_FUNCTION__ << std::endl;
-    const auto region = this->GetInput()->GetLargestPossibleRegion();
-    const auto volume_size = region.GetSize()[0] * region.GetSize()[1] * region.GetSize()[2];
-    int volume_width = region.GetSize()[0];
-    int volume_height = region.GetSize()[1];
-    int volume_depth = region.GetSize()[2];
-
-    std::vector<Voxel> voxels;
-    voxels.reserve(volume_size);
-    ImageRegionConstIterator<TImage> phaseIter(this->GetInput(0), region);
-    ImageRegionConstIterator<TImage> relIter(this->GetInput(1), region);
-    while (!phaseIter.IsAtEnd()) {
-        voxels.emplace_back(Voxel{phaseIter.Get(), relIter.Get()});
-        voxels.back().group->push_front(&voxels.back());
-        ++phaseIter; ++relIter;
+/*
+ * LSD radix sort in three passes of 11 bits. This is stable, so edges with equal reliability
+ * stay in the order they were generated, exactly as std::stable_sort left them.
+ */
+void sort_edges(std::vector<Edge> &edges) {
+    std::vector<Edge> scratch(edges.size());
+    for (int shift = 0; shift < 32; shift += 11) {
+        std::array<std::size_t, 2048> counts{};
+        for (auto const &e : edges) {
+            counts[(e.key >> shift) & 2047]++;
+        }
+        if (edges.empty() || counts[(edges.front().key >> shift) & 2047] == edges.size()) {
+            continue; // All in one bucket, nothing to do for this digit
+        }
+        std::size_t total = 0;
+        for (auto &c : counts) {
+            const std::size_t n = c;
+            c                   = total;
+            total += n;
+        }
+        for (auto const &e : edges) {
+            scratch[counts[(e.key >> shift) & 2047]++] = e;
+        }
+        edges.swap(scratch);
     }
-    std::vector<Edge> edges;
-    edges.reserve(3 * volume_size);
-    std::vector<Voxel>::iterator v_it = voxels.begin();
-    for (int n=0; n < volume_depth; n++) {
-        for (int i = 0; i < volume_height; i++) {
-            for (int j = 0; j < volume_width - 1; j++) {
-                edges.emplace_back(Edge{v_it->reliability + (v_it + 1)->reliability,
-                                    &*v_it, &*(v_it + 1),
-                                    find_wrap(v_it->phase, (v_it + 1)->phase)});
-                v_it++;
-            }
-        v_it++;
+}
+
+/*
+ * Union-find over voxels. Each voxel stores its wraps relative to its parent, and a root stores
+ * the absolute wraps of its group, so a merge only changes the root of the smaller group instead
+ * of every voxel in it. Path compression keeps the trees flat. The fields for a voxel are kept
+ * together as the edges visit voxels in no particular order.
+ */
+class WrapGroups {
+public:
+    explicit WrapGroups(const std::size_t n) : m_nodes(n) {
+        for (std::size_t v = 0; v < n; v++) {
+            m_nodes[v] = Node{static_cast<std::uint32_t>(v), 0, 1};
         }
     }
 
-    v_it = voxels.begin();
-    for (int n=0; n < volume_depth; n++) {
-        for (int i = 0; i < volume_height - 1; i++) {
-            for (int j = 0; j < volume_width; j++) {
-                edges.emplace_back(Edge{v_it->reliability + (v_it + volume_width)->reliability,
-                                    &*v_it, &*(v_it + volume_width),
-                                    find_wrap(v_it->phase, (v_it + volume_width)->phase)});
-                v_it++;
-            }
+    // Returns the root, and the absolute wraps of v in wraps
+    std::uint32_t find(const std::uint32_t v, int &wraps) {
+        std::uint32_t root = v;
+        int total = 0;
+        while (m_nodes[root].parent != root) {
+            total += m_nodes[root].wraps;
+            root = m_nodes[root].parent;
         }
-        v_it+=volume_width;
+        wraps = total + m_nodes[root].wraps;
+        std::uint32_t u = v;
+        while (u != root) {
+            Node &node = m_nodes[u];
+            const std::uint32_t next = node.parent;
+            const int relative = node.wraps;
+            node.parent = root;
+            node.wraps = total;
+            total -= relative;
+            u = next;
+        }
+        return root;
     }
 
-    v_it = voxels.begin();
-    for (int n=0; n < volume_depth - 1; n++) {
-        for (int i = 0; i < volume_height; i++) {
-            for (int j = 0; j < volume_width; j++) {
-                edges.emplace_back(Edge{v_it->reliability + (v_it + volume_width*volume_height)->reliability,
-                                    &*v_it, &*(v_it + (volume_width*volume_height)),
-                                    find_wrap(v_it->phase, (v_it + volume_width*volume_height)->phase)});
-                v_it++;
-            }
+    int wraps(const std::uint32_t v) {
+        int w;
+        find(v, w);
+        return w;
+    }
+
+    // The larger group keeps its wraps, and on a tie the group of v2 does
+    void join(const std::uint32_t v1, const std::uint32_t v2, const int wrap) {
+        int wraps1, wraps2;
+        const std::uint32_t root1 = find(v1, wraps1);
+        const std::uint32_t root2 = find(v2, wraps2);
+        if (root1 == root2) {
+            return;
         }
+        if (m_nodes[root1].size > m_nodes[root2].size) {
+            attach(root2, root1, wraps1 - wrap - wraps2);
+        } else {
+            attach(root1, root2, wraps2 + wrap - wraps1);
+        }
+    }
+
+private:
+    struct Node {
+        std::uint32_t parent;
+        int wraps;
+        std::uint32_t size; // Only kept up to date for roots
+    };
+    std::vector<Node> m_nodes;
+
+    void attach(const std::uint32_t child, const std::uint32_t root, const int delta) {
+        m_nodes[child].wraps += delta - m_nodes[root].wraps;
+        m_nodes[child].parent = root;
+        m_nodes[root].size += m_nodes[child].size;
     }
+};
+struct Grid {
+    std::int64_t nx, ny, nz;
 
-    std::stable_sort(edges.begin(), edges.end(), [](Edge a, Edge b){ return a.reliability < b.reliability; });
-    for (auto &edge : edges) {
-        Voxel *voxel1 = edge.voxel1;
-        Voxel *voxel2 = edge.voxel2;
-        if (voxel2->group != voxel1->group) {
-            if (voxel1->group->size() > voxel2->group->size()) {
-                merge_groups(voxel1->group, voxel2->group, voxel1->wraps - edge.wrap - voxel2->wraps);
-            } else {
-                merge_groups(voxel2->group, voxel1->group, voxel2->wraps + edge.wrap - voxel1->wraps);
+    std::int64_t slice() const { return nx * ny; }
+    std::int64_t stride(const int d) const { return (d == 0) ? 1 : (d == 1) ? nx : nx * ny; }
+};
+
+void add_edge(std::vector<Edge> &edges, const Grid &g, const float *reliability,
+              const std::int64_t v, const int d) {
+    edges.push_back(Edge{sort_key(reliability[v] + reliability[v + g.stride(d)]),
+                         static_cast<std::uint32_t>(3 * v + d)});
+}
+
+/*
+ * The edges between voxels in slices [z_begin, z_end), along x, then y, then z. This order sets
+ * which of two equally reliable edges is merged first.
+ */
+std::vector<Edge> slab_edges(const Grid &g, const float *reliability,
+                             const std::int64_t z_begin, const std::int64_t z_end) {
+    std::vector<Edge> edges;
+    edges.reserve(3 * g.slice() * (z_end - z_begin));
+    for (std::int64_t z = z_begin; z < z_end; z++) {
+        for (std::int64_t y = 0; y < g.ny; y++) {
+            for (std::int64_t x = 0; x < g.nx - 1; x++) {
+                add_edge(edges, g, reliability, (z * g.ny + y) * g.nx + x, 0);
             }
         }
     }
+    for (std::int64_t z = z_begin; z < z_end; z++) {
+        for (std::int64_t y = 0; y < g.ny - 1; y++) {
+            for (std::int64_t x = 0; x < g.nx; x++) {
+                add_edge(edges, g, reliability, (z * g.ny + y) * g.nx + x, 1);
+            }
+        }
+    }
+    for (std::int64_t v = z_begin * g.slice(); v < (z_end - 1) * g.slice(); v++) {
+        add_edge(edges, g, reliability, v, 2);
+    }
+    return edges;
+}
+
+// The z edges that cross from slice z - 1 to slice z for each seam
+std::vector<Edge> seam_edges(const Grid &g, const float *reliability,
+                             const std::vector<std::int64_t> &seams) {
+    std::vector<Edge> edges;
+    edges.reserve(g.slice() * seams.size());
+    for (const auto z : seams) {
+        for (std::int64_t v = (z - 1) * g.slice(); v < z * g.slice(); v++) {
+            add_edge(edges, g, reliability, v, 2);
+        }
+    }
+    return edges;
+}
+
+void merge_edges(const std::vector<Edge> &edges, const Grid &g, const float *phase,
+                 WrapGroups &groups) {
+    for (const auto &edge : edges) {
+        const std::int64_t v1 = edge.index / 3;
+        const std::int64_t v2 = v1 + g.stride(edge.index % 3);
+        groups.join(v1, v2, find_wrap(phase[v1], phase[v2]));
+    }
+}
+
+Grid grid_of(const QI::VolumeF *img) {
+    const auto size = img->GetLargestPossibleRegion().GetSize();
+    return Grid{static_cast<std::int64_t>(size[0]), static_cast<std::int64_t>(size[1]),
+                static_cast<std::int64_t>(size[2])};
+}
+
+// Slices per tile, chosen so that there are no more than the requested number of tiles
+std::int64_t slices_per_tile(const Grid &g, const int tiles) {
+    return (g.nz + tiles - 1) / tiles;
+}
+} // namespace
+
+void UnwrapPathPhaseFilter::SetTiles(const int n) {
+    if (n < 1) {
+        QI::Fail("Number of unwrapping tiles must be at least 1, not {}", n);
+    }
+    m_tiles = n;
+    this->Modified();
+}
+
+void UnwrapPathPhaseFilter::SetEdgeOrder(std::shared_ptr<const EdgeOrder> order) {
+    m_order = order;
+    this->Modified();
+}
+
+/*
+ * With more than one tile the volume is split into slabs along z that are sorted and unwrapped in
+ * parallel. Every group inside a slab then acts as a single node, and the groups are joined
+ * across the seams between slabs using the seam edges in order of reliability. Edges are still
+ * merged in order inside a slab, but a seam edge can no longer come before a less reliable edge
+ * inside a slab, so the result can differ slightly from a single tile.
+ */
+auto UnwrapPathPhaseFilter::OrderEdges(const TImage *reliability_image, const int tiles,
+                                       const int threads) -> std::shared_ptr<const EdgeOrder> {
+    const Grid grid = grid_of(reliability_image);
+    if (3 * grid.slice() * grid.nz > std::numeric_limits<std::uint32_t>::max()) {
+        QI::Fail("Image is too large to unwrap ({} voxels)", grid.slice() * grid.nz);
+    }
+    const float *reliability = reliability_image->GetBufferPointer();
+    const std::int64_t per_tile = slices_per_tile(grid, tiles);
+    const std::int64_t n_tiles = (grid.nz + per_tile - 1) / per_tile;
+
+    auto order = std::make_shared<EdgeOrder>(n_tiles + 1);
+    auto mt = MultiThreaderBase::New();
+    mt->SetNumberOfWorkUnits(threads);
+    mt->ParallelizeArray(
+        0,
+        n_tiles,
+        [&](const SizeValueType t) {
+            const std::int64_t z_begin = t * per_tile;
+            const std::int64_t z_end = std::min(z_begin + per_tile, grid.nz);
+            (*order)[t] = slab_edges(grid, reliability, z_begin, z_end);
+            sort_edges((*order)[t]);
+        },
+        nullptr);
+    std::vector<std::int64_t> seams;
+    for (std::int64_t t = 1; t < n_tiles; t++) {
+        seams.push_back(t * per_tile);
+    }
+    order->back() = seam_edges(grid, reliability, seams);
+    sort_edges(order->back());
+    return order;
+}
+
+void UnwrapPathPhaseFilter::GenerateData() {
+    const Grid grid = grid_of(this->GetInput(0));
+    const std::int64_t n_voxels = grid.slice() * grid.nz;
+    const std::int64_t per_tile = slices_per_tile(grid, m_tiles);
+    const std::int64_t n_tiles = (grid.nz + per_tile - 1) / per_tile;
+    const auto order =
+        m_order ? m_order : OrderEdges(this->GetInput(1), m_tiles, this->GetNumberOfWorkUnits());
+    if (static_cast<std::int64_t>(order->size()) != n_tiles + 1) {
+        QI::Fail("Edge order has {} tiles but {} were expected", order->size() - 1, n_tiles);
+    }
+    const float *phase = this->GetInput(0)->GetBufferPointer();
+
+    WrapGroups groups(n_voxels);
+    // Tiles only touch their own voxels, so they can share the groups
+    this->GetMultiThreader()->SetNumberOfWorkUnits(this->GetNumberOfWorkUnits());
+    this->GetMultiThreader()->ParallelizeArray(
+        0,
+        n_tiles,
+        [&](const SizeValueType t) { merge_edges((*order)[t], grid, phase, groups); },
+        nullptr);
+    merge_edges(order->back(), grid, phase, groups);
 
-    // Unwrap voxels and reassemble into image
-    ImageRegionIterator<TImage> outputIter(this->GetOutput(), region);
-    v_it = voxels.begin();
-    while (!outputIter.IsAtEnd()) {
-        outputIter.Set(v_it->phase + 2*M_PI*v_it->wraps);
-        ++v_it; ++outputIter;
+    float *output = this->GetOutput()->GetBufferPointer();
+    for (std::int64_t v = 0; v < n_voxels; v++) {
+        output[v] = phase[v] + 2*M_PI*groups.wraps(v);
     }
 }
 
-} // End namespace itk
\ No newline at end of file
+} // End namespace itk
@@ -17,7 +17,9 @@
 #ifndef PATH_UNWRAP_FILTER_H
 #define PATH_UNWRAP_FILTER_H
 
+#include <cstdint>
 #include <memory>
+#include <vector>
 #include "itkImageToImageFilter.h"
 #include "ImageTypes.h"
 
@@ -34,45 +36,40 @@ public:
     itkNewMacro(Self)
     itkTypeMacro(Self, Superclass);
 
+    /*
+     * An edge is stored as its sort key and voxel * 3 + direction, so the other voxel and the
+     * wrap are worked out again from the phase when the edge is merged
+     */
+    struct Edge {
+        std::uint32_t key;
+        std::uint32_t index;
+    };
+    // The edges inside each tile, then the edges across the seams, each sorted by reliability
+    typedef std::vector<std::vector<Edge>> EdgeOrder;
+
     void SetReliability(const TImage *img);
+    // Unwrap n slabs in parallel and then join them, default 1
+    void SetTiles(const int n);
+
+    /*
+     * The edge order only depends on the reliability, so echoes unwrapped with the same
+     * reliability can share one order and skip sorting. The order must have been made with the
+     * same number of tiles.
+     */
+    static std::shared_ptr<const EdgeOrder> OrderEdges(const TImage *reliability, const int tiles,
+                                                      const int threads);
+    void SetEdgeOrder(std::shared_ptr<const EdgeOrder> order);
     void GenerateOutputInformation() ITK_OVERRIDE;
 
 protected:
     UnwrapPathPhaseFilter();
     ~UnwrapPathPhaseFilter() {}
 
-    struct Voxel {
-        float phase;
-        float reliability;
-        int wraps;
-        std::shared_ptr<std::list<Voxel *>> group;
-
-        Voxel() {}
-        Voxel(float ph, float rel) {
-            phase = ph; reliability = rel;
-            wraps = 0;
-            group = std::make_shared<std::list<Voxel *>>();
-            // group->push_front(this);
-            // std::cout << "New Voxel " << this << " / " << group->front() << std::endl;
-        }
-    };
-
-    struct Edge {
-        float reliability;			//reliabilty of the edge and its equal to the sum of the reliability of the two voxels that it conntects
-        Voxel *voxel1;		//pointer to the first voxel
-        Voxel *voxel2;		//pointer to the second voxel
-        int wrap;			//No. of 2*pi to add to the voxel to unwrap it 
-    }; 
-
-    int find_wrap(float phase1, float phase2);
-
-    // Do not point shared_ptrs as references, otherwise group2 gets deallocated during loop
-    void merge_groups(std::shared_ptr<std::list<Voxel *>> group1,
-                      std::shared_ptr<std::list<Voxel *>> group2,
-                      int wrap_delta);
-
     void GenerateData() ITK_OVERRIDE;
 
+    int m_tiles = 1;
+    std::shared_ptr<const EdgeOrder> m_order;
+
 private:
     UnwrapPathPhaseFilter(const Self &); //purposely not implemented
     void operator=(const Self &);  //purposely not implemented
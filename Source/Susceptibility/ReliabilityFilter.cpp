@@ -14,9 +14,10 @@
  *  avoids singularity loops, http://ao.osa.org/abstract.cfm?URI=ao-48-23-4582
  */
 
+#include <algorithm>
+#include <cstdint>
+
 #include "ReliabilityFilter.h"
-#include "itkConstNeighborhoodIterator.h"
-#include "itkImageRegionIterator.h"
 
 namespace itk {
 
@@ -26,47 +27,101 @@ PhaseReliabilityFilter::PhaseReliabilityFilter() {
     this->SetNthOutput(0, this->MakeOutput(0));
 }
 
-float PhaseReliabilityFilter::wrap(float voxel_value) {
-    if (voxel_value > M_PI) {
-        return voxel_value - (2*M_PI);
-    } else if (voxel_value < -M_PI) {
-        return voxel_value + (2*M_PI);
-    } else {
-        return voxel_value;
+namespace {
+/*
+ * Same as an if/else on the difference, but written as selects so loops over voxels vectorize.
+ * GCC only does that at -O3 and with -fno-trapping-math, which Source/CMakeLists.txt sets for this
+ * file. The vectors are the baseline SSE2 width unless QUIT_NATIVE_ARCH is on. The arithmetic is
+ * done in double as before, so results are unchanged.
+ */
+inline float wrap(const float voxel_value) {
+    const double v = voxel_value;
+    return v - (v > M_PI ? 2*M_PI : 0.0) + (v < -M_PI ? 2*M_PI : 0.0);
+}
+
+// The 13 directions to the neighbours behind a voxel. Each is paired with its opposite.
+constexpr int Directions[13][3] = {{-1, 0, 0}, { 0,-1, 0}, { 0, 0,-1},
+                                   {-1,-1, 0}, { 1,-1, 0}, {-1,-1,-1},
+                                   { 0,-1,-1}, { 1,-1,-1}, {-1, 0,-1},
+                                   {-1, 1,-1}, { 1, 0,-1}, { 0, 1,-1},
+                                   { 1, 1,-1}};
+
+inline float reliability(const float phase, const float *back, const float *fwrd) {
+    float sum = 0;
+    for (int j = 0; j < 13; j++) {
+        const float d = wrap(back[j] - phase) - wrap(phase - fwrd[j]);
+        sum += d*d;
     }
+    return sum;
 }
+} // namespace
 
+/*
+ * Voxels away from the edge of the image read their neighbours at fixed linear offsets, a row at
+ * a time. Voxels on the edge clamp the neighbour index instead, which matches the zero-flux
+ * Neumann boundary that the neighbourhood iterator used.
+ */
 void PhaseReliabilityFilter::DynamicThreadedGenerateData(const TRegion &region) {
-    using TIter = ImageRegionIterator<TImage>;
-    using TCNIter = ConstNeighborhoodIterator<TImage>;
-    using TOffset = TCNIter::OffsetType;
-    TCNIter::RadiusType radius; radius.Fill(1);
-    TCNIter inputIter(radius, this->GetInput(0), region);
-    TIter   outputIter(this->GetOutput(), region);
-    std::vector<TOffset> back = { {{-1, 0, 0}}, {{ 0,-1, 0}}, {{ 0, 0,-1}},
-                                    {{-1,-1, 0}}, {{ 1,-1, 0}}, {{-1,-1,-1}},
-                                    {{ 0,-1,-1}}, {{ 1,-1,-1}}, {{-1, 0,-1}},
-                                    {{-1, 1,-1}}, {{ 1, 0,-1}}, {{ 0, 1,-1}},
-                                    {{ 1, 1,-1}} };
-    std::vector<TOffset> fwrd = { {{ 1, 0, 0}}, {{ 0, 1, 0}}, {{ 0, 0, 1}},
-                                    {{ 1, 1, 0}}, {{-1, 1, 0}}, {{ 1, 1, 1}},
-                                    {{ 0, 1, 1}}, {{-1, 1, 1}}, {{ 1, 0, 1}},
-                                    {{ 1,-1, 1}}, {{-1, 0, 1}}, {{ 0,-1, 1}},
-                                    {{-1,-1, 1}} };
+    const TImage *input = this->GetInput(0);
+    const auto image = input->GetBufferedRegion();
+    const auto size = image.GetSize();
+    const std::int64_t nx = size[0], ny = size[1], nz = size[2];
+    const float *in = input->GetBufferPointer();
+    float *out = this->GetOutput()->GetBufferPointer();
 
-    inputIter.GoToBegin();
-    outputIter.GoToBegin();
+    std::int64_t offsets[13];
+    for (int j = 0; j < 13; j++) {
+        offsets[j] = Directions[j][0] + nx * (Directions[j][1] + ny * Directions[j][2]);
+    }
+    auto clamp = [](const std::int64_t i, const std::int64_t n) {
+        return std::min(std::max(i, std::int64_t{0}), n - 1);
+    };
+    auto edge_voxel = [&](const std::int64_t x, const std::int64_t y, const std::int64_t z) {
+        float back[13], fwrd[13];
+        for (int j = 0; j < 13; j++) {
+            const auto &d = Directions[j];
+            back[j] = in[clamp(x + d[0], nx) +
+                         nx * (clamp(y + d[1], ny) + ny * clamp(z + d[2], nz))];
+            fwrd[j] = in[clamp(x - d[0], nx) +
+                         nx * (clamp(y - d[1], ny) + ny * clamp(z - d[2], nz))];
+        }
+        return reliability(in[x + nx * (y + ny * z)], back, fwrd);
+    };
 
-    while (!inputIter.IsAtEnd()) {
-        const float phase = inputIter.GetCenterPixel();
-        float reliability = 0;
-        for (size_t j = 0; j < back.size(); j++) {
-            const float d = wrap(inputIter.GetPixel(back[j]) - phase) -
-                            wrap(phase - inputIter.GetPixel(fwrd[j]));
-            reliability += d*d;
+    const std::int64_t x_begin = region.GetIndex()[0] - image.GetIndex()[0];
+    const std::int64_t x_end = x_begin + region.GetSize()[0];
+    const std::int64_t y_begin = region.GetIndex()[1] - image.GetIndex()[1];
+    const std::int64_t z_begin = region.GetIndex()[2] - image.GetIndex()[2];
+    for (std::int64_t z = z_begin; z < z_begin + std::int64_t(region.GetSize()[2]); z++) {
+        for (std::int64_t y = y_begin; y < y_begin + std::int64_t(region.GetSize()[1]); y++) {
+            const std::int64_t row = nx * (y + ny * z);
+            if (y == 0 || y == ny - 1 || z == 0 || z == nz - 1) {
+                for (std::int64_t x = x_begin; x < x_end; x++) {
+                    out[row + x] = edge_voxel(x, y, z);
+                }
+                continue;
+            }
+            const std::int64_t inner_begin = std::max(x_begin, std::int64_t{1});
+            const std::int64_t inner_end = std::max(inner_begin, std::min(x_end, nx - 1));
+            for (std::int64_t x = x_begin; x < std::min(inner_begin, x_end); x++) {
+                out[row + x] = edge_voxel(x, y, z);
+            }
+            // One direction at a time along the row, so the loop over x vectorizes
+            const float *p = in + row;
+            float *o = out + row;
+            std::fill(o + inner_begin, o + inner_end, 0.f);
+            for (int j = 0; j < 13; j++) {
+                const float *back = p + offsets[j];
+                const float *fwrd = p - offsets[j];
+                for (std::int64_t x = inner_begin; x < inner_end; x++) {
+                    const float d = wrap(back[x] - p[x]) - wrap(p[x] - fwrd[x]);
+                    o[x] += d*d;
+                }
+            }
+            for (std::int64_t x = inner_end; x < x_end; x++) {
+                out[row + x] = edge_voxel(x, y, z);
+            }
         }
-        outputIter.Set(reliability);
-        ++inputIter; ++outputIter;
     }
 }
 
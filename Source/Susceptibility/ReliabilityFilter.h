@@ -37,7 +37,6 @@ protected:
     PhaseReliabilityFilter();
     ~PhaseReliabilityFilter() {}
 
-    float wrap(float voxel_value);
     void DynamicThreadedGenerateData(const TRegion &region) ITK_OVERRIDE;
 
 private:
@@ -16,18 +16,15 @@
 #include "itkComplexToModulusImageFilter.h"
 #include "itkConstNeighborhoodIterator.h"
 #include "itkDivideImageFilter.h"
-#include "itkExtractImageFilter.h"
-#include "itkFFTPadImageFilter.h"
 #include "itkFFTShiftImageFilter.h"
 #include "itkForwardFFTImageFilter.h"
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkImageSource.h"
-#include "itkInverseFFTImageFilter.h"
 #include "itkMaskImageFilter.h"
-#include "itkMultiplyImageFilter.h"
 #include "itkThresholdImageFilter.h"
 
 #include "Args.h"
+#include "FFT.h"
 #include "ImageIO.h"
 #include "ImageTypes.h"
 #include "Util.h"
@@ -330,63 +327,59 @@ int unwrap_laplace_main(args::Subparser &parser) {
             QI::WriteImage(lap, prefix + "_step1_laplace_masked" + QI::OutExt(), verbose);
     }
 
-    QI::Log(verbose, "Padding image to valid FFT size.");
-    typedef itk::FFTPadImageFilter<QI::VolumeF> PadFFTType;
-    auto                                        padFFT = PadFFTType::New();
-    padFFT->SetInput(lap);
-    padFFT->Update();
-    if (debug)
-        QI::WriteImage(padFFT->GetOutput(), prefix + "_step2_padFFT" + QI::OutExt(), verbose);
-    QI::Log(verbose,
-            "Padded image size: {}\nCalculating Forward FFT.",
-            padFFT->GetOutput()->GetLargestPossibleRegion().GetSize());
-    typedef itk::ForwardFFTImageFilter<QI::VolumeF> FFFTType;
-    auto                                            forwardFFT = FFFTType::New();
-    forwardFFT->SetInput(padFFT->GetOutput());
-    forwardFFT->Update();
-    if (debug)
-        QI::WriteImage(
-            forwardFFT->GetOutput(), prefix + "_step3_forwardFFT" + QI::OutExt(), verbose);
     QI::Log(verbose, "Generating Inverse Laplace Kernel.");
     auto inverseLaplace = itk::DiscreteInverseLaplace::New();
-    inverseLaplace->SetImageProperties(padFFT->GetOutput());
+    inverseLaplace->SetImageProperties(lap);
     inverseLaplace->Update();
     if (debug)
         QI::WriteImage(inverseLaplace->GetOutput(),
                        prefix + "_inverse_laplace_filter" + QI::OutExt(),
                        verbose);
+
+    // The FFT handles any size, so there is no need to pad. The Laplacian is real, so only half
+    // of its spectrum is needed, and the kernel is the same in both halves.
+    auto const          region = lap->GetLargestPossibleRegion();
+    QI::FFT::Size const size{static_cast<std::int64_t>(region.GetSize()[0]),
+                             static_cast<std::int64_t>(region.GetSize()[1]),
+                             static_cast<std::int64_t>(region.GetSize()[2])};
+    QI::FFT const       fft(size, threads.Get());
+    auto const          half = fft.half_size();
+    std::vector<double> real(lap->GetBufferPointer(),
+                             lap->GetBufferPointer() + size[0] * size[1] * size[2]);
+    std::vector<QI::FFT::Complex> spectrum(half[0] * half[1] * half[2]);
+    QI::Log(verbose, "Calculating Forward FFT.");
+    fft.forward(real.data(), spectrum.data());
     QI::Log(verbose, "Multiplying.");
-    auto mult = itk::MultiplyImageFilter<QI::VolumeXF, QI::VolumeF, QI::VolumeXF>::New();
-    mult->SetInput1(forwardFFT->GetOutput());
-    mult->SetInput2(inverseLaplace->GetOutput());
-    if (debug)
-        QI::WriteImage(mult->GetOutput(), prefix + "_step3_multFFT" + QI::OutExt(), verbose);
+    float const *kernel = inverseLaplace->GetOutput()->GetBufferPointer();
+    for (std::int64_t z = 0; z < half[2]; z++) {
+        for (std::int64_t y = 0; y < half[1]; y++) {
+            auto *       line = spectrum.data() + (z * half[1] + y) * half[0];
+            float const *k    = kernel + (z * size[1] + y) * size[0];
+            for (std::int64_t x = 0; x < half[0]; x++) {
+                line[x] *= k[x];
+            }
+        }
+    }
     QI::Log(verbose, "Inverse FFT.");
-    auto inverseFFT = itk::InverseFFTImageFilter<QI::VolumeXF, QI::VolumeF>::New();
-    inverseFFT->SetInput(mult->GetOutput());
-    inverseFFT->Update();
-    if (debug)
-        QI::WriteImage(
-            inverseFFT->GetOutput(), prefix + "_step4_inverseFFT" + QI::OutExt(), verbose);
-    QI::Log(verbose, "Extracting original size image");
-    auto extract = itk::ExtractImageFilter<QI::VolumeF, QI::VolumeF>::New();
-    extract->SetInput(inverseFFT->GetOutput());
-    extract->SetDirectionCollapseToSubmatrix();
-    extract->SetExtractionRegion(calcLaplace->GetOutput()->GetLargestPossibleRegion());
-    extract->Update();
+    fft.inverse(spectrum.data(), real.data());
+    QI::VolumeF::Pointer unwrapped = QI::VolumeF::New();
+    unwrapped->CopyInformation(lap);
+    unwrapped->SetRegions(region);
+    unwrapped->Allocate();
+    std::copy(real.begin(), real.end(), unwrapped->GetBufferPointer());
     if (debug)
-        QI::WriteImage(extract->GetOutput(), prefix + "_step5_extract" + QI::OutExt(), verbose);
+        QI::WriteImage(unwrapped, prefix + "_step2_inverseFFT" + QI::OutExt(), verbose);
     std::string outname = prefix + "_unwrap" + QI::OutExt();
     QI::Log(verbose, "Output filename: {}", outname);
     if (mask) {
         QI::Log(verbose, "Re-applying mask");
         auto masker = itk::MaskImageFilter<QI::VolumeF, QI::VolumeUC>::New();
         masker->SetMaskImage(mask_img);
-        masker->SetInput(extract->GetOutput());
+        masker->SetInput(unwrapped);
         masker->Update();
         QI::WriteImage(masker->GetOutput(), outname, verbose);
     } else {
-        QI::WriteImage(extract->GetOutput(), outname, verbose);
+        QI::WriteImage(unwrapped, outname, verbose);
     }
     QI::Log(verbose, "Finished.");
     return EXIT_SUCCESS;
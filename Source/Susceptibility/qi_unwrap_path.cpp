@@ -14,8 +14,10 @@
  *  avoids singularity loops, http://ao.osa.org/abstract.cfm?URI=ao-48-23-4582
  */
 
-#include <list>
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <vector>
 
 #include "Args.h"
 #include "ImageIO.h"
@@ -25,6 +27,7 @@
 #include "Util.h"
 #include "itkExtractImageFilter.h"
 #include "itkImageToImageFilter.h"
+#include "itkMultiThreaderBase.h"
 #include "itkTileImageFilter.h"
 
 /*
@@ -41,42 +44,155 @@ int unwrap_path_main(args::Subparser &parser) {
         parser, "OUTPUT PREFIX", "Change output prefix (default input filename)", {'o', "out"});
     args::ValueFlag<std::string> maskarg(
         parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
+    args::ValueFlag<int>         tiles(
+        parser, "TILES", "Unwrap N slabs in parallel, then join them (default 1)", {"tiles"}, 1);
+    args::ValueFlag<std::string> relarg(parser,
+                                        "RELIABILITY",
+                                        "For 4D input, use the reliability of each echo (default), "
+                                        "the first echo, or the mean over echoes (sum)",
+                                        {"reliability"},
+                                        "each");
+    args::ValueFlag<std::string> magarg(
+        parser,
+        "MAGNITUDE",
+        "Weight the mean reliability by this magnitude (only with --reliability=sum)",
+        {"mag"});
     parser.Parse();
 
+    if (relarg.Get() != "each" && relarg.Get() != "first" && relarg.Get() != "sum") {
+        QI::Fail("Unknown reliability option {}", relarg.Get());
+    }
+    if (magarg && relarg.Get() != "sum") {
+        QI::Fail("--mag can only be used with --reliability=sum");
+    }
     auto inFile = QI::ReadImage<QI::SeriesF>(QI::CheckPos(input_path), verbose);
 
     typedef itk::ExtractImageFilter<QI::SeriesF, QI::VolumeF> TExtract;
     typedef itk::TileImageFilter<QI::VolumeF, QI::SeriesF>    TTile;
 
-    auto         region           = inFile->GetLargestPossibleRegion();
-    const size_t nvols            = region.GetSize()[3]; // Save for the loop
-    region.GetModifiableSize()[3] = 0;
+    const size_t nvols = inFile->GetLargestPossibleRegion().GetSize()[3];
     itk::FixedArray<unsigned int, 4> layout;
     layout[0] = layout[1] = layout[2] = 1;
     layout[3]                         = nvols;
-
-    auto extract = TExtract::New();
-    auto tile    = TTile::New();
-    extract->SetInput(inFile);
-    extract->SetDirectionCollapseToSubmatrix();
+    auto tile                         = TTile::New();
     tile->SetLayout(layout);
 
-    auto reliabilityFilter = itk::PhaseReliabilityFilter::New();
-    auto unwrapFilter      = itk::UnwrapPathPhaseFilter::New();
+    // Split the echoes up front so they can all be unwrapped at once
+    auto split = [](QI::SeriesF::Pointer series) {
+        auto region                   = series->GetLargestPossibleRegion();
+        region.GetModifiableSize()[3] = 0;
+        auto extract                  = TExtract::New();
+        extract->SetInput(series);
+        extract->SetDirectionCollapseToSubmatrix();
+        std::vector<QI::VolumeF::Pointer> volumes(series->GetLargestPossibleRegion().GetSize()[3]);
+        for (size_t i = 0; i < volumes.size(); i++) {
+            region.GetModifiableIndex()[3] = i;
+            extract->SetExtractionRegion(region);
+            extract->Update();
+            volumes[i] = extract->GetOutput();
+            volumes[i]->DisconnectPipeline();
+        }
+        return volumes;
+    };
+    const auto phases = split(inFile);
+
+    auto reliability = [&](const QI::VolumeF *phase, const int threads) {
+        auto filter = itk::PhaseReliabilityFilter::New();
+        filter->SetNumberOfWorkUnits(threads);
+        filter->SetInput(phase);
+        filter->Update();
+        QI::VolumeF::Pointer r = filter->GetOutput();
+        r->DisconnectPipeline();
+        return r;
+    };
+
+    // With one reliability for every echo the edges only need sorting once
+    QI::VolumeF::Pointer shared;
+    if (relarg.Get() == "first") {
+        QI::Log(verbose, "Calculating reliability from first echo");
+        shared = reliability(phases[0], threads.Get());
+    } else if (relarg.Get() == "sum") {
+        QI::Log(verbose, "Averaging reliability over echoes");
+        std::vector<QI::VolumeF::Pointer> mags;
+        if (magarg) {
+            mags = split(QI::ReadImage<QI::SeriesF>(magarg.Get(), verbose));
+            if (mags.size() != nvols) {
+                QI::Fail("Magnitude has {} volumes but phase has {}", mags.size(), nvols);
+            }
+            for (size_t i = 0; i < nvols; i++) {
+                if (mags[i]->GetLargestPossibleRegion() != phases[i]->GetLargestPossibleRegion()) {
+                    QI::Fail("Magnitude volume {} does not have the same size as the phase", i);
+                }
+            }
+        }
+        const size_t n_voxels = phases[0]->GetBufferedRegion().GetNumberOfPixels();
+        std::vector<float> weights(n_voxels, 0.f);
+        for (size_t i = 0; i < nvols; i++) {
+            auto r = reliability(phases[i], threads.Get());
+            if (i == 0) {
+                shared = r;
+            }
+            const float *mag = magarg ? mags[i]->GetBufferPointer() : nullptr;
+            const float *rel = r->GetBufferPointer();
+            float *      sum = shared->GetBufferPointer();
+            for (size_t v = 0; v < n_voxels; v++) {
+                const float w = mag ? mag[v] : 1.f;
+                sum[v]        = ((i == 0) ? 0.f : sum[v]) + w * rel[v];
+                weights[v] += w;
+            }
+        }
+        float *sum = shared->GetBufferPointer();
+        for (size_t v = 0; v < n_voxels; v++) {
+            if (weights[v] > 0.f) {
+                sum[v] /= weights[v];
+            }
+        }
+    }
+    std::shared_ptr<const itk::UnwrapPathPhaseFilter::EdgeOrder> order;
+    if (shared) {
+        QI::Log(verbose, "Sorting edges");
+        order = itk::UnwrapPathPhaseFilter::OrderEdges(shared, tiles.Get(), threads.Get());
+    }
+
+    /*
+     * An echo can keep about one thread per tile busy, so several echoes are unwrapped at a time
+     * with the threads split between them, as in qi tgv
+     */
+    const int  n_threads  = std::max(1, threads.Get());
+    const int  per_tiles  = std::clamp(tiles.Get(), 1, n_threads);
+    const long concurrent = std::clamp<long>(n_threads / per_tiles, 1, std::max<long>(1, nvols));
+    const int  per_echo =
+        std::max(per_tiles, static_cast<int>(n_threads / concurrent)); // Use any left over
+    QI::Log(verbose, "Unwrapping {} volumes at a time with {} threads each", concurrent, per_echo);
+
+    std::vector<QI::VolumeF::Pointer> unwrapped(nvols);
+    std::atomic<size_t>               cursor{0};
+    auto                              mt = itk::MultiThreaderBase::New();
+    mt->SetNumberOfWorkUnits(concurrent);
+    mt->ParallelizeArray(
+        0,
+        concurrent,
+        [&](const itk::SizeValueType) {
+            for (size_t i = cursor.fetch_add(1); i < nvols; i = cursor.fetch_add(1)) {
+                QI::Log(verbose, "Unwrapping volume {}", i);
+                auto unwrapFilter = itk::UnwrapPathPhaseFilter::New();
+                unwrapFilter->SetNumberOfWorkUnits(per_echo);
+                unwrapFilter->SetTiles(tiles.Get());
+                unwrapFilter->SetInput(phases[i]);
+                if (order) {
+                    unwrapFilter->SetReliability(shared);
+                    unwrapFilter->SetEdgeOrder(order);
+                } else {
+                    unwrapFilter->SetReliability(reliability(phases[i], per_echo));
+                }
+                unwrapFilter->Update();
+                unwrapped[i] = unwrapFilter->GetOutput();
+                unwrapped[i]->DisconnectPipeline();
+            }
+        },
+        nullptr);
     for (size_t i = 0; i < nvols; i++) {
-        region.GetModifiableIndex()[3] = i;
-        QI::Log(verbose, "Processing volume {}", i);
-        extract->SetExtractionRegion(region);
-        extract->Update();
-        QI::Log(verbose, "Calculating reliabilty");
-        reliabilityFilter->SetInput(extract->GetOutput());
-        reliabilityFilter->Update();
-        QI::Log(verbose, "Unwrapping phase");
-        unwrapFilter->SetInput(extract->GetOutput());
-        unwrapFilter->SetReliability(reliabilityFilter->GetOutput());
-        unwrapFilter->Update();
-        tile->SetInput(i, unwrapFilter->GetOutput());
-        unwrapFilter->GetOutput()->DisconnectPipeline();
+        tile->SetInput(i, unwrapped[i]);
     }
     tile->Update();
     // Make sure output orientation info is correct
@@ -12,6 +12,8 @@
 #include <Eigen/Core>
 
 #include <Eigen/Eigenvalues>
+#include <numeric>
+#include <vector>
 
 #include "itkImageRegionConstIterator.h"
 #include "itkImageRegionIterator.h"
@@ -51,51 +53,81 @@ int pca_main(args::Subparser &parser) {
     auto const region = input->GetLargestPossibleRegion();
 
     QI::VolumeF::Pointer const mask_img = mask ? QI::ReadImage(mask.Get(), verbose) : nullptr;
-    auto const                 Nvox     = [&]() {
-        if (mask) {
-            QI::Log(verbose, "Counting voxels in mask...");
-            auto         mask_it = itk::ImageRegionConstIterator<QI::VolumeF>(mask_img, region);
-            Eigen::Index Nv = 0;
-            while (!mask_it.IsAtEnd()) {
-                if (mask_it.Get())
-                    ++Nv;
-                ++mask_it;
-            }
-            return Nv;
-        } else {
-            QI::Log(verbose, "No mask, will use all voxels in image");
-            return static_cast<Eigen::Index>(region.GetNumberOfPixels());
-        }
-    }();
-    QI::Log(verbose, "Total voxels = {}", Nvox);
-
-    Eigen::Index const Nq   = input->GetNumberOfComponentsPerPixel();
-    Eigen::Index const Nret = (n_retain.Get() > Nq) ? Nq : n_retain.Get();
-
-    Eigen::MatrixXd X(Nvox, Nq);
-    {
-        // Use scope to keep these iterators separate to the multi-threaded ones later
-        itk::ImageRegionConstIterator<QI::VectorVolumeF> in_it(input, region);
-        itk::ImageRegionConstIterator<QI::VolumeF>       mask_it;
-        if (mask)
-            mask_it = itk::ImageRegionConstIterator<QI::VolumeF>(mask_img, region);
-        Eigen::Index row_ind = 0;
-        for (in_it.GoToBegin(); !in_it.IsAtEnd(); ++in_it) {
-            if (!mask || mask_it.Get()) {
-                const Eigen::Map<const Eigen::VectorXf> vox(in_it.Get().GetDataPointer(), Nq);
-                X.row(row_ind) = vox.cast<double>();
-                ++row_ind;
-            }
-            if (mask) {
-                ++mask_it;
-            }
-        }
+    if (!mask) {
+        QI::Log(verbose, "No mask, will use all voxels in image");
     }
 
+    Eigen::Index const Nq      = input->GetNumberOfComponentsPerPixel();
+    Eigen::Index const Nret    = (n_retain.Get() > Nq) ? Nq : n_retain.Get();
+    Eigen::Index const Nimg    = region.GetNumberOfPixels();
+    float const *const in_data = input->GetBufferPointer();
+    float const *const mask_data = mask_img ? mask_img->GetBufferPointer() : nullptr;
+
+    /*
+     * The voxels are never gathered into one matrix. Instead each work unit takes a contiguous
+     * range of the image and passes its masked voxels in blocks of columns to f, along with their
+     * offsets. Partial sums are kept per work unit and added in order, so the results do not
+     * depend on timing.
+     */
+    int const          units     = std::max(1, threads.Get());
+    Eigen::Index const BlockSize = 256;
+    auto               mt        = itk::MultiThreaderBase::New();
+    mt->SetNumberOfWorkUnits(units);
+    auto ForBlocks = [&](auto &&f) {
+        mt->ParallelizeArray(
+            0,
+            units,
+            [&](itk::SizeValueType const unit) {
+                Eigen::Index const        start = Nimg * unit / units;
+                Eigen::Index const        end   = Nimg * (unit + 1) / units;
+                Eigen::MatrixXd           block(Nq, BlockSize);
+                std::vector<Eigen::Index> offsets;
+                offsets.reserve(BlockSize);
+                for (Eigen::Index o = start; o < end; o++) {
+                    if (mask_data && !mask_data[o]) {
+                        continue;
+                    }
+                    block.col(offsets.size()) =
+                        Eigen::Map<const Eigen::VectorXf>(in_data + o * Nq, Nq).cast<double>();
+                    offsets.push_back(o);
+                    if (static_cast<Eigen::Index>(offsets.size()) == BlockSize) {
+                        f(unit, Eigen::Ref<Eigen::MatrixXd>(block), offsets);
+                        offsets.clear();
+                    }
+                }
+                if (!offsets.empty()) {
+                    f(unit, Eigen::Ref<Eigen::MatrixXd>(block.leftCols(offsets.size())), offsets);
+                }
+            },
+            nullptr);
+    };
+
     QI::Info(verbose, "Calculating Principal Components");
-    Eigen::VectorXd xmean = X.colwise().mean();
-    X.rowwise() -= xmean.transpose();
-    auto const cov = X.adjoint() * X / (Nq - 1);
+    std::vector<Eigen::VectorXd> sums(units, Eigen::VectorXd::Zero(Nq));
+    std::vector<Eigen::Index>    counts(units, 0);
+    ForBlocks([&](int const u, Eigen::Ref<Eigen::MatrixXd> X, std::vector<Eigen::Index> const &) {
+        sums[u] += X.rowwise().sum();
+        counts[u] += X.cols();
+    });
+    Eigen::Index const Nvox = std::accumulate(counts.begin(), counts.end(), Eigen::Index{0});
+    QI::Log(verbose, "Total voxels = {}", Nvox);
+    if (Nvox < 2) {
+        QI::Fail("Need at least two voxels to calculate principal components");
+    }
+    Eigen::VectorXd const xmean =
+        std::accumulate(sums.begin(), sums.end(), Eigen::VectorXd::Zero(Nq).eval()) / Nvox;
+
+    // Only the lower triangles are accumulated, as that is all the eigensolver reads
+    std::vector<Eigen::MatrixXd> partial_cov(units, Eigen::MatrixXd::Zero(Nq, Nq));
+    ForBlocks([&](int const u, Eigen::Ref<Eigen::MatrixXd> X, std::vector<Eigen::Index> const &) {
+        X.colwise() -= xmean;
+        partial_cov[u].selfadjointView<Eigen::Lower>().rankUpdate(X);
+    });
+    Eigen::MatrixXd cov = Eigen::MatrixXd::Zero(Nq, Nq);
+    for (auto const &c : partial_cov) {
+        cov += c;
+    }
+    cov /= (Nvox - 1);
 
     Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eig(cov);
     auto const norm_eig_vals = eig.eigenvalues() / eig.eigenvalues().sum();
@@ -119,50 +151,23 @@ int pca_main(args::Subparser &parser) {
         QI::WriteJSON(save_pcs.Get(), doc);
     }
 
+    // These start zeroed, so voxels outside the mask are already done
     auto proj_img = QI::NewImageLike<QI::VectorVolumeF>(input, Nret);
     auto out_img  = QI::NewImageLike<QI::VectorVolumeF>(input, Nq);
 
     QI::Info(verbose, "Calculating projection...");
-    auto mt = itk::MultiThreaderBase::New();
-    mt->SetNumberOfWorkUnits(threads.Get());
-    mt->ParallelizeImageRegion<3>(
-        input->GetBufferedRegion(),
-        [&](const QI::VectorVolumeF::RegionType &thread_region) {
-            itk::ImageRegionConstIterator<QI::VectorVolumeF> in_it(input, thread_region);
-            itk::ImageRegionIterator<QI::VectorVolumeF>      proj_it(proj_img, thread_region);
-            itk::ImageRegionIterator<QI::VectorVolumeF>      out_it(out_img, thread_region);
-            itk::ImageRegionConstIterator<QI::VolumeF>       mask_it;
-            if (mask_img)
-                mask_it = itk::ImageRegionConstIterator<QI::VolumeF>(mask_img, thread_region);
-            for (in_it.GoToBegin(); !in_it.IsAtEnd(); ++in_it, ++proj_it, ++out_it) {
-                itk::VariableLengthVector<float> itk_proj(Nret);
-                itk::VariableLengthVector<float> itk_out(Nq);
-                if (!mask_img || mask_it.Get()) {
-                    const Eigen::Map<const Eigen::VectorXf> vox(in_it.Get().GetDataPointer(), Nq);
-
-                    auto const &    voxd     = vox.cast<double>() - xmean;
-                    Eigen::VectorXd vox_proj = voxd.transpose() * retained_vecs;
-                    Eigen::VectorXd vox_out  = xmean + retained_vecs * vox_proj;
-
-                    for (Eigen::Index i = 0; i < Nret; i++) {
-                        itk_proj[i] = vox_proj[i];
-                    }
-                    for (Eigen::Index i = 0; i < Nq; i++) {
-                        itk_out[i] = vox_out[i];
-                    }
-                } else {
-                    itk_proj.Fill(0.0);
-                    itk_out.Fill(0.0);
-                }
-                proj_it.Set(itk_proj);
-                out_it.Set(itk_out);
-
-                if (mask) {
-                    ++mask_it;
-                }
-            }
-        },
-        nullptr);
+    float *const proj_data = proj_img->GetBufferPointer();
+    float *const out_data  = out_img->GetBufferPointer();
+    ForBlocks([&](int, Eigen::Ref<Eigen::MatrixXd> X, std::vector<Eigen::Index> const &offsets) {
+        X.colwise() -= xmean;
+        Eigen::MatrixXd const proj = retained_vecs.transpose() * X;
+        Eigen::MatrixXd const out  = (retained_vecs * proj).colwise() + xmean;
+        for (size_t i = 0; i < offsets.size(); i++) {
+            Eigen::Map<Eigen::VectorXf>(proj_data + offsets[i] * Nret, Nret) =
+                proj.col(i).cast<float>();
+            Eigen::Map<Eigen::VectorXf>(out_data + offsets[i] * Nq, Nq) = out.col(i).cast<float>();
+        }
+    });
     QI::Info(verbose, "Finished");
     if (project) {
         QI::WriteImage(proj_img, project.Get(), verbose);
@@ -11,6 +11,9 @@
 
 #include "tgv-denoise.hpp"
 
+#include <algorithm>
+#include <atomic>
+
 #include "Args.h"
 #include "ImageIO.h"
 #include "Util.h"
@@ -24,6 +27,11 @@
  */
 int tgv_main(args::Subparser &parser) {
     args::Positional<std::string> iname(parser, "INPUT", "Input filename");
+    args::ValueFlag<int>          threads(parser,
+                                 "THREADS",
+                                 "Use N threads (default=hardware limit or $QUIT_THREADS)",
+                                 {'T', "threads"},
+                                 QI::GetDefaultThreads());
 
     args::ValueFlag<std::string> outarg(
         parser, "OUTPUT", "Change ouput filename (default is input_denoise)", {'o', "out"});
@@ -43,30 +51,63 @@ int tgv_main(args::Subparser &parser) {
         QI::Fail("Input filename must be set");
     }
 
-    Eigen::ThreadPool       pool(std::thread::hardware_concurrency());
-    Eigen::ThreadPoolDevice device(&pool, pool.NumThreads());
-
     auto pipeline = [&]<typename T>() {
         using TT        = Eigen::Tensor<T, 4>;
+        using T3        = Eigen::Tensor<T, 3>;
         auto const iimg = QI::ReadImage<itk::Image<T, 4>>(iname.Get(), verbose);
         auto const sz   = iimg->GetLargestPossibleRegion().GetSize();
 
         typename TT::Dimensions dims;
         std::copy_n(sz.begin(), 4, dims.begin());
-        Eigen::TensorMap<TT> input(iimg->GetBufferPointer(), dims);
-        TT                   output(dims);
-        for (long ii = 0; ii < dims[3]; ii++) {
-            QI::Log(verbose, "Processing volume {}", ii);
-            Eigen::Tensor<T, 3> vol     = input.template chip<3>(ii);
-            output.template chip<3>(ii) = tgvdenoise(vol,
-                                                     its.Get(),
-                                                     thr.Get(),
-                                                     alpha.Get(),
-                                                     alpha_reduction.Get(),
-                                                     step_size.Get(),
-                                                     verbose,
-                                                     device);
+        typename T3::Dimensions const vdims{dims[0], dims[1], dims[2]};
+        long const                    nvox  = dims[0] * dims[1] * dims[2];
+        long const                    nvols = dims[3];
+        TT                            output(dims);
+
+        /*
+         * A volume can only keep about one thread busy per 128k voxels, so small volumes are
+         * denoised several at a time with the threads split between them.
+         */
+        int const  n_threads  = std::max(1, threads.Get());
+        int const  per_volume = std::clamp<long>(nvox / (1 << 17), 1, n_threads);
+        long const concurrent = std::clamp<long>(n_threads / per_volume, 1, std::max(1L, nvols));
+        int const  vol_threads =
+            std::max(per_volume, static_cast<int>(n_threads / concurrent)); // Use any left over
+        QI::Log(verbose,
+                "Denoising {} volumes at a time with {} threads each",
+                concurrent,
+                vol_threads);
+        if (concurrent > 1) {
+            // The iterations of different volumes would be interleaved
+            QI::Log(verbose, "Per-iteration output is off when denoising several volumes at once");
         }
+
+        std::atomic<long> cursor{0};
+        auto              mt = itk::MultiThreaderBase::New();
+        mt->SetNumberOfWorkUnits(concurrent);
+        mt->ParallelizeArray(
+            0,
+            concurrent,
+            [&](itk::SizeValueType) {
+                Eigen::ThreadPool       pool(vol_threads);
+                Eigen::ThreadPoolDevice device(&pool, pool.NumThreads());
+                for (long ii = cursor.fetch_add(1); ii < nvols; ii = cursor.fetch_add(1)) {
+                    QI::Log(verbose, "Processing volume {}", ii);
+                    Eigen::TensorMap<Eigen::Tensor<T const, 3>> const input(
+                        iimg->GetBufferPointer() + ii * nvox, vdims);
+                    Eigen::TensorMap<T3> vol(output.data() + ii * nvox, vdims);
+                    tgvdenoise(input,
+                               vol,
+                               its.Get(),
+                               thr.Get(),
+                               alpha.Get(),
+                               alpha_reduction.Get(),
+                               step_size.Get(),
+                               verbose && (concurrent == 1),
+                               device);
+                }
+            },
+            nullptr);
         using Importer                    = itk::ImportImageFilter<T, 4>;
         typename Importer::Pointer import = Importer::New();
         import->SetRegion(iimg->GetLargestPossibleRegion());
@@ -9,28 +9,24 @@
  *
  */
 
+#include <atomic>
 #include <memory>
 
 #include "Eigen/Core"
 #include <sstream>
 
 #include "itkCastImageFilter.h"
-#include "itkComplexToComplexFFTImageFilter.h"
 #include "itkComplexToModulusImageFilter.h"
 #include "itkConstNeighborhoodIterator.h"
-#include "itkConstantPadImageFilter.h"
 #include "itkDivideImageFilter.h"
-#include "itkExtractImageFilter.h"
-#include "itkFFTPadImageFilter.h"
 #include "itkFFTShiftImageFilter.h"
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkImageSource.h"
-#include "itkInverseFFTImageFilter.h"
-#include "itkMultiplyImageFilter.h"
+#include "itkMultiThreaderBase.h"
 #include "itkPasteImageFilter.h"
-#include "itkTileImageFilter.h"
 
 #include "Args.h"
+#include "FFT.h"
 #include "ImageIO.h"
 #include "ImageTypes.h"
 #include "Kernels.h"
@@ -54,7 +50,7 @@ template <typename TImage> class KernelSource : public ImageSource<TImage> {
     typedef typename ImageType::PointType     PointType;
 
   protected:
-    KernelSource() { this->DynamicMultiThreadingOff(); }
+    KernelSource() {}
     ~KernelSource() {}
     RegionType                                     m_Region;
     SpacingType                                    m_Spacing;
@@ -90,31 +86,17 @@ template <typename TImage> class KernelSource : public ImageSource<TImage> {
         output->SetOrigin(m_Origin);
     }
 
-    void DynamicThreadedGenerateData(const RegionType &outputRegion) ITK_OVERRIDE {
-        const auto                          startIndex = m_Region.GetIndex();
-        const Eigen::Array3d                sz{static_cast<double>(m_Region.GetSize()[0]),
-                                static_cast<double>(m_Region.GetSize()[1]),
-                                static_cast<double>(m_Region.GetSize()[2])};
-        const Eigen::Array3d                hsz = sz / 2;
-        const Eigen::Array3d                sp{m_Spacing[0], m_Spacing[1], m_Spacing[2]};
-        itk::ImageRegionIterator<ImageType> outIt(this->GetOutput(), outputRegion);
-        outIt.GoToBegin();
-        while (!outIt.IsAtEnd()) {
-            const auto   I = outIt.GetIndex() - startIndex; // Might be padded to a negative start
-            const double x = fmod(static_cast<double>(I[0]) + hsz[0], sz[0]) - hsz[0];
-            const double y = fmod(static_cast<double>(I[1]) + hsz[1], sz[1]) - hsz[1];
-            const double z = fmod(static_cast<double>(I[2]) + hsz[2], sz[2]) - hsz[2];
-            const Eigen::Array3d          p{x, y, z};
-            typename ImageType::PixelType val = 1;
-            for (const auto &kernel : m_kernels) {
-                val *= kernel->value(p, hsz, sp);
-            }
-            if (m_Highpass) {
-                val = 1 - val;
-            }
-            outIt.Set(val);
-            ++outIt;
-        }
+    void GenerateData() ITK_OVERRIDE {
+        auto output = this->GetOutput();
+        output->SetBufferedRegion(m_Region);
+        output->Allocate();
+        auto const weights = QI::KernelWeights(m_kernels,
+                                               {static_cast<int64_t>(m_Region.GetSize()[0]),
+                                                static_cast<int64_t>(m_Region.GetSize()[1]),
+                                                static_cast<int64_t>(m_Region.GetSize()[2])},
+                                               {m_Spacing[0], m_Spacing[1], m_Spacing[2]},
+                                               m_Highpass);
+        std::copy(weights->begin(), weights->end(), output->GetBufferPointer());
     }
 
   private:
@@ -142,8 +124,10 @@ int kfilter_main(args::Subparser &parser) {
     args::Flag complex_in(parser, "COMPLEX_IN", "Input data is complex", {"complex_in"});
     args::Flag complex_out(parser, "COMPLEX_OUT", "Write complex output", {"complex_out"});
     args::Flag save_kernel(parser, "KERNEL", "Save kernels as images", {"save_kernel"});
-    args::Flag save_kspace(
-        parser, "KSPACE", "Save k-space before & after filtering", {"save_kspace"});
+    args::Flag save_kspace(parser,
+                           "KSPACE",
+                           "Save k-space of the last volume before & after filtering",
+                           {"save_kspace"});
     args::Flag highpass(parser, "HIGHPASS", "Use a high-pass, not a low-pass filter", {"highpass"});
     args::Flag filter_per_volume(parser,
                                  "FILTER_PER_VOL",
@@ -177,141 +161,135 @@ int kfilter_main(args::Subparser &parser) {
         vols->DisconnectPipeline();
     }
     const std::string out_base = out_prefix ? out_prefix.Get() : QI::Basename(in_path.Get());
-    /*
-     * Main calculation starts hear.
-     * First a lot of typedefs.
-     */
-    typedef itk::ExtractImageFilter<QI::SeriesXF, QI::VolumeXD>               TExtract;
-    typedef itk::TileImageFilter<QI::VolumeXF, QI::SeriesXF>                  TTile;
-    typedef itk::ConstantPadImageFilter<QI::VolumeXD, QI::VolumeXD>           TZeroPad;
-    typedef itk::FFTPadImageFilter<QI::VolumeXD>                              TFFTPad;
-    typedef itk::FFTShiftImageFilter<QI::VolumeXD, QI::VolumeXD>              TFFTShift;
-    typedef itk::ComplexToComplexFFTImageFilter<QI::VolumeXD>                 TFFT;
-    typedef itk::MultiplyImageFilter<QI::VolumeXD, QI::VolumeD, QI::VolumeXD> TMult;
-    typedef itk::KernelSource<QI::VolumeD>                                    TKernel;
-    typedef itk::ExtractImageFilter<QI::VolumeXD, QI::VolumeXF>               TUnpad;
+    typedef itk::KernelSource<QI::VolumeD> TKernel;
 
-    auto         region = vols->GetLargestPossibleRegion();
-    const size_t nvols  = region.GetSize()[3]; // Save for the loop
+    auto const   series = vols->GetLargestPossibleRegion();
+    const size_t nvols  = series.GetSize()[3];
     if (filter_per_volume && nvols != kernels.size()) {
         QI::Fail(
             "Number of volumes ({}) and kernels ({}) do not match for filter_per_volume option",
             nvols,
             kernels.size());
     }
-    region.GetModifiableSize()[3] = 0;
-    QI::VolumeXD::RegionType unpad_region;
+
+    // Zero-padding puts the start of the padded region at a negative index
+    int const                  pad = zero_padding.Get();
+    QI::VolumeD::RegionType    padded;
+    QI::VolumeD::SpacingType   spacing;
+    QI::VolumeD::PointType     origin;
+    QI::VolumeD::DirectionType direction;
+    QI::FFT::Size              inner, size;
     for (int i = 0; i < 3; i++) {
-        unpad_region.GetModifiableSize()[i] = region.GetSize()[i];
+        inner[i] = series.GetSize()[i];
+        size[i]  = inner[i] + 2 * pad;
+        padded.GetModifiableIndex()[i] = -pad;
+        padded.GetModifiableSize()[i]  = size[i];
+        spacing[i]                     = vols->GetSpacing()[i];
+        origin[i]                      = vols->GetOrigin()[i];
+        for (int j = 0; j < 3; j++) {
+            direction[i][j] = vols->GetDirection()[i][j];
+        }
     }
+    std::int64_t const n_inner  = inner[0] * inner[1] * inner[2];
+    std::int64_t const n_padded = size[0] * size[1] * size[2];
+
+    auto MakeKSpace = [&](QI::FFT::Complex const *data) {
+        QI::VolumeXD::Pointer k = QI::VolumeXD::New();
+        k->SetRegions(padded);
+        k->SetSpacing(spacing);
+        k->SetOrigin(origin);
+        k->SetDirection(direction);
+        k->Allocate();
+        std::copy(data, data + n_padded, k->GetBufferPointer());
+        return k;
+    };
+    // Shifted so the centre of k-space is in the middle of the image
+    auto WriteKSpace = [&](QI::VolumeXD *kspace, std::string const &path) {
+        auto shift_filter = itk::FFTShiftImageFilter<QI::VolumeXD, QI::VolumeXD>::New();
+        auto cast_filter  = itk::CastImageFilter<QI::VolumeXD, QI::VolumeXF>::New();
+        shift_filter->SetInput(kspace);
+        cast_filter->SetInput(shift_filter->GetOutput());
+        cast_filter->Update();
+        QI::WriteMagnitudeImage(cast_filter->GetOutput(), path, verbose);
+    };
 
-    auto tkernel = TKernel::New();
+    std::array<double, 3> const                kernel_spacing{spacing[0], spacing[1], spacing[2]};
+    std::shared_ptr<std::vector<double> const> shared_weights;
     if (!filter_per_volume) {
         QI::Info(verbose, "Kernels:");
         for (auto const &k : kernels) {
             QI::Info(verbose, "{}", *k);
         }
-        tkernel->SetKernels(kernels);
+        shared_weights = QI::KernelWeights(kernels, size, kernel_spacing, highpass);
+        QI::Log(verbose, "Created kernel filter, size is: {}", padded.GetSize());
     }
     if (highpass) {
-        tkernel->SetHighpass(highpass);
         QI::Log(verbose, "Set highpass filter");
     }
 
-    auto                             tile = TTile::New();
-    itk::FixedArray<unsigned int, 4> layout;
-    layout[0] = layout[1] = layout[2] = 1;
-    layout[3]                         = nvols;
-    tile->SetLayout(layout);
-
-    for (size_t i = 0; i < nvols; i++) {
-        region.GetModifiableIndex()[3] = i;
-        QI::Log(verbose, "Processing volume {}", i);
-
-        auto extract = TExtract::New();
-        extract->SetInput(vols);
-        extract->SetDirectionCollapseToSubmatrix();
-        extract->SetExtractionRegion(region);
-        auto zero_pad = TZeroPad::New();
-        auto fft_pad  = TFFTPad::New();
-        fft_pad->SetSizeGreatestPrimeFactor(5); // This is the largest the VNL FFT supports
-        if (zero_padding > 0) {
-            QI::VolumeXD::SizeType padding;
-            padding.Fill(zero_padding);
-            zero_pad->SetInput(extract->GetOutput());
-            zero_pad->SetPadLowerBound(padding);
-            zero_pad->SetPadUpperBound(padding);
-            zero_pad->SetConstant(0);
-            fft_pad->SetInput(zero_pad->GetOutput());
-        } else {
-            fft_pad->SetInput(extract->GetOutput());
-        }
-        fft_pad->Update(); // Need to know the size of this to set up the kernel properly
-        QI::Log(verbose,
-                "After FFT padding size is: {}",
-                fft_pad->GetOutput()->GetLargestPossibleRegion().GetSize());
-        if (i == 0) {
-            tkernel->SetRegion(fft_pad->GetOutput()->GetLargestPossibleRegion());
-            tkernel->SetSpacing(fft_pad->GetOutput()->GetSpacing());
-            tkernel->SetOrigin(fft_pad->GetOutput()->GetOrigin());
-            tkernel->SetDirection(fft_pad->GetOutput()->GetDirection());
-            tkernel->Update();
-            QI::Log(verbose,
-                    "Created kernel filter, size is: {}",
-                    tkernel->GetOutput()->GetLargestPossibleRegion().GetSize());
-        }
-        if (filter_per_volume) {
-            tkernel->SetKernel(kernels.at(i));
-            QI::Log(verbose, "Setting kernel to: {}", *kernels.at(i));
-        }
-        auto forward = TFFT::New();
-        forward->SetInput(fft_pad->GetOutput());
-        forward->Update();
-
-        auto mult = TMult::New();
-        mult->SetInput1(forward->GetOutput());
-        mult->SetInput2(tkernel->GetOutput());
-        mult->Update();
-
-        auto inverse = TFFT::New();
-        inverse->SetTransformDirection(TFFT::INVERSE);
-        inverse->SetInput(mult->GetOutput());
-        QI::Log(verbose, "Filtering k-space");
-        inverse->Update(); // If we don't have this update, next step fails
-
-        auto unpadder = TUnpad::New();
-        unpadder->SetDirectionCollapseToSubmatrix();
-        unpadder->SetExtractionRegion(unpad_region);
-        unpadder->SetInput(inverse->GetOutput());
-        QI::Log(verbose, "Unpadding & tiling output");
-        unpadder->Update();
-
-        QI::VolumeXF::Pointer v = unpadder->GetOutput();
-        tile->SetInput(i, v);
-        v->DisconnectPipeline();
+    /*
+     * Volumes are filtered concurrently, each worker with its own padded k-space buffer, and
+     * written back in place. Any threads left over go to the FFTs, which share their plans.
+     */
+    int const     workers = std::max(1, std::min(threads.Get(), static_cast<int>(nvols)));
+    QI::FFT const fft(size, threads.Get() / workers);
+    std::atomic<size_t>   cursor{0};
+    QI::VolumeXD::Pointer kspace_before, kspace_after; // Of the last volume
+    auto                  mt = itk::MultiThreaderBase::New();
+    mt->SetNumberOfWorkUnits(workers);
+    mt->ParallelizeArray(
+        0,
+        workers,
+        [&](itk::SizeValueType) {
+            std::vector<QI::FFT::Complex>              kspace(n_padded);
+            std::shared_ptr<std::vector<double> const> weights = shared_weights;
+            for (size_t i = cursor.fetch_add(1); i < nvols; i = cursor.fetch_add(1)) {
+                QI::Log(verbose, "Processing volume {}", i);
+                if (filter_per_volume) {
+                    // Cached by KernelWeights, shared with any worker using the same kernel
+                    QI::Log(verbose, "Setting kernel to: {}", *kernels.at(i));
+                    weights = QI::KernelWeights({kernels.at(i)}, size, kernel_spacing, highpass);
+                }
+                std::complex<float> *volume = vols->GetBufferPointer() + i * n_inner;
 
-        if (save_kspace) {
-            auto shift_filter = TFFTShift::New();
-            auto cast_filter  = itk::CastImageFilter<QI::VolumeXD, QI::VolumeXF>::New();
-            shift_filter->SetInput(forward->GetOutput());
-            cast_filter->SetInput(shift_filter->GetOutput());
-            cast_filter->Update();
-            QI::WriteMagnitudeImage(
-                cast_filter->GetOutput(), out_base + "_kspace_before" + QI::OutExt(), verbose);
-            shift_filter->SetInput(mult->GetOutput());
-            cast_filter->Update();
-            QI::WriteMagnitudeImage(
-                cast_filter->GetOutput(), out_base + "_kspace_after" + QI::OutExt(), verbose);
-        }
-    }
+                std::fill(kspace.begin(), kspace.end(), QI::FFT::Complex(0.));
+                for (std::int64_t z = 0; z < inner[2]; z++) {
+                    for (std::int64_t y = 0; y < inner[1]; y++) {
+                        auto const *in  = volume + (z * inner[1] + y) * inner[0];
+                        auto *      out = kspace.data() +
+                                     ((z + pad) * size[1] + y + pad) * size[0] + pad;
+                        std::copy(in, in + inner[0], out);
+                    }
+                }
+                fft.forward(kspace.data());
+                if (save_kspace && i == nvols - 1) {
+                    kspace_before = MakeKSpace(kspace.data());
+                }
+                for (std::int64_t v = 0; v < n_padded; v++) {
+                    kspace[v] *= (*weights)[v];
+                }
+                if (save_kspace && i == nvols - 1) {
+                    kspace_after = MakeKSpace(kspace.data());
+                }
+                fft.inverse(kspace.data());
+                for (std::int64_t z = 0; z < inner[2]; z++) {
+                    for (std::int64_t y = 0; y < inner[1]; y++) {
+                        auto const *in = kspace.data() +
+                                         ((z + pad) * size[1] + y + pad) * size[0] + pad;
+                        auto *out = volume + (z * inner[1] + y) * inner[0];
+                        for (std::int64_t x = 0; x < inner[0]; x++) {
+                            out[x] = std::complex<float>(in[x]);
+                        }
+                    }
+                }
+            }
+        },
+        nullptr);
     QI::Log(verbose, "Finished.");
-    tile->Update();
-    auto dir = vols->GetDirection();
-    auto spc = vols->GetSpacing();
-    vols     = tile->GetOutput();
-    vols->SetDirection(dir);
-    vols->SetSpacing(spc);
-    vols->DisconnectPipeline();
+    if (save_kspace) {
+        WriteKSpace(kspace_before, out_base + "_kspace_before" + QI::OutExt());
+        WriteKSpace(kspace_after, out_base + "_kspace_after" + QI::OutExt());
+    }
 
     const std::string out_path = out_base + "_filtered" + QI::OutExt();
     if (complex_out) {
@@ -320,6 +298,17 @@ int kfilter_main(args::Subparser &parser) {
         QI::WriteMagnitudeImage(vols, out_path, verbose);
     }
     if (save_kernel) {
+        auto tkernel = TKernel::New();
+        tkernel->SetRegion(padded);
+        tkernel->SetSpacing(spacing);
+        tkernel->SetOrigin(origin);
+        tkernel->SetDirection(direction);
+        tkernel->SetHighpass(highpass);
+        if (filter_per_volume) {
+            tkernel->SetKernel(kernels.back());
+        } else {
+            tkernel->SetKernels(kernels);
+        }
         auto shift_filter = itk::FFTShiftImageFilter<QI::VolumeD, QI::VolumeD>::New();
         shift_filter->SetInput(tkernel->GetOutput());
         auto cast_filter = itk::CastImageFilter<QI::VolumeD, QI::VolumeF>::New();
@@ -2,13 +2,19 @@
 
 #define EIGEN_USE_THREADS
 
+#include <algorithm>
+#include <numeric>
+#include <type_traits>
+#include <vector>
+
 #include <unsupported/Eigen/CXX11/Tensor>
 #include <unsupported/Eigen/CXX11/ThreadPool>
 
 #include "Log.h"
 
-template <typename T> typename T::Scalar Dot(T const &a, T const &b) {
-    Eigen::TensorFixedSize<typename T::Scalar, Eigen::Sizes<>> d = (a.conjugate() * b).sum();
+template <typename T> auto Dot(T const &a, T const &b) {
+    using Scalar                                   = std::remove_const_t<typename T::Scalar>;
+    Eigen::TensorFixedSize<Scalar, Eigen::Sizes<>> d = (a.conjugate() * b).sum();
     return d();
 }
 
@@ -16,163 +22,192 @@ template <typename T> float Norm(T const &a) {
     return sqrt(std::real(Dot(a, a)));
 }
 
-template <typename T>
-auto ForwardDiff(T const &a, Eigen::Index const d, Eigen::array<long, 3> const dims) {
-    using Dims = Eigen::array<long, 3>;
-    Dims const sz{dims[0] - 2, dims[1] - 2, dims[2] - 2};
-    Dims const st1{1, 1, 1};
-    Dims       fwd{1, 1, 1};
-    fwd[d] = 2;
-    return (a.slice(fwd, sz) - a.slice(st1, sz));
-}
-
-template <typename T>
-auto BackwardDiff(T const &a, Eigen::Index const d, Eigen::array<long, 3> const dims) {
-    using Dims = Eigen::array<long, 3>;
-    Dims const sz{dims[0] - 2, dims[1] - 2, dims[2] - 2};
-    Dims const st1{1, 1, 1};
-    Dims       bck{1, 1, 1};
-    bck[d] = 0;
-
-    return (a.slice(st1, sz) - a.slice(bck, sz));
-}
-
-template <typename T>
-auto CentralDiff(T const &a, Eigen::Index const d, Eigen::array<long, 3> const dims) {
-    using Dims = Eigen::array<long, 3>;
-    Dims const sz{dims[0] - 2, dims[1] - 2, dims[2] - 2};
-    Dims const st1{1, 1, 1};
-    Dims       fwd{1, 1, 1};
-    Dims       bck{1, 1, 1};
-    fwd[d] = 2;
-    bck[d] = 0;
-
-    return (a.slice(fwd, sz) - a.slice(bck, sz)) / a.slice(st1, sz).constant(2.f);
-}
-
-template <typename T>
-void Grad(Eigen::Tensor<T, 3> const &a, Eigen::Tensor<T, 4> &g, Eigen::ThreadPoolDevice &dev) {
-    using Dims = typename Eigen::Tensor<T, 3>::Dimensions;
-    Dims const sz{a.dimension(0) - 2, a.dimension(1) - 2, a.dimension(2) - 2};
-    Dims const st1{1, 1, 1};
-    g.template chip<3>(0).slice(st1, sz).device(dev) = ForwardDiff(a, 0, a.dimensions());
-    g.template chip<3>(1).slice(st1, sz).device(dev) = ForwardDiff(a, 1, a.dimensions());
-    g.template chip<3>(2).slice(st1, sz).device(dev) = ForwardDiff(a, 2, a.dimensions());
-}
-
-template <typename T>
-void Grad(Eigen::Tensor<T, 4> const &x, Eigen::Tensor<T, 4> &gx, Eigen::ThreadPoolDevice &dev) {
-    using Dims = typename Eigen::Tensor<T, 3>::Dimensions;
-    Dims const sz1{x.dimension(0), x.dimension(1), x.dimension(2)};
-    Dims const sz2{x.dimension(0) - 2, x.dimension(1) - 2, x.dimension(2) - 2};
-    Dims const st1{1, 1, 1};
-
-    gx.template chip<3>(0).slice(st1, sz2).device(dev) =
-        BackwardDiff(x.template chip<3>(0), 0, sz1);
-    gx.template chip<3>(1).slice(st1, sz2).device(dev) =
-        BackwardDiff(x.template chip<3>(1), 1, sz1);
-    gx.template chip<3>(2).slice(st1, sz2).device(dev) =
-        BackwardDiff(x.template chip<3>(2), 2, sz1);
-
-    gx.template chip<3>(3).slice(st1, sz2).device(dev) =
-        (BackwardDiff(x.template chip<3>(0), 1, sz1) +
-         BackwardDiff(x.template chip<3>(1), 0, sz1)) /
-        gx.template chip<3>(3).slice(st1, sz2).constant(2.f);
-
-    gx.template chip<3>(4).slice(st1, sz2).device(dev) =
-        (BackwardDiff(x.template chip<3>(0), 2, sz1) +
-         BackwardDiff(x.template chip<3>(2), 0, sz1)) /
-        gx.template chip<3>(4).slice(st1, sz2).constant(2.f);
-
-    gx.template chip<3>(5).slice(st1, sz2).device(dev) =
-        (BackwardDiff(x.template chip<3>(1), 2, sz1) +
-         BackwardDiff(x.template chip<3>(2), 1, sz1)) /
-        gx.template chip<3>(5).slice(st1, sz2).constant(2.f);
-}
-
-template <typename T>
-inline void
-Div(Eigen::Tensor<T, 4> const &x, Eigen::Tensor<T, 3> &div, Eigen::ThreadPoolDevice &dev) {
-    using Dims = typename Eigen::Tensor<T, 3>::Dimensions;
-    Dims const sz1{x.dimension(0), x.dimension(1), x.dimension(2)};
-    Dims const sz2{x.dimension(0) - 2, x.dimension(1) - 2, x.dimension(2) - 2};
-    Dims const st1{1, 1, 1};
-    div.slice(st1, sz2).device(dev) = BackwardDiff(x.template chip<3>(0), 0, sz1) +
-                                      BackwardDiff(x.template chip<3>(1), 1, sz1) +
-                                      BackwardDiff(x.template chip<3>(2), 2, sz1);
-}
-
-template <typename T>
-inline void
-Div(Eigen::Tensor<T, 4> const &x, Eigen::Tensor<T, 4> &div, Eigen::ThreadPoolDevice &dev) {
-    using Dims = typename Eigen::Tensor<T, 3>::Dimensions;
-    Dims const sz1{x.dimension(0), x.dimension(1), x.dimension(2)};
-    Dims const sz2{x.dimension(0) - 2, x.dimension(1) - 2, x.dimension(2) - 2};
-    Dims const st1{1, 1, 1};
-    div.template chip<3>(0).slice(st1, sz2).device(dev) =
-        ForwardDiff(x.template chip<3>(0), 0, sz1) + ForwardDiff(x.template chip<3>(3), 1, sz1) +
-        ForwardDiff(x.template chip<3>(4), 2, sz1);
-    div.template chip<3>(1).slice(st1, sz2).device(dev) =
-        ForwardDiff(x.template chip<3>(3), 0, sz1) + ForwardDiff(x.template chip<3>(1), 1, sz1) +
-        ForwardDiff(x.template chip<3>(5), 2, sz1);
-    div.template chip<3>(2).slice(st1, sz2).device(dev) =
-        ForwardDiff(x.template chip<3>(4), 0, sz1) + ForwardDiff(x.template chip<3>(5), 1, sz1) +
-        ForwardDiff(x.template chip<3>(2), 2, sz1);
-}
+/*
+ *  The TGV primal-dual iterations, fused into two sweeps over the volume per iteration. The first
+ *  updates the duals p and q from the gradients of the extrapolated primals and projects them, the
+ *  second updates u and v from the divergences of the new duals and extrapolates them. Each voxel
+ *  only needs its own values and its neighbours in other variables, so both sweeps work in place
+ *  and there are no gradient, divergence or _old temporaries. Differences are only taken in the
+ *  interior, as the edges are treated as having zero gradient and divergence.
+ */
+template <typename T> class TGVSweeps {
+  public:
+    using T3 = Eigen::Tensor<T, 3>;
+    using T4 = Eigen::Tensor<T, 4>;
+
+    long const n0, n1, n2;
+    long const s0 = 1, s1 = n0, s2 = n0 * n1, n = n0 * n1 * n2;
+
+    T const *image;
+    T *      u, *u_; // u_ is the extrapolated u
+    T *      v, *v_;
+    T *      p, *q; // q is a symmetric rank-2 tensor stored as xx yy zz xy xz yz
+
+    TGVSweeps(typename T3::Dimensions const &dims,
+              T const *                      i,
+              T *                            u,
+              T *                            u_,
+              T4 &                           v,
+              T4 &                           v_,
+              T4 &                           p,
+              T4 &                           q) :
+        n0{dims[0]},
+        n1{dims[1]},
+        n2{dims[2]},
+        image{i},
+        u{u},
+        u_{u_},
+        v{v.data()},
+        v_{v_.data()},
+        p{p.data()},
+        q{q.data()} {}
+
+    void dual(float const              tau_d,
+              float const              alpha0,
+              float const              alpha1,
+              Eigen::ThreadPoolDevice &dev) {
+        Slices(dev, 9, [&](long const z) {
+            T *const       pc[3]  = {P(0), P(1), P(2)};
+            T *const       qc[6]  = {Q(0), Q(1), Q(2), Q(3), Q(4), Q(5)};
+            T const *const ub     = u_;
+            T const *const vb[3]  = {V_(0), V_(1), V_(2)};
+            float const    ia0    = 1.f / alpha0;
+            float const    ia1    = 1.f / alpha1;
+            auto const     update = [&](long const o, bool const in) {
+                T gu[3], gv[6];
+                for (int c = 0; c < 3; c++) {
+                    gu[c] = in ? ub[o + S(c)] - ub[o] : T(0.f);
+                }
+                if (in) {
+                    gv[0] = vb[0][o] - vb[0][o - s0];
+                    gv[1] = vb[1][o] - vb[1][o - s1];
+                    gv[2] = vb[2][o] - vb[2][o - s2];
+                    gv[3] = ((vb[0][o] - vb[0][o - s1]) + (vb[1][o] - vb[1][o - s0])) / 2.f;
+                    gv[4] = ((vb[0][o] - vb[0][o - s2]) + (vb[2][o] - vb[2][o - s0])) / 2.f;
+                    gv[5] = ((vb[1][o] - vb[1][o - s2]) + (vb[2][o] - vb[2][o - s1])) / 2.f;
+                } else {
+                    std::fill_n(gv, 6, T(0.f));
+                }
+                T np[3], nq[6];
+                for (int c = 0; c < 3; c++) {
+                    np[c] = pc[c][o] - tau_d * (gu[c] + vb[c][o]);
+                }
+                for (int c = 0; c < 6; c++) {
+                    nq[c] = qc[c][o] - tau_d * gv[c];
+                }
+                float const normp =
+                    sqrt(std::norm(np[0]) + std::norm(np[1]) + std::norm(np[2])) * ia1;
+                float const normq = sqrt(std::norm(nq[0]) + std::norm(nq[1]) + std::norm(nq[2]) +
+                                         (std::norm(nq[3]) + std::norm(nq[4]) + std::norm(nq[5])) *
+                                             2.f) *
+                                    ia0;
+                float const clampp = normp > 1.f ? normp : 1.f;
+                float const clampq = normq > 1.f ? normq : 1.f;
+                for (int c = 0; c < 3; c++) {
+                    pc[c][o] = np[c] / clampp;
+                }
+                for (int c = 0; c < 6; c++) {
+                    qc[c][o] = nq[c] / clampq;
+                }
+            };
+            Rows(z, update);
+        });
+    }
 
-template <typename T>
-auto ProjectP(Eigen::Tensor<T, 4> &p, float const a, Eigen::ThreadPoolDevice &dev) {
-    Eigen::IndexList<int, int, int, Eigen::type2index<1>> res;
-    res.set(0, p.dimension(0));
-    res.set(1, p.dimension(1));
-    res.set(2, p.dimension(2));
-    Eigen::IndexList<Eigen::type2index<1>,
-                     Eigen::type2index<1>,
-                     Eigen::type2index<1>,
-                     Eigen::type2index<3>>
-        brd;
+    // Returns the squared norm of the change in u
+    double primal(float const tau_p, float const scale, Eigen::ThreadPoolDevice &dev) {
+        std::vector<double> change(n2, 0.); // Per slice, so the sum is the same for any threads
+        Slices(dev, 11, [&](long const z) {
+            T const *const pc[3] = {P(0), P(1), P(2)};
+            T const *const qc[6] = {Q(0), Q(1), Q(2), Q(3), Q(4), Q(5)};
+            T *const       vc[3] = {V(0), V(1), V(2)};
+            T *const       vb[3] = {V_(0), V_(1), V_(2)};
+            T const *const im    = image;
+            T *const       uc    = u;
+            T *const       ub    = u_;
+            double         sum   = 0.;
+            auto const     update = [&](long const o, bool const in) {
+                T divp = 0.f, divq[3] = {0.f, 0.f, 0.f};
+                if (in) {
+                    divp = (pc[0][o] - pc[0][o - s0]) + (pc[1][o] - pc[1][o - s1]) +
+                           (pc[2][o] - pc[2][o - s2]);
+                    divq[0] = (qc[0][o + s0] - qc[0][o]) + (qc[3][o + s1] - qc[3][o]) +
+                              (qc[4][o + s2] - qc[4][o]);
+                    divq[1] = (qc[3][o + s0] - qc[3][o]) + (qc[1][o + s1] - qc[1][o]) +
+                              (qc[5][o + s2] - qc[5][o]);
+                    divq[2] = (qc[4][o + s0] - qc[4][o]) + (qc[5][o + s1] - qc[5][o]) +
+                              (qc[2][o + s2] - qc[2][o]);
+                }
+                T const un = ((uc[o] - tau_p * divp) + (im[o] * (tau_p / scale))) /
+                             (1.f + tau_p); // Prox op
+                sum += std::norm(un - uc[o]);
+                ub[o] = 2.f * un - uc[o];
+                uc[o] = un;
+                for (int c = 0; c < 3; c++) {
+                    T const vn = vc[c][o] - tau_p * (divq[c] - pc[c][o]);
+                    vb[c][o]   = 2.f * vn - vc[c][o];
+                    vc[c][o]   = vn;
+                }
+            };
+            Rows(z, update);
+            change[z] = sum;
+        });
+        return std::accumulate(change.begin(), change.end(), 0.);
+    }
 
-    Eigen::Tensor<float, 3> normp(p.dimension(0), p.dimension(1), p.dimension(2));
-    normp.device(dev) =
-        (p * p.conjugate()).sum(Eigen::array<int, 1>{3}).real().sqrt() / normp.constant(a);
-    auto const clamped = (normp > 1.f).select(normp, normp.constant(1.f));
-    p.device(dev)      = p / clamped.reshape(res).broadcast(brd).template cast<T>();
-}
+  private:
+    long S(int const c) const { return c == 0 ? s0 : (c == 1 ? s1 : s2); }
+    T *  P(int const c) const { return p + c * n; }
+    T *  Q(int const c) const { return q + c * n; }
+    T *  V(int const c) const { return v + c * n; }
+    T *  V_(int const c) const { return v_ + c * n; }
+
+    // Slabs of whole slices go to each thread, so the neighbouring slices are still in cache
+    template <typename F> void Slices(Eigen::ThreadPoolDevice &dev, int const volumes, F &&f) {
+        double const bytes = static_cast<double>(volumes * sizeof(T)) * n0 * n1;
+        dev.parallelFor(n2,
+                        Eigen::TensorOpCost(bytes, bytes, 20. * n0 * n1),
+                        [&](Eigen::Index const first, Eigen::Index const last) {
+                            for (Eigen::Index z = first; z < last; z++) {
+                                f(z);
+                            }
+                        });
+    }
 
-template <typename T>
-auto ProjectQ(Eigen::Tensor<T, 4> &q, float const a, Eigen::ThreadPoolDevice &dev) {
-    Eigen::IndexList<int, int, int, Eigen::type2index<1>> res;
-    res.set(0, q.dimension(0));
-    res.set(1, q.dimension(1));
-    res.set(2, q.dimension(2));
-    Eigen::IndexList<Eigen::type2index<1>,
-                     Eigen::type2index<1>,
-                     Eigen::type2index<1>,
-                     Eigen::type2index<6>>
-        brd;
-    using Dims4 = typename Eigen::Tensor<T, 4>::Dimensions;
-    auto const q1 =
-        q.slice(Dims4{0, 0, 0, 0}, Dims4{q.dimension(0), q.dimension(1), q.dimension(2), 3});
-    auto const q2 =
-        q.slice(Dims4{0, 0, 0, 3}, Dims4{q.dimension(0), q.dimension(1), q.dimension(2), 3});
-    Eigen::Tensor<float, 3> normq(q.dimension(0), q.dimension(1), q.dimension(2));
-    normq.device(dev) = ((q1 * q1.conjugate()).sum(Eigen::array<int, 1>{3}).real() +
-                         (q2 * q2.conjugate()).sum(Eigen::array<int, 1>{3}).real() * 2.f)
-                            .sqrt() /
-                        normq.constant(a);
-    auto const clamped = (normq > 1.f).select(normq, normq.constant(1.f));
-    q.device(dev)      = q / clamped.reshape(res).broadcast(brd).template cast<T>();
-}
+    // Differences are only taken for voxels that have neighbours on both sides in every direction
+    template <typename F> void Rows(long const z, F &&update) const {
+        bool const z_in = (z > 0) && (z < n2 - 1);
+        for (long y = 0; y < n1; y++) {
+            long const o    = (z * n1 + y) * n0;
+            bool const y_in = z_in && (y > 0) && (y < n1 - 1);
+            if (y_in && n0 > 2) {
+                update(o, false);
+                for (long x = 1; x < n0 - 1; x++) {
+                    update(o + x, true);
+                }
+                update(o + n0 - 1, false);
+            } else {
+                for (long x = 0; x < n0; x++) {
+                    update(o + x, false);
+                }
+            }
+        }
+    }
+};
 
+/*
+ *  Denoise image into u, which can be part of a larger output so no copies are needed
+ */
 template <typename T>
-Eigen::Tensor<T, 3> tgvdenoise(Eigen::Tensor<T, 3> const &image,
-                               long const                 max_its,
-                               float const                thresh,
-                               float const                alpha,
-                               float const                reduction,
-                               float const                step_size,
-                               bool                       vb,
-                               Eigen::ThreadPoolDevice &  dev) {
+void tgvdenoise(Eigen::TensorMap<Eigen::Tensor<T const, 3>> const &image,
+                Eigen::TensorMap<Eigen::Tensor<T, 3>> &            u,
+                long const                                         max_its,
+                float const                                        thresh,
+                float const                                        alpha,
+                float const                                        reduction,
+                float const                                        step_size,
+                bool                                               vb,
+                Eigen::ThreadPoolDevice &                          dev) {
     using T3                     = Eigen::Tensor<T, 3>;
     using T4                     = Eigen::Tensor<T, 4>;
     typename T3::Dimensions dims = image.dimensions();
@@ -181,28 +216,20 @@ Eigen::Tensor<T, 3> tgvdenoise(Eigen::Tensor<T, 3> const &image,
 
     float const scale = Norm(image);
     // Primal Variables
-    T3 u     = image / image.constant(scale);
-    T3 u_    = u;
-    T3 u_old = u;
-    T4 grad_u(dims3);
+    u.device(dev) = image / image.constant(scale);
+    T3 u_         = u;
     T4 v(dims3);
     T4 v_(dims3);
-    T4 v_old(dims3);
-    T4 grad_v(dims6); // Symmetric rank-2 tensor stored as xx yy zz (xy + yx) (xz + zx) (yz + zy)
-    grad_u.setZero();
+    v.setZero();
     v_.setZero();
-    v_old.setZero();
-    grad_v.setZero();
 
     // Dual Variables
     T4 p(dims3);
     T4 q(dims6);
-    T4 divq(dims3);
-    T3 divp(dims);
     p.setZero();
-    divp.setZero();
     q.setZero();
-    divq.setZero();
+
+    TGVSweeps<T> sweeps(dims, image.data(), u.data(), u_.data(), v, v_, p, q);
 
     float const alpha00 = alpha;
     float const alpha10 = alpha / 2.f;
@@ -216,38 +243,15 @@ Eigen::Tensor<T, 3> tgvdenoise(Eigen::Tensor<T, 3> const &image,
     QI::Info(vb, "TGV Scale {}", scale);
 
     for (auto ii = 0.f; ii < max_its; ii++) {
-        // log.image(u, fmt::format(FMT_STRING("tgv-u-{:02}.nii"), ii));
         // Regularisation factors
         float const prog   = static_cast<float>(ii) / ((max_its == 1) ? 1. : (max_its - 1.f));
         float const alpha0 = std::exp(std::log(alpha01) * prog + std::log(alpha00) * (1.f - prog));
         float const alpha1 = std::exp(std::log(alpha11) * prog + std::log(alpha10) * (1.f - prog));
 
-        // Update p
-        Grad(u_, grad_u, dev);
-        p.device(dev) =
-            p - p.constant(tau_d) * (grad_u + v_); // Paper says +tau, but code says -tau
-        ProjectP(p, alpha1, dev);
-
-        // Update q
-        Grad(v_, grad_v, dev);
-        q.device(dev) = q - q.constant(tau_d) * grad_v;
-        ProjectQ(q, alpha0, dev);
-
-        // Update u
-        u_old.device(dev) = u;
-        Div(p, divp, dev);
-        u.device(dev) = ((u - u.constant(tau_p) * divp) + (image * u.constant(tau_p / scale))) /
-                        u.constant(1.f + tau_p); // Prox op
-        u_.device(dev) = 2.0 * u - u_old;
-
-        // Update v
-        v_old.device(dev) = v;
-        Div(q, divq, dev);
-        v.device(dev)  = v - v.constant(tau_p) * (divq - p);
-        v_.device(dev) = 2.0 * v - v_old;
-
-        // Check for convergence
-        float const delta = Norm(u - u_old);
+        // Update p and q. Paper says +tau, but code says -tau
+        sweeps.dual(tau_d, alpha0, alpha1, dev);
+        // Update u and v, and check for convergence
+        float const delta = sqrt(sweeps.primal(tau_p, scale, dev));
         QI::Info(vb, FMT_STRING("TGV {}: ɑ0 {:.2g} ɑ1 {:.2g} δ {}"), ii + 1, alpha0, alpha1, delta);
         if (delta < thresh) {
             QI::Info(vb, "Reached threshold on delta, stopping");
@@ -255,6 +259,5 @@ Eigen::Tensor<T, 3> tgvdenoise(Eigen::Tensor<T, 3> const &image,
         }
     }
 
-    u = u * u.constant(scale);
-    return u;
-}
\ No newline at end of file
+    u.device(dev) = u * u.constant(scale);
+}